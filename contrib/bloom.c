@@ -22,6 +22,11 @@
 
 #include "bloom.h"
 #include "murmurhash2.h"
+#include "src/simd.h"
+
+#if BLOOM_BLOCK_BYTES != SIMD_BLOCK_BYTES
+#error "Bloom blocks must match the SIMD kernel block size"
+#endif
 
 #define MAKESTRING(n) STRING(n)
 #define STRING(n) #n
@@ -33,6 +38,7 @@
 
 #define MODE_READ 0
 #define MODE_WRITE 1
+#define MODE_DELETE 2
 
 inline static int test_bit_set_bit(unsigned char *buf, uint64_t x, int mode) {
     uint64_t byte = x >> 3;
@@ -104,6 +110,151 @@ static int bloom_check_add_compat(struct bloom *bloom, bloom_hashval hashval, in
     CHECK_ADD_FUNC(uint64_t, bloom->bits)
 }
 
+// Blocked filters select one block with the first hash, and derive all the
+// bit positions inside that block from the second one. Plain double hashing
+// inside a 512 bit block produces too many overlapping progressions, so each
+// position is taken from the top bits of a multiplicative sequence instead.
+//
+// The positions are gathered into a mask of the block's size, which the SIMD
+// kernels then test or set against the block in one go.
+#define BLOOM_BLOCK_MULT 0x9E3779B97F4A7C15ULL
+
+static inline void bloom_block_mask(bloom_hashval hashval, uint32_t hashes, unsigned char *mask) {
+    uint64_t h = hashval.b ^ (hashval.a >> 32);
+    for (uint32_t i = 0; i < hashes; i++) {
+        h *= BLOOM_BLOCK_MULT;
+        uint32_t x = h >> (64 - 9);
+        mask[x >> 3] |= 1 << (x % 8);
+    }
+}
+
+static int bloom_check_add_blocked(struct bloom *bloom, bloom_hashval hashval, int mode) {
+    const uint64_t nblocks = bloom->bytes / BLOOM_BLOCK_BYTES;
+    unsigned char *block = bloom->bf + (hashval.a % nblocks) * BLOOM_BLOCK_BYTES;
+    uint64_t maskbuf[BLOOM_BLOCK_BYTES / 8] = {0};
+    unsigned char *mask = (unsigned char *)maskbuf;
+    bloom_block_mask(hashval, bloom->hashes, mask);
+    if (mode == MODE_READ) {
+        return simdOps.blockTest(block, mask);
+    }
+    return simdOps.blockSet(block, mask);
+}
+
+// Counting filters derive their positions like the other layouts, using
+// counters instead of bits: double hashing over all the counters, or the
+// multiplicative sequence inside the 128 counters of a block when blocked.
+//
+// `mod` is the number of counters, or of blocks for blocked filters. In
+// MODE_READ returns 1 if every counter is set. MODE_WRITE increments them and
+// returns 1 if any was unset, MODE_DELETE decrements them. Saturated counters
+// are left alone by both.
+#define BLOOM_BLOCK_COUNTERS_LOG2 7
+#define BLOOM_BLOCK_COUNTERS (1 << BLOOM_BLOCK_COUNTERS_LOG2)
+
+#if BLOOM_BLOCK_COUNTERS * BLOOM_COUNTER_BITS != BLOOM_BLOCK_BITS
+#error "Counting blocks must have the size of bloom blocks"
+#endif
+
+static inline int bloom_counters_op(unsigned char *bf, uint64_t mod, uint32_t hashes, int blocked,
+                                    bloom_hashval hashval, int mode) {
+    uint64_t base = 0;
+    uint64_t h = 0;
+    if (blocked) {
+        base = (hashval.a % mod) * BLOOM_BLOCK_COUNTERS;
+        h = hashval.b ^ (hashval.a >> 32);
+    }
+    int found_unset = 0;
+    for (uint32_t i = 0; i < hashes; i++) {
+        uint64_t x;
+        if (blocked) {
+            h *= BLOOM_BLOCK_MULT;
+            x = base + (h >> (64 - BLOOM_BLOCK_COUNTERS_LOG2));
+        } else {
+            x = (hashval.a + i * hashval.b) % mod;
+        }
+        const unsigned shift = (x & 1) * BLOOM_COUNTER_BITS;
+        const unsigned c = (bf[x >> 1] >> shift) & BLOOM_COUNTER_MAX;
+        if (c == 0) {
+            if (mode == MODE_READ) {
+                return 0;
+            }
+            found_unset = 1;
+        }
+        if (mode == MODE_WRITE && c < BLOOM_COUNTER_MAX) {
+            bf[x >> 1] += 1 << shift;
+        } else if (mode == MODE_DELETE && c > 0 && c < BLOOM_COUNTER_MAX) {
+            bf[x >> 1] -= 1 << shift;
+        }
+    }
+    return mode == MODE_READ ? 1 : found_unset;
+}
+
+static int bloom_check_add_counting(const struct bloom *bloom, bloom_hashval hashval, int mode) {
+    const uint64_t mod = bloom->blocked ? bloom->bytes / BLOOM_BLOCK_BYTES : bloom->bits;
+    return bloom_counters_op(bloom->bf, mod, bloom->hashes, bloom->blocked, hashval, mode);
+}
+
+// Merges `n` bytes of counters of `src` into `dst`: saturating sums, or the
+// smallest of both with `intersect`. Returns the sum of the counters of `dst`
+// afterwards.
+static uint64_t bloom_counters_merge(unsigned char *dst, const unsigned char *src, size_t n,
+                                     int intersect) {
+    uint64_t ret = 0;
+    for (size_t ii = 0; ii < n; ++ii) {
+        unsigned out = 0;
+        for (unsigned shift = 0; shift < 8; shift += BLOOM_COUNTER_BITS) {
+            const unsigned d = (dst[ii] >> shift) & BLOOM_COUNTER_MAX;
+            const unsigned s = (src[ii] >> shift) & BLOOM_COUNTER_MAX;
+            unsigned c;
+            if (intersect) {
+                c = d < s ? d : s;
+            } else {
+                c = d + s > BLOOM_COUNTER_MAX ? BLOOM_COUNTER_MAX : d + s;
+            }
+            out |= c << shift;
+            ret += c;
+        }
+        dst[ii] = out;
+    }
+    return ret;
+}
+
+// Mirrors the position calculation of CHECK_ADD_FUNC, without touching memory.
+// `shift` converts a position to its byte offset.
+static void bloom_prefetch_bits(const struct bloom *bloom, bloom_hashval hashval, int rw,
+                                uint64_t mod, unsigned shift) {
+    for (uint32_t i = 0; i < bloom->hashes; i++) {
+        uint64_t x = ((hashval.a + i * hashval.b)) % mod;
+        if (rw) {
+            __builtin_prefetch(bloom->bf + (x >> shift), 1);
+        } else {
+            __builtin_prefetch(bloom->bf + (x >> shift), 0);
+        }
+    }
+}
+
+void bloom_prefetch_h(const struct bloom *bloom, bloom_hashval hashval, int mode) {
+    const int rw = mode == MODE_WRITE;
+    if (bloom->blocked) {
+        const uint64_t nblocks = bloom->bytes / BLOOM_BLOCK_BYTES;
+        const unsigned char *block = bloom->bf + (hashval.a % nblocks) * BLOOM_BLOCK_BYTES;
+        // The buffer is not cache-line aligned, so a block may span two lines
+        if (rw) {
+            __builtin_prefetch(block, 1);
+            __builtin_prefetch(block + BLOOM_BLOCK_BYTES - 1, 1);
+        } else {
+            __builtin_prefetch(block, 0);
+            __builtin_prefetch(block + BLOOM_BLOCK_BYTES - 1, 0);
+        }
+    } else if (bloom->counting) {
+        bloom_prefetch_bits(bloom, hashval, rw, bloom->bits, 1);
+    } else if (bloom->n2 > 0) {
+        bloom_prefetch_bits(bloom, hashval, rw, 1LLU << bloom->n2, 3);
+    } else {
+        bloom_prefetch_bits(bloom, hashval, rw, bloom->bits, 3);
+    }
+}
+
 static double calc_bpe(double error) {
     static const double denom = 0.480453013918201; // ln(2)^2
     double num = log(error);
@@ -115,7 +266,7 @@ static double calc_bpe(double error) {
     return bpe;
 }
 
-int bloom_init(struct bloom *bloom, uint64_t entries, double error, unsigned options) {
+int bloom_layout(struct bloom *bloom, uint64_t entries, double error, unsigned options) {
     if (entries < 1 || error <= 0 || error >= 1.0) {
         return 1;
     }
@@ -160,15 +311,34 @@ int bloom_init(struct bloom *bloom, uint64_t entries, double error, unsigned opt
         bloom->entries += itemDiff;
     }
 
-    if (bits % 64) {
+    // Every position takes one bit, or one counter
+    const unsigned width = (options & BLOOM_OPT_COUNTING) ? BLOOM_COUNTER_BITS : 1;
+    if (bits > UINT64_MAX / width) {
+        return 1;
+    }
+    bits *= width;
+
+    if (options & BLOOM_OPT_BLOCKED) {
+        // Round up to a whole number of blocks
+        bloom->bytes = ((bits + BLOOM_BLOCK_BITS - 1) / BLOOM_BLOCK_BITS) * BLOOM_BLOCK_BYTES;
+    } else if (bits % 64) {
         bloom->bytes = ((bits / 64) + 1) * 8;
     } else {
         bloom->bytes = bits / 8;
     }
-    bloom->bits = bloom->bytes * 8;
+    bloom->bits = bloom->bytes * 8 / width;
 
     bloom->force64 = (options & BLOOM_OPT_FORCE64);
+    bloom->blocked = !!(options & BLOOM_OPT_BLOCKED);
+    bloom->counting = !!(options & BLOOM_OPT_COUNTING);
     bloom->hashes = (int)ceil(0.693147180559945 * bloom->bpe); // ln(2)
+    return 0;
+}
+
+int bloom_init(struct bloom *bloom, uint64_t entries, double error, unsigned options) {
+    if (bloom_layout(bloom, entries, error, options) != 0) {
+        return 1;
+    }
     bloom->bf = (unsigned char *)BLOOM_CALLOC(bloom->bytes, sizeof(unsigned char));
     if (bloom->bf == NULL) {
         return 1;
@@ -178,7 +348,11 @@ int bloom_init(struct bloom *bloom, uint64_t entries, double error, unsigned opt
 }
 
 int bloom_check_h(const struct bloom *bloom, bloom_hashval hash) {
-    if (bloom->n2 > 0) {
+    if (bloom->counting) {
+        return bloom_check_add_counting(bloom, hash, MODE_READ);
+    } else if (bloom->blocked) {
+        return bloom_check_add_blocked((void *)bloom, hash, MODE_READ);
+    } else if (bloom->n2 > 0) {
         if (bloom->force64 || bloom->n2 > 31) {
             return bloom_check_add64((void *)bloom, hash, MODE_READ);
         } else {
@@ -194,7 +368,11 @@ int bloom_check(const struct bloom *bloom, const void *buffer, int len) {
 }
 
 int bloom_add_h(struct bloom *bloom, bloom_hashval hash) {
-    if (bloom->n2 > 0) {
+    if (bloom->counting) {
+        return !bloom_check_add_counting(bloom, hash, MODE_WRITE);
+    } else if (bloom->blocked) {
+        return !bloom_check_add_blocked(bloom, hash, MODE_WRITE);
+    } else if (bloom->n2 > 0) {
         if (bloom->force64 || bloom->n2 > 31) {
             return !bloom_check_add64(bloom, hash, MODE_WRITE);
         } else {
@@ -209,6 +387,17 @@ int bloom_add(struct bloom *bloom, const void *buffer, int len) {
     return bloom_add_h(bloom, bloom_calc_hash(buffer, len));
 }
 
+int bloom_del_h(struct bloom *bloom, bloom_hashval hash) {
+    if (!bloom->counting) {
+        return -1;
+    }
+    if (!bloom_check_add_counting(bloom, hash, MODE_READ)) {
+        return 0;
+    }
+    bloom_check_add_counting(bloom, hash, MODE_DELETE);
+    return 1;
+}
+
 void bloom_free(struct bloom *bloom) { BLOOM_FREE(bloom->bf); }
 
 const char *bloom_version() { return MAKESTRING(BLOOM_VERSION); }
@@ -24,6 +24,8 @@ struct bloom {
     uint32_t hashes;
     uint8_t force64;
     uint8_t n2;
+    uint8_t blocked;
+    uint8_t counting;
     uint64_t entries;
 
     double error;
@@ -75,8 +77,34 @@ struct bloom {
 // Disable auto-scaling. Saves memory
 #define BLOOM_OPT_NO_SCALING 8
 
+// Keep all the bits of an item inside a single cache-line sized block. Lookups
+// touch one block instead of `hashes` random locations, at the cost of a
+// slightly higher false positive rate.
+#define BLOOM_OPT_BLOCKED 16
+
+// Size, in bytes, of a single block when BLOOM_OPT_BLOCKED is used
+#define BLOOM_BLOCK_BYTES 64
+#define BLOOM_BLOCK_BITS (BLOOM_BLOCK_BYTES * 8)
+
+// Keep a small counter instead of a bit at every position, so that items can
+// be removed with bloom_del_h(). `bits` is then the number of counters. Takes
+// BLOOM_COUNTER_BITS times the memory of a plain filter for the same error.
+#define BLOOM_OPT_COUNTING 32
+
+// Counters are packed two per byte. They saturate at BLOOM_COUNTER_MAX and
+// are never decremented from there, since the real count is lost.
+#define BLOOM_COUNTER_BITS 4
+#define BLOOM_COUNTER_MAX ((1 << BLOOM_COUNTER_BITS) - 1)
+
 int bloom_init(struct bloom *bloom, uint64_t entries, double error, unsigned options);
 
+/** ***************************************************************************
+ * Same as bloom_init(), without allocating the bit array: bloom->bf is left
+ * untouched, for the caller to point to bloom->bytes zeroed bytes.
+ *
+ */
+int bloom_layout(struct bloom *bloom, uint64_t entries, double error, unsigned options);
+
 /** ***************************************************************************
  * Deprecated, use bloom_init()
  *
@@ -89,6 +117,7 @@ typedef struct {
 } bloom_hashval;
 
 bloom_hashval bloom_calc_hash(const void *buffer, int len);
+bloom_hashval bloom_calc_hash64(const void *buffer, int len);
 
 /** ***************************************************************************
  * Check if the given element is in the bloom filter. Remember this may
@@ -129,6 +158,28 @@ int bloom_check(const struct bloom *bloom, const void *buffer, int len);
  *
  */
 int bloom_add_h(struct bloom *bloom, bloom_hashval hash);
+
+/** ***************************************************************************
+ * Remove an element previously added to a counting bloom filter (see
+ * BLOOM_OPT_COUNTING). Removing an element that was never added may remove
+ * others with it, if it was a false positive.
+ *
+ * Return:
+ * -------
+ *     0 - element is not present, nothing was changed
+ *     1 - element was present and was removed
+ *    -1 - not a counting filter
+ *
+ */
+int bloom_del_h(struct bloom *bloom, bloom_hashval hash);
+
+/** ***************************************************************************
+ * Issue software prefetches for every location that bloom_check_h() or
+ * bloom_add_h() would access for this hash. `mode` is 0 for a lookup and 1
+ * for an insertion. Does not modify the filter.
+ *
+ */
+void bloom_prefetch_h(const struct bloom *bloom, bloom_hashval hash, int mode);
 int bloom_add(struct bloom *bloom, const void *buffer, int len);
 
 /** ***************************************************************************
@@ -0,0 +1,18 @@
+//-----------------------------------------------------------------------------
+// MurmurHash3 was written by Austin Appleby, and is placed in the public
+// domain. The author hereby disclaims copyright to this source code.
+
+#ifndef _MURMURHASH3_H_
+#define _MURMURHASH3_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+
+//-----------------------------------------------------------------------------
+
+// Writes the two 64-bit halves of the hash to out[0] and out[1]
+void MurmurHash3_x64_128(const void *key, int len, uint32_t seed, uint64_t out[2]);
+
+//-----------------------------------------------------------------------------
+
+#endif // _MURMURHASH3_H_
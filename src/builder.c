@@ -0,0 +1,510 @@
+/*
+ * redisbloom-builder: builds Bloom and Cuckoo filters offline, without a
+ * server. Items are hashed on several threads and added in input order, so the
+ * filter is the same as the one BF.ADD or CF.ADD would build from them. The
+ * output is either the raw SCANDUMP chunks of the filter, as read by BF.MMAP,
+ * or the BF.LOADCHUNK / CF.LOADCHUNK commands restoring it, for redis-cli --pipe.
+ */
+#include "redismodule.h"
+#include "sb.h"
+#include "cf.h"
+#include "crc64.h"
+#include "simd.h"
+#include "workers.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Same defaults as BF.RESERVE and CF.RESERVE
+#define BUILDER_BF_ERROR_RATE 0.01
+#define BUILDER_BF_EXPANSION 2
+#define BUILDER_CF_BUCKETSIZE 2
+#define BUILDER_CF_MAX_ITERATIONS 20
+#define BUILDER_CF_EXPANSION 1
+
+// Input is read, hashed and added in blocks of at most this many bytes and items
+#define BUILDER_BLOCK_BYTES (16 << 20)
+#define BUILDER_BLOCK_ITEMS (1 << 20)
+// Items hashed by each thread at a time
+#define BUILDER_MIN_PART 4096
+#define BUILDER_MAX_THREADS 64
+// Size of the data chunks written, below the default proto-max-bulk-len
+#define BUILDER_CHUNK_BYTES (64 << 20)
+
+typedef struct {
+    int cuckoo;
+    long long capacity;
+    double errorRate;
+    long long expansion; //< 0 for the default of the filter type
+    int nonScaling;
+    int blocked;
+    int counting;
+    long long bucketSize;
+    long long maxIterations;
+    long long fpBits;
+    int semiSort;
+    int unique;
+    long long recordSize; //< 0 for newline separated items
+    long long threads;
+    const char *respKey; //< Write LOADCHUNK commands for this key instead of raw chunks
+    const char *output;
+} BuilderOptions;
+
+typedef struct {
+    const BuilderOptions *opts;
+    SBChain *sb;
+    CuckooFilter *cf;
+    char *buf;
+    const char **items;
+    size_t *lens;
+    size_t nitems;
+    bloom_hashval *bfHashes;
+    CuckooHash *cfHashes;
+    int *results;
+    long long numRead;
+    long long numAdded;
+} Builder;
+
+static void *calloc_wrap(size_t a, size_t b) { return calloc(a, b); }
+static void free_wrap(void *p) { free(p); }
+
+static void usage(FILE *fp) {
+    fprintf(fp,
+            "Usage: redisbloom-builder [OPTIONS] -c CAPACITY -o OUTPUT [INPUT...]\n"
+            "Builds a filter from the items of the INPUT files, or of stdin.\n"
+            "\n"
+            "  -t, --type bf|cf          filter type (bf)\n"
+            "  -c, --capacity N          initial capacity\n"
+            "  -o, --output FILE         output file, - for stdout\n"
+            "  -p, --resp KEY            write the LOADCHUNK commands restoring KEY, as\n"
+            "                            accepted by redis-cli --pipe, instead of raw chunks\n"
+            "  -r, --record-size N       items are records of N bytes instead of lines\n"
+            "  -j, --threads N           hashing threads (number of CPUs)\n"
+            "  -x, --expansion N         growth of new sub-filters\n"
+            "Bloom filters:\n"
+            "  -e, --error-rate R        false positive rate (%g)\n"
+            "  -n, --nonscaling          fail instead of adding sub-filters\n"
+            "  -B, --blocked             cache-line blocked bits\n"
+            "  -C, --counting            counters instead of bits, for BF.DEL\n"
+            "Cuckoo filters:\n"
+            "  -b, --bucket-size N       fingerprints per bucket (%d)\n"
+            "  -i, --max-iterations N    evictions before expanding (%d)\n"
+            "  -f, --fp-size 8|16|32     fingerprint bits (8)\n"
+            "  -s, --semisort            semi-sorted buckets\n"
+            "  -u, --unique              skip items already in the filter, as CF.ADDNX\n",
+            BUILDER_BF_ERROR_RATE, BUILDER_CF_BUCKETSIZE, BUILDER_CF_MAX_ITERATIONS);
+}
+
+static int parseLong(const char *s, long long min, long long max, long long *out) {
+    char *end;
+    errno = 0;
+    long long v = strtoll(s, &end, 10);
+    if (errno || end == s || *end || v < min || v > max) {
+        return -1;
+    }
+    *out = v;
+    return 0;
+}
+
+static int parseOptions(int argc, char **argv, BuilderOptions *opts) {
+    static const struct option longopts[] = {{"type", required_argument, NULL, 't'},
+                                             {"capacity", required_argument, NULL, 'c'},
+                                             {"output", required_argument, NULL, 'o'},
+                                             {"resp", required_argument, NULL, 'p'},
+                                             {"record-size", required_argument, NULL, 'r'},
+                                             {"threads", required_argument, NULL, 'j'},
+                                             {"expansion", required_argument, NULL, 'x'},
+                                             {"error-rate", required_argument, NULL, 'e'},
+                                             {"nonscaling", no_argument, NULL, 'n'},
+                                             {"blocked", no_argument, NULL, 'B'},
+                                             {"counting", no_argument, NULL, 'C'},
+                                             {"bucket-size", required_argument, NULL, 'b'},
+                                             {"max-iterations", required_argument, NULL, 'i'},
+                                             {"fp-size", required_argument, NULL, 'f'},
+                                             {"semisort", no_argument, NULL, 's'},
+                                             {"unique", no_argument, NULL, 'u'},
+                                             {"help", no_argument, NULL, 'h'},
+                                             {NULL, 0, NULL, 0}};
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    *opts = (BuilderOptions){.errorRate = BUILDER_BF_ERROR_RATE,
+                             .bucketSize = BUILDER_CF_BUCKETSIZE,
+                             .maxIterations = BUILDER_CF_MAX_ITERATIONS,
+                             .fpBits = CUCKOO_DEFAULT_FPSIZE * 8,
+                             .threads = cpus < 1                     ? 1
+                                        : cpus > BUILDER_MAX_THREADS ? BUILDER_MAX_THREADS
+                                                                     : cpus};
+    int bucketSizeSet = 0;
+    int c;
+    while ((c = getopt_long(argc, argv, "t:c:o:p:r:j:x:e:nBCb:i:f:suh", longopts, NULL)) != -1) {
+        int rc = 0;
+        switch (c) {
+        case 't':
+            if (!strcmp(optarg, "bf") || !strcmp(optarg, "cf")) {
+                opts->cuckoo = optarg[0] == 'c';
+            } else {
+                rc = -1;
+            }
+            break;
+        case 'c':
+            rc = parseLong(optarg, 1, LLONG_MAX, &opts->capacity);
+            break;
+        case 'o':
+            opts->output = optarg;
+            break;
+        case 'p':
+            opts->respKey = optarg;
+            break;
+        case 'r':
+            rc = parseLong(optarg, 1, BUILDER_BLOCK_BYTES, &opts->recordSize);
+            break;
+        case 'j':
+            rc = parseLong(optarg, 1, BUILDER_MAX_THREADS, &opts->threads);
+            break;
+        case 'x':
+            rc = parseLong(optarg, 1, UINT16_MAX, &opts->expansion);
+            break;
+        case 'e': {
+            char *end;
+            opts->errorRate = strtod(optarg, &end);
+            rc = (end == optarg || *end || opts->errorRate <= 0 || opts->errorRate >= 1) ? -1 : 0;
+            break;
+        }
+        case 'n':
+            opts->nonScaling = 1;
+            break;
+        case 'B':
+            opts->blocked = 1;
+            break;
+        case 'C':
+            opts->counting = 1;
+            break;
+        case 'b':
+            rc = parseLong(optarg, 1, UINT16_MAX, &opts->bucketSize);
+            bucketSizeSet = 1;
+            break;
+        case 'i':
+            rc = parseLong(optarg, 1, UINT16_MAX, &opts->maxIterations);
+            break;
+        case 'f':
+            rc = parseLong(optarg, 8, 32, &opts->fpBits);
+            if (rc == 0 && (opts->fpBits % 8 || !CuckooFilter_ValidFpSize(opts->fpBits / 8))) {
+                rc = -1;
+            }
+            break;
+        case 's':
+            opts->semiSort = 1;
+            break;
+        case 'u':
+            opts->unique = 1;
+            break;
+        case 'h':
+            usage(stdout);
+            exit(0);
+        default:
+            return -1;
+        }
+        if (rc != 0) {
+            fprintf(stderr, "redisbloom-builder: invalid value for -%c: %s\n", c, optarg);
+            return -1;
+        }
+    }
+
+    if (!opts->capacity || !opts->output) {
+        fprintf(stderr, "redisbloom-builder: -c and -o are required\n");
+        return -1;
+    }
+    if (opts->cuckoo) {
+        if (opts->semiSort && !bucketSizeSet) {
+            opts->bucketSize = CUCKOO_SEMISORT_BUCKETSIZE;
+        }
+        if (opts->semiSort && !CuckooFilter_ValidSemiSort(opts->bucketSize, opts->fpBits / 8)) {
+            fprintf(stderr, "redisbloom-builder: --semisort requires a bucket size of 4 and a "
+                            "fingerprint size of 8 or 16\n");
+            return -1;
+        }
+        if (opts->capacity < opts->bucketSize * 2) {
+            fprintf(stderr, "redisbloom-builder: capacity must be at least bucket size * 2\n");
+            return -1;
+        }
+    } else if (opts->nonScaling && opts->expansion) {
+        fprintf(stderr, "redisbloom-builder: nonscaling filters cannot expand\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int createFilter(Builder *b) {
+    const BuilderOptions *opts = b->opts;
+    if (!opts->cuckoo) {
+        unsigned options = BLOOM_OPT_FORCE64 | BLOOM_OPT_NOROUND;
+        options |= opts->nonScaling ? BLOOM_OPT_NO_SCALING : 0;
+        options |= opts->blocked ? BLOOM_OPT_BLOCKED : 0;
+        options |= opts->counting ? BLOOM_OPT_COUNTING : 0;
+        b->sb = SB_NewChain(opts->capacity, opts->errorRate, options,
+                            opts->expansion ? opts->expansion : BUILDER_BF_EXPANSION);
+        return b->sb ? 0 : -1;
+    }
+
+    long long expansion = opts->expansion ? opts->expansion : BUILDER_CF_EXPANSION;
+    b->cf = calloc(1, sizeof(*b->cf));
+    int rc = opts->semiSort ? CuckooFilter_InitSemiSorted(b->cf, opts->capacity,
+                                                          opts->maxIterations, expansion,
+                                                          opts->fpBits / 8)
+                            : CuckooFilter_InitWithFpSize(b->cf, opts->capacity, opts->bucketSize,
+                                                          opts->maxIterations, expansion,
+                                                          opts->fpBits / 8);
+    if (rc != 0) {
+        free(b->cf);
+        b->cf = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static void hashPart(void *arg, size_t begin, size_t end) {
+    Builder *b = arg;
+    for (size_t ii = begin; ii < end; ++ii) {
+        if (b->sb) {
+            b->bfHashes[ii] = SBChain_HashItem(b->sb, b->items[ii], b->lens[ii]);
+        } else {
+            b->cfHashes[ii] = CUCKOO_GEN_HASH(b->items[ii], b->lens[ii]);
+        }
+    }
+}
+
+static int addItems(Builder *b) {
+    Workers_ParallelFor(b->nitems, BUILDER_MIN_PART, hashPart, b);
+    b->numRead += b->nitems;
+
+    if (b->sb) {
+        size_t n = SBChain_AddHashes(b->sb, b->bfHashes, b->nitems, b->results);
+        for (size_t ii = 0; ii < n; ++ii) {
+            if (b->results[ii] < 0) {
+                fprintf(stderr, "redisbloom-builder: %s\n",
+                        b->results[ii] == -2 ? "non scaling filter is full" : "out of memory");
+                return -1;
+            }
+            b->numAdded += b->results[ii];
+        }
+        return 0;
+    }
+
+    for (size_t ii = 0; ii < b->nitems; ++ii) {
+        CuckooInsertStatus status = b->opts->unique
+                                        ? CuckooFilter_InsertUnique(b->cf, b->cfHashes[ii])
+                                        : CuckooFilter_Insert(b->cf, b->cfHashes[ii]);
+        if (status == CuckooInsert_NoSpace || status == CuckooInsert_MemAllocFailed) {
+            fprintf(stderr, "redisbloom-builder: %s\n",
+                    status == CuckooInsert_NoSpace ? "filter is full" : "out of memory");
+            return -1;
+        }
+        b->numAdded += status == CuckooInsert_Inserted;
+    }
+    return 0;
+}
+
+// Splits the first `len` bytes of the buffer into items. Returns the number of
+// bytes they span; the rest is an incomplete item unless `eof` is set.
+static size_t splitItems(Builder *b, size_t len, int eof) {
+    const size_t recordSize = b->opts->recordSize;
+    size_t pos = 0;
+    b->nitems = 0;
+    while (pos < len && b->nitems < BUILDER_BLOCK_ITEMS) {
+        size_t itemLen;
+        size_t next;
+        if (recordSize) {
+            if (len - pos < recordSize) {
+                break;
+            }
+            itemLen = recordSize;
+            next = pos + recordSize;
+        } else {
+            const char *nl = memchr(b->buf + pos, '\n', len - pos);
+            if (!nl && !eof) {
+                break;
+            }
+            itemLen = nl ? (size_t)(nl - (b->buf + pos)) : len - pos;
+            next = pos + itemLen + (nl != NULL);
+        }
+        b->items[b->nitems] = b->buf + pos;
+        b->lens[b->nitems] = itemLen;
+        b->nitems++;
+        pos = next;
+    }
+    return pos;
+}
+
+static int readInput(Builder *b, FILE *fp, const char *name) {
+    size_t len = 0;
+    int eof = 0;
+    while (!eof || len > 0) {
+        if (!eof) {
+            size_t want = BUILDER_BLOCK_BYTES - len;
+            size_t n = fread(b->buf + len, 1, want, fp);
+            if (n < want) {
+                if (ferror(fp)) {
+                    fprintf(stderr, "redisbloom-builder: %s: %s\n", name, strerror(errno));
+                    return -1;
+                }
+                eof = 1;
+            }
+            len += n;
+        }
+
+        size_t used = splitItems(b, len, eof);
+        if (used == 0 && len > 0) {
+            fprintf(stderr, "redisbloom-builder: %s: %s\n", name,
+                    eof ? "truncated record" : "item too long");
+            return -1;
+        }
+        if (addItems(b) != 0) {
+            return -1;
+        }
+        memmove(b->buf, b->buf + used, len - used);
+        len -= used;
+    }
+    return 0;
+}
+
+static int writeChunk(const Builder *b, FILE *fp, long long iter, const char *buf, size_t len) {
+    if (!b->opts->respKey) {
+        return fwrite(buf, 1, len, fp) == len ? 0 : -1;
+    }
+    const char *cmd = b->sb ? "BF.LOADCHUNK" : "CF.LOADCHUNK";
+    const char *key = b->opts->respKey;
+    char iterStr[32], crcStr[32];
+    snprintf(iterStr, sizeof(iterStr), "%lld", iter);
+    snprintf(crcStr, sizeof(crcStr), "%lld", (long long)crc64(0, buf, len));
+
+    fprintf(fp, "*5\r\n$%zu\r\n%s\r\n$%zu\r\n%s\r\n$%zu\r\n%s\r\n$%zu\r\n", strlen(cmd), cmd,
+            strlen(key), key, strlen(iterStr), iterStr, len);
+    fwrite(buf, 1, len, fp);
+    fprintf(fp, "\r\n$%zu\r\n%s\r\n", strlen(crcStr), crcStr);
+    return ferror(fp) ? -1 : 0;
+}
+
+static int writeFilter(const Builder *b, FILE *fp) {
+    size_t len;
+    char *hdr = b->sb ? SBChain_GetEncodedHeader(b->sb, &len) : CF_GetEncodedHeader(b->cf, &len);
+    int rc = writeChunk(b, fp, 1, hdr, len);
+    if (b->sb) {
+        SB_FreeEncodedHeader(hdr);
+    } else {
+        CF_FreeEncodedHeader(hdr);
+    }
+
+    long long iter = 1;
+    const char *chunk;
+    while (rc == 0) {
+        chunk = b->sb ? SBChain_GetEncodedChunk(b->sb, &iter, &len, BUILDER_CHUNK_BYTES)
+                      : CF_GetEncodedChunk(b->cf, &iter, &len, BUILDER_CHUNK_BYTES);
+        if (!chunk) {
+            break;
+        }
+        rc = writeChunk(b, fp, iter, chunk, len);
+    }
+    return rc;
+}
+
+// Writes to a temporary file renamed over OUTPUT once complete, so that a file
+// mapped by BF.MMAP is never modified in place.
+static int writeOutput(const Builder *b) {
+    const char *output = b->opts->output;
+    if (!strcmp(output, "-")) {
+        return writeFilter(b, stdout) == 0 && fflush(stdout) == 0 ? 0 : -1;
+    }
+
+    size_t tmpLen = strlen(output) + sizeof(".tmp");
+    char *tmp = malloc(tmpLen);
+    snprintf(tmp, tmpLen, "%s.tmp", output);
+    FILE *fp = fopen(tmp, "wb");
+    int rc = fp ? writeFilter(b, fp) : -1;
+    if (fp && fclose(fp) != 0) {
+        rc = -1;
+    }
+    if (rc == 0 && rename(tmp, output) != 0) {
+        rc = -1;
+    }
+    if (rc != 0) {
+        fprintf(stderr, "redisbloom-builder: %s: %s\n", output, strerror(errno));
+        unlink(tmp);
+    }
+    free(tmp);
+    return rc;
+}
+
+int main(int argc, char **argv) {
+    RedisModule_Alloc = malloc;
+    RedisModule_Calloc = calloc_wrap;
+    RedisModule_Realloc = realloc;
+    RedisModule_Free = free_wrap;
+
+    BuilderOptions opts;
+    if (parseOptions(argc, argv, &opts) != 0) {
+        usage(stderr);
+        return 1;
+    }
+    SIMD_Init();
+    if (opts.threads > 1 && Workers_Init(opts.threads - 1) != 0) {
+        fprintf(stderr, "redisbloom-builder: could not start the hashing threads\n");
+        return 1;
+    }
+
+    Builder b = {.opts = &opts};
+    if (createFilter(&b) != 0) {
+        fprintf(stderr, "redisbloom-builder: could not create the filter\n");
+        return 1;
+    }
+    b.buf = malloc(BUILDER_BLOCK_BYTES);
+    b.items = malloc(sizeof(*b.items) * BUILDER_BLOCK_ITEMS);
+    b.lens = malloc(sizeof(*b.lens) * BUILDER_BLOCK_ITEMS);
+    if (b.sb) {
+        b.bfHashes = malloc(sizeof(*b.bfHashes) * BUILDER_BLOCK_ITEMS);
+    } else {
+        b.cfHashes = malloc(sizeof(*b.cfHashes) * BUILDER_BLOCK_ITEMS);
+    }
+    b.results = malloc(sizeof(*b.results) * BUILDER_BLOCK_ITEMS);
+
+    int rc = 0;
+    if (optind == argc) {
+        rc = readInput(&b, stdin, "stdin");
+    }
+    for (int ii = optind; rc == 0 && ii < argc; ++ii) {
+        FILE *fp = strcmp(argv[ii], "-") ? fopen(argv[ii], "rb") : stdin;
+        if (!fp) {
+            fprintf(stderr, "redisbloom-builder: %s: %s\n", argv[ii], strerror(errno));
+            rc = -1;
+            break;
+        }
+        rc = readInput(&b, fp, argv[ii]);
+        if (fp != stdin) {
+            fclose(fp);
+        }
+    }
+    if (rc == 0) {
+        rc = writeOutput(&b);
+    }
+    if (rc == 0) {
+        fprintf(stderr, "redisbloom-builder: read %lld items, added %lld\n", b.numRead,
+                b.numAdded);
+    }
+
+    if (b.sb) {
+        SBChain_Free(b.sb);
+    } else {
+        CuckooFilter_Free(b.cf);
+        free(b.cf);
+    }
+    free(b.buf);
+    free(b.items);
+    free(b.lens);
+    free(b.bfHashes);
+    free(b.cfHashes);
+    free(b.results);
+    return rc == 0 ? 0 : 1;
+}
@@ -5,83 +5,119 @@
 #define CUCKOO_FREE RedisModule_Free
 #include "cuckoo.c"
 #include "cf.h"
+#include <stddef.h>
 
-// Get the bucket corresponding to the given position. 'offset' is modified to be the
-// actual position (beginning of bucket) where `pos` is mapped to, with respect to
-// the current filter. The filter itself is not returned directly (but can be inferred)
-// via `offset`
-static uint8_t *getBucketPos(const CuckooFilter *cf, long long pos, size_t *offset) {
-    // Normalize the pos pointer to the beginning of the filter
-    pos--;
-    *offset = pos % cf->numBuckets;
-    // Get the actual filter index.
-    size_t filterIx = (pos - (pos % cf->numBuckets)) / cf->numBuckets;
-
-    if (filterIx >= cf->numFilters) {
-        // Last position
+// Chunk positions are 1 + the byte offset of the chunk in the concatenation of
+// all the sub-filters. Returns the sub-filter containing the byte at `pos`, with
+// `offset` set to its position inside it, or NULL past the end.
+static SubCF *getFilterPos(const CuckooFilter *cf, long long pos, size_t *offset) {
+    if (pos < 1) {
         return NULL;
     }
-
-    if (*offset + 1 == cf->numBuckets) {
-        *offset = 0;
-        if (++filterIx == cf->numFilters) {
-            return NULL;
+    size_t remaining = pos - 1;
+    for (size_t ii = 0; ii < cf->numFilters; ++ii) {
+        SubCF *filter = cf->filters + ii;
+        size_t filterSize = SubCF_DataSize(filter);
+        if (remaining < filterSize) {
+            *offset = remaining;
+            return filter;
         }
+        remaining -= filterSize;
     }
-    return cf->filters[filterIx].data + *offset;
+    return NULL;
 }
 
 const char *CF_GetEncodedChunk(const CuckooFilter *cf, long long *pos, size_t *buflen,
                                size_t bytelimit) {
     size_t offset;
-    uint8_t *bucket = getBucketPos(cf, *pos, &offset);
-    if (!bucket) {
+    SubCF *filter = getFilterPos(cf, *pos, &offset);
+    if (!filter) {
         return NULL;
     }
-    size_t chunksz = cf->numBuckets - offset;
-    size_t max_buckets = (bytelimit / cf->bucketSize);
-    if (chunksz > max_buckets) {
-        chunksz = max_buckets;
+    size_t chunksz = SubCF_DataSize(filter) - offset;
+    if (chunksz > bytelimit) {
+        chunksz = bytelimit;
     }
     *pos += chunksz;
-    *buflen = chunksz * cf->bucketSize;
-    return (const char *)bucket;
+    *buflen = chunksz;
+    return (const char *)filter->data + offset;
 }
 
 int CF_LoadEncodedChunk(const CuckooFilter *cf, long long pos, const char *data, size_t datalen) {
-    if (datalen == 0 || datalen % cf->bucketSize != 0) {
-        // printf("problem with datalen!\n");
+    if (datalen == 0 || pos <= (long long)datalen) {
         return REDISMODULE_ERR;
     }
 
-    size_t nbuckets = datalen / cf->bucketSize;
-    if (nbuckets > pos) {
-        // printf("nbuckets>pos. pos=%lu. nbuckets=%lu\n", nbuckets, pos);
-        return REDISMODULE_ERR;
-    }
-
-    pos -= nbuckets;
-
     size_t offset;
-    uint8_t *bucketpos = getBucketPos(cf, pos, &offset);
-    if (bucketpos == NULL) {
-        // printf("bucketpos=NULL\n");
+    SubCF *filter = getFilterPos(cf, pos - datalen, &offset);
+    if (filter == NULL) {
         return REDISMODULE_ERR;
     }
 
-    // printf("OFFSET: %lu\n", offset);
-
-    if (offset + nbuckets > cf->numBuckets) {
-        // printf("offset+nbuckets > cf->numBuckets. offset=%lu, nbuckets=%lu, numBuckets=%lu\n",
-        //        offset, nbuckets, cf->numBuckets);
+    if (offset + datalen > SubCF_DataSize(filter)) {
         return REDISMODULE_ERR;
     }
 
-    memcpy(bucketpos, data, datalen);
+    memcpy(filter->data + offset, data, datalen);
     return REDISMODULE_OK;
 }
 
-CuckooFilter *CFHeader_Load(const CFHeader *header) {
+// Headers without fpSize and semiSort, from filters that always had 1 byte fingerprints
+#define CF_LEGACY_HEADER_SIZE offsetof(CFHeader, fpSize)
+// Headers without the compaction cursor, from filters that compacted at once
+#define CF_NOCOMPACT_HEADER_SIZE offsetof(CFHeader, compactFilter)
+
+static uint32_t headerNumBuckets(const char *buf, size_t headerSize, size_t ii) {
+    uint32_t numBuckets;
+    memcpy(&numBuckets, buf + headerSize + sizeof(numBuckets) * ii, sizeof(numBuckets));
+    return numBuckets;
+}
+
+CuckooFilter *CFHeader_Load(const char *buf, size_t len) {
+    const CFHeader *header = (const void *)buf;
+    if (len < CF_LEGACY_HEADER_SIZE || header->numFilters == 0 ||
+        header->numFilters > UINT16_MAX) {
+        return NULL;
+    }
+    size_t numBucketsLen = sizeof(header->filtersNumBucket[0]) * header->numFilters;
+    size_t headerSize;
+    uint16_t fpSize, semiSort, compactFilter = 0, compactDirty = 0;
+    uint32_t compactBucket = 0;
+    if (len == sizeof(*header) + numBucketsLen) {
+        headerSize = sizeof(*header);
+        fpSize = header->fpSize;
+        semiSort = header->semiSort;
+        compactFilter = header->compactFilter;
+        compactDirty = header->compactDirty;
+        compactBucket = header->compactBucket;
+    } else if (len == CF_NOCOMPACT_HEADER_SIZE + numBucketsLen) {
+        headerSize = CF_NOCOMPACT_HEADER_SIZE;
+        fpSize = header->fpSize;
+        semiSort = header->semiSort;
+    } else if (len == CF_LEGACY_HEADER_SIZE + numBucketsLen) {
+        headerSize = CF_LEGACY_HEADER_SIZE;
+        fpSize = 1;
+        semiSort = 0;
+    } else {
+        return NULL;
+    }
+    if (header->bucketSize == 0 || header->expansion == 0 || header->numBuckets == 0 ||
+        !CuckooFilter_ValidFpSize(fpSize) || semiSort > 1 ||
+        (semiSort && !CuckooFilter_ValidSemiSort(header->bucketSize, fpSize))) {
+        return NULL;
+    }
+    // Sub-filters grow by a fixed factor. Anything else means a corrupt header.
+    uint64_t expected = header->numBuckets;
+    for (size_t ii = 0; ii < header->numFilters; ++ii, expected *= header->expansion) {
+        if (headerNumBuckets(buf, headerSize, ii) != expected) {
+            return NULL;
+        }
+    }
+    if (compactFilter >= header->numFilters || compactDirty > 1 ||
+        (compactFilter && compactBucket > headerNumBuckets(buf, headerSize, compactFilter))) {
+        return NULL;
+    }
+
     CuckooFilter *filter = RedisModule_Calloc(1, sizeof(*filter));
     filter->numBuckets = header->numBuckets;
     filter->numFilters = header->numFilters;
@@ -90,29 +126,44 @@ CuckooFilter *CFHeader_Load(const CFHeader *header) {
     filter->bucketSize = header->bucketSize;
     filter->maxIterations = header->maxIterations;
     filter->expansion = header->expansion;
+    filter->fpSize = fpSize;
+    filter->semiSort = semiSort;
+    if (compactFilter) {
+        filter->compactFilter = compactFilter;
+        filter->compactDirty = compactDirty;
+        filter->compactBucket = compactBucket;
+    }
     filter->filters = RedisModule_Alloc(sizeof(*filter->filters) * header->numFilters);
     for (size_t ii = 0; ii < filter->numFilters; ++ii) {
         SubCF *cur = filter->filters + ii;
         cur->bucketSize = header->bucketSize;
-        cur->numBuckets = header->filtersNumBucket[ii];
-        cur->data =
-            RedisModule_Calloc((size_t)cur->numBuckets * filter->bucketSize, sizeof(CuckooBucket));
+        cur->fpSize = fpSize;
+        cur->semiSort = semiSort;
+        cur->numBuckets = headerNumBuckets(buf, headerSize, ii);
+        cur->data = RedisModule_Calloc(SubCF_DataSize(cur), sizeof(CuckooBucket));
     }
-    RedisModule_Free(header->filtersNumBucket);
     return filter;
 }
 
-void fillCFHeader(CFHeader *header, const CuckooFilter *cf) {
+char *CF_GetEncodedHeader(const CuckooFilter *cf, size_t *len) {
+    *len = sizeof(CFHeader) + sizeof(uint32_t) * cf->numFilters;
+    CFHeader *header = RedisModule_Alloc(*len);
     *header = (CFHeader){.numItems = cf->numItems,
                          .numBuckets = cf->numBuckets,
                          .numDeletes = cf->numDeletes,
                          .numFilters = cf->numFilters,
                          .bucketSize = cf->bucketSize,
                          .maxIterations = cf->maxIterations,
-                         .expansion = cf->expansion};
-    header->filtersNumBucket =
-        RedisModule_Calloc(cf->numFilters, sizeof(*header->filtersNumBucket));
-    for (size_t ii = 0; ii < header->numFilters; ++ii) {
+                         .expansion = cf->expansion,
+                         .fpSize = cf->fpSize,
+                         .semiSort = cf->semiSort,
+                         .compactFilter = cf->compactFilter,
+                         .compactDirty = cf->compactDirty,
+                         .compactBucket = cf->compactBucket};
+    for (size_t ii = 0; ii < cf->numFilters; ++ii) {
         header->filtersNumBucket[ii] = cf->filters[ii].numBuckets;
     }
-}
\ No newline at end of file
+    return (char *)header;
+}
+
+void CF_FreeEncodedHeader(char *header) { RedisModule_Free(header); }
@@ -6,6 +6,10 @@ const char *CF_GetEncodedChunk(const CuckooFilter *cf, long long *pos, size_t *b
                                size_t bytelimit);
 int CF_LoadEncodedChunk(const CuckooFilter *cf, long long pos, const char *data, size_t datalen);
 
+/**
+ * Encoded form of a filter's parameters, followed by the number of buckets of
+ * each of its `numFilters` sub-filters.
+ */
 typedef struct __attribute__((packed)) {
     uint64_t numItems;
     uint64_t numBuckets;
@@ -14,10 +18,22 @@ typedef struct __attribute__((packed)) {
     uint16_t bucketSize;
     uint16_t maxIterations;
     uint16_t expansion;
-    uint32_t *filtersNumBucket;
+    uint16_t fpSize;
+    uint16_t semiSort;
+    uint16_t compactFilter;
+    uint16_t compactDirty;
+    uint32_t compactBucket;
+    uint32_t filtersNumBucket[0];
 } CFHeader;
 
-CuckooFilter *CFHeader_Load(const CFHeader *header);
-void fillCFHeader(CFHeader *header, const CuckooFilter *cf);
+/**
+ * Returns a newly allocated header describing `cf`, and its length in `len`.
+ * Free with CF_FreeEncodedHeader.
+ */
+char *CF_GetEncodedHeader(const CuckooFilter *cf, size_t *len);
+void CF_FreeEncodedHeader(char *header);
 
-#endif
\ No newline at end of file
+/** Creates an empty filter from an encoded header. Returns NULL if the header is invalid */
+CuckooFilter *CFHeader_Load(const char *buf, size_t len);
+
+#endif
@@ -2,8 +2,10 @@
 #include <math.h>   // q, ceil
 #include <stdio.h>  // printf
 #include <stdlib.h> // malloc
+#include <string.h> // memcpy
 
 #include "cms.h"
+#include "sketch_index.h"
 #include "contrib/murmurhash2.h"
 
 #define min(a, b)                                                                                  \
@@ -16,16 +18,31 @@
 #define BIT64 64
 #define CMS_HASH(item, itemlen, i) MurmurHash2(item, itemlen, i)
 
+static inline uint32_t rowHash(const CMSketch *cms, const char *item, size_t itemlen,
+                               SketchHash h, size_t i) {
+    if (cms->hashMode == SKETCH_HASH_DOUBLE) {
+        return Sketch_RowHash(h, i);
+    }
+    return CMS_HASH(item, itemlen, i);
+}
+
 CMSketch *NewCMSketch(size_t width, size_t depth) {
+    return NewCMSketchWithCounter(width, depth, sizeof(uint32_t));
+}
+
+CMSketch *NewCMSketchWithCounter(size_t width, size_t depth, size_t counterSize) {
     assert(width > 0);
     assert(depth > 0);
+    assert(counterSize == 2 || counterSize == 4 || counterSize == 8);
 
     CMSketch *cms = CMS_CALLOC(1, sizeof(CMSketch));
 
     cms->width = width;
     cms->depth = depth;
     cms->counter = 0;
-    cms->array = CMS_CALLOC(width * depth, sizeof(uint32_t));
+    cms->hashMode = SKETCH_HASH_DOUBLE;
+    cms->counterSize = counterSize;
+    cms->array = CMS_CALLOC(width * depth, counterSize);
 
     return cms;
 }
@@ -43,22 +60,111 @@ void CMS_Destroy(CMSketch *cms) {
 
     CMS_FREE(cms->array);
     cms->array = NULL;
+    CMS_FREE(cms->stats);
 
     CMS_FREE(cms);
 }
 
+CMSStats cmsTotalStats;
+
+int CMS_EnableStats(CMSketch *cms) {
+    if (!cms->stats) {
+        cms->stats = CMS_CALLOC(1, sizeof(*cms->stats));
+    }
+    return cms->stats ? 0 : -1;
+}
+
+#define CMS_COUNT(cms, field)                                                                      \
+    do {                                                                                           \
+        if ((cms)->stats) {                                                                        \
+            (cms)->stats->field++;                                                                 \
+            cmsTotalStats.field++;                                                                 \
+        }                                                                                          \
+    } while (0)
+
+static inline uint64_t counterMax(const CMSketch *cms) {
+    return cms->counterSize == 8 ? UINT64_MAX : (1ULL << (cms->counterSize * 8)) - 1;
+}
+
+static inline uint64_t saturatingAdd(uint64_t a, uint64_t b, uint64_t max) {
+    return (b >= max || a >= max - b) ? max : a + b;
+}
+
+static inline uint64_t getCounter(const CMSketch *cms, size_t loc) {
+    switch (cms->counterSize) {
+    case 2:
+        return ((uint16_t *)cms->array)[loc];
+    case 8:
+        return ((uint64_t *)cms->array)[loc];
+    default:
+        return ((uint32_t *)cms->array)[loc];
+    }
+}
+
+static inline void setCounter(CMSketch *cms, size_t loc, uint64_t value) {
+    switch (cms->counterSize) {
+    case 2:
+        ((uint16_t *)cms->array)[loc] = value;
+        break;
+    case 8:
+        ((uint64_t *)cms->array)[loc] = value;
+        break;
+    default:
+        ((uint32_t *)cms->array)[loc] = value;
+        break;
+    }
+}
+
+/* Fills locs with the position of the item's counter in every row */
+static void itemLocs(const CMSketch *cms, const char *item, size_t itemlen, size_t *locs) {
+    SketchHash h = {0};
+    if (cms->hashMode == SKETCH_HASH_DOUBLE) {
+        h = Sketch_Hash(item, itemlen);
+    }
+    for (size_t i = 0; i < cms->depth; ++i) {
+        uint32_t hash = rowHash(cms, item, itemlen, h, i);
+        locs[i] = Sketch_Index(hash, cms->width, cms->indexMode) + (i * cms->width);
+    }
+}
+
+#define CMS_STACK_DEPTH 32
+
 size_t CMS_IncrBy(CMSketch *cms, const char *item, size_t itemlen, size_t value) {
     assert(cms);
     assert(item);
 
-    size_t minCount = (size_t)-1;
+    size_t stackLocs[CMS_STACK_DEPTH];
+    size_t *locs =
+        cms->depth <= CMS_STACK_DEPTH ? stackLocs : CMS_CALLOC(cms->depth, sizeof(*locs));
+    itemLocs(cms, item, itemlen, locs);
 
-    for (size_t i = 0; i < cms->depth; ++i) {
-        uint32_t hash = CMS_HASH(item, itemlen, i);
-        cms->array[(hash % cms->width) + (i * cms->width)] += value;
-        minCount = min(minCount, cms->array[(hash % cms->width) + (i * cms->width)]);
+    uint64_t max = counterMax(cms);
+    uint64_t minCount = UINT64_MAX;
+    if (cms->conservative) {
+        // Only raise the counters below the new estimate
+        for (size_t i = 0; i < cms->depth; ++i) {
+            minCount = min(minCount, getCounter(cms, locs[i]));
+        }
+        minCount = saturatingAdd(minCount, value, max);
+        for (size_t i = 0; i < cms->depth; ++i) {
+            if (getCounter(cms, locs[i]) < minCount) {
+                setCounter(cms, locs[i], minCount);
+            }
+        }
+    } else {
+        for (size_t i = 0; i < cms->depth; ++i) {
+            uint64_t count = getCounter(cms, locs[i]);
+            count = saturatingAdd(count, value, max);
+            setCounter(cms, locs[i], count);
+            minCount = min(minCount, count);
+        }
+    }
+
+    if (locs != stackLocs) {
+        CMS_FREE(locs);
     }
     cms->counter += value;
+    CMS_COUNT(cms, increments);
     return minCount;
 }
 
@@ -66,39 +172,125 @@ size_t CMS_Query(CMSketch *cms, const char *item, size_t itemlen) {
     assert(cms);
     assert(item);
 
-    size_t minCount = (size_t)-1;
+    size_t stackLocs[CMS_STACK_DEPTH];
+    size_t *locs =
+        cms->depth <= CMS_STACK_DEPTH ? stackLocs : CMS_CALLOC(cms->depth, sizeof(*locs));
+    itemLocs(cms, item, itemlen, locs);
 
+    uint64_t minCount = UINT64_MAX;
     for (size_t i = 0; i < cms->depth; ++i) {
-        uint32_t hash = CMS_HASH(item, itemlen, i);
-        minCount = min(minCount, cms->array[(hash % cms->width) + (i * cms->width)]);
+        minCount = min(minCount, getCounter(cms, locs[i]));
+    }
+
+    if (locs != stackLocs) {
+        CMS_FREE(locs);
     }
+    CMS_COUNT(cms, queries);
     return minCount;
 }
 
-void CMS_Merge(CMSketch *dest, size_t quantity, const CMSketch **src, const long long *weights) {
+// Counters merged per pass over the sources. The tile stays in L1 while every
+// source streams through it sequentially.
+#define CMS_MERGE_TILE 1024
+
+// Merging is done in signed 64 bit arithmetic, then saturated to the counter
+// range. `exact` is set when the weights are small enough for the sums to never
+// leave the int64 range.
+#define CMS_MERGE_FUNC(T)                                                                          \
+    static void mergeRange_##T(T *dest, size_t quantity, const CMSketch **src,                     \
+                               const long long *weights, size_t begin, size_t end, int exact,      \
+                               int64_t max) {                                                      \
+        int64_t tile[CMS_MERGE_TILE];                                                              \
+        for (size_t lo = begin; lo < end; lo += CMS_MERGE_TILE) {                                  \
+            size_t n = min((size_t)CMS_MERGE_TILE, end - lo);                                      \
+            memset(tile, 0, n * sizeof(*tile));                                                    \
+            size_t k = 0;                                                                          \
+            for (; exact && k + 1 < quantity; k += 2) {                                            \
+                const T *a = (const T *)src[k]->array + lo;                                        \
+                const T *b = (const T *)src[k + 1]->array + lo;                                    \
+                int64_t wa = weights[k], wb = weights[k + 1];                                      \
+                for (size_t j = 0; j < n; ++j) {                                                   \
+                    tile[j] += (int64_t)a[j] * wa + (int64_t)b[j] * wb;                            \
+                }                                                                                  \
+            }                                                                                      \
+            for (; k < quantity; ++k) {                                                            \
+                const T *a = (const T *)src[k]->array + lo;                                        \
+                int64_t w = weights[k];                                                            \
+                if (exact) {                                                                       \
+                    for (size_t j = 0; j < n; ++j) {                                               \
+                        tile[j] += (int64_t)a[j] * w;                                              \
+                    }                                                                              \
+                    continue;                                                                      \
+                }                                                                                  \
+                for (size_t j = 0; j < n; ++j) {                                                   \
+                    int64_t v = a[j] > INT64_MAX ? INT64_MAX : (int64_t)a[j], p;                   \
+                    if (__builtin_mul_overflow(v, w, &p)) {                                        \
+                        p = (w < 0) ? INT64_MIN : INT64_MAX;                                       \
+                    }                                                                              \
+                    if (__builtin_add_overflow(tile[j], p, &tile[j])) {                            \
+                        tile[j] = (p < 0) ? INT64_MIN : INT64_MAX;                                 \
+                    }                                                                              \
+                }                                                                                  \
+            }                                                                                      \
+            /* Only written once all the sources were read, so `dest` may be one of them */        \
+            for (size_t j = 0; j < n; ++j) {                                                       \
+                dest[lo + j] = tile[j] < 0 ? 0 : (tile[j] > max ? (T)max : (T)tile[j]);            \
+            }                                                                                      \
+        }                                                                                          \
+    }
+
+CMS_MERGE_FUNC(uint16_t)
+CMS_MERGE_FUNC(uint32_t)
+CMS_MERGE_FUNC(uint64_t)
+
+void CMS_MergeRange(void *dest, size_t quantity, const CMSketch **src, const long long *weights,
+                    size_t begin, size_t end) {
     assert(dest);
     assert(src);
     assert(weights);
+    assert(quantity > 0);
 
-    size_t itemCount = 0;
-    size_t cmsCount = 0;
-    size_t width = dest->width;
-    size_t depth = dest->depth;
-
-    for (size_t i = 0; i < depth; ++i) {
-        for (size_t j = 0; j < width; ++j) {
-            itemCount = 0;
-            for (size_t k = 0; k < quantity; ++k) {
-                itemCount += src[k]->array[(i * width) + j] * weights[k];
-            }
-            dest->array[(i * width) + j] = itemCount;
-        }
+    size_t counterSize = src[0]->counterSize;
+    uint64_t max = counterMax(src[0]);
+    // Bound of any partial sum, to know whether the fast path can't overflow
+    int exact = counterSize < 8;
+    int64_t bound = 0;
+    for (size_t k = 0; k < quantity && exact; ++k) {
+        int64_t p;
+        exact = weights[k] != INT64_MIN &&
+                !__builtin_mul_overflow((int64_t)max, llabs(weights[k]), &p) &&
+                !__builtin_add_overflow(bound, p, &bound);
     }
 
+    int64_t smax = max > INT64_MAX ? INT64_MAX : (int64_t)max;
+    switch (counterSize) {
+    case 2:
+        mergeRange_uint16_t(dest, quantity, src, weights, begin, end, exact, smax);
+        break;
+    case 8:
+        mergeRange_uint64_t(dest, quantity, src, weights, begin, end, exact, smax);
+        break;
+    default:
+        mergeRange_uint32_t(dest, quantity, src, weights, begin, end, exact, smax);
+        break;
+    }
+}
+
+size_t CMS_MergeCounter(size_t quantity, const CMSketch **src, const long long *weights) {
+    size_t cmsCount = 0;
     for (size_t i = 0; i < quantity; ++i) {
         cmsCount += src[i]->counter * weights[i];
     }
-    dest->counter = cmsCount;
+    return cmsCount;
+}
+
+void CMS_Merge(CMSketch *dest, size_t quantity, const CMSketch **src, const long long *weights) {
+    assert(dest);
+    assert(src);
+    assert(weights);
+
+    CMS_MergeRange(dest->array, quantity, src, weights, 0, dest->width * dest->depth);
+    dest->counter = CMS_MergeCounter(quantity, src, weights);
 }
 
 void CMS_MergeParams(mergeParams params) {
@@ -112,7 +304,7 @@ void CMS_Print(const CMSketch *cms) {
 
     for (int i = 0; i < cms->depth; ++i) {
         for (int j = 0; j < cms->width; ++j) {
-            printf("%d\t", cms->array[(i * cms->width) + j]);
+            printf("%lu\t", getCounter(cms, (i * cms->width) + j));
         }
         printf("\n");
     }
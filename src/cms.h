@@ -13,11 +13,26 @@
 #define CMS_FREE(ptr) free(ptr)
 #endif
 
+/* Counters of a sketch, see CMS_EnableStats */
+typedef struct CMSStats {
+    uint64_t increments; // Items counted by CMS_IncrBy
+    uint64_t queries;    // Items looked up by CMS_Query
+} CMSStats;
+
+/* Sum of the counters of all the sketches with stats */
+extern CMSStats cmsTotalStats;
+
 typedef struct CMS {
     size_t width;
     size_t depth;
-    uint32_t *array;
+    void *array; // width * depth counters of counterSize bytes
     size_t counter;
+    int indexMode;    // SketchIndexMode
+    int hashMode;     // SketchHashMode
+    int counterSize;  // 2, 4 or 8. Counters saturate instead of wrapping
+    int conservative; // Only raise the minimal counters of an item
+    CMSStats *stats;  // Counters, NULL unless enabled
+    uint64_t stamp;   // Changed by every write through the module, see rm_cms.c
 } CMSketch;
 
 typedef struct {
@@ -30,6 +45,9 @@ typedef struct {
 /* Creates a new Count-Min Sketch with dimensions of width * depth */
 CMSketch *NewCMSketch(size_t width, size_t depth);
 
+/* Same as NewCMSketch, with counters of counterSize bytes (2, 4 or 8) */
+CMSketch *NewCMSketchWithCounter(size_t width, size_t depth, size_t counterSize);
+
 /*  Recommends width & depth for expected n different items,
     with probability of an error  - prob and over estimation
     error - overEst (use 1 for max accuracy) */
@@ -37,6 +55,10 @@ void CMS_DimFromProb(double overEst, double prob, size_t *width, size_t *depth);
 
 void CMS_Destroy(CMSketch *cms);
 
+/* Starts counting the increments and queries of 'cms', also summed in cmsTotalStats.
+   Returns 0 on success */
+int CMS_EnableStats(CMSketch *cms);
+
 /*  Increases item count in value.
     Value must be a non negative number */
 size_t CMS_IncrBy(CMSketch *cms, const char *item, size_t strlen, size_t value);
@@ -45,10 +67,19 @@ size_t CMS_IncrBy(CMSketch *cms, const char *item, size_t strlen, size_t value);
 size_t CMS_Query(CMSketch *cms, const char *item, size_t strlen);
 
 /*  Merges multiple CMSketches into a single one.
-    All sketches must have identical width and depth.
+    All sketches must have identical width, depth and counter size.
+    Merged counters saturate to the counter range.
     dest must be already initialized.
 */
 void CMS_Merge(CMSketch *dest, size_t quantity, const CMSketch **src, const long long *weights);
+
+/*  Computes the merged counters in [begin, end) of the sketches' arrays
+    into dest, which may alias one of the sources. */
+void CMS_MergeRange(void *dest, size_t quantity, const CMSketch **src, const long long *weights,
+                    size_t begin, size_t end);
+
+/* Returns the total count of the merge of src */
+size_t CMS_MergeCounter(size_t quantity, const CMSketch **src, const long long *weights);
 void CMS_MergeParams(mergeParams params);
 
 /* Help function */
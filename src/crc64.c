@@ -0,0 +1,50 @@
+#include "crc64.h"
+
+#include <string.h> // memcpy
+
+// Reflected form of the Jones polynomial 0xad93d23594c935a9
+#define CRC64_POLY 0x95ac9329ac4bc9b5ULL
+
+// Slicing-by-8 tables: table[k][n] is the CRC of byte n followed by k zero bytes
+static uint64_t crc64_table[8][256];
+static int crc64_ready = 0;
+
+static void crc64_init(void) {
+    for (int n = 0; n < 256; ++n) {
+        uint64_t crc = n;
+        for (int k = 0; k < 8; ++k) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC64_POLY : crc >> 1;
+        }
+        crc64_table[0][n] = crc;
+    }
+    for (int n = 0; n < 256; ++n) {
+        for (int k = 1; k < 8; ++k) {
+            uint64_t prev = crc64_table[k - 1][n];
+            crc64_table[k][n] = (prev >> 8) ^ crc64_table[0][prev & 0xff];
+        }
+    }
+    crc64_ready = 1;
+}
+
+uint64_t crc64(uint64_t crc, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    if (!crc64_ready) {
+        crc64_init();
+    }
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc ^= word;
+        crc = crc64_table[7][crc & 0xff] ^ crc64_table[6][(crc >> 8) & 0xff] ^
+              crc64_table[5][(crc >> 16) & 0xff] ^ crc64_table[4][(crc >> 24) & 0xff] ^
+              crc64_table[3][(crc >> 32) & 0xff] ^ crc64_table[2][(crc >> 40) & 0xff] ^
+              crc64_table[1][(crc >> 48) & 0xff] ^ crc64_table[0][crc >> 56];
+    }
+#endif
+    for (; len; --len, ++p) {
+        crc = crc64_table[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
@@ -0,0 +1,21 @@
+#ifndef REDISBLOOM_CRC64_H
+#define REDISBLOOM_CRC64_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * CRC-64/Jones, the variant used by Redis for RDB files.
+ * Pass 0 as `crc` for the first buffer, and the previous result to continue
+ * over several buffers.
+ */
+uint64_t crc64(uint64_t crc, const void *buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -1,4 +1,6 @@
 #include "cuckoo.h"
+#include "reserve.h"
+#include "simd.h"
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
@@ -13,6 +15,8 @@
 
 // int globalCuckooHash64Bit;
 
+CuckooEviction cuckooEviction = CuckooEviction_Walk;
+
 static int CuckooFilter_Grow(CuckooFilter *filter);
 
 static int isPower2(uint64_t num) { return (num & (num - 1)) == 0 && num != 0; }
@@ -29,11 +33,14 @@ static uint64_t getNextN2(uint64_t n) {
     return n;
 }
 
-int CuckooFilter_Init(CuckooFilter *filter, uint64_t capacity, uint16_t bucketSize,
-                      uint16_t maxIterations, uint16_t expansion) {
+static int cuckooFilterInit(CuckooFilter *filter, uint64_t capacity, uint16_t bucketSize,
+                            uint16_t maxIterations, uint16_t expansion, uint16_t fpSize,
+                            uint16_t semiSort) {
     memset(filter, 0, sizeof(*filter));
     filter->expansion = getNextN2(expansion);
     filter->bucketSize = bucketSize;
+    filter->fpSize = fpSize;
+    filter->semiSort = semiSort;
     filter->maxIterations = maxIterations;
     filter->numBuckets = getNextN2(capacity / bucketSize);
     if (filter->numBuckets == 0) {
@@ -47,11 +54,85 @@ int CuckooFilter_Init(CuckooFilter *filter, uint64_t capacity, uint16_t bucketSi
     return 0;
 }
 
+int CuckooFilter_Init(CuckooFilter *filter, uint64_t capacity, uint16_t bucketSize,
+                      uint16_t maxIterations, uint16_t expansion) {
+    return CuckooFilter_InitWithFpSize(filter, capacity, bucketSize, maxIterations, expansion,
+                                       CUCKOO_DEFAULT_FPSIZE);
+}
+
+int CuckooFilter_InitWithFpSize(CuckooFilter *filter, uint64_t capacity, uint16_t bucketSize,
+                                uint16_t maxIterations, uint16_t expansion, uint16_t fpSize) {
+    assert(CuckooFilter_ValidFpSize(fpSize));
+    return cuckooFilterInit(filter, capacity, bucketSize, maxIterations, expansion, fpSize, 0);
+}
+
+int CuckooFilter_InitSemiSorted(CuckooFilter *filter, uint64_t capacity, uint16_t maxIterations,
+                                uint16_t expansion, uint16_t fpSize) {
+    assert(CuckooFilter_ValidSemiSort(CUCKOO_SEMISORT_BUCKETSIZE, fpSize));
+    return cuckooFilterInit(filter, capacity, CUCKOO_SEMISORT_BUCKETSIZE, maxIterations, expansion,
+                            fpSize, 1);
+}
+
 void CuckooFilter_Free(CuckooFilter *filter) {
     for (uint16_t ii = 0; ii < filter->numFilters; ++ii) {
         CUCKOO_FREE(filter->filters[ii].data);
     }
     CUCKOO_FREE(filter->filters);
+    CUCKOO_FREE(filter->stats);
+    Reserve_Cancel(filter->reserve);
+}
+
+CuckooStats cuckooTotalStats;
+
+int CuckooFilter_EnableStats(CuckooFilter *filter) {
+    if (!filter->stats) {
+        filter->stats = CUCKOO_CALLOC(1, sizeof(*filter->stats));
+    }
+    return filter->stats ? 0 : -1;
+}
+
+// Adds to a counter of `filter` and to the total. Counters other than the lookups
+// are only updated with the filter locked for writing, i.e. by a single thread.
+#define CUCKOO_COUNT(filter, field, n)                                                             \
+    do {                                                                                           \
+        if ((filter)->stats) {                                                                     \
+            (filter)->stats->field += (n);                                                         \
+            __atomic_fetch_add(&cuckooTotalStats.field, (n), __ATOMIC_RELAXED);                    \
+        }                                                                                          \
+    } while (0)
+
+static void countLookups(const CuckooFilter *filter, uint64_t lookups, uint64_t visited) {
+    if (filter->stats) {
+        __atomic_fetch_add(&filter->stats->lookups, lookups, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&filter->stats->filtersVisited, visited, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&cuckooTotalStats.lookups, lookups, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&cuckooTotalStats.filtersVisited, visited, __ATOMIC_RELAXED);
+    }
+}
+
+// Layout of the sub-filter following the last one, without its data
+static void nextSubFilter(const CuckooFilter *filter, SubCF *next) {
+    size_t growth = pow(filter->expansion, filter->numFilters);
+    next->bucketSize = filter->bucketSize;
+    next->fpSize = filter->fpSize;
+    next->semiSort = filter->semiSort;
+    next->numBuckets = filter->numBuckets * growth;
+    next->data = NULL;
+}
+
+// Starts allocating the next sub-filter once the filter holds reserveThreshold
+// percent of the fingerprints it has room for
+static void reserveGrowth(CuckooFilter *filter) {
+    uint64_t slots = 0;
+    for (uint16_t ii = 0; ii < filter->numFilters; ++ii) {
+        slots += (uint64_t)filter->filters[ii].numBuckets * filter->bucketSize;
+    }
+    if (filter->numItems * 100 < slots * reserveThreshold) {
+        return;
+    }
+    SubCF next;
+    nextSubFilter(filter, &next);
+    filter->reserve = Reserve_Start(SubCF_DataSize(&next) * sizeof(CuckooBucket));
 }
 
 static int CuckooFilter_Grow(CuckooFilter *filter) {
@@ -62,15 +143,22 @@ static int CuckooFilter_Grow(CuckooFilter *filter) {
         return -1; // LCOV_EXCL_LINE memory failure
     }
     SubCF *currentFilter = filtersArray + filter->numFilters;
-    size_t growth = pow(filter->expansion, filter->numFilters);
-    currentFilter->bucketSize = filter->bucketSize;
-    currentFilter->numBuckets = filter->numBuckets * growth;
-    currentFilter->data =
-        CUCKOO_CALLOC((size_t)currentFilter->numBuckets * filter->bucketSize, sizeof(CuckooBucket));
+    nextSubFilter(filter, currentFilter);
+    size_t dataSize = SubCF_DataSize(currentFilter) * sizeof(CuckooBucket);
+    if (filter->reserve) {
+        currentFilter->data = Reserve_Take(filter->reserve, dataSize);
+        filter->reserve = NULL;
+    }
+    if (!currentFilter->data) {
+        currentFilter->data = CUCKOO_CALLOC(dataSize, 1);
+    }
     if (!currentFilter->data) {
         return -1; // LCOV_EXCL_LINE memory failure
     }
 
+    if (filter->numFilters > 0) {
+        CUCKOO_COUNT(filter, grows, 1);
+    }
     filter->numFilters++;
     filter->filters = filtersArray;
     return 0;
@@ -86,90 +174,348 @@ static CuckooHash getAltHash(CuckooFingerprint fp, CuckooHash index) {
     return ((CuckooHash)(index ^ ((CuckooHash)fp * 0x5bd1e995)));
 }
 
-static void getLookupParams(CuckooHash hash, LookupParams *params) {
-    params->fp = hash % 255 + 1;
+static void getLookupParams(CuckooHash hash, uint16_t fpSize, LookupParams *params) {
+    // Wide fingerprints are taken from the high bits, the bucket index uses the low ones
+    switch (fpSize) {
+    case 1:
+        params->fp = hash % 255 + 1;
+        break;
+    case 2:
+        params->fp = (hash >> 32) % UINT16_MAX + 1;
+        break;
+    default:
+        params->fp = (hash >> 32) % UINT32_MAX + 1;
+        break;
+    }
 
     params->h1 = hash;
     params->h2 = getAltHash(params->fp, params->h1);
     // assert(getAltHash(params->fp, params->h2, numBuckets) == params->h1);
 }
 
-static uint32_t SubCF_GetIndex(const SubCF *subCF, CuckooHash hash) {
-    return (hash % subCF->numBuckets) * subCF->bucketSize;
+/*
+ * Semi-sorted buckets, from "Cuckoo Filter: Practically Better Than Bloom" (Fan et al.).
+ * The order of the fingerprints within a bucket does not matter, so a bucket of 4 is
+ * kept sorted and the high nibbles of its fingerprints are stored as the rank of their
+ * multiset: there are only 3876 of them, which takes 12 bits instead of 16. The low
+ * bits of the fingerprints follow, in the same order. Buckets are packed back to back.
+ */
+#define SEMISORT_RANK_BITS 12
+#define SEMISORT_COMBINATIONS 3876
+
+// Rank -> the 4 sorted nibbles, lowest first
+static uint16_t semiSortNibbles[SEMISORT_COMBINATIONS];
+
+// Rank of a <= b <= c <= d in the combinatorial number system
+static uint16_t semiSortRank(unsigned a, unsigned b, unsigned c, unsigned d) {
+    unsigned x1 = b + 1, x2 = c + 2, x3 = d + 3;
+    return a + x1 * (x1 - 1) / 2 + x2 * (x2 - 1) * (x2 - 2) / 6 +
+           x3 * (x3 - 1) * (x3 - 2) * (x3 - 3) / 24;
 }
 
-static uint8_t *Bucket_Find(CuckooBucket bucket, uint16_t bucketSize, CuckooFingerprint fp) {
-    for (uint16_t ii = 0; ii < bucketSize; ++ii) {
-        if (bucket[ii] == fp) {
-            return bucket + ii;
+// Built when loaded, as lookups may run on several threads at once
+__attribute__((constructor)) static void semiSortInit(void) {
+    for (unsigned d = 0; d < 16; ++d) {
+        for (unsigned c = 0; c <= d; ++c) {
+            for (unsigned b = 0; b <= c; ++b) {
+                for (unsigned a = 0; a <= b; ++a) {
+                    semiSortNibbles[semiSortRank(a, b, c, d)] = a | b << 4 | c << 8 | d << 12;
+                }
+            }
         }
     }
-    return NULL;
 }
 
-static int Filter_Find(const SubCF *filter, const LookupParams *params) {
-    uint8_t bucketSize = filter->bucketSize;
-    uint64_t loc1 = SubCF_GetIndex(filter, params->h1);
-    uint64_t loc2 = SubCF_GetIndex(filter, params->h2);
-    return Bucket_Find(&filter->data[loc1], bucketSize, params->fp) != NULL ||
-           Bucket_Find(&filter->data[loc2], bucketSize, params->fp) != NULL;
+// Buckets are at most 60 bits and start on a nibble, so a single 8 byte load covers one.
+// Like the rest of the encoding this assumes a little endian host.
+static void SemiSort_Read(const SubCF *filter, uint64_t bucketIx, CuckooFingerprint *fps) {
+    unsigned lowBits = filter->fpSize * 8 - 4;
+    uint64_t lowMask = (1ULL << lowBits) - 1;
+    uint64_t bitOffset = bucketIx * CuckooFilter_SemiSortBucketBits(filter->fpSize);
+    uint64_t word;
+    memcpy(&word, filter->data + bitOffset / 8, sizeof(word));
+    word >>= bitOffset % 8;
+
+    uint16_t nibbles = semiSortNibbles[word & ((1 << SEMISORT_RANK_BITS) - 1)];
+    word >>= SEMISORT_RANK_BITS;
+    for (int ii = 0; ii < CUCKOO_SEMISORT_BUCKETSIZE; ++ii) {
+        fps[ii] = ((CuckooFingerprint)(nibbles >> (4 * ii)) & 0xf) << lowBits | (word & lowMask);
+        word >>= lowBits;
+    }
 }
 
-static int Bucket_Delete(CuckooBucket bucket, uint16_t bucketSize, CuckooFingerprint fp) {
-    for (uint16_t ii = 0; ii < bucketSize; ii++) {
-        if (bucket[ii] == fp) {
-            bucket[ii] = CUCKOO_NULLFP;
-            return 1;
+static void SemiSort_Write(SubCF *filter, uint64_t bucketIx, CuckooFingerprint *fps) {
+    // Sorting network for 4
+    static const int pairs[][2] = {{0, 1}, {2, 3}, {0, 2}, {1, 3}, {1, 2}};
+    for (size_t ii = 0; ii < sizeof(pairs) / sizeof(pairs[0]); ++ii) {
+        CuckooFingerprint lo = fps[pairs[ii][0]], hi = fps[pairs[ii][1]];
+        if (lo > hi) {
+            fps[pairs[ii][0]] = hi;
+            fps[pairs[ii][1]] = lo;
         }
     }
+
+    unsigned lowBits = filter->fpSize * 8 - 4;
+    uint64_t lowMask = (1ULL << lowBits) - 1;
+    unsigned bucketBits = CuckooFilter_SemiSortBucketBits(filter->fpSize);
+    uint64_t packed = semiSortRank(fps[0] >> lowBits, fps[1] >> lowBits, fps[2] >> lowBits,
+                                   fps[3] >> lowBits);
+    for (int ii = 0; ii < CUCKOO_SEMISORT_BUCKETSIZE; ++ii) {
+        packed |= (fps[ii] & lowMask) << (SEMISORT_RANK_BITS + ii * lowBits);
+    }
+
+    uint64_t bitOffset = bucketIx * bucketBits;
+    uint64_t mask = ((1ULL << bucketBits) - 1) << (bitOffset % 8);
+    uint64_t word;
+    memcpy(&word, filter->data + bitOffset / 8, sizeof(word));
+    word = (word & ~mask) | (packed << (bitOffset % 8));
+    memcpy(filter->data + bitOffset / 8, &word, sizeof(word));
+}
+
+static inline uint8_t *bucketData(const SubCF *filter, uint64_t bucketIx) {
+    return filter->data + bucketIx * filter->bucketSize * filter->fpSize;
+}
+
+// Slots are `fpSize` bytes wide and naturally aligned, as buckets are
+static inline CuckooFingerprint slotLoad(const uint8_t *slot, uint8_t fpSize) {
+    switch (fpSize) {
+    case 1:
+        return *slot;
+    case 2:
+        return *(const uint16_t *)slot;
+    default:
+        return *(const uint32_t *)slot;
+    }
+}
+
+static inline void slotStore(uint8_t *slot, uint8_t fpSize, CuckooFingerprint fp) {
+    switch (fpSize) {
+    case 1:
+        *slot = fp;
+        break;
+    case 2:
+        *(uint16_t *)slot = fp;
+        break;
+    default:
+        *(uint32_t *)slot = fp;
+        break;
+    }
+}
+
+static CuckooFingerprint Slot_Get(const SubCF *filter, uint64_t bucketIx, uint16_t slotIx) {
+    if (filter->semiSort) {
+        CuckooFingerprint fps[CUCKOO_SEMISORT_BUCKETSIZE];
+        SemiSort_Read(filter, bucketIx, fps);
+        return fps[slotIx];
+    }
+    return slotLoad(bucketData(filter, bucketIx) + slotIx * filter->fpSize, filter->fpSize);
+}
+
+/**
+ * Semi-sorted buckets are sorted again after the update, which moves the slots
+ * before `slotIx` around. The ones after it are left in place.
+ */
+static void Slot_Set(SubCF *filter, uint64_t bucketIx, uint16_t slotIx, CuckooFingerprint fp) {
+    if (filter->semiSort) {
+        CuckooFingerprint fps[CUCKOO_SEMISORT_BUCKETSIZE];
+        SemiSort_Read(filter, bucketIx, fps);
+        fps[slotIx] = fp;
+        SemiSort_Write(filter, bucketIx, fps);
+        return;
+    }
+    slotStore(bucketData(filter, bucketIx) + slotIx * filter->fpSize, filter->fpSize, fp);
+}
+
+// Buckets smaller than this are scanned inline; the call into the SIMD kernels
+// only pays off for wider buckets.
+#define CUCKOO_SIMD_MIN_BUCKET 16
+
+// Bucket scans specialised for each fingerprint width
+#define CUCKOO_BUCKET_SCAN(T, N)                                                                   \
+    static inline int bucketFind##N(const uint8_t *bucket, uint16_t bucketSize,                    \
+                                    CuckooFingerprint fp) {                                        \
+        const T *slots = (const T *)bucket;                                                        \
+        for (uint16_t ii = 0; ii < bucketSize; ++ii) {                                             \
+            if (slots[ii] == (T)fp) {                                                              \
+                return ii;                                                                         \
+            }                                                                                      \
+        }                                                                                          \
+        return -1;                                                                                 \
+    }                                                                                              \
+    static inline uint16_t bucketCount##N(const uint8_t *bucket, uint16_t bucketSize,              \
+                                          CuckooFingerprint fp) {                                  \
+        const T *slots = (const T *)bucket;                                                        \
+        uint16_t ret = 0;                                                                          \
+        for (uint16_t ii = 0; ii < bucketSize; ++ii) {                                             \
+            ret += slots[ii] == (T)fp;                                                             \
+        }                                                                                          \
+        return ret;                                                                                \
+    }
+
+CUCKOO_BUCKET_SCAN(uint8_t, 8)
+CUCKOO_BUCKET_SCAN(uint16_t, 16)
+CUCKOO_BUCKET_SCAN(uint32_t, 32)
+
+// Calls a scan with a constant size for the usual bucket sizes, so that its loop
+// is unrolled, and with the filter's size for the others
+#define CUCKOO_BUCKET_DISPATCH(fn, bucket, bucketSize, fp)                                         \
+    ((bucketSize) == 2   ? fn(bucket, 2, fp)                                                       \
+     : (bucketSize) == 4 ? fn(bucket, 4, fp)                                                       \
+     : (bucketSize) == 1 ? fn(bucket, 1, fp)                                                       \
+     : (bucketSize) == 8 ? fn(bucket, 8, fp)                                                       \
+                         : fn(bucket, bucketSize, fp))
+
+// Returns the slot of `fp` in the bucket, or -1
+static int Bucket_Find(const SubCF *filter, uint64_t bucketIx, CuckooFingerprint fp) {
+    uint16_t bucketSize = filter->bucketSize;
+    if (filter->semiSort) {
+        CuckooFingerprint fps[CUCKOO_SEMISORT_BUCKETSIZE];
+        SemiSort_Read(filter, bucketIx, fps);
+        return bucketFind32((const uint8_t *)fps, CUCKOO_SEMISORT_BUCKETSIZE, fp);
+    }
+
+    const uint8_t *bucket = bucketData(filter, bucketIx);
+    switch (filter->fpSize) {
+    case 1:
+        return bucketSize >= CUCKOO_SIMD_MIN_BUCKET
+                   ? simdOps.findByte(bucket, bucketSize, fp)
+                   : CUCKOO_BUCKET_DISPATCH(bucketFind8, bucket, bucketSize, fp);
+    case 2:
+        return CUCKOO_BUCKET_DISPATCH(bucketFind16, bucket, bucketSize, fp);
+    default:
+        return CUCKOO_BUCKET_DISPATCH(bucketFind32, bucket, bucketSize, fp);
+    }
+}
+
+static int Filter_Find(const SubCF *filter, const LookupParams *params) {
+    uint64_t loc1 = params->h1 % filter->numBuckets;
+    uint64_t loc2 = params->h2 % filter->numBuckets;
+    return Bucket_Find(filter, loc1, params->fp) >= 0 || Bucket_Find(filter, loc2, params->fp) >= 0;
+}
+
+static int Bucket_Delete(SubCF *filter, uint64_t bucketIx, CuckooFingerprint fp) {
+    int slotIx = Bucket_Find(filter, bucketIx, fp);
+    if (slotIx >= 0) {
+        Slot_Set(filter, bucketIx, slotIx, CUCKOO_NULLFP);
+        return 1;
+    }
     return 0;
 }
 
-static int Filter_Delete(const SubCF *filter, const LookupParams *params) {
-    uint8_t bucketSize = filter->bucketSize;
-    uint64_t loc1 = SubCF_GetIndex(filter, params->h1);
-    uint64_t loc2 = SubCF_GetIndex(filter, params->h2);
-    return Bucket_Delete(&filter->data[loc1], bucketSize, params->fp) ||
-           Bucket_Delete(&filter->data[loc2], bucketSize, params->fp);
+static int Filter_Delete(SubCF *filter, const LookupParams *params) {
+    uint64_t loc1 = params->h1 % filter->numBuckets;
+    uint64_t loc2 = params->h2 % filter->numBuckets;
+    return Bucket_Delete(filter, loc1, params->fp) || Bucket_Delete(filter, loc2, params->fp);
 }
 
-static int CuckooFilter_CheckFP(const CuckooFilter *filter, const LookupParams *params) {
+// Also adds the number of sub-filters probed to `visited`
+static int checkFPVisited(const CuckooFilter *filter, const LookupParams *params,
+                          uint64_t *visited) {
     for (uint16_t ii = 0; ii < filter->numFilters; ++ii) {
         if (Filter_Find(&filter->filters[ii], params)) {
+            *visited += ii + 1;
             return 1;
         }
     }
+    *visited += filter->numFilters;
     return 0;
 }
 
+static int CuckooFilter_CheckFP(const CuckooFilter *filter, const LookupParams *params) {
+    uint64_t visited = 0;
+    return checkFPVisited(filter, params, &visited);
+}
+
 int CuckooFilter_Check(const CuckooFilter *filter, CuckooHash hash) {
     LookupParams params;
-    getLookupParams(hash, &params);
-    return CuckooFilter_CheckFP(filter, &params);
+    getLookupParams(hash, filter->fpSize, &params);
+    uint64_t visited = 0;
+    int rv = checkFPVisited(filter, &params, &visited);
+    countLookups(filter, 1, visited);
+    return rv;
+}
+
+// Number of items hashed and prefetched ahead of resolving them, as for Bloom filters
+#define CUCKOO_BATCH_SIZE 16
+
+static void prefetchBucket(const SubCF *filter, uint64_t bucketIx, int rw) {
+    const uint8_t *start, *end;
+    if (filter->semiSort) {
+        start = filter->data + bucketIx * CuckooFilter_SemiSortBucketBits(filter->fpSize) / 8;
+        end = start + sizeof(uint64_t) - 1;
+    } else {
+        start = bucketData(filter, bucketIx);
+        end = start + filter->bucketSize * filter->fpSize - 1;
+    }
+    // Buckets are not cache-line aligned and may span two lines
+    if (rw) {
+        __builtin_prefetch(start, 1);
+        __builtin_prefetch(end, 1);
+    } else {
+        __builtin_prefetch(start, 0);
+        __builtin_prefetch(end, 0);
+    }
 }
 
-static uint16_t bucketCount(const CuckooBucket bucket, uint16_t bucketSize, CuckooFingerprint fp) {
-    uint16_t ret = 0;
-    for (uint16_t ii = 0; ii < bucketSize; ++ii) {
-        if (bucket[ii] == fp) {
-            ret++;
+static void prefetchBatch(const CuckooFilter *filter, const char *const *items, const size_t *lens,
+                          size_t n, LookupParams *params, int rw) {
+    for (size_t ii = 0; ii < n; ++ii) {
+        getLookupParams(CUCKOO_GEN_HASH(items[ii], lens[ii]), filter->fpSize, &params[ii]);
+    }
+    for (size_t ii = 0; ii < n; ++ii) {
+        for (uint16_t jj = 0; jj < filter->numFilters; ++jj) {
+            const SubCF *subCF = &filter->filters[jj];
+            prefetchBucket(subCF, params[ii].h1 % subCF->numBuckets, rw);
+            prefetchBucket(subCF, params[ii].h2 % subCF->numBuckets, rw);
         }
     }
-    return ret;
+}
+
+void CuckooFilter_CheckMany(const CuckooFilter *filter, const char *const *items,
+                            const size_t *lens, size_t n, int *results) {
+    LookupParams params[CUCKOO_BATCH_SIZE];
+    uint64_t visited = 0;
+    for (size_t base = 0; base < n; base += CUCKOO_BATCH_SIZE) {
+        size_t batch = n - base < CUCKOO_BATCH_SIZE ? n - base : CUCKOO_BATCH_SIZE;
+        prefetchBatch(filter, items + base, lens + base, batch, params, 0);
+        for (size_t ii = 0; ii < batch; ++ii) {
+            results[base + ii] = checkFPVisited(filter, &params[ii], &visited);
+        }
+    }
+    countLookups(filter, n, visited);
+}
+
+static uint16_t bucketCount(const SubCF *filter, uint64_t bucketIx, CuckooFingerprint fp) {
+    uint16_t bucketSize = filter->bucketSize;
+    if (filter->semiSort) {
+        CuckooFingerprint fps[CUCKOO_SEMISORT_BUCKETSIZE];
+        SemiSort_Read(filter, bucketIx, fps);
+        return bucketCount32((const uint8_t *)fps, CUCKOO_SEMISORT_BUCKETSIZE, fp);
+    }
+
+    const uint8_t *bucket = bucketData(filter, bucketIx);
+    switch (filter->fpSize) {
+    case 1:
+        return bucketSize >= CUCKOO_SIMD_MIN_BUCKET
+                   ? simdOps.countByte(bucket, bucketSize, fp)
+                   : CUCKOO_BUCKET_DISPATCH(bucketCount8, bucket, bucketSize, fp);
+    case 2:
+        return CUCKOO_BUCKET_DISPATCH(bucketCount16, bucket, bucketSize, fp);
+    default:
+        return CUCKOO_BUCKET_DISPATCH(bucketCount32, bucket, bucketSize, fp);
+    }
 }
 
 static uint64_t subFilterCount(const SubCF *filter, const LookupParams *params) {
-    uint8_t bucketSize = filter->bucketSize;
-    uint64_t loc1 = SubCF_GetIndex(filter, params->h1);
-    uint64_t loc2 = SubCF_GetIndex(filter, params->h2);
+    uint64_t loc1 = params->h1 % filter->numBuckets;
+    uint64_t loc2 = params->h2 % filter->numBuckets;
 
-    return bucketCount(&filter->data[loc1], bucketSize, params->fp) +
-           bucketCount(&filter->data[loc2], bucketSize, params->fp);
+    return bucketCount(filter, loc1, params->fp) + bucketCount(filter, loc2, params->fp);
 }
 
 uint64_t CuckooFilter_Count(const CuckooFilter *filter, CuckooHash hash) {
     LookupParams params;
-    getLookupParams(hash, &params);
+    getLookupParams(hash, filter->fpSize, &params);
     uint64_t ret = 0;
     for (uint16_t ii = 0; ii < filter->numFilters; ++ii) {
         ret += subFilterCount(&filter->filters[ii], &params);
@@ -179,13 +525,14 @@ uint64_t CuckooFilter_Count(const CuckooFilter *filter, CuckooHash hash) {
 
 int CuckooFilter_Delete(CuckooFilter *filter, CuckooHash hash) {
     LookupParams params;
-    getLookupParams(hash, &params);
+    getLookupParams(hash, filter->fpSize, &params);
     for (uint16_t ii = filter->numFilters; ii > 0; --ii) {
         if (Filter_Delete(&filter->filters[ii - 1], &params)) {
             filter->numItems--;
             filter->numDeletes++;
             if (filter->numFilters > 1 && filter->numDeletes > (double)filter->numItems * 0.10) {
-                CuckooFilter_Compact(filter);
+                // Deletes stay O(1): the caller runs the compaction steps
+                CuckooFilter_CompactStart(filter);
             }
             return 1;
         }
@@ -193,46 +540,67 @@ int CuckooFilter_Delete(CuckooFilter *filter, CuckooHash hash) {
     return 0;
 }
 
-static uint8_t *Bucket_FindAvailable(CuckooBucket bucket, uint16_t bucketSize) {
-    for (uint16_t ii = 0; ii < bucketSize; ++ii) {
-        if (bucket[ii] == CUCKOO_NULLFP) {
-            return &bucket[ii];
-        }
+// Stores the fingerprint in a free slot of either bucket. Returns 0 if both are full
+static int Filter_InsertAvailable(SubCF *filter, const LookupParams *params) {
+    uint64_t loc1 = params->h1 % filter->numBuckets;
+    uint64_t loc2 = params->h2 % filter->numBuckets;
+    int slotIx;
+    if ((slotIx = Bucket_Find(filter, loc1, CUCKOO_NULLFP)) >= 0) {
+        Slot_Set(filter, loc1, slotIx, params->fp);
+        return 1;
     }
-    return NULL;
-}
-
-static uint8_t *Filter_FindAvailable(SubCF *filter, const LookupParams *params) {
-    uint8_t *slot;
-    uint8_t bucketSize = filter->bucketSize;
-    uint64_t loc1 = SubCF_GetIndex(filter, params->h1);
-    uint64_t loc2 = SubCF_GetIndex(filter, params->h2);
-    if ((slot = Bucket_FindAvailable(&filter->data[loc1], bucketSize)) ||
-        (slot = Bucket_FindAvailable(&filter->data[loc2], bucketSize))) {
-        return slot;
+    if ((slotIx = Bucket_Find(filter, loc2, CUCKOO_NULLFP)) >= 0) {
+        Slot_Set(filter, loc2, slotIx, params->fp);
+        return 1;
     }
-    return NULL;
+    return 0;
 }
 
 static CuckooInsertStatus Filter_KOInsert(CuckooFilter *filter, SubCF *curFilter,
                                           const LookupParams *params);
+static CuckooInsertStatus Filter_BFSInsert(CuckooFilter *filter, SubCF *curFilter,
+                                           const LookupParams *params);
 
 static CuckooInsertStatus CuckooFilter_InsertFP(CuckooFilter *filter, const LookupParams *params) {
+    if (reserveThreshold && !filter->reserve) {
+        reserveGrowth(filter);
+    }
+    uint16_t compacting = filter->compactFilter;
     for (uint16_t ii = filter->numFilters; ii > 0; --ii) {
-        uint8_t *slot = Filter_FindAvailable(&filter->filters[ii - 1], params);
-        if (slot) {
-            *slot = params->fp;
+        if (ii - 1 == compacting && compacting) {
+            continue;
+        }
+        if (Filter_InsertAvailable(&filter->filters[ii - 1], params)) {
+            filter->numItems++;
+            return CuckooInsert_Inserted;
+        }
+    }
+
+    if (compacting) {
+        // The sub-filter being compacted is the last resort, as it may now get fingerprints
+        // behind the cursor, and then can't be dropped
+        filter->compactDirty = 1;
+        if (Filter_InsertAvailable(&filter->filters[compacting], params)) {
             filter->numItems++;
             return CuckooInsert_Inserted;
         }
     }
 
     // No space. Time to evict!
-    CuckooInsertStatus status =
-        Filter_KOInsert(filter, &filter->filters[filter->numFilters - 1], params);
+    CuckooInsertStatus status = CuckooInsert_NoSpace;
+    if (cuckooEviction == CuckooEviction_BFS) {
+        // Every sub-filter can take the fingerprint, so all are searched before growing
+        for (uint16_t ii = filter->numFilters; ii > 0 && status == CuckooInsert_NoSpace; --ii) {
+            status = Filter_BFSInsert(filter, &filter->filters[ii - 1], params);
+        }
+    } else {
+        status = Filter_KOInsert(filter, &filter->filters[filter->numFilters - 1], params);
+    }
     if (status == CuckooInsert_Inserted) {
         filter->numItems++;
         return CuckooInsert_Inserted;
+    } else if (status == CuckooInsert_MemAllocFailed) {
+        return status; // LCOV_EXCL_LINE memory failure
     }
 
     if (CuckooFilter_Grow(filter) != 0) {
@@ -245,23 +613,39 @@ static CuckooInsertStatus CuckooFilter_InsertFP(CuckooFilter *filter, const Look
 
 CuckooInsertStatus CuckooFilter_Insert(CuckooFilter *filter, CuckooHash hash) {
     LookupParams params;
-    getLookupParams(hash, &params);
+    getLookupParams(hash, filter->fpSize, &params);
     return CuckooFilter_InsertFP(filter, &params);
 }
 
 CuckooInsertStatus CuckooFilter_InsertUnique(CuckooFilter *filter, CuckooHash hash) {
     LookupParams params;
-    getLookupParams(hash, &params);
+    getLookupParams(hash, filter->fpSize, &params);
     if (CuckooFilter_CheckFP(filter, &params)) {
         return CuckooInsert_Exists;
     }
     return CuckooFilter_InsertFP(filter, &params);
 }
 
-static void swapFPs(uint8_t *a, uint8_t *b) {
-    uint8_t temp = *a;
-    *a = *b;
-    *b = temp;
+void CuckooFilter_InsertMany(CuckooFilter *filter, const char *const *items, const size_t *lens,
+                             size_t n, int unique, CuckooInsertStatus *results) {
+    LookupParams params[CUCKOO_BATCH_SIZE];
+    for (size_t base = 0; base < n; base += CUCKOO_BATCH_SIZE) {
+        size_t batch = n - base < CUCKOO_BATCH_SIZE ? n - base : CUCKOO_BATCH_SIZE;
+        prefetchBatch(filter, items + base, lens + base, batch, params, 1);
+        for (size_t ii = 0; ii < batch; ++ii) {
+            if (unique && CuckooFilter_CheckFP(filter, &params[ii])) {
+                results[base + ii] = CuckooInsert_Exists;
+            } else {
+                results[base + ii] = CuckooFilter_InsertFP(filter, &params[ii]);
+            }
+        }
+    }
+}
+
+static void swapFPs(SubCF *filter, uint64_t bucketIx, uint16_t slotIx, CuckooFingerprint *fp) {
+    CuckooFingerprint temp = Slot_Get(filter, bucketIx, slotIx);
+    Slot_Set(filter, bucketIx, slotIx, *fp);
+    *fp = temp;
 }
 
 static CuckooInsertStatus Filter_KOInsert(CuckooFilter *filter, SubCF *curFilter,
@@ -271,35 +655,127 @@ static CuckooInsertStatus Filter_KOInsert(CuckooFilter *filter, SubCF *curFilter
     uint16_t bucketSize = filter->bucketSize;
     CuckooFingerprint fp = params->fp;
 
+    // Semi-sorted buckets reorder their slots on every update, so the rollback looks
+    // the fingerprints it has to take back up by value rather than by slot
+    CuckooFingerprint *path = NULL;
+    if (curFilter->semiSort) {
+        path = CUCKOO_MALLOC(sizeof(*path) * maxIterations);
+        if (!path) {
+            return CuckooInsert_MemAllocFailed; // LCOV_EXCL_LINE memory failure
+        }
+    }
+
     uint16_t counter = 0;
     uint32_t victimIx = 0;
     uint32_t ii = params->h1 % numBuckets;
 
     while (counter++ < maxIterations) {
-        uint8_t *bucket = &curFilter->data[ii * bucketSize];
-        swapFPs(bucket + victimIx, &fp);
+        if (path) {
+            path[counter - 1] = fp;
+        }
+        swapFPs(curFilter, ii, victimIx, &fp);
         ii = getAltHash(fp, ii) % numBuckets;
         // Insert the new item in potentially the same bucket
-        uint8_t *empty = Bucket_FindAvailable(&curFilter->data[ii * bucketSize], bucketSize);
-        if (empty) {
-            // printf("Found slot. Bucket[%lu], Pos=%lu\n", ii, empty - curFilter[ii]);
-            // printf("Old FP Value: %d\n", *empty);
-            // printf("Setting FP: %p\n", empty);
-            *empty = fp;
+        int empty = Bucket_Find(curFilter, ii, CUCKOO_NULLFP);
+        if (empty >= 0) {
+            Slot_Set(curFilter, ii, empty, fp);
+            CUCKOO_FREE(path);
+            CUCKOO_COUNT(filter, evictions, counter);
             return CuckooInsert_Inserted;
         }
         victimIx = (victimIx + 1) % bucketSize;
     }
+    CUCKOO_COUNT(filter, evictions, maxIterations);
 
     // If we weren't able to insert, we roll back and try to insert new element in new filter
-    counter = 0;
-    while (counter++ < maxIterations) {
+    counter = maxIterations;
+    while (counter-- > 0) {
         victimIx = (victimIx + bucketSize - 1) % bucketSize;
         ii = getAltHash(fp, ii) % numBuckets;
-        uint8_t *bucket = &curFilter->data[ii * bucketSize];
-        swapFPs(bucket + victimIx, &fp);
+        uint16_t slotIx = victimIx;
+        if (path) {
+            int found = Bucket_Find(curFilter, ii, path[counter]);
+            assert(found >= 0);
+            slotIx = found;
+        }
+        swapFPs(curFilter, ii, slotIx, &fp);
+    }
+
+    CUCKOO_FREE(path);
+    return CuckooInsert_NoSpace;
+}
+
+typedef struct {
+    uint32_t bucket;
+    int32_t parent; // -1 for the buckets of the new fingerprint
+    CuckooFingerprint fp; // Moves from the parent's bucket to this one
+} EvictNode;
+
+// Moves `fp` to a free slot of another bucket. Works by value, as semi-sorted buckets reorder
+static void bucketMoveFP(SubCF *filter, uint64_t from, uint64_t to, CuckooFingerprint fp) {
+    Slot_Set(filter, to, Bucket_Find(filter, to, CUCKOO_NULLFP), fp);
+    Slot_Set(filter, from, Bucket_Find(filter, from, fp), CUCKOO_NULLFP);
+}
+
+static int evictVisited(const EvictNode *nodes, uint32_t numNodes, uint32_t bucket) {
+    for (uint32_t ii = 0; ii < numNodes; ++ii) {
+        if (nodes[ii].bucket == bucket) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Searches the buckets reachable by kicking out fingerprints breadth first, visiting
+ * at most `maxIterations` of them, for the shortest path to a free slot. Nothing is
+ * moved until one is found, so there is nothing to roll back on failure.
+ */
+static CuckooInsertStatus Filter_BFSInsert(CuckooFilter *filter, SubCF *curFilter,
+                                           const LookupParams *params) {
+    uint32_t numBuckets = curFilter->numBuckets;
+    uint32_t maxNodes = filter->maxIterations + 2;
+    EvictNode *nodes = CUCKOO_MALLOC(sizeof(*nodes) * maxNodes);
+    if (!nodes) {
+        return CuckooInsert_MemAllocFailed; // LCOV_EXCL_LINE memory failure
+    }
+
+    // Both buckets of the new fingerprint are full, or it would have been inserted
+    uint32_t head = 0, tail = 0;
+    nodes[tail++] = (EvictNode){.bucket = params->h1 % numBuckets, .parent = -1};
+    if (params->h2 % numBuckets != nodes[0].bucket) {
+        nodes[tail++] = (EvictNode){.bucket = params->h2 % numBuckets, .parent = -1};
     }
 
+    for (; head < tail; ++head) {
+        uint32_t bucket = nodes[head].bucket;
+        for (uint16_t slotIx = 0; slotIx < curFilter->bucketSize; ++slotIx) {
+            CuckooFingerprint fp = Slot_Get(curFilter, bucket, slotIx);
+            uint32_t alt = getAltHash(fp, bucket) % numBuckets;
+            if (Bucket_Find(curFilter, alt, CUCKOO_NULLFP) < 0) {
+                if (tail < maxNodes && !evictVisited(nodes, tail, alt)) {
+                    nodes[tail++] = (EvictNode){.bucket = alt, .parent = head, .fp = fp};
+                }
+                continue;
+            }
+
+            // Shift the fingerprints along the path, from the free slot back to the root
+            bucketMoveFP(curFilter, bucket, alt, fp);
+            int32_t ix = head;
+            for (; nodes[ix].parent >= 0; ix = nodes[ix].parent) {
+                bucketMoveFP(curFilter, nodes[nodes[ix].parent].bucket, nodes[ix].bucket,
+                             nodes[ix].fp);
+            }
+            uint32_t root = nodes[ix].bucket;
+            Slot_Set(curFilter, root, Bucket_Find(curFilter, root, CUCKOO_NULLFP), params->fp);
+            CUCKOO_FREE(nodes);
+            CUCKOO_COUNT(filter, evictions, head + 1);
+            return CuckooInsert_Inserted;
+        }
+    }
+
+    CUCKOO_FREE(nodes);
+    CUCKOO_COUNT(filter, evictions, tail);
     return CuckooInsert_NoSpace;
 }
 
@@ -310,10 +786,10 @@ static CuckooInsertStatus Filter_KOInsert(CuckooFilter *filter, SubCF *curFilter
 /**
  * Attempt to move a slot from one bucket to another filter
  */
-static int relocateSlot(CuckooFilter *cf, CuckooBucket bucket, uint16_t filterIx, uint64_t bucketIx,
-                        uint16_t slotIx) {
+static int relocateSlot(CuckooFilter *cf, uint16_t filterIx, uint64_t bucketIx, uint16_t slotIx) {
     LookupParams params = {0};
-    if ((params.fp = bucket[slotIx]) == CUCKOO_NULLFP) {
+    SubCF *filter = &cf->filters[filterIx];
+    if ((params.fp = Slot_Get(filter, bucketIx, slotIx)) == CUCKOO_NULLFP) {
         // Nothing in this slot.
         return RELOC_EMPTY;
     }
@@ -325,49 +801,72 @@ static int relocateSlot(CuckooFilter *cf, CuckooBucket bucket, uint16_t filterIx
 
     // Look at all the prior filters and attempt to find a home
     for (uint16_t ii = 0; ii < filterIx; ++ii) {
-        uint8_t *slot = Filter_FindAvailable(&cf->filters[ii], &params);
-        if (slot) {
-            *slot = params.fp;
-            bucket[slotIx] = CUCKOO_NULLFP;
+        if (Filter_InsertAvailable(&cf->filters[ii], &params)) {
+            // Semi-sorted buckets only move the slots before slotIx, which were visited
+            Slot_Set(filter, bucketIx, slotIx, CUCKOO_NULLFP);
             return RELOC_OK;
         }
     }
     return RELOC_FAIL;
 }
 
-/**
- * Attempt to strip a single filter moving it down a slot
- */
-static uint64_t CuckooFilter_CompactSingle(CuckooFilter *cf, uint16_t filterIx) {
-    SubCF *currentFilter = &cf->filters[filterIx];
-    MyCuckooBucket *filter = currentFilter->data;
-    int dirty = 0;
-    uint64_t numRelocs = 0;
-
-    for (uint64_t bucketIx = 0; bucketIx < currentFilter->numBuckets; ++bucketIx) {
-        for (uint16_t slotIx = 0; slotIx < currentFilter->bucketSize; ++slotIx) {
-            int status = relocateSlot(cf, &filter[bucketIx * currentFilter->bucketSize], filterIx,
-                                      bucketIx, slotIx);
-            if (status == RELOC_FAIL) {
-                dirty = 1;
-            } else if (status == RELOC_OK) {
-                numRelocs++;
+void CuckooFilter_CompactStart(CuckooFilter *cf) {
+    if (cf->compactFilter == 0 && cf->numFilters > 1) {
+        cf->compactFilter = cf->numFilters - 1;
+        cf->compactBucket = 0;
+        cf->compactDirty = 0;
+    }
+}
+
+static void compactDone(CuckooFilter *cf) {
+    cf->compactFilter = 0;
+    cf->numDeletes = 0;
+}
+
+int CuckooFilter_CompactStep(CuckooFilter *cf, uint64_t maxBuckets, uint64_t *numRelocs) {
+    while (cf->compactFilter != 0) {
+        SubCF *currentFilter = &cf->filters[cf->compactFilter];
+        // Fingerprints that find no room stay, the others still make room in this one
+        for (; cf->compactBucket < currentFilter->numBuckets; ++cf->compactBucket) {
+            if (maxBuckets-- == 0) {
+                return 0;
+            }
+            for (uint16_t slotIx = 0; slotIx < currentFilter->bucketSize; ++slotIx) {
+                int status = relocateSlot(cf, cf->compactFilter, cf->compactBucket, slotIx);
+                if (status == RELOC_FAIL) {
+                    cf->compactDirty = 1;
+                } else if (status == RELOC_OK) {
+                    CUCKOO_COUNT(cf, relocations, 1);
+                    if (numRelocs) {
+                        (*numRelocs)++;
+                    }
+                }
             }
         }
+
+        // Only the last sub-filter can go, the sizes of the others follow from their position.
+        // Once one has to stay, the prior ones have to as well, but their fingerprints are
+        // still moved to the older ones.
+        if (!cf->compactDirty && cf->compactFilter == cf->numFilters - 1) {
+            CUCKOO_FREE(currentFilter->data);
+            // The next sub-filter is now the one just dropped
+            Reserve_Cancel(cf->reserve);
+            cf->reserve = NULL;
+            cf->numFilters--;
+        }
+        cf->compactFilter--;
+        cf->compactBucket = 0;
     }
-    if (!dirty) {
-        CUCKOO_FREE(filter);
-        cf->numFilters--;
-    }
-    return numRelocs;
+    compactDone(cf);
+    return 1;
 }
 
 uint64_t CuckooFilter_Compact(CuckooFilter *cf) {
     uint64_t ret = 0;
-    for (uint64_t ii = cf->numFilters; ii > 1; --ii) {
-        ret += CuckooFilter_CompactSingle(cf, ii - 1);
-    }
-    cf->numDeletes = 0;
+    CuckooFilter_CompactStart(cf);
+    CuckooFilter_CompactStep(cf, UINT64_MAX, &ret);
+    // Also resets the delete count of filters with a single sub-filter
+    compactDone(cf);
     return ret;
 }
 
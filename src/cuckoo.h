@@ -12,7 +12,13 @@
 #define CUCKOO_NULLFP 0
 // extern int globalCuckooHash64Bit;
 
-typedef uint8_t CuckooFingerprint;
+// Size in bytes of the fingerprints of a filter (1, 2 or 4)
+#define CUCKOO_DEFAULT_FPSIZE 1
+
+// Semi-sorted filters always have buckets of 4
+#define CUCKOO_SEMISORT_BUCKETSIZE 4
+
+typedef uint32_t CuckooFingerprint;
 typedef uint64_t CuckooHash;
 typedef uint8_t CuckooBucket[1];
 typedef uint8_t MyCuckooBucket;
@@ -20,9 +26,24 @@ typedef uint8_t MyCuckooBucket;
 typedef struct {
     uint32_t numBuckets;
     uint8_t bucketSize;
-    MyCuckooBucket *data;
+    uint8_t fpSize;
+    uint8_t semiSort;
+    MyCuckooBucket *data; // numBuckets * bucketSize fingerprints of fpSize bytes, or packed
+                          // semi-sorted buckets
 } SubCF;
 
+/** Counters of a filter, see CuckooFilter_EnableStats */
+typedef struct CuckooStats {
+    uint64_t lookups;        // Items checked by CuckooFilter_Check and CuckooFilter_CheckMany
+    uint64_t filtersVisited; // Sub-filters probed by those lookups
+    uint64_t evictions;      // Eviction steps taken to make room for insertions
+    uint64_t grows;          // Sub-filters added because the others were full
+    uint64_t relocations;    // Fingerprints moved to older sub-filters by compactions
+} CuckooStats;
+
+/** Sum of the counters of all the filters with stats */
+extern CuckooStats cuckooTotalStats;
+
 typedef struct {
     uint64_t numBuckets;
     uint64_t numItems;
@@ -31,9 +52,44 @@ typedef struct {
     uint16_t bucketSize;
     uint16_t maxIterations;
     uint16_t expansion;
+    uint16_t fpSize;
+    uint16_t semiSort;
+    // Resumable compaction: the next bucket to visit in sub-filter compactFilter,
+    // which is 0 when no compaction is running. Saved with the filter.
+    uint16_t compactFilter;
+    uint8_t compactDirty;
+    uint8_t compactScheduled; // A timer runs the compaction, not saved
+    uint32_t compactBucket;
     SubCF *filters;
+    CuckooStats *stats;      // Counters, NULL unless enabled
+    struct Reserve *reserve; // Data of the next sub-filter, allocated ahead of time, or NULL
 } CuckooFilter;
 
+/** Size in bits of a semi-sorted bucket: a 12 bit rank plus 4 fingerprints less their nibble */
+static inline unsigned CuckooFilter_SemiSortBucketBits(uint8_t fpSize) {
+    return 12 + CUCKOO_SEMISORT_BUCKETSIZE * (fpSize * 8 - 4);
+}
+
+/** Size in bytes of the data of a sub-filter */
+static inline size_t SubCF_DataSize(const SubCF *filter) {
+    if (filter->semiSort) {
+        size_t bits = (size_t)filter->numBuckets * CuckooFilter_SemiSortBucketBits(filter->fpSize);
+        // Padded so that the last bucket can be read with a single 8 byte load
+        return (bits + 7) / 8 + 7;
+    }
+    return (size_t)filter->numBuckets * filter->bucketSize * filter->fpSize;
+}
+
+/** Returns 1 if `fpSize` is a supported fingerprint size */
+static inline int CuckooFilter_ValidFpSize(uint64_t fpSize) {
+    return fpSize == 1 || fpSize == 2 || fpSize == 4;
+}
+
+/** Returns 1 if semi-sorted buckets support this geometry */
+static inline int CuckooFilter_ValidSemiSort(uint64_t bucketSize, uint64_t fpSize) {
+    return bucketSize == CUCKOO_SEMISORT_BUCKETSIZE && (fpSize == 1 || fpSize == 2);
+}
+
 #define CUCKOO_GEN_HASH(s, n) MurmurHash64A_Bloom(s, n, 0)
 
 /*
@@ -48,6 +104,17 @@ typedef struct {
     CuckooFingerprint fp;
 } CuckooKey;
 
+/** How insertions make room once both buckets of a fingerprint are full */
+typedef enum {
+    // Random walk kicking out fingerprints in the newest sub-filter
+    CuckooEviction_Walk = 0,
+    // Breadth-first search for the shortest path to a free slot, in every sub-filter
+    CuckooEviction_BFS = 1,
+} CuckooEviction;
+
+/** Eviction used by all filters, CuckooEviction_Walk by default */
+extern CuckooEviction cuckooEviction;
+
 typedef enum {
     CuckooInsert_Inserted = 1,
     CuckooInsert_Exists = 0,
@@ -57,12 +124,67 @@ typedef enum {
 
 int CuckooFilter_Init(CuckooFilter *filter, uint64_t capacity, uint16_t bucketSize,
                       uint16_t maxIterations, uint16_t expansion);
+int CuckooFilter_InitWithFpSize(CuckooFilter *filter, uint64_t capacity, uint16_t bucketSize,
+                                uint16_t maxIterations, uint16_t expansion, uint16_t fpSize);
+/**
+ * Creates a filter with semi-sorted buckets of 4, which take 1 bit less per fingerprint.
+ * `fpSize` must be 1 or 2.
+ */
+int CuckooFilter_InitSemiSorted(CuckooFilter *filter, uint64_t capacity, uint16_t maxIterations,
+                                uint16_t expansion, uint16_t fpSize);
 void CuckooFilter_Free(CuckooFilter *filter);
+
+/**
+ * Starts counting lookups, evictions, growth and relocations of the filter, also
+ * summed in cuckooTotalStats. Lookups may run on several threads at once, so
+ * their counters are updated atomically. Returns 0 on success.
+ */
+int CuckooFilter_EnableStats(CuckooFilter *filter);
 CuckooInsertStatus CuckooFilter_InsertUnique(CuckooFilter *filter, CuckooHash hash);
 CuckooInsertStatus CuckooFilter_Insert(CuckooFilter *filter, CuckooHash hash);
 int CuckooFilter_Delete(CuckooFilter *filter, CuckooHash hash);
 int CuckooFilter_Check(const CuckooFilter *filter, CuckooHash hash);
+
+/**
+ * Check several items at once. All the items of a batch are hashed and both of their
+ * buckets prefetched in every sub-filter before any of them is resolved, so the cache
+ * misses of different items overlap.
+ * results[i] receives the value CuckooFilter_Check would return for items[i].
+ */
+void CuckooFilter_CheckMany(const CuckooFilter *filter, const char *const *items,
+                            const size_t *lens, size_t n, int *results);
+
+/**
+ * Insert several items at once, prefetching like CuckooFilter_CheckMany. Items are
+ * inserted in order, as by CuckooFilter_InsertUnique if `unique` is set or by
+ * CuckooFilter_Insert otherwise, and results[i] receives the status of items[i].
+ */
+void CuckooFilter_InsertMany(CuckooFilter *filter, const char *const *items, const size_t *lens,
+                             size_t n, int unique, CuckooInsertStatus *results);
 uint64_t CuckooFilter_Count(const CuckooFilter *filter, CuckooHash);
+
+/**
+ * Compaction moves the fingerprints of each sub-filter, from the last one, into the
+ * prior ones. The last sub-filters are dropped once empty, until one is left or a
+ * fingerprint finds no room; the fingerprints of the prior ones are moved anyway.
+ * It can run to completion with CuckooFilter_Compact, or in bounded steps:
+ * CuckooFilter_CompactStart starts a compaction (CuckooFilter_Delete does so once
+ * enough items were deleted) and CuckooFilter_CompactStep resumes it. Items can be
+ * added and deleted between steps.
+ */
 uint64_t CuckooFilter_Compact(CuckooFilter *filter);
+void CuckooFilter_CompactStart(CuckooFilter *filter);
+
+/**
+ * Visits up to `maxBuckets` buckets of the running compaction, and adds the number of
+ * fingerprints moved to `numRelocs` if not NULL. Returns 1 when no compaction is left
+ * running, 0 if more steps are needed.
+ */
+int CuckooFilter_CompactStep(CuckooFilter *filter, uint64_t maxBuckets, uint64_t *numRelocs);
+
+/** Returns 1 if a compaction was started and has not finished yet */
+static inline int CuckooFilter_Compacting(const CuckooFilter *filter) {
+    return filter->compactFilter != 0;
+}
 void CuckooFilter_GetInfo(const CuckooFilter *cf, CuckooHash hash, CuckooKey *out);
 #endif
\ No newline at end of file
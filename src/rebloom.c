@@ -1,8 +1,15 @@
 #include "redismodule.h"
 #include "sb.h"
 #include "cf.h"
+#include "cms.h"
+#include "topk.h"
 #include "rm_cms.h"
 #include "rm_topk.h"
+#include "simd.h"
+#include "workers.h"
+#include "reserve.h"
+#include "zrle.h"
+#include "crc64.h"
 #include "version.h"
 #include "rmutil/util.h"
 
@@ -10,11 +17,25 @@
 #include <strings.h> // strncasecmp
 #include <string.h>
 #include <ctype.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
 
 #define CF_MAX_ITERATIONS 20
 #define CF_DEFAULT_BUCKETSIZE 2
 #define CF_DEFAULT_EXPANSION 1
+// Compactions started by CF.DEL run from a timer, in slices of this many ms
+#define CF_COMPACT_SLICE_MS 1
+#define CF_COMPACT_PERIOD_MS 10
+// Buckets visited between two looks at the clock
+#define CF_COMPACT_STEP_BUCKETS 1024
 #define BF_DEFAULT_EXPANSION 2
+#define BF_MAX_WINDOW_GENERATIONS 256
+// Bytes of every source merged while holding the GIL during an asynchronous BF.MERGE
+#define BF_ASYNC_MERGE_SLICE (1 << 22)
 
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
@@ -27,6 +48,12 @@ static double BFDefaultErrorRate = 0.01;
 static size_t BFDefaultInitCapacity = 100;
 static size_t CFDefaultInitCapacity = 1024;
 static size_t CFMaxExpansions = 32;
+// Resolved directory BF.MMAP may read from, NULL when BF.MMAP is disabled
+static char *BFMmapDir = NULL;
+// Set by the STATS option, filters start counting the next time they are opened
+static int BFCollectStats = 0;
+// BF.MERGE reading at least this many bytes runs on a thread, 0 to never do so
+static long long BFAsyncMergeBytes = 0;
 static int rsStrcasecmp(const RedisModuleString *rs1, const char *s2);
 
 typedef enum { SB_OK = 0, SB_MISSING, SB_EMPTY, SB_MISMATCH } lookupStatus;
@@ -39,6 +66,8 @@ typedef struct {
     int is_multi;
     long long expansion;
     long long nonScaling;
+    long long blocked;
+    long long counting;
 } BFInsertOptions;
 
 static int getValue(RedisModuleKey *key, RedisModuleType *expType, void **sbout) {
@@ -59,11 +88,49 @@ static int getValue(RedisModuleKey *key, RedisModuleType *expType, void **sbout)
 }
 
 static int bfGetChain(RedisModuleKey *key, SBChain **sbout) {
-    return getValue(key, BFType, (void **)sbout);
+    int status = getValue(key, BFType, (void **)sbout);
+    if (status == SB_OK && BFCollectStats) {
+        SBChain_EnableStats(*sbout);
+    }
+    // Lookups skip the generations past their time, only writes rotate them, see
+    // bfAdvanceWindow
+    if (status == SB_OK && (*sbout)->window) {
+        SBChain_Expire(*sbout, RedisModule_Milliseconds());
+    }
+    return status;
+}
+
+/**
+ * Replicas and AOF replays only change filters as told by the replication
+ * stream, not on their own clock or timers.
+ */
+static int isReplicatedCtx(RedisModuleCtx *ctx) {
+    return RedisModule_GetContextFlags &&
+           (RedisModule_GetContextFlags(ctx) &
+            (REDISMODULE_CTX_FLAGS_REPLICATED | REDISMODULE_CTX_FLAGS_LOADING));
+}
+
+/**
+ * Rotates the generations of a windowed filter on the server clock before a
+ * write, replicating the rotation as BF.ADVANCE with the time used, so that
+ * replicas and the AOF rotate at the same point of the stream.
+ */
+static void bfAdvanceWindow(RedisModuleCtx *ctx, RedisModuleString *keyname, SBChain *sb) {
+    if (!sb->window || isReplicatedCtx(ctx)) {
+        return;
+    }
+    long long now = RedisModule_Milliseconds();
+    if (SBChain_Advance(sb, now) > 0) {
+        RedisModule_Replicate(ctx, "BF.ADVANCE", "sl", keyname, now);
+    }
 }
 
 static int cfGetFilter(RedisModuleKey *key, CuckooFilter **cfout) {
-    return getValue(key, CFType, (void **)cfout);
+    int status = getValue(key, CFType, (void **)cfout);
+    if (status == SB_OK && BFCollectStats) {
+        CuckooFilter_EnableStats(*cfout);
+    }
+    return status;
 }
 
 static const char *statusStrerror(int status) {
@@ -85,8 +152,8 @@ static const char *statusStrerror(int status) {
  * capacity and error rate must not be 0.
  */
 static SBChain *bfCreateChain(RedisModuleKey *key, double error_rate, size_t capacity,
-                              unsigned expansion, unsigned scaling) {
-    SBChain *sb = SB_NewChain(capacity, error_rate, BLOOM_OPT_FORCE64 | scaling | BLOOM_OPT_NOROUND,
+                              unsigned expansion, unsigned options) {
+    SBChain *sb = SB_NewChain(capacity, error_rate, BLOOM_OPT_FORCE64 | options | BLOOM_OPT_NOROUND,
                               expansion);
     if (sb != NULL) {
         RedisModule_ModuleTypeSetValue(key, BFType, sb);
@@ -94,13 +161,31 @@ static SBChain *bfCreateChain(RedisModuleKey *key, double error_rate, size_t cap
     return sb;
 }
 
+// Windowed filters start their first generation at `start`, in ms on the server clock
+static SBChain *bfCreateWindowChain(RedisModuleKey *key, double error_rate, size_t capacity,
+                                    unsigned options, long long generations, long long period,
+                                    long long start) {
+    SBChain *sb =
+        SB_NewWindowChain(capacity, error_rate, BLOOM_OPT_FORCE64 | options | BLOOM_OPT_NOROUND,
+                          generations, period, start);
+    if (sb != NULL) {
+        RedisModule_ModuleTypeSetValue(key, BFType, sb);
+    }
+    return sb;
+}
+
 static CuckooFilter *cfCreate(RedisModuleKey *key, size_t capacity, size_t bucketSize,
-                              size_t maxIterations, size_t expansion) {
+                              size_t maxIterations, size_t expansion, size_t fpSize,
+                              int semiSort) {
     if (capacity < bucketSize * 2)
         return NULL;
 
     CuckooFilter *cf = RedisModule_Calloc(1, sizeof(*cf));
-    if (CuckooFilter_Init(cf, capacity, bucketSize, maxIterations, expansion) != 0) {
+    int rc = semiSort
+                 ? CuckooFilter_InitSemiSorted(cf, capacity, maxIterations, expansion, fpSize)
+                 : CuckooFilter_InitWithFpSize(cf, capacity, bucketSize, maxIterations, expansion,
+                                               fpSize);
+    if (rc != 0) {
         RedisModule_Free(cf); // LCOV_EXCL_LINE
         cf = NULL;            // LCOV_EXCL_LINE
     }
@@ -110,12 +195,14 @@ static CuckooFilter *cfCreate(RedisModuleKey *key, size_t capacity, size_t bucke
 
 /**
  * Reserves a new empty filter with custom parameters:
- * BF.RESERVE <KEY> <ERROR_RATE (double)> <INITIAL_CAPACITY (int)> [NONSCALING]
+ * BF.RESERVE <KEY> <ERROR_RATE (double)> <INITIAL_CAPACITY (int)> [EXPANSION <expansion>]
+ *            [NONSCALING] [BLOCKED] [COUNTING] [WINDOW <period (ms)> <generations>]
+ *            [START <time (ms)>]
  */
 static int BFReserve_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_AutoMemory(ctx);
 
-    if (argc < 4 || argc > 7) {
+    if (argc < 4 || argc > 12) {
         return RedisModule_WrongArity(ctx);
     }
 
@@ -139,6 +226,16 @@ static int BFReserve_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
         nonScaling = BLOOM_OPT_NO_SCALING;
     }
 
+    unsigned blocked = 0;
+    if (RMUtil_ArgIndex("BLOCKED", argv, argc) != -1) {
+        blocked = BLOOM_OPT_BLOCKED;
+    }
+
+    unsigned counting = 0;
+    if (RMUtil_ArgIndex("COUNTING", argv, argc) != -1) {
+        counting = BLOOM_OPT_COUNTING;
+    }
+
     long long expansion = BF_DEFAULT_EXPANSION;
     ex_loc = RMUtil_ArgIndex("EXPANSION", argv, argc);
     if (ex_loc + 1 == argc) {
@@ -153,6 +250,33 @@ static int BFReserve_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
         }
     }
 
+    long long period = 0, generations = 0;
+    int window_loc = RMUtil_ArgIndex("WINDOW", argv, argc);
+    if (window_loc != -1) {
+        if (window_loc + 2 >= argc ||
+            RedisModule_StringToLongLong(argv[window_loc + 1], &period) != REDISMODULE_OK ||
+            RedisModule_StringToLongLong(argv[window_loc + 2], &generations) != REDISMODULE_OK ||
+            period <= 0 || generations <= 0 || generations > BF_MAX_WINDOW_GENERATIONS) {
+            return RedisModule_ReplyWithError(ctx, "ERR bad window");
+        }
+        if (ex_loc != -1 || nonScaling) {
+            return RedisModule_ReplyWithError(ctx, "ERR windowed filters do not scale");
+        }
+    }
+
+    long long start = RedisModule_Milliseconds();
+    int start_loc = RMUtil_ArgIndex("START", argv, argc);
+    if (start_loc != -1) {
+        if (window_loc == -1) {
+            return RedisModule_ReplyWithError(ctx, "ERR START requires WINDOW");
+        }
+        if (start_loc + 1 >= argc ||
+            RedisModule_StringToLongLong(argv[start_loc + 1], &start) != REDISMODULE_OK ||
+            start < 0) {
+            return RedisModule_ReplyWithError(ctx, "ERR bad start");
+        }
+    }
+
     RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
     SBChain *sb;
     int status = bfGetChain(key, &sb);
@@ -160,12 +284,24 @@ static int BFReserve_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
         return RedisModule_ReplyWithError(ctx, statusStrerror(status));
     }
 
-    if (bfCreateChain(key, error_rate, capacity, expansion, nonScaling) == NULL) {
+    if (window_loc != -1) {
+        sb = bfCreateWindowChain(key, error_rate, capacity, blocked | counting, generations,
+                                 period, start);
+    } else {
+        sb = bfCreateChain(key, error_rate, capacity, expansion, nonScaling | blocked | counting);
+    }
+    if (sb == NULL) {
         RedisModule_ReplyWithError(ctx, "ERR could not create filter"); // LCOV_EXCL_LINE
     } else {
         RedisModule_ReplyWithSimpleString(ctx, "OK");
     }
-    RedisModule_ReplicateVerbatim(ctx);
+    // Replicas and the AOF start the window at the same time
+    if (window_loc != -1 && start_loc == -1) {
+        RedisModule_Replicate(ctx, "BF.RESERVE", "vcl", argv + 1, (size_t)argc - 1, "START",
+                              start);
+    } else {
+        RedisModule_ReplicateVerbatim(ctx);
+    }
     return REDISMODULE_OK;
 }
 
@@ -175,6 +311,42 @@ static int isMulti(const RedisModuleString *rs) {
     return s[3] == 'm' || s[3] == 'M';
 }
 
+// Existence checks are split across the read threads in parts of at least this many items
+#define READ_THREADS_MIN_PART 512
+#define READ_THREADS_MAX 64
+
+typedef struct {
+    const void *filter;
+    const char **items;
+    size_t *lens;
+    int *results;
+} CheckManyJob;
+
+static void bfCheckPart(void *arg, size_t begin, size_t end) {
+    CheckManyJob *job = arg;
+    SBChain_CheckMany(job->filter, job->items + begin, job->lens + begin, end - begin,
+                      job->results + begin);
+}
+
+static void cfCheckPart(void *arg, size_t begin, size_t end) {
+    CheckManyJob *job = arg;
+    CuckooFilter_CheckMany(job->filter, job->items + begin, job->lens + begin, end - begin,
+                           job->results + begin);
+}
+
+/**
+ * Convert the item arguments into the buffer and length arrays used by the SBChain batch API.
+ * The arrays are allocated from the command's memory pool.
+ */
+static void bfGetItems(RedisModuleCtx *ctx, RedisModuleString **argv, size_t nitems,
+                       const char ***items, size_t **lens) {
+    *items = RedisModule_PoolAlloc(ctx, sizeof(**items) * nitems);
+    *lens = RedisModule_PoolAlloc(ctx, sizeof(**lens) * nitems);
+    for (size_t ii = 0; ii < nitems; ++ii) {
+        (*items)[ii] = RedisModule_StringPtrLen(argv[ii], &(*lens)[ii]);
+    }
+}
+
 /**
  * Check for the existence of an item
  * BF.CHECK <KEY>
@@ -202,15 +374,23 @@ static int BFCheck_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, i
         RedisModule_ReplyWithArray(ctx, argc - 2);
     }
 
-    for (size_t ii = 2; ii < argc; ++ii) {
-        if (is_empty == 1) {
+    if (is_empty == 1) {
+        for (size_t ii = 2; ii < argc; ++ii) {
             RedisModule_ReplyWithLongLong(ctx, 0);
-        } else {
-            size_t n;
-            const char *s = RedisModule_StringPtrLen(argv[ii], &n);
-            int exists = SBChain_Check(sb, s, n);
-            RedisModule_ReplyWithLongLong(ctx, exists);
         }
+        return REDISMODULE_OK;
+    }
+
+    const size_t nitems = argc - 2;
+    const char **items;
+    size_t *lens;
+    bfGetItems(ctx, argv + 2, nitems, &items, &lens);
+    int *results = RedisModule_PoolAlloc(ctx, sizeof(*results) * nitems);
+    // Writes are held back until the whole batch is checked, as this thread waits for it
+    CheckManyJob job = {.filter = sb, .items = items, .lens = lens, .results = results};
+    Workers_ParallelFor(nitems, READ_THREADS_MIN_PART, bfCheckPart, &job);
+    for (size_t ii = 0; ii < nitems; ++ii) {
+        RedisModule_ReplyWithLongLong(ctx, results[ii]);
     }
 
     return REDISMODULE_OK;
@@ -224,30 +404,32 @@ static int bfInsertCommon(RedisModuleCtx *ctx, RedisModuleString *keystr, RedisM
 
     if (status == SB_EMPTY && options->autocreate) {
         sb = bfCreateChain(key, options->error_rate, options->capacity, options->expansion,
-                           options->nonScaling);
+                           options->nonScaling | options->blocked | options->counting);
         if (sb == NULL) {
             return RedisModule_ReplyWithError(ctx, "ERR could not create filter"); // LCOV_EXCL_LINE
         }
     } else if (status != SB_OK) {
         return RedisModule_ReplyWithError(ctx, statusStrerror(status));
     }
+    bfAdvanceWindow(ctx, keystr, sb);
 
     if (options->is_multi) {
         RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
     }
 
-    size_t array_len = 0;
-    int rv = 0;
-    for (size_t ii = 0; ii < nitems && rv != -2; ++ii) {
-        size_t n;
-        const char *s = RedisModule_StringPtrLen(items[ii], &n);
-        rv = SBChain_Add(sb, s, n);
-        if (rv == -2) { // decide if to make into an error
+    const char **bufs;
+    size_t *lens;
+    bfGetItems(ctx, items, nitems, &bufs, &lens);
+    int *results = RedisModule_PoolAlloc(ctx, sizeof(*results) * nitems);
+    size_t array_len = SBChain_AddMany(sb, bufs, lens, nitems, results);
+    for (size_t ii = 0; ii < array_len; ++ii) {
+        if (results[ii] == -2) { // decide if to make into an error
             RedisModule_ReplyWithError(ctx, "ERR non scaling filter is full");
+        } else if (results[ii] < 0) {
+            RedisModule_ReplyWithError(ctx, "ERR could not add item"); // LCOV_EXCL_LINE
         } else {
-            RedisModule_ReplyWithLongLong(ctx, !!rv);
+            RedisModule_ReplyWithLongLong(ctx, results[ii]);
         }
-        array_len++;
     }
 
     if (options->is_multi) {
@@ -269,7 +451,9 @@ static int BFAdd_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int
                                .error_rate = BFDefaultErrorRate,
                                .autocreate = 1,
                                .expansion = BF_DEFAULT_EXPANSION,
-                               .nonScaling = 0};
+                               .nonScaling = 0,
+                               .blocked = 0,
+                               .counting = 0};
     options.is_multi = isMulti(argv[0]);
 
     if ((options.is_multi && argc < 3) || (!options.is_multi && argc != 3)) {
@@ -280,7 +464,7 @@ static int BFAdd_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int
 
 /**
  * BF.INSERT {filter} [ERROR {rate} CAPACITY {cap} EXPANSION {expansion}]
- *                    [NOCREATE] [NONSCALING] ITEMS {item} {item}
+ *                    [NOCREATE] [NONSCALING] [BLOCKED] [COUNTING] ITEMS {item} {item}
  * ..
  * -> (Array) (or error )
  */
@@ -291,7 +475,9 @@ static int BFInsert_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
                                .autocreate = 1,
                                .is_multi = 1,
                                .expansion = BF_DEFAULT_EXPANSION,
-                               .nonScaling = 0};
+                               .nonScaling = 0,
+                               .blocked = 0,
+                               .counting = 0};
     int items_index = -1;
 
     // Scan the arguments
@@ -327,6 +513,11 @@ static int BFInsert_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
             break;
 
         case 'c':
+            if (tolower(*(argstr + 1)) == 'o') { // counting
+                options.counting = BLOOM_OPT_COUNTING;
+                cur_pos++;
+                break;
+            }
             if (++cur_pos == argc) {
                 return RedisModule_WrongArity(ctx);
             }
@@ -345,6 +536,11 @@ static int BFInsert_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
             cur_pos++;
             break;
 
+        case 'b':
+            options.blocked = BLOOM_OPT_BLOCKED;
+            cur_pos++;
+            break;
+
         default:
             return RedisModule_ReplyWithError(ctx, "Unknown argument received");
         }
@@ -360,6 +556,310 @@ static int BFInsert_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
     return bfInsertCommon(ctx, argv[1], argv + items_index, argc - items_index, &options);
 }
 
+/**
+ * BF.DEL <KEY> <ITEM>
+ * Removes an item from a counting filter. Returns 1 if the item was removed, 0 if it
+ * was not found.
+ */
+static int BFDel_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+
+    if (argc != 3) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+    SBChain *sb;
+    int status = bfGetChain(key, &sb);
+    if (status != SB_OK) {
+        return RedisModule_ReplyWithError(ctx, statusStrerror(status));
+    }
+    if (!(sb->options & BLOOM_OPT_COUNTING)) {
+        return RedisModule_ReplyWithError(ctx, "ERR filter is not counting");
+    }
+    bfAdvanceWindow(ctx, argv[1], sb);
+
+    size_t n;
+    const char *s = RedisModule_StringPtrLen(argv[2], &n);
+    int rv = SBChain_Delete(sb, s, n);
+    RedisModule_ReplicateVerbatim(ctx);
+    return RedisModule_ReplyWithLongLong(ctx, rv);
+}
+
+/**
+ * Look the sources of BF.MERGE up into `srcs`. They must be laid out like `layout`,
+ * or like the first one if it is NULL. Returns an error message on failure.
+ */
+static const char *bfMergeGetSources(RedisModuleCtx *ctx, RedisModuleString **keys, long long n,
+                                     const SBChain *layout, SBChain **srcs) {
+    for (long long ii = 0; ii < n; ++ii) {
+        RedisModuleKey *key = RedisModule_OpenKey(ctx, keys[ii], REDISMODULE_READ);
+        int status = bfGetChain(key, srcs + ii);
+        RedisModule_CloseKey(key);
+        if (status != SB_OK) {
+            return statusStrerror(status);
+        }
+        if (srcs[ii]->window) {
+            return "ERR windowed filters cannot be merged";
+        }
+        if (!SBChain_MergeCompatible(layout ? layout : srcs[0], srcs[ii])) {
+            return "ERR filters have different layouts";
+        }
+    }
+    return NULL;
+}
+
+// Checks that the destination can receive a merge laid out like `layout`
+static const char *bfMergeCheckDest(RedisModuleKey *key, const SBChain *layout, SBChain **dest) {
+    int status = bfGetChain(key, dest);
+    if (status == SB_EMPTY) {
+        *dest = NULL;
+        return NULL;
+    } else if (status != SB_OK) {
+        return statusStrerror(status);
+    } else if ((*dest)->staging) {
+        return "ERR filter is being consolidated";
+    } else if (!SBChain_MergeCompatible(layout, *dest)) {
+        return (*dest)->window ? "ERR windowed filters cannot be merged"
+                               : "ERR filters have different layouts";
+    }
+    return NULL;
+}
+
+// Moves a complete merge into the destination key, creating it if needed
+static const char *bfMergeStore(RedisModuleCtx *ctx, RedisModuleString *keyname,
+                                SBChainMerge *merge) {
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, keyname, REDISMODULE_READ | REDISMODULE_WRITE);
+    SBChain *dest;
+    const char *err = bfMergeCheckDest(key, merge->chain, &dest);
+    if (err) {
+        SBChain_MergeAbort(merge);
+    } else if (dest) {
+        SBChain_MergeEnd(merge, dest);
+    } else {
+        RedisModule_ModuleTypeSetValue(key, BFType, SBChain_MergeEnd(merge, NULL));
+    }
+    RedisModule_CloseKey(key);
+    return err;
+}
+
+typedef struct {
+    RedisModuleBlockedClient *bc;
+    int dbid;
+    int argc;
+    RedisModuleString **argv;
+    long long numKeys;
+    SBChain **srcs;
+    uint64_t *stamps; // Of the sources when the first slice was merged
+    SBChainMerge *merge;
+    const char *err;
+} BFMergeJob;
+
+static void *bfMergeJobThread(void *arg) {
+    BFMergeJob *job = arg;
+    RedisModuleCtx *ctx = RedisModule_GetThreadSafeContext(job->bc);
+    size_t slice = BF_ASYNC_MERGE_SLICE / job->numKeys + 1;
+
+    // The sources are looked up again for every slice, as they may change meanwhile
+    for (size_t begin = 0; job->merge && !job->err; begin += slice) {
+        RedisModule_ThreadSafeContextLock(ctx);
+        RedisModule_SelectDb(ctx, job->dbid);
+        job->err =
+            bfMergeGetSources(ctx, job->argv + 3, job->numKeys, job->merge->chain, job->srcs);
+        if (!job->err) {
+            size_t end = begin + slice < job->merge->total ? begin + slice : job->merge->total;
+            int changed = 0;
+            for (long long ii = 0; ii < job->numKeys; ++ii) {
+                changed |= begin > 0 && job->srcs[ii]->stamp != job->stamps[ii];
+                job->stamps[ii] = job->srcs[ii]->stamp;
+            }
+            // The command is replicated as if it ran at once: if a source was written to
+            // since the first slice, merge them all again from their current state
+            if (changed) {
+                SBChain_MergeReset(job->merge);
+                begin = 0;
+                end = job->merge->total;
+            }
+            SBChain_MergeRange(job->merge, (const SBChain *const *)job->srcs, job->numKeys, begin,
+                               end);
+            if (end == job->merge->total) {
+                // Stored under the same lock as the last slice, the sources can't change
+                job->err = bfMergeStore(ctx, job->argv[1], job->merge);
+                job->merge = NULL;
+                if (!job->err) {
+                    RedisModule_Replicate(ctx, "BF.MERGE", "v", job->argv + 1,
+                                          (size_t)job->argc - 1);
+                }
+            }
+        }
+        RedisModule_ThreadSafeContextUnlock(ctx);
+    }
+
+    RedisModule_ThreadSafeContextLock(ctx);
+    if (job->merge) {
+        SBChain_MergeAbort(job->merge);
+    }
+    for (int ii = 0; ii < job->argc; ++ii) {
+        RedisModule_FreeString(ctx, job->argv[ii]);
+    }
+    RedisModule_ThreadSafeContextUnlock(ctx);
+
+    RedisModule_UnblockClient(job->bc, job);
+    RedisModule_FreeThreadSafeContext(ctx);
+    return NULL;
+}
+
+static int bfMergeJobReply(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    BFMergeJob *job = RedisModule_GetBlockedClientPrivateData(ctx);
+    if (job->err) {
+        return RedisModule_ReplyWithError(ctx, job->err);
+    }
+    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+static void bfMergeJobFree(void *privdata) {
+    BFMergeJob *job = privdata;
+    RedisModule_Free(job->argv);
+    RedisModule_Free(job->srcs);
+    RedisModule_Free(job->stamps);
+    RedisModule_Free(job);
+}
+
+/**
+ * Runs the merge on a separate thread, which only holds the GIL for slices of
+ * BF_ASYNC_MERGE_SLICE bytes at a time. Returns REDISMODULE_ERR if the client
+ * can't be blocked, in which case the merge should be run inline. Replicas and
+ * AOF replays merge inline, before the writes that follow it in the stream.
+ */
+static int bfMergeAsync(RedisModuleCtx *ctx, RedisModuleString **argv, int argc,
+                        long long numKeys, SBChainMerge *merge) {
+    if (!RedisModule_GetContextFlags || isReplicatedCtx(ctx) ||
+        (RedisModule_GetContextFlags(ctx) &
+         (REDISMODULE_CTX_FLAGS_LUA | REDISMODULE_CTX_FLAGS_MULTI))) {
+        return REDISMODULE_ERR;
+    }
+
+    BFMergeJob *job = RedisModule_Calloc(1, sizeof(*job));
+    *job = (BFMergeJob){.dbid = RedisModule_GetSelectedDb(ctx),
+                        .argc = argc,
+                        .argv = RedisModule_Calloc(argc, sizeof(RedisModuleString *)),
+                        .numKeys = numKeys,
+                        .srcs = RedisModule_Calloc(numKeys, sizeof(SBChain *)),
+                        .stamps = RedisModule_Calloc(numKeys, sizeof(uint64_t)),
+                        .merge = merge};
+    job->bc = RedisModule_BlockClient(ctx, bfMergeJobReply, NULL, bfMergeJobFree, 0);
+
+    pthread_t tid;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (int ii = 0; ii < argc; ++ii) {
+        job->argv[ii] = argv[ii];
+        RedisModule_RetainString(ctx, argv[ii]);
+    }
+    if (pthread_create(&tid, &attr, bfMergeJobThread, job) != 0) {
+        // LCOV_EXCL_START
+        RedisModule_AbortBlock(job->bc);
+        for (int ii = 0; ii < argc; ++ii) {
+            RedisModule_FreeString(ctx, argv[ii]);
+        }
+        bfMergeJobFree(job);
+        pthread_attr_destroy(&attr);
+        return REDISMODULE_ERR;
+        // LCOV_EXCL_STOP
+    }
+    pthread_attr_destroy(&attr);
+    return REDISMODULE_OK;
+}
+
+/**
+ * BF.MERGE <DEST> <NUMKEYS> <SRC ...> [INTERSECT]
+ * Stores the union, or the intersection, of filters with the same layout into
+ * DEST. DEST is created like the first source if it does not exist, and must
+ * otherwise have the same layout; its previous content is replaced.
+ */
+static int BFMerge_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+
+    if (argc < 4) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    long long numKeys;
+    if (RedisModule_StringToLongLong(argv[2], &numKeys) != REDISMODULE_OK || numKeys < 1) {
+        return RedisModule_ReplyWithError(ctx, "ERR bad numkeys");
+    }
+    int intersect = 0;
+    if (argc == 4 + numKeys && !rsStrcasecmp(argv[argc - 1], "intersect")) {
+        intersect = 1;
+    } else if (argc != 3 + numKeys) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    SBChain **srcs = RedisModule_PoolAlloc(ctx, sizeof(*srcs) * numKeys);
+    const char *err = bfMergeGetSources(ctx, argv + 3, numKeys, NULL, srcs);
+    if (err) {
+        return RedisModule_ReplyWithError(ctx, err);
+    }
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+    SBChain *dest;
+    err = bfMergeCheckDest(key, srcs[0], &dest);
+    RedisModule_CloseKey(key);
+    if (err) {
+        return RedisModule_ReplyWithError(ctx, err);
+    }
+
+    SBChainMerge *merge = SBChain_MergeBegin(srcs[0], intersect);
+    if (!merge) {
+        return RedisModule_ReplyWithError(ctx, "ERR could not merge filters"); // LCOV_EXCL_LINE
+    }
+    // The job takes ownership of the merge
+    if (BFAsyncMergeBytes > 0 && merge->total * numKeys >= (size_t)BFAsyncMergeBytes &&
+        bfMergeAsync(ctx, argv, argc, numKeys, merge) == REDISMODULE_OK) {
+        return REDISMODULE_OK;
+    }
+
+    SBChain_MergeRange(merge, (const SBChain *const *)srcs, numKeys, 0, merge->total);
+    err = bfMergeStore(ctx, argv[1], merge);
+    if (err) {
+        return RedisModule_ReplyWithError(ctx, err);
+    }
+    RedisModule_ReplicateVerbatim(ctx);
+    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+/**
+ * BF.ADVANCE <KEY> <TIME (ms)>
+ * Rotates the generations of a windowed filter to TIME, as done before the writes
+ * that follow it. Replicated ahead of them, so that replicas and the AOF rotate
+ * at the same point. Returns the number of generations cleared.
+ */
+static int BFAdvance_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+
+    if (argc != 3) {
+        return RedisModule_WrongArity(ctx);
+    }
+    long long now;
+    if (RedisModule_StringToLongLong(argv[2], &now) != REDISMODULE_OK || now < 0) {
+        return RedisModule_ReplyWithError(ctx, "ERR bad time");
+    }
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+    SBChain *sb;
+    int status = bfGetChain(key, &sb);
+    if (status != SB_OK) {
+        return RedisModule_ReplyWithError(ctx, statusStrerror(status));
+    }
+    if (!sb->window) {
+        return RedisModule_ReplyWithError(ctx, "ERR filter is not windowed");
+    }
+
+    size_t cleared = SBChain_Advance(sb, now);
+    RedisModule_ReplicateVerbatim(ctx);
+    return RedisModule_ReplyWithLongLong(ctx, cleared);
+}
+
 /**
  * BF.DEBUG KEY
  * returns some information about the bloom filter.
@@ -399,15 +899,190 @@ static int BFDebug_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, i
     return REDISMODULE_OK;
 }
 
+/**
+ * BF.CONSOLIDATE {key} [CAPACITY {cap}] ITEMS {item ...}
+ * BF.CONSOLIDATE {key} COMMIT
+ * BF.CONSOLIDATE {key} ABORT
+ * BF.CONSOLIDATE {key} RESTORE {params} [{offset} {bits}]
+ *
+ * Rebuilds the filter into a single sub-filter from items supplied by the client.
+ * The first ITEMS call starts a staging sub-filter for `cap` items (default: the
+ * number of items in the filter), the following ones add to it, COMMIT replaces
+ * the filter with it and ABORT discards it.
+ * ITEMS returns the number of items in the staging sub-filter.
+ * RESTORE is emitted by AOF rewrites: with the parameters of the staging
+ * sub-filter it starts a zeroed one, with an offset it loads its bits there.
+ */
+static int BFConsolidate_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+
+    if (argc < 3) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+    SBChain *sb;
+    int status = bfGetChain(key, &sb);
+    if (status != SB_OK) {
+        return RedisModule_ReplyWithError(ctx, statusStrerror(status));
+    }
+
+    const char *cmd = RedisModule_StringPtrLen(argv[2], NULL);
+    if (!strcasecmp(cmd, "commit") || !strcasecmp(cmd, "abort")) {
+        if (argc != 3) {
+            return RedisModule_WrongArity(ctx);
+        }
+        if (!sb->staging) {
+            return RedisModule_ReplyWithError(ctx, "ERR no consolidation in progress");
+        }
+        if (tolower(*cmd) == 'a') {
+            SBChain_StageAbort(sb);
+        } else if (SBChain_StageCommit(sb) != 0) {
+            return RedisModule_ReplyWithError(ctx, "ERR could not consolidate filter"); // LCOV_EXCL_LINE
+        }
+        RedisModule_ReplyWithSimpleString(ctx, "OK");
+        RedisModule_ReplicateVerbatim(ctx);
+        return REDISMODULE_OK;
+    }
+
+    if (!strcasecmp(cmd, "restore")) {
+        if (argc != 4 && argc != 5) {
+            return RedisModule_WrongArity(ctx);
+        }
+        long long offset = 0;
+        if (argc == 5 &&
+            (RedisModule_StringToLongLong(argv[3], &offset) != REDISMODULE_OK || offset < 0)) {
+            return RedisModule_ReplyWithError(ctx, "ERR invalid offset");
+        }
+        size_t len;
+        const char *buf = RedisModule_StringPtrLen(argv[argc - 1], &len);
+        const char *errmsg;
+        if ((argc == 4 ? SBChain_LoadEncodedStaging(sb, buf, len, &errmsg)
+                       : SBChain_LoadStagingChunk(sb, offset, buf, len, &errmsg)) != 0) {
+            return RedisModule_ReplyWithError(ctx, errmsg);
+        }
+        RedisModule_ReplyWithSimpleString(ctx, "OK");
+        RedisModule_ReplicateVerbatim(ctx);
+        return REDISMODULE_OK;
+    }
+
+    int items_index = RMUtil_ArgIndex("ITEMS", argv + 2, argc - 2) + 2;
+    if (items_index == 1 || items_index + 1 == argc) {
+        return RedisModule_ReplyWithError(ctx, "ERR ITEMS must be followed by at least one item");
+    }
+    if (sb->window) {
+        return RedisModule_ReplyWithError(ctx, "ERR windowed filters cannot be consolidated");
+    }
+    if (sb->options & BLOOM_OPT_COUNTING) {
+        return RedisModule_ReplyWithError(ctx, "ERR counting filters cannot be consolidated");
+    }
+
+    long long capacity = sb->size;
+    if (items_index == 4 && !strcasecmp(RedisModule_StringPtrLen(argv[2], NULL), "capacity")) {
+        if (RedisModule_StringToLongLong(argv[3], &capacity) != REDISMODULE_OK || capacity < 1) {
+            return RedisModule_ReplyWithError(ctx, "ERR bad capacity");
+        }
+    } else if (items_index != 2) {
+        return RedisModule_ReplyWithError(ctx, "Unknown argument received");
+    }
+
+    if (!sb->staging && SBChain_StageBegin(sb, capacity < 1 ? 1 : capacity) != 0) {
+        return RedisModule_ReplyWithError(ctx, "ERR could not create staging filter");
+    }
+
+    for (int ii = items_index + 1; ii < argc; ++ii) {
+        size_t n;
+        const char *s = RedisModule_StringPtrLen(argv[ii], &n);
+        SBChain_StageAdd(sb, s, n);
+    }
+    RedisModule_ReplyWithLongLong(ctx, sb->staging->size);
+    RedisModule_ReplicateVerbatim(ctx);
+    return REDISMODULE_OK;
+}
+
 #define MAX_SCANDUMP_SIZE 535822336 // 511MB
 
+typedef struct {
+    size_t chunkSize;
+    int checksum;
+} ScanDumpOptions;
+
 /**
- * BF.SCANDUMP <KEY> <ITER>
- * Returns an (iterator,data) pair which can be used for LOADCHUNK later on
+ * Parses the trailing [CHUNKSIZE <n>|ALL] [CHECKSUM] arguments of BF.SCANDUMP
+ * and CF.SCANDUMP. Replies with an error and returns REDISMODULE_ERR when invalid.
+ */
+static int parseScanDumpOptions(RedisModuleCtx *ctx, RedisModuleString **argv, int argc,
+                                ScanDumpOptions *opts) {
+    *opts = (ScanDumpOptions){.chunkSize = MAX_SCANDUMP_SIZE, .checksum = 0};
+    for (int ii = 3; ii < argc; ++ii) {
+        if (!rsStrcasecmp(argv[ii], "CHUNKSIZE") && ii + 1 < argc) {
+            long long chunkSize;
+            if (!rsStrcasecmp(argv[ii + 1], "ALL")) {
+                // Whole remainder of the current sub-filter in a single reply
+                opts->chunkSize = SIZE_MAX;
+            } else if (RedisModule_StringToLongLong(argv[ii + 1], &chunkSize) != REDISMODULE_OK ||
+                       chunkSize < 1 || chunkSize > MAX_SCANDUMP_SIZE) {
+                RedisModule_ReplyWithError(ctx, "ERR bad chunk size");
+                return REDISMODULE_ERR;
+            } else {
+                opts->chunkSize = chunkSize;
+            }
+            ++ii;
+        } else if (!rsStrcasecmp(argv[ii], "CHECKSUM")) {
+            opts->checksum = 1;
+        } else {
+            RedisModule_ReplyWithError(ctx, "ERR syntax error");
+            return REDISMODULE_ERR;
+        }
+    }
+    return REDISMODULE_OK;
+}
+
+/**
+ * Replies with an (iterator,data[,checksum]) tuple. `buf` is sent as is, without
+ * being copied to an intermediate buffer first. A NULL `buf` replies with a null.
+ */
+static void replyScanDumpChunk(RedisModuleCtx *ctx, const ScanDumpOptions *opts, long long iter,
+                               const char *buf, size_t len) {
+    RedisModule_ReplyWithArray(ctx, opts->checksum ? 3 : 2);
+    RedisModule_ReplyWithLongLong(ctx, iter);
+    if (buf) {
+        RedisModule_ReplyWithStringBuffer(ctx, buf, len);
+    } else {
+        RedisModule_ReplyWithNull(ctx);
+        len = 0;
+    }
+    if (opts->checksum) {
+        RedisModule_ReplyWithLongLong(ctx, (long long)crc64(0, buf, len));
+    }
+}
+
+/**
+ * Verifies the optional checksum argument of BF.LOADCHUNK and CF.LOADCHUNK.
+ * Replies with an error and returns REDISMODULE_ERR on mismatch.
+ */
+static int checkLoadChunkChecksum(RedisModuleCtx *ctx, RedisModuleString *crcArg, const char *buf,
+                                  size_t len) {
+    long long crc;
+    if (RedisModule_StringToLongLong(crcArg, &crc) != REDISMODULE_OK) {
+        RedisModule_ReplyWithError(ctx, "ERR invalid checksum");
+        return REDISMODULE_ERR;
+    }
+    if ((uint64_t)crc != crc64(0, buf, len)) {
+        RedisModule_ReplyWithError(ctx, "ERR checksum mismatch");
+        return REDISMODULE_ERR;
+    }
+    return REDISMODULE_OK;
+}
+
+/**
+ * BF.SCANDUMP <KEY> <ITER> [CHUNKSIZE <n>|ALL] [CHECKSUM]
+ * Returns an (iterator,data) pair which can be used for LOADCHUNK later on.
+ * With CHECKSUM, the CRC-64 of the data is appended to the reply.
  */
 static int BFScanDump_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_AutoMemory(ctx);
-    if (argc != 3) {
+    if (argc < 3) {
         return RedisModule_WrongArity(ctx);
     }
     const SBChain *sb = NULL;
@@ -422,31 +1097,32 @@ static int BFScanDump_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv
         return RedisModule_ReplyWithError(ctx, "Second argument must be numeric");
     }
 
-    RedisModule_ReplyWithArray(ctx, 2);
+    ScanDumpOptions opts;
+    if (parseScanDumpOptions(ctx, argv, argc, &opts) != REDISMODULE_OK) {
+        return REDISMODULE_OK;
+    }
 
     if (iter == 0) {
         size_t hdrlen;
         char *hdr = SBChain_GetEncodedHeader(sb, &hdrlen);
-        RedisModule_ReplyWithLongLong(ctx, SB_CHUNKITER_INIT);
-        RedisModule_ReplyWithStringBuffer(ctx, (const char *)hdr, hdrlen);
+        replyScanDumpChunk(ctx, &opts, SB_CHUNKITER_INIT, hdr, hdrlen);
         SB_FreeEncodedHeader(hdr);
     } else {
         size_t bufLen = 0;
-        const char *buf = SBChain_GetEncodedChunk(sb, &iter, &bufLen, MAX_SCANDUMP_SIZE);
-        RedisModule_ReplyWithLongLong(ctx, iter);
-        RedisModule_ReplyWithStringBuffer(ctx, buf, bufLen);
+        const char *buf = SBChain_GetEncodedChunk(sb, &iter, &bufLen, opts.chunkSize);
+        replyScanDumpChunk(ctx, &opts, iter, buf ? buf : "", bufLen);
     }
     return REDISMODULE_OK;
 }
 
 /**
- * BF.LOADCHUNK <KEY> <ITER> <DATA>
+ * BF.LOADCHUNK <KEY> <ITER> <DATA> [CHECKSUM]
  * Incrementally loads a bloom filter.
  */
 static int BFLoadChunk_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_AutoMemory(ctx);
 
-    if (argc != 4) {
+    if (argc != 4 && argc != 5) {
         return RedisModule_WrongArity(ctx);
     }
 
@@ -457,6 +1133,9 @@ static int BFLoadChunk_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **arg
 
     size_t bufLen;
     const char *buf = RedisModule_StringPtrLen(argv[3], &bufLen);
+    if (argc == 5 && checkLoadChunkChecksum(ctx, argv[4], buf, bufLen) != REDISMODULE_OK) {
+        return REDISMODULE_OK;
+    }
 
     RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
     SBChain *sb;
@@ -485,11 +1164,77 @@ static int BFLoadChunk_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **arg
     }
 }
 
-/** CF.RESERVE <KEY> <CAPACITY> [BUCKETSIZE] [MAXITERATIONS] [EXPANSION] */
+/**
+ * Resolves a path given to BF.MMAP relative to BF_MMAP_DIR. Returns NULL if the
+ * file does not exist or lies outside of the directory, e.g. through ".." or
+ * a symbolic link. Free the result with free().
+ */
+static char *bfMmapPath(const char *name) {
+    char joined[PATH_MAX];
+    if (snprintf(joined, sizeof(joined), "%s/%s", BFMmapDir, name) >= (int)sizeof(joined)) {
+        return NULL;
+    }
+    char *path = realpath(joined, NULL);
+    size_t dirlen = strlen(BFMmapDir);
+    if (path && (strncmp(path, BFMmapDir, dirlen) != 0 ||
+                 (BFMmapDir[dirlen - 1] != '/' && path[dirlen] != '/'))) {
+        free(path);
+        path = NULL;
+    }
+    return path;
+}
+
+/**
+ * BF.MMAP <KEY> <PATH>
+ * Creates a filter from a file inside BF_MMAP_DIR holding the BF.SCANDUMP
+ * chunks of a filter, concatenated in order. The file is mapped instead of
+ * being read, see SB_NewChainFromFile.
+ */
+static int BFMmap_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+
+    if (argc != 3) {
+        return RedisModule_WrongArity(ctx);
+    }
+    if (!BFMmapDir) {
+        return RedisModule_ReplyWithError(ctx, "ERR BF.MMAP is disabled, see BF_MMAP_DIR");
+    }
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+    SBChain *sb;
+    int status = bfGetChain(key, &sb);
+    if (status != SB_EMPTY) {
+        return RedisModule_ReplyWithError(ctx, statusStrerror(status));
+    }
+
+    char *path = bfMmapPath(RedisModule_StringPtrLen(argv[2], NULL));
+    if (!path) {
+        return RedisModule_ReplyWithError(ctx, "ERR no such file in BF_MMAP_DIR");
+    }
+    const char *errmsg;
+    sb = SB_NewChainFromFile(path, &errmsg);
+    free(path);
+    if (!sb) {
+        return RedisModule_ReplyWithError(ctx, errmsg);
+    }
+    RedisModule_ModuleTypeSetValue(key, BFType, sb);
+    RedisModule_ReplyWithSimpleString(ctx, "OK");
+    RedisModule_ReplicateVerbatim(ctx);
+    return REDISMODULE_OK;
+}
+
+/**
+ * CF.RESERVE <KEY> <CAPACITY> [BUCKETSIZE] [MAXITERATIONS] [EXPANSION] [FPSIZE] [SEMISORT]
+ */
 static int CFReserve_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_AutoMemory(ctx);
-    //
-    if (argc != 3 && (argc % 2) == 0) {
+    // SEMISORT is the only option without a value
+    int semiSort = 0;
+    for (int ii = 3; ii < argc; ++ii) {
+        semiSort += RMUtil_ArgIndex("SEMISORT", argv + ii, 1) == 0;
+    }
+    int optArgc = argc - semiSort;
+    if (optArgc != 3 && (optArgc % 2) == 0) {
         return RedisModule_WrongArity(ctx);
     }
 
@@ -522,6 +1267,25 @@ static int CFReserve_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
         }
     }
 
+    long long fpBits = CUCKOO_DEFAULT_FPSIZE * 8;
+    int fp_loc = RMUtil_ArgIndex("FPSIZE", argv, argc);
+    if (fp_loc != -1) {
+        if (RedisModule_StringToLongLong(argv[fp_loc + 1], &fpBits) != REDISMODULE_OK ||
+            (fpBits != 8 && fpBits != 16 && fpBits != 32)) {
+            return RedisModule_ReplyWithError(ctx, "FPSIZE must be 8, 16 or 32");
+        }
+    }
+
+    if (semiSort) {
+        if (bs_loc == -1) {
+            bucketSize = CUCKOO_SEMISORT_BUCKETSIZE;
+        }
+        if (!CuckooFilter_ValidSemiSort(bucketSize, fpBits / 8)) {
+            return RedisModule_ReplyWithError(ctx,
+                                              "SEMISORT requires BUCKETSIZE 4 and FPSIZE 8 or 16");
+        }
+    }
+
     if (bucketSize * 2 > capacity) {
         return RedisModule_ReplyWithError(ctx, "Capacity must be at least (BucketSize * 2)");
     }
@@ -533,7 +1297,7 @@ static int CFReserve_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
         return RedisModule_ReplyWithError(ctx, statusStrerror(status));
     }
 
-    cf = cfCreate(key, capacity, bucketSize, maxIterations, expansion);
+    cf = cfCreate(key, capacity, bucketSize, maxIterations, expansion, fpBits / 8, semiSort);
     if (cf == NULL) {
         return RedisModule_ReplyWithError(ctx, "Couldn't create Cuckoo Filter"); // LCOV_EXCL_LINE
     } else {
@@ -557,7 +1321,7 @@ static int cfInsertCommon(RedisModuleCtx *ctx, RedisModuleString *keystr, RedisM
 
     if (status == SB_EMPTY && options->autocreate) {
         if ((cf = cfCreate(key, options->capacity, CF_DEFAULT_BUCKETSIZE, CF_MAX_ITERATIONS,
-                           CF_DEFAULT_EXPANSION)) == NULL) {
+                           CF_DEFAULT_EXPANSION, CUCKOO_DEFAULT_FPSIZE, 0)) == NULL) {
             return RedisModule_ReplyWithError(ctx, "Could not create filter"); // LCOV_EXCL_LINE
         }
     } else if (status != SB_OK) {
@@ -576,17 +1340,13 @@ static int cfInsertCommon(RedisModuleCtx *ctx, RedisModuleString *keystr, RedisM
         RedisModule_ReplyWithArray(ctx, nitems);
     }
 
+    const char **bufs;
+    size_t *lens;
+    bfGetItems(ctx, items, nitems, &bufs, &lens);
+    CuckooInsertStatus *results = RedisModule_PoolAlloc(ctx, sizeof(*results) * nitems);
+    CuckooFilter_InsertMany(cf, bufs, lens, nitems, options->is_nx, results);
     for (size_t ii = 0; ii < nitems; ++ii) {
-        size_t elemlen;
-        const char *elem = RedisModule_StringPtrLen(items[ii], &elemlen);
-        CuckooHash hash = CUCKOO_GEN_HASH(elem, elemlen);
-        CuckooInsertStatus insStatus;
-        if (options->is_nx) {
-            insStatus = CuckooFilter_InsertUnique(cf, hash);
-        } else {
-            insStatus = CuckooFilter_Insert(cf, hash);
-        }
-        switch (insStatus) {
+        switch (results[ii]) {
         case CuckooInsert_Inserted:
             RedisModule_ReplyWithLongLong(ctx, 1);
             break;
@@ -599,6 +1359,7 @@ static int cfInsertCommon(RedisModuleCtx *ctx, RedisModuleString *keystr, RedisM
             } else {
                 RedisModule_ReplyWithLongLong(ctx, -1);
             }
+            break;
         case CuckooInsert_MemAllocFailed:
             RedisModule_ReplyWithError(ctx, "Memory allocation failure"); // LCOV_EXCL_LINE
             break;
@@ -709,25 +1470,100 @@ static int CFCheck_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, i
         RedisModule_ReplyWithArray(ctx, argc - 2);
     }
 
-    for (size_t ii = 2; ii < argc; ++ii) {
-        if (is_empty == 1) {
+    if (is_empty == 1) {
+        for (size_t ii = 2; ii < argc; ++ii) {
             RedisModule_ReplyWithLongLong(ctx, 0);
-        } else {
-            size_t n;
-            const char *s = RedisModule_StringPtrLen(argv[ii], &n);
-            CuckooHash hash = CUCKOO_GEN_HASH(s, n);
-            long long rv;
-            if (is_count) {
-                rv = CuckooFilter_Count(cf, hash);
-            } else {
-                rv = CuckooFilter_Check(cf, hash);
-            }
-            RedisModule_ReplyWithLongLong(ctx, rv);
         }
+        return REDISMODULE_OK;
+    }
+
+    if (is_count) {
+        size_t n;
+        const char *s = RedisModule_StringPtrLen(argv[2], &n);
+        return RedisModule_ReplyWithLongLong(ctx, CuckooFilter_Count(cf, CUCKOO_GEN_HASH(s, n)));
+    }
+
+    const size_t nitems = argc - 2;
+    const char **items;
+    size_t *lens;
+    bfGetItems(ctx, argv + 2, nitems, &items, &lens);
+    int *results = RedisModule_PoolAlloc(ctx, sizeof(*results) * nitems);
+    CheckManyJob job = {.filter = cf, .items = items, .lens = lens, .results = results};
+    Workers_ParallelFor(nitems, READ_THREADS_MIN_PART, cfCheckPart, &job);
+    for (size_t ii = 0; ii < nitems; ++ii) {
+        RedisModule_ReplyWithLongLong(ctx, results[ii]);
     }
     return REDISMODULE_OK;
 }
 
+static long long monotonicMicros(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/**
+ * Runs compaction steps for up to `budgetMs`, writing to `buckets` the number of buckets
+ * they were allowed to visit: replicas redo the same work with CF.COMPACT BUCKETS rather
+ * than their own time budget. Returns 1 once the compaction is over
+ */
+static int cfCompactFor(CuckooFilter *cf, long long budgetMs, long long *buckets) {
+    long long deadline = monotonicMicros() + budgetMs * 1000;
+    *buckets = CF_COMPACT_STEP_BUCKETS;
+    while (!CuckooFilter_CompactStep(cf, CF_COMPACT_STEP_BUCKETS, NULL)) {
+        if (monotonicMicros() >= deadline) {
+            return 0;
+        }
+        *buckets += CF_COMPACT_STEP_BUCKETS;
+    }
+    return 1;
+}
+
+typedef struct {
+    RedisModuleString *keyname;
+    int dbid;
+} CFCompactJob;
+
+static void cfCompactTimer(RedisModuleCtx *ctx, void *data) {
+    CFCompactJob *job = data;
+    RedisModule_SelectDb(ctx, job->dbid);
+    RedisModuleKey *key =
+        RedisModule_OpenKey(ctx, job->keyname, REDISMODULE_READ | REDISMODULE_WRITE);
+    CuckooFilter *cf;
+    int more = 0;
+    // The key may have been deleted or replaced meanwhile, or compacted by CF.COMPACT
+    if (cfGetFilter(key, &cf) == SB_OK && CuckooFilter_Compacting(cf)) {
+        long long buckets;
+        more = !cfCompactFor(cf, CF_COMPACT_SLICE_MS, &buckets);
+        RedisModule_Replicate(ctx, "CF.COMPACT", "scl", job->keyname, "BUCKETS", buckets);
+        cf->compactScheduled = more;
+    }
+    RedisModule_CloseKey(key);
+    if (more) {
+        RedisModule_CreateTimer(ctx, CF_COMPACT_PERIOD_MS, cfCompactTimer, job);
+        return;
+    }
+    RedisModule_FreeString(NULL, job->keyname);
+    RedisModule_Free(job);
+}
+
+static void cfScheduleCompaction(RedisModuleCtx *ctx, RedisModuleString *keyname,
+                                 CuckooFilter *cf) {
+    if (!RedisModule_CreateTimer) {
+        CuckooFilter_Compact(cf); // Servers without timers compact right away
+        return;
+    }
+    // Compactions loaded from RDB or AOF have no timer yet
+    if (isReplicatedCtx(ctx) || cf->compactScheduled) {
+        return;
+    }
+    cf->compactScheduled = 1;
+    CFCompactJob *job = RedisModule_Alloc(sizeof(*job));
+    job->keyname = RedisModule_CreateStringFromString(NULL, keyname);
+    job->dbid = RedisModule_GetSelectedDb(ctx);
+    RedisModule_CreateTimer(ctx, CF_COMPACT_PERIOD_MS, cfCompactTimer, job);
+}
+
 static int CFDel_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_AutoMemory(ctx);
 
@@ -747,31 +1583,87 @@ static int CFDel_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int
     size_t elemlen;
     const char *elem = RedisModule_StringPtrLen(argv[2], &elemlen);
     CuckooHash hash = CUCKOO_GEN_HASH(elem, elemlen);
-    return RedisModule_ReplyWithLongLong(ctx, CuckooFilter_Delete(cf, hash));
+    int rv = CuckooFilter_Delete(cf, hash);
+    if (CuckooFilter_Compacting(cf)) {
+        cfScheduleCompaction(ctx, argv[1], cf);
+    }
+    return RedisModule_ReplyWithLongLong(ctx, rv);
 }
 
+/**
+ * CF.COMPACT <KEY> [START|BUDGET <ms>|BUCKETS <n>]
+ * START starts a compaction, which is then run by the other forms. With a budget,
+ * resumes the running compaction for up to `ms` milliseconds and replies 1 if it is
+ * over, 0 if another call is needed. BUCKETS visits up to `n` buckets instead, and
+ * is what budgeted compactions are replicated as.
+ */
 static int CFCompact_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_AutoMemory(ctx);
 
-    if (argc != 2) {
+    if (argc < 2 || argc > 4) {
         return RedisModule_WrongArity(ctx);
     }
 
+    int start = 0;
+    long long budget = -1, buckets = -1;
+    if (argc == 3) {
+        if (RMUtil_ArgIndex("START", argv + 2, 1) != 0) {
+            return RedisModule_ReplyWithError(ctx, "Unknown argument received");
+        }
+        start = 1;
+    } else if (argc == 4) {
+        if (RMUtil_ArgIndex("BUDGET", argv + 2, 1) == 0) {
+            if (RedisModule_StringToLongLong(argv[3], &budget) != REDISMODULE_OK || budget < 0) {
+                return RedisModule_ReplyWithError(ctx, "BUDGET must be a non-negative integer");
+            }
+        } else if (RMUtil_ArgIndex("BUCKETS", argv + 2, 1) == 0) {
+            if (RedisModule_StringToLongLong(argv[3], &buckets) != REDISMODULE_OK ||
+                buckets < 0) {
+                return RedisModule_ReplyWithError(ctx, "BUCKETS must be a non-negative integer");
+            }
+        } else {
+            return RedisModule_ReplyWithError(ctx, "Unknown argument received");
+        }
+    }
+
     RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
     CuckooFilter *cf;
     int status = cfGetFilter(key, &cf);
     if (status != SB_OK) {
         return RedisModule_ReplyWithError(ctx, "Cuckoo filter was not found");
     }
-    CuckooFilter_Compact(cf);
-    RedisModule_ReplicateVerbatim(ctx);
-    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+    if (start) {
+        CuckooFilter_CompactStart(cf);
+        RedisModule_ReplicateVerbatim(ctx);
+        return RedisModule_ReplyWithSimpleString(ctx, "OK");
+    }
+    if (budget < 0 && buckets < 0) {
+        RedisModule_ReplicateVerbatim(ctx);
+        CuckooFilter_Compact(cf);
+        return RedisModule_ReplyWithSimpleString(ctx, "OK");
+    }
+    // Steps only resume a compaction started on every server, by CF.DEL or START
+    if (!CuckooFilter_Compacting(cf)) {
+        return RedisModule_ReplyWithLongLong(ctx, 1);
+    }
+    int done;
+    if (buckets >= 0) {
+        done = CuckooFilter_CompactStep(cf, buckets, NULL);
+    } else {
+        done = cfCompactFor(cf, budget, &buckets);
+    }
+    RedisModule_Replicate(ctx, "CF.COMPACT", "scl", argv[1], "BUCKETS", buckets);
+    return RedisModule_ReplyWithLongLong(ctx, done);
 }
 
+/**
+ * CF.SCANDUMP <KEY> <ITER> [CHUNKSIZE <n>|ALL] [CHECKSUM]
+ * Same as BF.SCANDUMP, for cuckoo filters.
+ */
 static int CFScanDump_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_AutoMemory(ctx);
 
-    if (argc != 3) {
+    if (argc < 3) {
         return RedisModule_WrongArity(ctx);
     }
 
@@ -780,6 +1672,11 @@ static int CFScanDump_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv
         return RedisModule_ReplyWithError(ctx, "Invalid position");
     }
 
+    ScanDumpOptions opts;
+    if (parseScanDumpOptions(ctx, argv, argc, &opts) != REDISMODULE_OK) {
+        return REDISMODULE_OK;
+    }
+
     RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
     CuckooFilter *cf;
     int status = cfGetFilter(key, &cf);
@@ -787,38 +1684,38 @@ static int CFScanDump_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv
         return RedisModule_ReplyWithError(ctx, statusStrerror(status));
     }
 
-    RedisModule_ReplyWithArray(ctx, 2);
     if (!cf->numItems) {
-        RedisModule_ReplyWithLongLong(ctx, 0);
-        RedisModule_ReplyWithNull(ctx);
+        replyScanDumpChunk(ctx, &opts, 0, NULL, 0);
         return REDISMODULE_OK;
     }
 
     // Start
     if (pos == 0) {
-        CFHeader header;
-        fillCFHeader(&header, cf);
-        RedisModule_ReplyWithLongLong(ctx, 1);
-        RedisModule_ReplyWithStringBuffer(ctx, (const char *)&header, sizeof header);
+        size_t hdrlen;
+        char *hdr = CF_GetEncodedHeader(cf, &hdrlen);
+        replyScanDumpChunk(ctx, &opts, 1, hdr, hdrlen);
+        CF_FreeEncodedHeader(hdr);
         return REDISMODULE_OK;
     }
 
     size_t chunkLen;
-    const char *chunk = CF_GetEncodedChunk(cf, &pos, &chunkLen, MAX_SCANDUMP_SIZE);
+    const char *chunk = CF_GetEncodedChunk(cf, &pos, &chunkLen, opts.chunkSize);
     if (chunk == NULL) {
-        RedisModule_ReplyWithLongLong(ctx, 0);
-        RedisModule_ReplyWithNull(ctx);
+        replyScanDumpChunk(ctx, &opts, 0, NULL, 0);
     } else {
-        RedisModule_ReplyWithLongLong(ctx, pos);
-        RedisModule_ReplyWithStringBuffer(ctx, chunk, chunkLen);
+        replyScanDumpChunk(ctx, &opts, pos, chunk, chunkLen);
     }
     return REDISMODULE_OK;
 }
 
+/**
+ * CF.LOADCHUNK <KEY> <ITER> <DATA> [CHECKSUM]
+ * Incrementally loads a cuckoo filter.
+ */
 static int CFLoadChunk_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_AutoMemory(ctx);
 
-    if (argc != 4) {
+    if (argc != 4 && argc != 5) {
         return RedisModule_WrongArity(ctx);
     }
 
@@ -833,17 +1730,18 @@ static int CFLoadChunk_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **arg
     }
     size_t bloblen;
     const char *blob = RedisModule_StringPtrLen(argv[3], &bloblen);
+    if (argc == 5 && checkLoadChunkChecksum(ctx, argv[4], blob, bloblen) != REDISMODULE_OK) {
+        return REDISMODULE_OK;
+    }
 
     if (pos == 1) {
         if (status != SB_EMPTY) {
             return RedisModule_ReplyWithError(ctx, statusStrerror(status));
-        } else if (bloblen != sizeof(CFHeader)) {
-            return RedisModule_ReplyWithError(ctx, "Invalid header");
         }
 
-        cf = CFHeader_Load((CFHeader *)blob);
+        cf = CFHeader_Load(blob, bloblen);
         if (cf == NULL) {
-            return RedisModule_ReplyWithError(ctx, "Couldn't create filter!");
+            return RedisModule_ReplyWithError(ctx, "Invalid header");
         }
         RedisModule_ModuleTypeSetValue(key, CFType, cf);
         return RedisModule_ReplyWithSimpleString(ctx, "OK");
@@ -872,6 +1770,15 @@ uint64_t BFSize(SBChain *bf) {
     for (size_t ii = 0; ii < bf->nfilters; ++ii) {
         bytes += bf->filters[ii].inner.bytes; // * sizeof(unsigned char);
     }
+    if (bf->staging) {
+        bytes += sizeof(*bf->staging) + bf->staging->inner.bytes;
+    }
+    if (bf->stats) {
+        bytes += sizeof(*bf->stats);
+    }
+    if (bf->window) {
+        bytes += sizeof(*bf->window);
+    }
 
     return sizeof(*bf) + sizeof(*bf->filters) * bf->nfilters + sizeof(struct bloom) * bf->nfilters +
            bytes;
@@ -890,7 +1797,7 @@ static int BFInfo_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, in
         return RedisModule_ReplyWithError(ctx, statusStrerror(status));
     }
 
-    RedisModule_ReplyWithArray(ctx, 5 * 2);
+    RedisModule_ReplyWithArray(ctx, (5 + (bf->window ? 1 : 0) + (bf->stats ? 3 : 0)) * 2);
     RedisModule_ReplyWithSimpleString(ctx, "Capacity");
     RedisModule_ReplyWithLongLong(ctx, BFCapacity(bf));
     RedisModule_ReplyWithSimpleString(ctx, "Size");
@@ -902,17 +1809,30 @@ static int BFInfo_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, in
     RedisModule_ReplyWithSimpleString(ctx, "Expansion rate");
     bf->options &BLOOM_OPT_NO_SCALING ? RedisModule_ReplyWithNull(ctx)
                                       : RedisModule_ReplyWithLongLong(ctx, bf->growth);
+    if (bf->window) {
+        RedisModule_ReplyWithSimpleString(ctx, "Generation period");
+        RedisModule_ReplyWithLongLong(ctx, bf->window->period);
+    }
+    if (bf->stats) {
+        RedisModule_ReplyWithSimpleString(ctx, "Lookups");
+        RedisModule_ReplyWithLongLong(ctx, bf->stats->lookups);
+        RedisModule_ReplyWithSimpleString(ctx, "Filters visited");
+        RedisModule_ReplyWithLongLong(ctx, bf->stats->linksVisited);
+        RedisModule_ReplyWithSimpleString(ctx, "Filters added");
+        RedisModule_ReplyWithLongLong(ctx, bf->stats->grows);
+    }
 
     return REDISMODULE_OK;
 }
 
 uint64_t CFSize(CuckooFilter *cf) {
-    uint64_t numBuckets = 0;
+    uint64_t dataSize = 0;
     for (uint16_t ii = 0; ii < cf->numFilters; ++ii) {
-        numBuckets += cf->filters[ii].numBuckets;
+        dataSize += SubCF_DataSize(&cf->filters[ii]);
     }
 
-    return sizeof(*cf) + sizeof(*cf->filters) * cf->numFilters + numBuckets * cf->bucketSize;
+    return sizeof(*cf) + sizeof(*cf->filters) * cf->numFilters + dataSize +
+           (cf->stats ? sizeof(*cf->stats) : 0);
 }
 
 static int CFInfo_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
@@ -928,7 +1848,7 @@ static int CFInfo_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, in
         return RedisModule_ReplyWithError(ctx, statusStrerror(status));
     }
 
-    RedisModule_ReplyWithArray(ctx, 8 * 2);
+    RedisModule_ReplyWithArray(ctx, (cf->stats ? 14 : 9) * 2);
     RedisModule_ReplyWithSimpleString(ctx, "Size");
     RedisModule_ReplyWithLongLong(ctx, CFSize(cf));
     RedisModule_ReplyWithSimpleString(ctx, "Number of buckets");
@@ -945,6 +1865,20 @@ static int CFInfo_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, in
     RedisModule_ReplyWithLongLong(ctx, cf->expansion);
     RedisModule_ReplyWithSimpleString(ctx, "Max iterations");
     RedisModule_ReplyWithLongLong(ctx, cf->maxIterations);
+    RedisModule_ReplyWithSimpleString(ctx, "Fingerprint size");
+    RedisModule_ReplyWithLongLong(ctx, cf->fpSize * 8);
+    if (cf->stats) {
+        RedisModule_ReplyWithSimpleString(ctx, "Lookups");
+        RedisModule_ReplyWithLongLong(ctx, cf->stats->lookups);
+        RedisModule_ReplyWithSimpleString(ctx, "Filters visited");
+        RedisModule_ReplyWithLongLong(ctx, cf->stats->filtersVisited);
+        RedisModule_ReplyWithSimpleString(ctx, "Evictions");
+        RedisModule_ReplyWithLongLong(ctx, cf->stats->evictions);
+        RedisModule_ReplyWithSimpleString(ctx, "Filters added");
+        RedisModule_ReplyWithLongLong(ctx, cf->stats->grows);
+        RedisModule_ReplyWithSimpleString(ctx, "Relocations");
+        RedisModule_ReplyWithLongLong(ctx, cf->stats->relocations);
+    }
 
     return REDISMODULE_OK;
 }
@@ -978,8 +1912,34 @@ static int CFDebug_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, i
 #define BF_MIN_OPTIONS_ENC 2
 #define BF_ENCODING_VERSION 3
 #define BF_MIN_GROWTH_ENC 4
+#define BF_MIN_BLOCKED_ENC 5
+#define BF_MIN_CHUNKED_ENC 6
+#define BF_MIN_WINDOW_ENC 7
+#define BF_MIN_COUNTING_ENC 8
+#define BF_MIN_ZRLE_ENC 9
+#define BF_MIN_STAGING_ENC 10
 
 #define CF_MIN_EXPANSION_VERSION 4
+#define CF_MIN_CHUNKED_ENC 5
+#define CF_MIN_FPSIZE_ENC 6
+#define CF_MIN_SEMISORT_ENC 7
+#define CF_MIN_ZRLE_ENC 8
+#define CF_MIN_COMPACT_ENC 9
+
+static void bfRdbSaveLink(RedisModuleIO *io, const SBLink *lb) {
+    const struct bloom *bm = &lb->inner;
+
+    RedisModule_SaveUnsigned(io, bm->entries);
+    RedisModule_SaveDouble(io, bm->error);
+    RedisModule_SaveUnsigned(io, bm->hashes);
+    RedisModule_SaveDouble(io, bm->bpe);
+    RedisModule_SaveUnsigned(io, bm->bits);
+    RedisModule_SaveUnsigned(io, bm->n2);
+    ZRLE_RdbSave(io, bm->bf, bm->bytes);
+
+    // Save the number of actual entries stored thus far.
+    RedisModule_SaveUnsigned(io, lb->size);
+}
 
 static void BFRdbSave(RedisModuleIO *io, void *obj) {
     // Save the setting!
@@ -989,26 +1949,65 @@ static void BFRdbSave(RedisModuleIO *io, void *obj) {
     RedisModule_SaveUnsigned(io, sb->nfilters);
     RedisModule_SaveUnsigned(io, sb->options);
     RedisModule_SaveUnsigned(io, sb->growth);
+    if (sb->window) {
+        RedisModule_SaveUnsigned(io, sb->window->period);
+        RedisModule_SaveUnsigned(io, sb->window->start);
+        RedisModule_SaveUnsigned(io, sb->window->current);
+    }
 
     for (size_t ii = 0; ii < sb->nfilters; ++ii) {
-        const SBLink *lb = sb->filters + ii;
-        const struct bloom *bm = &lb->inner;
+        bfRdbSaveLink(io, sb->filters + ii);
+    }
+    // A consolidation in progress follows the links
+    RedisModule_SaveUnsigned(io, sb->staging != NULL);
+    if (sb->staging) {
+        bfRdbSaveLink(io, sb->staging);
+    }
+}
 
-        RedisModule_SaveUnsigned(io, bm->entries);
-        RedisModule_SaveDouble(io, bm->error);
-        RedisModule_SaveUnsigned(io, bm->hashes);
-        RedisModule_SaveDouble(io, bm->bpe);
-        RedisModule_SaveUnsigned(io, bm->bits);
-        RedisModule_SaveUnsigned(io, bm->n2);
-        RedisModule_SaveStringBuffer(io, (const char *)bm->bf, bm->bytes);
+// Returns 0 on success, -1 if the link is corrupt
+static int bfRdbLoadLink(RedisModuleIO *io, int encver, unsigned options, SBLink *lb) {
+    struct bloom *bm = &lb->inner;
 
-        // Save the number of actual entries stored thus far.
-        RedisModule_SaveUnsigned(io, lb->size);
+    bm->entries = RedisModule_LoadUnsigned(io);
+    bm->error = RedisModule_LoadDouble(io);
+    bm->hashes = RedisModule_LoadUnsigned(io);
+    bm->bpe = RedisModule_LoadDouble(io);
+    if (encver == 0) {
+        bm->bits = (double)bm->entries * bm->bpe;
+    } else {
+        bm->bits = RedisModule_LoadUnsigned(io);
+        bm->n2 = RedisModule_LoadUnsigned(io);
+    }
+    if (options & BLOOM_OPT_FORCE64) {
+        bm->force64 = 1;
     }
+    if (options & BLOOM_OPT_BLOCKED) {
+        bm->blocked = 1;
+    }
+    if (options & BLOOM_OPT_COUNTING) {
+        bm->counting = 1;
+    }
+    size_t sztmp;
+    if (encver >= BF_MIN_CHUNKED_ENC) {
+        bm->bf = ZRLE_RdbLoad(io, &sztmp, encver >= BF_MIN_ZRLE_ENC);
+        if (!bm->bf) {
+            return -1; // LCOV_EXCL_LINE corrupt data
+        }
+    } else {
+        bm->bf = (unsigned char *)RedisModule_LoadStringBuffer(io, &sztmp);
+    }
+    bm->bytes = sztmp;
+    lb->size = RedisModule_LoadUnsigned(io);
+    // Counting links are looked up by `bits`, check it against the buffer
+    if (bm->counting && bm->bits != bm->bytes * 8 / BLOOM_COUNTER_BITS) {
+        return -1; // LCOV_EXCL_LINE corrupt data
+    }
+    return 0;
 }
 
 static void *BFRdbLoad(RedisModuleIO *io, int encver) {
-    if (encver > BF_MIN_GROWTH_ENC) {
+    if (encver > BF_MIN_STAGING_ENC) {
         return NULL;
     }
 
@@ -1024,34 +2023,42 @@ static void *BFRdbLoad(RedisModuleIO *io, int encver) {
     } else {
         sb->growth = 2;
     }
+    if (encver >= BF_MIN_WINDOW_ENC && (sb->options & SB_OPT_WINDOW)) {
+        sb->window = RedisModule_Calloc(1, sizeof(*sb->window));
+        sb->window->period = RedisModule_LoadUnsigned(io);
+        sb->window->start = RedisModule_LoadUnsigned(io);
+        sb->window->current = RedisModule_LoadUnsigned(io);
+    }
 
     // Sanity:
     assert(sb->nfilters < 1000);
+    if (sb->window && (sb->window->period == 0 || sb->window->current >= sb->nfilters)) {
+        sb->nfilters = 0; // LCOV_EXCL_LINE corrupt data
+        SBChain_Free(sb); // LCOV_EXCL_LINE
+        return NULL;      // LCOV_EXCL_LINE
+    }
     sb->filters = RedisModule_Calloc(sb->nfilters, sizeof(*sb->filters));
 
     for (size_t ii = 0; ii < sb->nfilters; ++ii) {
-        SBLink *lb = sb->filters + ii;
-        struct bloom *bm = &lb->inner;
-
-        bm->entries = RedisModule_LoadUnsigned(io);
-        bm->error = RedisModule_LoadDouble(io);
-        bm->hashes = RedisModule_LoadUnsigned(io);
-        bm->bpe = RedisModule_LoadDouble(io);
-        if (encver == 0) {
-            bm->bits = (double)bm->entries * bm->bpe;
-        } else {
-            bm->bits = RedisModule_LoadUnsigned(io);
-            bm->n2 = RedisModule_LoadUnsigned(io);
+        if (bfRdbLoadLink(io, encver, sb->options, sb->filters + ii) != 0) {
+            SBChain_Free(sb); // LCOV_EXCL_LINE corrupt data
+            return NULL;      // LCOV_EXCL_LINE
         }
-        if (sb->options & BLOOM_OPT_FORCE64) {
-            bm->force64 = 1;
+    }
+
+    if (encver >= BF_MIN_STAGING_ENC && RedisModule_LoadUnsigned(io)) {
+        sb->staging = RedisModule_Calloc(1, sizeof(*sb->staging));
+        // Consolidation is refused for these chains, see SBChain_StageBegin
+        if (bfRdbLoadLink(io, encver, sb->options, sb->staging) != 0 || sb->window ||
+            (sb->options & BLOOM_OPT_COUNTING) || sb->staging->inner.bits == 0 ||
+            sb->staging->inner.bits > sb->staging->inner.bytes * 8) {
+            SBChain_Free(sb); // LCOV_EXCL_LINE corrupt data
+            return NULL;      // LCOV_EXCL_LINE
         }
-        size_t sztmp;
-        bm->bf = (unsigned char *)RedisModule_LoadStringBuffer(io, &sztmp);
-        bm->bytes = sztmp;
-        lb->size = RedisModule_LoadUnsigned(io);
     }
 
+    SBChain_Touch(sb);
+    SBChain_UpdateProbes(sb);
     return sb;
 }
 
@@ -1062,10 +2069,30 @@ static void BFAofRewrite(RedisModuleIO *aof, RedisModuleString *key, void *value
     RedisModule_EmitAOF(aof, "BF.LOADCHUNK", "slb", key, 1, hdr, len);
     SB_FreeEncodedHeader(hdr);
 
+    // Chunks are loaded by position into zeroed links, all-zero ones are left out
     long long iter = SB_CHUNKITER_INIT;
     const char *chunk;
     while ((chunk = SBChain_GetEncodedChunk(sb, &iter, &len, MAX_SCANDUMP_SIZE)) != NULL) {
-        RedisModule_EmitAOF(aof, "BF.LOADCHUNK", "slb", key, iter, chunk, len);
+        if (!ZRLE_IsZero(chunk, len)) {
+            RedisModule_EmitAOF(aof, "BF.LOADCHUNK", "slb", key, iter, chunk, len);
+        }
+    }
+
+    // Then a consolidation in progress, zeroed in the same way
+    char *staging = SBChain_GetEncodedStaging(sb, &len);
+    if (!staging) {
+        return;
+    }
+    RedisModule_EmitAOF(aof, "BF.CONSOLIDATE", "scb", key, "RESTORE", staging, len);
+    SB_FreeEncodedHeader(staging);
+    const struct bloom *bm = &sb->staging->inner;
+    for (size_t offset = 0; offset < bm->bytes; offset += len) {
+        chunk = (const char *)bm->bf + offset;
+        len = bm->bytes - offset < MAX_SCANDUMP_SIZE ? bm->bytes - offset : MAX_SCANDUMP_SIZE;
+        if (!ZRLE_IsZero(chunk, len)) {
+            RedisModule_EmitAOF(aof, "BF.CONSOLIDATE", "sclb", key, "RESTORE", (long long)offset,
+                                chunk, len);
+        }
     }
 }
 
@@ -1078,6 +2105,18 @@ static size_t BFMemUsage(const void *value) {
         rv += sizeof(*sb->filters);
         rv += sb->filters[ii].inner.bytes;
     }
+    if (sb->staging) {
+        rv += sizeof(*sb->staging) + sb->staging->inner.bytes;
+    }
+    if (sb->stats) {
+        rv += sizeof(*sb->stats);
+    }
+    if (sb->window) {
+        rv += sizeof(*sb->window);
+    }
+    if (sb->reserve) {
+        rv += Reserve_Size(sb->reserve);
+    }
     return rv;
 }
 
@@ -1095,16 +2134,19 @@ static void CFRdbSave(RedisModuleIO *io, void *obj) {
     RedisModule_SaveUnsigned(io, cf->bucketSize);
     RedisModule_SaveUnsigned(io, cf->maxIterations);
     RedisModule_SaveUnsigned(io, cf->expansion);
+    RedisModule_SaveUnsigned(io, cf->fpSize);
+    RedisModule_SaveUnsigned(io, cf->semiSort);
+    RedisModule_SaveUnsigned(io, cf->compactFilter);
+    RedisModule_SaveUnsigned(io, cf->compactDirty);
+    RedisModule_SaveUnsigned(io, cf->compactBucket);
     for (size_t ii = 0; ii < cf->numFilters; ++ii) {
         RedisModule_SaveUnsigned(io, cf->filters[ii].numBuckets);
-        RedisModule_SaveStringBuffer(io, (char *)cf->filters[ii].data,
-                                     cf->filters[ii].bucketSize * cf->filters[ii].numBuckets *
-                                         sizeof(*cf->filters[ii].data));
+        ZRLE_RdbSave(io, cf->filters[ii].data, SubCF_DataSize(&cf->filters[ii]));
     }
 }
 
 static void *CFRdbLoad(RedisModuleIO *io, int encver) {
-    if (encver > CF_MIN_EXPANSION_VERSION) {
+    if (encver > CF_MIN_COMPACT_ENC) {
         return NULL;
     }
     /* RDBCF
@@ -1132,10 +2174,35 @@ static void *CFRdbLoad(RedisModuleIO *io, int encver) {
         cf->maxIterations = RedisModule_LoadUnsigned(io);
         cf->expansion = RedisModule_LoadUnsigned(io);
     }
+    cf->fpSize = CUCKOO_DEFAULT_FPSIZE;
+    if (encver >= CF_MIN_FPSIZE_ENC) {
+        cf->fpSize = RedisModule_LoadUnsigned(io);
+    }
+    cf->semiSort = 0;
+    if (encver >= CF_MIN_SEMISORT_ENC) {
+        cf->semiSort = RedisModule_LoadUnsigned(io);
+    }
+    // Replicas go on with the compaction from the same bucket
+    uint64_t compactFilter = 0, compactDirty = 0, compactBucket = 0;
+    if (encver >= CF_MIN_COMPACT_ENC) {
+        compactFilter = RedisModule_LoadUnsigned(io);
+        compactDirty = RedisModule_LoadUnsigned(io);
+        compactBucket = RedisModule_LoadUnsigned(io);
+    }
+    // The bucket layout sizes the data below, check it as CFHeader_Load does
+    if (cf->bucketSize == 0 || cf->expansion == 0 || cf->numBuckets == 0 ||
+        !CuckooFilter_ValidFpSize(cf->fpSize) || cf->semiSort > 1 ||
+        (cf->semiSort && !CuckooFilter_ValidSemiSort(cf->bucketSize, cf->fpSize)) ||
+        compactFilter >= cf->numFilters || compactDirty > 1) {
+        RedisModule_Free(cf); // LCOV_EXCL_LINE corrupt data
+        return NULL;          // LCOV_EXCL_LINE
+    }
 
     cf->filters = RedisModule_Calloc(cf->numFilters, sizeof(*cf->filters));
     for (size_t ii = 0, exp = 1; ii < cf->numFilters; ++ii, exp *= cf->expansion) {
         cf->filters[ii].bucketSize = cf->bucketSize;
+        cf->filters[ii].fpSize = cf->fpSize;
+        cf->filters[ii].semiSort = cf->semiSort;
 
         if (encver < CF_MIN_EXPANSION_VERSION) {
             cf->filters[ii].numBuckets = cf->numBuckets;
@@ -1143,11 +2210,31 @@ static void *CFRdbLoad(RedisModuleIO *io, int encver) {
             cf->filters[ii].numBuckets = RedisModule_LoadUnsigned(io);
         }
 
+        size_t expected = SubCF_DataSize(&cf->filters[ii]);
         size_t lenDummy = 0;
-        cf->filters[ii].data = (MyCuckooBucket *)RedisModule_LoadStringBuffer(io, &lenDummy);
-        assert(cf->filters[ii].data != NULL && lenDummy == cf->filters[ii].bucketSize *
-                                                               cf->filters[ii].numBuckets *
-                                                               sizeof(*cf->filters[ii].data));
+        if (encver >= CF_MIN_CHUNKED_ENC) {
+            cf->filters[ii].data = ZRLE_RdbLoad(io, &lenDummy, encver >= CF_MIN_ZRLE_ENC);
+            if (!cf->filters[ii].data || lenDummy != expected) {
+                RedisModule_Free(cf->filters[ii].data); // LCOV_EXCL_LINE corrupt data
+                cf->numFilters = ii;                    // LCOV_EXCL_LINE
+                CuckooFilter_Free(cf);                  // LCOV_EXCL_LINE
+                RedisModule_Free(cf);                   // LCOV_EXCL_LINE
+                return NULL;                            // LCOV_EXCL_LINE
+            }
+        } else {
+            cf->filters[ii].data = (MyCuckooBucket *)RedisModule_LoadStringBuffer(io, &lenDummy);
+            assert(cf->filters[ii].data != NULL && lenDummy == expected);
+        }
+    }
+    if (compactFilter) {
+        if (compactBucket > cf->filters[compactFilter].numBuckets) {
+            CuckooFilter_Free(cf); // LCOV_EXCL_LINE corrupt data
+            RedisModule_Free(cf);  // LCOV_EXCL_LINE
+            return NULL;           // LCOV_EXCL_LINE
+        }
+        cf->compactFilter = compactFilter;
+        cf->compactDirty = compactDirty;
+        cf->compactBucket = compactBucket;
     }
     return cf;
 }
@@ -1157,27 +2244,52 @@ static size_t CFMemUsage(const void *value) {
 
     size_t filtersSize = 0;
     for (size_t ii = 0; ii < cf->numFilters; ++ii) {
-        filtersSize +=
-            cf->filters[ii].bucketSize * cf->filters[ii].numBuckets * sizeof(*cf->filters[ii].data);
+        filtersSize += SubCF_DataSize(&cf->filters[ii]);
     }
 
-    return sizeof(*cf) + sizeof(*cf->filters) * cf->numFilters + filtersSize;
+    return sizeof(*cf) + sizeof(*cf->filters) * cf->numFilters + filtersSize +
+           (cf->stats ? sizeof(*cf->stats) : 0) + (cf->reserve ? Reserve_Size(cf->reserve) : 0);
 }
 
 static void CFAofRewrite(RedisModuleIO *aof, RedisModuleString *key, void *obj) {
     CuckooFilter *cf = obj;
     const char *chunk;
     size_t nchunk;
-    CFHeader header;
-    fillCFHeader(&header, cf);
+    size_t hdrlen;
+    char *hdr = CF_GetEncodedHeader(cf, &hdrlen);
 
     long long pos = 1;
-    RedisModule_EmitAOF(aof, "CF.LOADCHUNK", "slb", key, pos, (const char *)&header, sizeof header);
+    RedisModule_EmitAOF(aof, "CF.LOADCHUNK", "slb", key, pos, hdr, hdrlen);
+    CF_FreeEncodedHeader(hdr);
+    // As for Bloom filters, the sub-filters of the header are zeroed
     while ((chunk = CF_GetEncodedChunk(cf, &pos, &nchunk, MAX_SCANDUMP_SIZE))) {
-        RedisModule_EmitAOF(aof, "CF.LOADCHUNK", "slb", key, pos, chunk, nchunk);
+        if (!ZRLE_IsZero(chunk, nchunk)) {
+            RedisModule_EmitAOF(aof, "CF.LOADCHUNK", "slb", key, pos, chunk, nchunk);
+        }
     }
 }
 
+// Totals of the filters and sketches with stats, listed by INFO in the "bf_stats" section
+static void statsInfo(RedisModuleInfoCtx *ctx, int for_crash_report) {
+    RedisModule_InfoAddSection(ctx, "stats");
+#define ADD_TOTAL(name, value)                                                                     \
+    RedisModule_InfoAddFieldULongLong(ctx, name, __atomic_load_n(&(value), __ATOMIC_RELAXED))
+    ADD_TOTAL("bf_lookups", sbTotalStats.lookups);
+    ADD_TOTAL("bf_filters_visited", sbTotalStats.linksVisited);
+    ADD_TOTAL("bf_filters_added", sbTotalStats.grows);
+    ADD_TOTAL("cf_lookups", cuckooTotalStats.lookups);
+    ADD_TOTAL("cf_filters_visited", cuckooTotalStats.filtersVisited);
+    ADD_TOTAL("cf_evictions", cuckooTotalStats.evictions);
+    ADD_TOTAL("cf_filters_added", cuckooTotalStats.grows);
+    ADD_TOTAL("cf_relocations", cuckooTotalStats.relocations);
+    ADD_TOTAL("cms_increments", cmsTotalStats.increments);
+    ADD_TOTAL("cms_queries", cmsTotalStats.queries);
+    ADD_TOTAL("topk_adds", topkTotalStats.adds);
+    ADD_TOTAL("topk_heap_replacements", topkTotalStats.heapReplacements);
+    ADD_TOTAL("topk_decrements", topkTotalStats.decrements);
+#undef ADD_TOTAL
+}
+
 static int rsStrcasecmp(const RedisModuleString *rs1, const char *s2) {
     size_t n1 = strlen(s2);
     size_t n2;
@@ -1214,6 +2326,8 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
         BAIL("Invalid number of arguments passed", NULL);
     }
 
+    SIMD_Init();
+
     for (int ii = 0; ii < argc; ii += 2) {
         if (!rsStrcasecmp(argv[ii], "initial_size")) {
             long long v;
@@ -1240,11 +2354,73 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
                 BAIL("Invalid argument for 'CF_MAX_EXPANSIONS'", NULL);
             }
             CFMaxExpansions = l;
+        } else if (!rsStrcasecmp(argv[ii], "cms_async_merge")) {
+            long long l;
+            if (RedisModule_StringToLongLong(argv[ii + 1], &l) == REDISMODULE_ERR || l < 0) {
+                BAIL("Invalid argument for 'CMS_ASYNC_MERGE'", NULL);
+            }
+            CMSAsyncMergeCells = l;
+        } else if (!rsStrcasecmp(argv[ii], "bf_async_merge")) {
+            long long l;
+            if (RedisModule_StringToLongLong(argv[ii + 1], &l) == REDISMODULE_ERR || l < 0) {
+                BAIL("Invalid argument for 'BF_ASYNC_MERGE'", NULL);
+            }
+            BFAsyncMergeBytes = l;
+        } else if (!rsStrcasecmp(argv[ii], "grow_reserve")) {
+            long long l;
+            if (RedisModule_StringToLongLong(argv[ii + 1], &l) == REDISMODULE_ERR || l < 0 ||
+                l > 100) {
+                BAIL("Invalid argument for 'GROW_RESERVE'", NULL);
+            }
+            reserveThreshold = l;
+        } else if (!rsStrcasecmp(argv[ii], "cf_eviction")) {
+            if (!rsStrcasecmp(argv[ii + 1], "walk")) {
+                cuckooEviction = CuckooEviction_Walk;
+            } else if (!rsStrcasecmp(argv[ii + 1], "bfs")) {
+                cuckooEviction = CuckooEviction_BFS;
+            } else {
+                BAIL("CF_EVICTION must be 'walk' or 'bfs'", NULL);
+            }
+        } else if (!rsStrcasecmp(argv[ii], "read_threads")) {
+            long long l;
+            if (RedisModule_StringToLongLong(argv[ii + 1], &l) == REDISMODULE_ERR || l < 0 ||
+                l > READ_THREADS_MAX) {
+                BAIL("Invalid argument for 'READ_THREADS'", NULL);
+            }
+            if (l > 0 && Workers_Init(l) != 0) {
+                BAIL("Could not start the read threads", NULL); // LCOV_EXCL_LINE
+            }
+        } else if (!rsStrcasecmp(argv[ii], "bf_mmap_dir")) {
+            struct stat st;
+            free(BFMmapDir);
+            BFMmapDir = realpath(RedisModule_StringPtrLen(argv[ii + 1], NULL), NULL);
+            if (!BFMmapDir || stat(BFMmapDir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+                BAIL("Invalid directory for 'BF_MMAP_DIR'", NULL);
+            }
+        } else if (!rsStrcasecmp(argv[ii], "stats")) {
+            if (!rsStrcasecmp(argv[ii + 1], "yes")) {
+                BFCollectStats = CMSCollectStats = TopKCollectStats = 1;
+            } else if (!rsStrcasecmp(argv[ii + 1], "no")) {
+                BFCollectStats = CMSCollectStats = TopKCollectStats = 0;
+            } else {
+                BAIL("STATS must be 'yes' or 'no'", NULL);
+            }
+        } else if (!rsStrcasecmp(argv[ii], "simd")) {
+            if (SIMD_Select(RedisModule_StringPtrLen(argv[ii + 1], NULL)) != 0) {
+                BAIL("Invalid or unsupported argument for 'SIMD'", NULL);
+            }
         } else {
             BAIL("Unrecognized option", NULL);
         }
     }
 
+    RedisModule_Log(ctx, "notice", "Using %s probe kernels", SIMD_Name());
+
+    // Only available since Redis 6
+    if (BFCollectStats && RedisModule_RegisterInfoFunc) {
+        RedisModule_RegisterInfoFunc(ctx, statsInfo);
+    }
+
 #define CREATE_CMD(name, tgt, attr)                                                                \
     do {                                                                                           \
         if (RedisModule_CreateCommand(ctx, name, tgt, attr, 1, 1, 1) != REDISMODULE_OK) {          \
@@ -1258,6 +2434,10 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
     CREATE_WRCMD("bf.add", BFAdd_RedisCommand);
     CREATE_WRCMD("bf.madd", BFAdd_RedisCommand);
     CREATE_WRCMD("bf.insert", BFInsert_RedisCommand);
+    CREATE_WRCMD("bf.consolidate", BFConsolidate_RedisCommand);
+    CREATE_CMD("bf.del", BFDel_RedisCommand, "write fast");
+    CREATE_CMD("bf.advance", BFAdvance_RedisCommand, "write fast");
+    CREATE_WRCMD("bf.merge", BFMerge_RedisCommand);
     CREATE_ROCMD("bf.exists", BFCheck_RedisCommand);
     CREATE_ROCMD("bf.mexists", BFCheck_RedisCommand);
     CREATE_ROCMD("bf.info", BFInfo_RedisCommand);
@@ -1268,6 +2448,7 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
     // Bloom - AOF
     CREATE_ROCMD("bf.scandump", BFScanDump_RedisCommand);
     CREATE_WRCMD("bf.loadchunk", BFLoadChunk_RedisCommand);
+    CREATE_CMD("bf.mmap", BFMmap_RedisCommand, "write");
 
     // Cuckoo Filter commands
     CREATE_WRCMD("cf.reserve", CFReserve_RedisCommand);
@@ -1299,7 +2480,7 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
                                                .aof_rewrite = BFAofRewrite,
                                                .free = BFFree,
                                                .mem_usage = BFMemUsage};
-    BFType = RedisModule_CreateDataType(ctx, "MBbloom--", BF_MIN_GROWTH_ENC, &typeprocs);
+    BFType = RedisModule_CreateDataType(ctx, "MBbloom--", BF_MIN_STAGING_ENC, &typeprocs);
     if (BFType == NULL) {
         return REDISMODULE_ERR;
     }
@@ -1310,7 +2491,7 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
                                                  .aof_rewrite = CFAofRewrite,
                                                  .free = CFFree,
                                                  .mem_usage = CFMemUsage};
-    CFType = RedisModule_CreateDataType(ctx, "MBbloomCF", CF_MIN_EXPANSION_VERSION, &cfTypeProcs);
+    CFType = RedisModule_CreateDataType(ctx, "MBbloomCF", CF_MIN_COMPACT_ENC, &cfTypeProcs);
     if (CFType == NULL) {
         return REDISMODULE_ERR;
     }
@@ -0,0 +1,175 @@
+#include "reserve.h"
+#include "redismodule.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define RESERVE_HUGE_PAGE (2 << 20)
+
+typedef enum {
+    Reserve_Queued,
+    Reserve_Running,
+    Reserve_Ready,
+    Reserve_Cancelled, // Released while running: freed by the thread
+} ReserveState;
+
+struct Reserve {
+    size_t bytes;
+    void *buf;
+    ReserveState state;
+    Reserve *next; // Queue of the reservations to allocate
+};
+
+unsigned reserveThreshold = 0;
+
+static pthread_mutex_t reserveLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reserveWake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t reserveDone = PTHREAD_COND_INITIALIZER;
+static Reserve *queueHead, *queueTail;
+static int threadStarted;
+
+// Fault the pages in now rather than on the first adds to the sub-filter,
+// asking for huge pages first on the part of the buffer they can cover
+static void prefault(unsigned char *buf, size_t bytes) {
+#ifdef MADV_HUGEPAGE
+    if (bytes >= 2 * RESERVE_HUGE_PAGE) {
+        const uintptr_t mask = ~(uintptr_t)(RESERVE_HUGE_PAGE - 1);
+        uintptr_t begin = ((uintptr_t)buf + RESERVE_HUGE_PAGE - 1) & mask;
+        uintptr_t end = ((uintptr_t)buf + bytes) & mask;
+        madvise((void *)begin, end - begin, MADV_HUGEPAGE); // Only a hint
+    }
+#endif
+    long page = sysconf(_SC_PAGESIZE);
+    if (page <= 0) {
+        page = 4096; // LCOV_EXCL_LINE
+    }
+    for (size_t off = 0; off < bytes; off += page) {
+        ((volatile unsigned char *)buf)[off] = 0;
+    }
+}
+
+static void *reserveMain(void *unused) {
+    (void)unused;
+    pthread_mutex_lock(&reserveLock);
+    for (;;) {
+        while (!queueHead) {
+            pthread_cond_wait(&reserveWake, &reserveLock);
+        }
+        Reserve *r = queueHead;
+        queueHead = r->next;
+        if (!queueHead) {
+            queueTail = NULL;
+        }
+        r->state = Reserve_Running;
+        pthread_mutex_unlock(&reserveLock);
+
+        void *buf = RedisModule_Calloc(r->bytes, 1);
+        if (buf) {
+            prefault(buf, r->bytes);
+        }
+
+        pthread_mutex_lock(&reserveLock);
+        if (r->state == Reserve_Cancelled) {
+            RedisModule_Free(buf);
+            RedisModule_Free(r);
+        } else {
+            r->buf = buf;
+            r->state = Reserve_Ready;
+            pthread_cond_broadcast(&reserveDone);
+        }
+    }
+    return NULL;
+}
+
+Reserve *Reserve_Start(size_t bytes) {
+    Reserve *r = RedisModule_Calloc(1, sizeof(*r));
+    if (!r) {
+        return NULL; // LCOV_EXCL_LINE memory failure
+    }
+    r->bytes = bytes;
+    r->state = Reserve_Queued;
+
+    pthread_mutex_lock(&reserveLock);
+    if (!threadStarted) {
+        pthread_t tid;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        threadStarted = pthread_create(&tid, &attr, reserveMain, NULL) == 0;
+        pthread_attr_destroy(&attr);
+        if (!threadStarted) {
+            pthread_mutex_unlock(&reserveLock); // LCOV_EXCL_START
+            RedisModule_Free(r);
+            return NULL; // LCOV_EXCL_STOP
+        }
+    }
+    if (queueTail) {
+        queueTail->next = r;
+    } else {
+        queueHead = r;
+    }
+    queueTail = r;
+    pthread_cond_signal(&reserveWake);
+    pthread_mutex_unlock(&reserveLock);
+    return r;
+}
+
+size_t Reserve_Size(const Reserve *r) { return r->bytes; }
+
+// Takes the reservation out of the queue. Called with the lock held
+static void unqueue(Reserve *r) {
+    Reserve *prev = NULL;
+    for (Reserve *cur = queueHead; cur != r; cur = cur->next) {
+        prev = cur;
+    }
+    if (prev) {
+        prev->next = r->next;
+    } else {
+        queueHead = r->next;
+    }
+    if (queueTail == r) {
+        queueTail = prev;
+    }
+}
+
+void *Reserve_Take(Reserve *r, size_t bytes) {
+    void *buf = NULL;
+    pthread_mutex_lock(&reserveLock);
+    if (r->state == Reserve_Queued) {
+        unqueue(r);
+    } else {
+        while (r->state == Reserve_Running) {
+            pthread_cond_wait(&reserveDone, &reserveLock);
+        }
+        buf = r->buf;
+    }
+    pthread_mutex_unlock(&reserveLock);
+
+    if (buf && r->bytes != bytes) {
+        RedisModule_Free(buf);
+        buf = NULL;
+    }
+    RedisModule_Free(r);
+    return buf;
+}
+
+void Reserve_Cancel(Reserve *r) {
+    if (!r) {
+        return;
+    }
+    pthread_mutex_lock(&reserveLock);
+    ReserveState state = r->state;
+    if (state == Reserve_Queued) {
+        unqueue(r);
+    } else if (state == Reserve_Running) {
+        r->state = Reserve_Cancelled;
+    }
+    pthread_mutex_unlock(&reserveLock);
+
+    if (state != Reserve_Running) {
+        RedisModule_Free(r->buf);
+        RedisModule_Free(r);
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef REDISBLOOM_RESERVE_H
+#define REDISBLOOM_RESERVE_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Zeroed buffers allocated ahead of time by a background thread, so that a
+ * filter outgrowing its capacity does not stall the command adding to it while
+ * the memory of the new sub-filter is allocated, zeroed and faulted in.
+ * Buffers come from RedisModule_Calloc, and large ones are backed by huge
+ * pages where the system supports it.
+ *
+ * A reservation belongs to a single filter and is only used by the thread
+ * owning it; the background thread is started by the first reservation.
+ */
+typedef struct Reserve Reserve;
+
+/**
+ * Percentage of its capacity at which a filter reserves its next sub-filter,
+ * 0 (the default) to only allocate it when needed
+ */
+extern unsigned reserveThreshold;
+
+/** Queue the allocation of `bytes` zeroed bytes. Returns NULL on failure */
+Reserve *Reserve_Start(size_t bytes);
+
+/** Number of bytes held by the reservation */
+size_t Reserve_Size(const Reserve *r);
+
+/**
+ * Release the reservation, returning its buffer if it holds `bytes` bytes.
+ * Waits for the buffer if it is being allocated, and returns NULL if the
+ * allocation has not started yet, failed, or is of another size: the caller
+ * then allocates the buffer itself.
+ */
+void *Reserve_Take(Reserve *r, size_t bytes);
+
+/** Release the reservation and its buffer. Accepts NULL */
+void Reserve_Cancel(Reserve *r);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -1,4 +1,5 @@
 #include <math.h>    // ceil, log10f
+#include <pthread.h>
 #include <stdlib.h>  // malloc
 #include <strings.h> // strncasecmp
 
@@ -7,6 +8,8 @@
 
 #include "cms.h"
 #include "rm_cms.h"
+#include "sketch_index.h"
+#include "zrle.h"
 
 #define INNER_ERROR(x)                                                                             \
     RedisModule_ReplyWithError(ctx, x);                                                            \
@@ -14,6 +17,15 @@
 
 RedisModuleType *CMSketchType;
 
+// Stamps are drawn from a module-wide clock rather than counted per sketch, so that a
+// sketch replacing another under the same key never has the same stamp
+static uint64_t cmsStampClock;
+
+/* Marks a write to `cms`, for asynchronous merges to notice their sources changed */
+static void touchSketch(CMSketch *cms) { cms->stamp = ++cmsStampClock; }
+long long CMSAsyncMergeCells = 0;
+int CMSCollectStats = 0;
+
 typedef struct {
     const char *key;
     size_t keylen;
@@ -29,11 +41,20 @@ static int GetCMSKey(RedisModuleCtx *ctx, RedisModuleString *keyName, CMSketch *
         INNER_ERROR(REDISMODULE_ERRORMSG_WRONGTYPE);
     }
     *cms = RedisModule_ModuleTypeGetValue(key);
+    if (CMSCollectStats) {
+        CMS_EnableStats(*cms);
+    }
     return REDISMODULE_OK;
 }
 
+typedef struct {
+    int indexMode;
+    int counterSize;
+    int conservative;
+} CMSCreateOptions;
+
 static int parseCreateArgs(RedisModuleCtx *ctx, RedisModuleString **argv, int argc,
-                           long long *width, long long *depth) {
+                           long long *width, long long *depth, CMSCreateOptions *opts) {
 
     size_t cmdlen;
     const char *cmd = RedisModule_StringPtrLen(argv[0], &cmdlen);
@@ -57,17 +78,39 @@ static int parseCreateArgs(RedisModuleCtx *ctx, RedisModuleString **argv, int ar
         CMS_DimFromProb(overEst, prob, (size_t *)width, (size_t *)depth);
     }
 
+    *opts = (CMSCreateOptions){
+        .indexMode = SKETCH_INDEX_MOD, .counterSize = sizeof(uint32_t), .conservative = 0};
+    for (int i = 4; i < argc; ++i) {
+        const char *opt = RedisModule_StringPtrLen(argv[i], NULL);
+        long long bits;
+        if (strcasecmp(opt, "CONSERVATIVE") == 0) {
+            opts->conservative = 1;
+        } else if (strcasecmp(opt, "COUNTER") == 0) {
+            if (++i == argc || RedisModule_StringToLongLong(argv[i], &bits) != REDISMODULE_OK ||
+                (bits != 16 && bits != 32 && bits != 64)) {
+                INNER_ERROR("CMS: counter width must be 16, 32 or 64");
+            }
+            opts->counterSize = bits / 8;
+        } else if ((opts->indexMode = Sketch_ParseIndexMode(opt)) < 0) {
+            INNER_ERROR("CMS: invalid option");
+        }
+    }
+    if (Sketch_IndexWidth(opts->indexMode, (size_t *)width) != 0) {
+        INNER_ERROR("CMS: width too large for index mode");
+    }
+
     return REDISMODULE_OK;
 }
 
 int CMSketch_Create(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_AutoMemory(ctx);
-    if (argc != 4) {
+    if (argc < 4) {
         return RedisModule_WrongArity(ctx);
     }
 
     CMSketch *cms = NULL;
     long long width = 0, depth = 0;
+    CMSCreateOptions opts;
     RedisModuleString *keyName = argv[1];
     RedisModuleKey *key = RedisModule_OpenKey(ctx, keyName, REDISMODULE_READ | REDISMODULE_WRITE);
 
@@ -76,10 +119,13 @@ int CMSketch_Create(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
         return RedisModule_ReplyWithError(ctx, "CMS: key already exists");
     }
 
-    if (parseCreateArgs(ctx, argv, argc, &width, &depth) != REDISMODULE_OK)
+    if (parseCreateArgs(ctx, argv, argc, &width, &depth, &opts) != REDISMODULE_OK)
         return REDISMODULE_OK;
 
-    cms = NewCMSketch(width, depth);
+    cms = NewCMSketchWithCounter(width, depth, opts.counterSize);
+    cms->indexMode = opts.indexMode;
+    cms->conservative = opts.conservative;
+    touchSketch(cms);
     RedisModule_ModuleTypeSetValue(key, CMSketchType, cms);
 
     RedisModule_CloseKey(key);
@@ -124,6 +170,7 @@ int CMSketch_IncrBy(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
         size_t count = CMS_IncrBy(cms, pairArray[i].key, pairArray[i].keylen, pairArray[i].value);
         RedisModule_ReplyWithLongLong(ctx, (long long)count);
     }
+    touchSketch(cms);
 
     CMS_FREE(pairArray);
     RedisModule_CloseKey(key);
@@ -162,7 +209,7 @@ static int parseMergeArgs(RedisModuleCtx *ctx, RedisModuleString **argv, int arg
             INNER_ERROR("CMS: wrong number of keys");
         }
     } else {
-        if ((pos != 3 + numKeys) && (argc != 4 + numKeys * 2)) {
+        if ((pos != 3 + numKeys) || (argc != 4 + numKeys * 2)) {
             INNER_ERROR("CMS: wrong number of keys/weights");
         }
     }
@@ -189,8 +236,190 @@ static int parseMergeArgs(RedisModuleCtx *ctx, RedisModuleString **argv, int arg
         if (params->cmsArray[i]->width != width || params->cmsArray[i]->depth != depth) {
             INNER_ERROR("CMS: width/depth is not equal");
         }
+        if (params->cmsArray[i]->indexMode != params->dest->indexMode ||
+            params->cmsArray[i]->hashMode != params->dest->hashMode) {
+            INNER_ERROR("CMS: index/hash mode is not equal");
+        }
+        if (params->cmsArray[i]->counterSize != params->dest->counterSize) {
+            INNER_ERROR("CMS: counter width is not equal");
+        }
+    }
+
+    return REDISMODULE_OK;
+}
+
+/* Number of source counters read while holding the GIL during an asynchronous merge */
+#define CMS_ASYNC_MERGE_SLICE (1 << 22)
+
+typedef struct {
+    RedisModuleBlockedClient *bc;
+    int dbid;
+    int argc;
+    RedisModuleString **argv;
+    long long numKeys;
+    long long *weights;
+    CMSketch **cmsArray;
+    uint64_t *stamps; // Of the sources when the first slice was merged
+    size_t width;
+    size_t depth;
+    int indexMode;
+    int hashMode;
+    int counterSize;
+    const char *err;
+} CMSMergeJob;
+
+/* Looks the merged keys up again, as they may have changed while the GIL was released */
+static const char *mergeJobOpenKeys(RedisModuleCtx *ctx, CMSMergeJob *job, CMSketch **dest) {
+    const char *err = NULL;
+    RedisModuleKey *key;
+    for (long long i = -1; i < job->numKeys && !err; ++i) {
+        key = RedisModule_OpenKey(ctx, job->argv[i < 0 ? 1 : 3 + i], REDISMODULE_READ);
+        CMSketch *cms = NULL;
+        if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY) {
+            err = "CMS: key does not exist";
+        } else if (RedisModule_ModuleTypeGetType(key) != CMSketchType) {
+            err = REDISMODULE_ERRORMSG_WRONGTYPE;
+        } else {
+            cms = RedisModule_ModuleTypeGetValue(key);
+            if (cms->width != job->width || cms->depth != job->depth) {
+                err = "CMS: width/depth is not equal";
+            } else if (cms->indexMode != job->indexMode || cms->hashMode != job->hashMode) {
+                err = "CMS: index/hash mode is not equal";
+            } else if (cms->counterSize != job->counterSize) {
+                err = "CMS: counter width is not equal";
+            }
+        }
+        if (i < 0) {
+            *dest = cms;
+        } else {
+            job->cmsArray[i] = cms;
+        }
+        RedisModule_CloseKey(key);
+    }
+    return err;
+}
+
+static void *mergeJobThread(void *arg) {
+    CMSMergeJob *job = arg;
+    RedisModuleCtx *ctx = RedisModule_GetThreadSafeContext(job->bc);
+    size_t total = job->width * job->depth;
+    size_t slice = CMS_ASYNC_MERGE_SLICE / job->numKeys + 1;
+
+    // Merged into a private array so `dest` is only updated once, when complete
+    void *merged = CMS_CALLOC(total, job->counterSize);
+    CMSketch *dest = NULL;
+    for (size_t begin = 0; merged && !job->err; begin += slice) {
+        RedisModule_ThreadSafeContextLock(ctx);
+        RedisModule_SelectDb(ctx, job->dbid);
+        job->err = mergeJobOpenKeys(ctx, job, &dest);
+        if (!job->err) {
+            size_t end = begin + slice < total ? begin + slice : total;
+            int changed = 0;
+            for (long long i = 0; i < job->numKeys; ++i) {
+                changed |= begin > 0 && job->cmsArray[i]->stamp != job->stamps[i];
+                job->stamps[i] = job->cmsArray[i]->stamp;
+            }
+            // The command is replicated as if it ran at once: if a source was written to
+            // since the first slice, merge them all again from their current state
+            if (changed) {
+                begin = 0;
+                end = total;
+            }
+            CMS_MergeRange(merged, job->numKeys, (const CMSketch **)job->cmsArray, job->weights,
+                           begin, end);
+            if (end == total) {
+                CMS_FREE(dest->array);
+                dest->array = merged;
+                dest->counter = CMS_MergeCounter(job->numKeys, (const CMSketch **)job->cmsArray,
+                                                 job->weights);
+                touchSketch(dest);
+                merged = NULL;
+                RedisModule_Replicate(ctx, "CMS.MERGE", "v", job->argv + 1, (size_t)job->argc - 1);
+            }
+        }
+        RedisModule_ThreadSafeContextUnlock(ctx);
     }
+    CMS_FREE(merged);
 
+    RedisModule_ThreadSafeContextLock(ctx);
+    for (int i = 0; i < job->argc; ++i) {
+        RedisModule_FreeString(ctx, job->argv[i]);
+    }
+    RedisModule_ThreadSafeContextUnlock(ctx);
+
+    RedisModule_UnblockClient(job->bc, job);
+    RedisModule_FreeThreadSafeContext(ctx);
+    return NULL;
+}
+
+static int mergeJobReply(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    CMSMergeJob *job = RedisModule_GetBlockedClientPrivateData(ctx);
+    if (job->err) {
+        return RedisModule_ReplyWithError(ctx, job->err);
+    }
+    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+static void mergeJobFree(void *privdata) {
+    CMSMergeJob *job = privdata;
+    CMS_FREE(job->argv);
+    CMS_FREE(job->cmsArray);
+    CMS_FREE(job->weights);
+    CMS_FREE(job->stamps);
+    CMS_FREE(job);
+}
+
+/* Runs the merge on a separate thread, which only holds the GIL for slices of
+ * CMS_ASYNC_MERGE_SLICE counters at a time. Returns REDISMODULE_ERR if the
+ * client can't be blocked, in which case the merge should be run inline.
+ * Replicas and AOF replays merge inline, before the writes that follow it in
+ * the stream. */
+static int mergeAsync(RedisModuleCtx *ctx, RedisModuleString **argv, int argc,
+                      mergeParams *params) {
+    if (!RedisModule_GetContextFlags ||
+        (RedisModule_GetContextFlags(ctx) &
+         (REDISMODULE_CTX_FLAGS_LUA | REDISMODULE_CTX_FLAGS_MULTI |
+          REDISMODULE_CTX_FLAGS_REPLICATED | REDISMODULE_CTX_FLAGS_LOADING))) {
+        return REDISMODULE_ERR;
+    }
+
+    CMSMergeJob *job = CMS_CALLOC(1, sizeof(*job));
+    *job = (CMSMergeJob){.dbid = RedisModule_GetSelectedDb(ctx),
+                         .argc = argc,
+                         .argv = CMS_CALLOC(argc, sizeof(RedisModuleString *)),
+                         .numKeys = params->numKeys,
+                         .weights = params->weights,
+                         .cmsArray = params->cmsArray,
+                         .stamps = CMS_CALLOC(params->numKeys, sizeof(uint64_t)),
+                         .width = params->dest->width,
+                         .depth = params->dest->depth,
+                         .indexMode = params->dest->indexMode,
+                         .hashMode = params->dest->hashMode,
+                         .counterSize = params->dest->counterSize};
+    job->bc = RedisModule_BlockClient(ctx, mergeJobReply, NULL, mergeJobFree, 0);
+
+    pthread_t tid;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (int i = 0; i < argc; ++i) {
+        job->argv[i] = argv[i];
+        RedisModule_RetainString(ctx, argv[i]);
+    }
+    if (pthread_create(&tid, &attr, mergeJobThread, job) != 0) {
+        // LCOV_EXCL_START
+        RedisModule_AbortBlock(job->bc);
+        for (int i = 0; i < argc; ++i) {
+            RedisModule_FreeString(ctx, argv[i]);
+        }
+        CMS_FREE(job->argv);
+        CMS_FREE(job->stamps);
+        CMS_FREE(job);
+        pthread_attr_destroy(&attr);
+        return REDISMODULE_ERR;
+        // LCOV_EXCL_STOP
+    }
+    pthread_attr_destroy(&attr);
     return REDISMODULE_OK;
 }
 
@@ -201,7 +430,8 @@ int CMSketch_Merge(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     }
 
     mergeParams params = {0};
-    if (RedisModule_StringToLongLong(argv[2], &(params.numKeys)) != REDISMODULE_OK) {
+    if (RedisModule_StringToLongLong(argv[2], &(params.numKeys)) != REDISMODULE_OK ||
+        params.numKeys < 1) {
         return RedisModule_ReplyWithError(ctx, "CMS: invalid numkeys");
     }
 
@@ -214,7 +444,15 @@ int CMSketch_Merge(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
         return REDISMODULE_OK;
     }
 
+    // The job takes ownership of the parameters
+    if (CMSAsyncMergeCells > 0 &&
+        params.dest->width * params.dest->depth * params.numKeys >= (size_t)CMSAsyncMergeCells &&
+        mergeAsync(ctx, argv, argc, &params) == REDISMODULE_OK) {
+        return REDISMODULE_OK;
+    }
+
     CMS_MergeParams(params);
+    touchSketch(params.dest);
 
     CMS_FREE(params.cmsArray);
     CMS_FREE(params.weights);
@@ -233,13 +471,19 @@ int CMSKetch_Info(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
         return REDISMODULE_OK;
     }
 
-    RedisModule_ReplyWithArray(ctx, 3 * 2);
+    RedisModule_ReplyWithArray(ctx, (cms->stats ? 5 : 3) * 2);
     RedisModule_ReplyWithSimpleString(ctx, "width");
     RedisModule_ReplyWithLongLong(ctx, cms->width);
     RedisModule_ReplyWithSimpleString(ctx, "depth");
     RedisModule_ReplyWithLongLong(ctx, cms->depth);
     RedisModule_ReplyWithSimpleString(ctx, "count");
     RedisModule_ReplyWithLongLong(ctx, cms->counter);
+    if (cms->stats) {
+        RedisModule_ReplyWithSimpleString(ctx, "increments");
+        RedisModule_ReplyWithLongLong(ctx, cms->stats->increments);
+        RedisModule_ReplyWithSimpleString(ctx, "queries");
+        RedisModule_ReplyWithLongLong(ctx, cms->stats->queries);
+    }
 
     return REDISMODULE_OK;
 }
@@ -249,8 +493,11 @@ void CMSRdbSave(RedisModuleIO *io, void *obj) {
     RedisModule_SaveUnsigned(io, cms->width);
     RedisModule_SaveUnsigned(io, cms->depth);
     RedisModule_SaveUnsigned(io, cms->counter);
-    RedisModule_SaveStringBuffer(io, (const char *)cms->array,
-                                 cms->width * cms->depth * sizeof(uint32_t));
+    ZRLE_RdbSave(io, cms->array, cms->width * cms->depth * cms->counterSize);
+    RedisModule_SaveUnsigned(io, cms->indexMode);
+    RedisModule_SaveUnsigned(io, cms->hashMode);
+    RedisModule_SaveUnsigned(io, cms->counterSize);
+    RedisModule_SaveUnsigned(io, cms->conservative);
 }
 
 void *CMSRdbLoad(RedisModuleIO *io, int encver) {
@@ -262,8 +509,29 @@ void *CMSRdbLoad(RedisModuleIO *io, int encver) {
     cms->width = RedisModule_LoadUnsigned(io);
     cms->depth = RedisModule_LoadUnsigned(io);
     cms->counter = RedisModule_LoadUnsigned(io);
-    size_t length = cms->width * cms->depth * sizeof(size_t);
-    cms->array = (uint32_t *)RedisModule_LoadStringBuffer(io, &length);
+    size_t length;
+    if (encver >= CMS_MIN_ZRLE_ENC) {
+        cms->array = ZRLE_RdbLoad(io, &length, 1);
+        if (!cms->array) {
+            CMS_FREE(cms); // LCOV_EXCL_LINE corrupt data
+            return NULL;   // LCOV_EXCL_LINE
+        }
+    } else {
+        cms->array = RedisModule_LoadStringBuffer(io, &length);
+    }
+    if (encver >= CMS_MIN_INDEX_MODE_ENC) {
+        cms->indexMode = RedisModule_LoadUnsigned(io);
+    }
+    cms->hashMode = SKETCH_HASH_PER_ROW;
+    if (encver >= CMS_MIN_HASH_MODE_ENC) {
+        cms->hashMode = RedisModule_LoadUnsigned(io);
+    }
+    cms->counterSize = sizeof(uint32_t);
+    if (encver >= CMS_MIN_COUNTER_SIZE_ENC) {
+        cms->counterSize = RedisModule_LoadUnsigned(io);
+        cms->conservative = RedisModule_LoadUnsigned(io);
+    }
+    touchSketch(cms);
 
     return cms;
 }
@@ -272,7 +540,8 @@ void CMSFree(void *value) { CMS_Destroy(value); }
 
 size_t CMSMemUsage(const void *value) {
     CMSketch *cms = (CMSketch *)value;
-    return sizeof(cms) + cms->width * cms->depth * sizeof(size_t);
+    return sizeof(*cms) + cms->width * cms->depth * cms->counterSize +
+           (cms->stats ? sizeof(*cms->stats) : 0);
 }
 
 int CMSModule_onLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
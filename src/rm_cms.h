@@ -6,7 +6,17 @@
 #define DEFAULT_WIDTH 2.7
 #define DEFAULT_DEPTH 5
 
-#define CMS_ENC_VER 0
+#define CMS_ENC_VER 4
+#define CMS_MIN_INDEX_MODE_ENC 1
+#define CMS_MIN_HASH_MODE_ENC 2
+#define CMS_MIN_COUNTER_SIZE_ENC 3
+#define CMS_MIN_ZRLE_ENC 4
+
+/* Merges reading at least this many counters run on a separate thread. 0 disables */
+extern long long CMSAsyncMergeCells;
+
+/* Counts the increments and queries of each sketch when set */
+extern int CMSCollectStats;
 
 int CMSModule_onLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc);
 
@@ -7,12 +7,15 @@
 
 #include "topk.h"
 #include "rm_topk.h"
+#include "sketch_index.h"
+#include "zrle.h"
 
 #define INNER_ERROR(x)                                                                             \
     RedisModule_ReplyWithError(ctx, x);                                                            \
     return REDISMODULE_ERR;
 
 RedisModuleType *TopKType;
+int TopKCollectStats = 0;
 
 static int GetTopKKey(RedisModuleCtx *ctx, RedisModuleString *keyName, TopK **topk, int mode) {
     // All using this function should call RedisModule_AutoMemory to prevent memory leak
@@ -27,15 +30,26 @@ static int GetTopKKey(RedisModuleCtx *ctx, RedisModuleString *keyName, TopK **to
 
     *topk = RedisModule_ModuleTypeGetValue(key);
     RedisModule_CloseKey(key);
+    if (TopKCollectStats) {
+        TopK_EnableStats(*topk);
+    }
     return REDISMODULE_OK;
 }
 
 static int createTopK(RedisModuleCtx *ctx, RedisModuleString **argv, int argc, TopK **topk) {
     long long k, width, depth;
     double decay;
+    int indexMode = SKETCH_INDEX_MOD;
     if ((RedisModule_StringToLongLong(argv[2], &k) != REDISMODULE_OK) || k < 1) {
         INNER_ERROR("TopK: invalid k");
     }
+    if (argc == 4 || argc == 7) {
+        indexMode = Sketch_ParseIndexMode(RedisModule_StringPtrLen(argv[argc - 1], NULL));
+        if (indexMode < 0) {
+            INNER_ERROR("TopK: invalid index mode");
+        }
+        --argc;
+    }
     if (argc == 6) {
         if ((RedisModule_StringToLongLong(argv[3], &width) != REDISMODULE_OK) || width < 1) {
             INNER_ERROR("TopK: invalid width");
@@ -52,12 +66,16 @@ static int createTopK(RedisModuleCtx *ctx, RedisModuleString **argv, int argc, T
         depth = 7;
         decay = 0.9;
     }
+    if (width > UINT32_MAX || Sketch_IndexWidth(indexMode, (size_t *)&width) != 0) {
+        INNER_ERROR("TopK: invalid width");
+    }
     *topk = TopK_Create(k, width, depth, decay);
+    (*topk)->indexMode = indexMode;
     return REDISMODULE_OK;
 }
 
 static int TopK_Create_Cmd(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    if (argc != 3 && argc != 6) {
+    if (argc < 3 || argc > 7 || argc == 5) {
         return RedisModule_WrongArity(ctx);
     }
 
@@ -98,13 +116,13 @@ static int TopK_Add_Cmd(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
     for (int i = 0; i < itemCount; ++i) {
         size_t itemlen;
         const char *item = RedisModule_StringPtrLen(argv[i + 2], &itemlen);
-        char *expelledItem = TopK_Add(topk, item, itemlen, 1);
+        size_t expelledLen;
+        const char *expelledItem = TopK_Add(topk, item, itemlen, 1, &expelledLen);
 
         if (expelledItem == NULL) {
             RedisModule_ReplyWithNull(ctx);
         } else {
-            RedisModule_ReplyWithSimpleString(ctx, expelledItem);
-            TOPK_FREE(expelledItem);
+            RedisModule_ReplyWithStringBuffer(ctx, expelledItem, expelledLen);
         }
     }
     RedisModule_ReplicateVerbatim(ctx);
@@ -133,13 +151,13 @@ static int TopK_Incrby_Cmd(RedisModuleCtx *ctx, RedisModuleString **argv, int ar
                                        "TopK: increment must be an integer greater or equal to 0");
             goto final;
         }
-        char *expelledItem = TopK_Add(topk, item, itemlen, (uint32_t)increment);
+        size_t expelledLen;
+        const char *expelledItem = TopK_Add(topk, item, itemlen, (uint32_t)increment, &expelledLen);
 
         if (expelledItem == NULL) {
             RedisModule_ReplyWithNull(ctx);
         } else {
-            RedisModule_ReplyWithSimpleString(ctx, expelledItem);
-            TOPK_FREE(expelledItem);
+            RedisModule_ReplyWithStringBuffer(ctx, expelledItem, expelledLen);
         }
     }
 final:
@@ -188,26 +206,102 @@ static int TopK_Count_Cmd(RedisModuleCtx *ctx, RedisModuleString **argv, int arg
 
 static int TopK_List_Cmd(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
 
-    if (argc != 2)
+    if (argc != 2 && argc != 3)
         return RedisModule_WrongArity(ctx);
 
+    bool withCount = false;
+    if (argc == 3) {
+        if (strcasecmp(RedisModule_StringPtrLen(argv[2], NULL), "WITHCOUNT") != 0) {
+            RedisModule_ReplyWithError(ctx, "TopK: invalid option");
+            return REDISMODULE_OK;
+        }
+        withCount = true;
+    }
+
     TopK *topk = NULL;
     if (GetTopKKey(ctx, argv[1], &topk, REDISMODULE_READ) != REDISMODULE_OK) {
         return REDISMODULE_OK;
     }
     uint32_t k = topk->k;
-    char **heapList = TOPK_CALLOC(k, (sizeof(char *)));
-    TopK_List(topk, heapList);
-    RedisModule_ReplyWithArray(ctx, k);
-    for (int i = 0; i < k; ++i) {
-        if (heapList[i] != NULL) {
-            RedisModule_ReplyWithSimpleString(ctx, heapList[i]);
-        } else {
-            RedisModule_ReplyWithNull(ctx);
+
+    if (!withCount) {
+        const HeapBucket *heapList = TopK_List(topk);
+        RedisModule_ReplyWithArray(ctx, k);
+        for (uint32_t i = 0; i < k; ++i) {
+            if (heapList[i].item != NULL) {
+                RedisModule_ReplyWithStringBuffer(ctx, heapList[i].item, heapList[i].itemlen);
+            } else {
+                RedisModule_ReplyWithNull(ctx);
+            }
         }
+        return REDISMODULE_OK;
+    }
+
+    // Items and their counts from the largest count down, empty buckets are skipped
+    HeapBucket *heapList = TopK_SortedList(topk);
+    uint32_t first = 0;
+    while (first < k && heapList[first].item == NULL) {
+        ++first;
+    }
+    RedisModule_ReplyWithArray(ctx, 2 * (k - first));
+    for (uint32_t i = k; i > first; --i) {
+        RedisModule_ReplyWithStringBuffer(ctx, heapList[i - 1].item, heapList[i - 1].itemlen);
+        RedisModule_ReplyWithLongLong(ctx, heapList[i - 1].count);
     }
     TOPK_FREE(heapList);
+    return REDISMODULE_OK;
+}
+
+static int TopK_Merge_Cmd(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc < 4)
+        return RedisModule_WrongArity(ctx);
+
+    long long numKeys;
+    if (RedisModule_StringToLongLong(argv[2], &numKeys) != REDISMODULE_OK || numKeys < 1) {
+        return RedisModule_ReplyWithError(ctx, "TopK: invalid numkeys");
+    }
+    int pos = RMUtil_ArgIndex("WEIGHTS", argv, argc);
+    if (pos < 0) {
+        if (numKeys != argc - 3) {
+            return RedisModule_ReplyWithError(ctx, "TopK: wrong number of keys");
+        }
+    } else if (pos != 3 + numKeys || argc != 4 + numKeys * 2) {
+        return RedisModule_ReplyWithError(ctx, "TopK: wrong number of keys/weights");
+    }
 
+    TopK *dest;
+    if (GetTopKKey(ctx, argv[1], &dest, REDISMODULE_READ | REDISMODULE_WRITE) != REDISMODULE_OK) {
+        return REDISMODULE_OK;
+    }
+
+    const TopK **srcArray = TOPK_CALLOC(numKeys, sizeof(TopK *));
+    uint32_t *weights = TOPK_CALLOC(numKeys, sizeof(uint32_t));
+    for (long long i = 0; i < numKeys; ++i) {
+        long long weight = 1;
+        if (pos >= 0 && (RedisModule_StringToLongLong(argv[4 + numKeys + i], &weight) !=
+                             REDISMODULE_OK ||
+                         weight < 0 || weight > UINT32_MAX)) {
+            RedisModule_ReplyWithError(ctx, "TopK: invalid weight value");
+            goto final;
+        }
+        weights[i] = weight;
+        TopK *src;
+        if (GetTopKKey(ctx, argv[3 + i], &src, REDISMODULE_READ) != REDISMODULE_OK) {
+            goto final;
+        }
+        if (!TopK_CanMerge(dest, src)) {
+            RedisModule_ReplyWithError(ctx, "TopK: width/depth/index/hash mode is not equal");
+            goto final;
+        }
+        srcArray[i] = src;
+    }
+
+    TopK_Merge(dest, numKeys, srcArray, weights);
+    RedisModule_ReplicateVerbatim(ctx);
+    RedisModule_ReplyWithSimpleString(ctx, "OK");
+final:
+    TOPK_FREE(srcArray);
+    TOPK_FREE(weights);
     return REDISMODULE_OK;
 }
 
@@ -221,7 +315,7 @@ static int TopK_Info_Cmd(RedisModuleCtx *ctx, RedisModuleString **argv, int argc
         return REDISMODULE_OK;
     }
 
-    RedisModule_ReplyWithArray(ctx, 4 * 2);
+    RedisModule_ReplyWithArray(ctx, (topk->stats ? 7 : 4) * 2);
     RedisModule_ReplyWithSimpleString(ctx, "k");
     RedisModule_ReplyWithLongLong(ctx, topk->k);
     RedisModule_ReplyWithSimpleString(ctx, "width");
@@ -230,6 +324,14 @@ static int TopK_Info_Cmd(RedisModuleCtx *ctx, RedisModuleString **argv, int argc
     RedisModule_ReplyWithLongLong(ctx, topk->depth);
     RedisModule_ReplyWithSimpleString(ctx, "decay");
     RedisModule_ReplyWithDouble(ctx, topk->decay);
+    if (topk->stats) {
+        RedisModule_ReplyWithSimpleString(ctx, "adds");
+        RedisModule_ReplyWithLongLong(ctx, topk->stats->adds);
+        RedisModule_ReplyWithSimpleString(ctx, "heap replacements");
+        RedisModule_ReplyWithLongLong(ctx, topk->stats->heapReplacements);
+        RedisModule_ReplyWithSimpleString(ctx, "decrements");
+        RedisModule_ReplyWithLongLong(ctx, topk->stats->decrements);
+    }
 
     return REDISMODULE_OK;
 }
@@ -242,16 +344,19 @@ static void TopKRdbSave(RedisModuleIO *io, void *obj) {
     RedisModule_SaveUnsigned(io, topk->width);
     RedisModule_SaveUnsigned(io, topk->depth);
     RedisModule_SaveDouble(io, topk->decay);
-    RedisModule_SaveStringBuffer(io, (const char *)topk->data,
-                                 ((size_t)topk->width) * topk->depth * sizeof(Bucket));
+    ZRLE_RdbSave(io, topk->data, ((size_t)topk->width) * topk->depth * sizeof(Bucket));
     RedisModule_SaveStringBuffer(io, (const char *)topk->heap, topk->k * sizeof(HeapBucket));
     for (uint32_t i = 0; i < topk->k; ++i) {
+        // Items are saved without their NUL, an empty buffer marks an empty bucket
         if (topk->heap[i].item != NULL) {
-            RedisModule_SaveStringBuffer(io, topk->heap[i].item, strlen(topk->heap[i].item) + 1);
+            RedisModule_SaveStringBuffer(io, topk->heap[i].item, topk->heap[i].itemlen);
         } else {
-            RedisModule_SaveStringBuffer(io, "", 1);
+            RedisModule_SaveStringBuffer(io, "", 0);
         }
     }
+    RedisModule_SaveUnsigned(io, topk->indexMode);
+    RedisModule_SaveUnsigned(io, topk->hashMode);
+    RedisModule_SaveUnsigned(io, topk->rngState);
 }
 
 static void *TopKRdbLoad(RedisModuleIO *io, int encver) {
@@ -265,16 +370,39 @@ static void *TopKRdbLoad(RedisModuleIO *io, int encver) {
     topk->decay = RedisModule_LoadDouble(io);
 
     size_t dataSize, heapSize, itemSize;
-    topk->data = (Bucket *)RedisModule_LoadStringBuffer(io, &dataSize);
-    assert(dataSize == ((size_t)topk->width) * topk->depth * sizeof(Bucket));
+    if (encver >= TOPK_MIN_ZRLE_ENC) {
+        topk->data = ZRLE_RdbLoad(io, &dataSize, 1);
+    } else {
+        topk->data = (Bucket *)RedisModule_LoadStringBuffer(io, &dataSize);
+    }
+    assert(topk->data != NULL && dataSize == ((size_t)topk->width) * topk->depth * sizeof(Bucket));
     topk->heap = (HeapBucket *)RedisModule_LoadStringBuffer(io, &heapSize);
     assert(heapSize == topk->k * sizeof(HeapBucket));
+    // Saved item pointers are meaningless, items are copied to the arena
     for (uint32_t i = 0; i < topk->k; ++i) {
-        topk->heap[i].item = RedisModule_LoadStringBuffer(io, &itemSize);
-        if (itemSize == 1) {
-            topk->heap[i].item = NULL;
+        topk->heap[i].item = NULL;
+    }
+    // Before TOPK_MIN_ITEM_LEN_ENC items were saved with their NUL
+    size_t nul = encver < TOPK_MIN_ITEM_LEN_ENC ? 1 : 0;
+    for (uint32_t i = 0; i < topk->k; ++i) {
+        char *item = RedisModule_LoadStringBuffer(io, &itemSize);
+        if (itemSize > nul) {
+            TopK_SetHeapItem(topk, i, item, itemSize - nul);
         }
+        RedisModule_Free(item);
+    }
+    if (encver >= TOPK_MIN_INDEX_MODE_ENC) {
+        topk->indexMode = RedisModule_LoadUnsigned(io);
+    }
+    topk->hashMode = SKETCH_HASH_PER_ROW;
+    if (encver >= TOPK_MIN_HASH_MODE_ENC) {
+        topk->hashMode = RedisModule_LoadUnsigned(io);
+    }
+    if (encver >= TOPK_MIN_RNG_STATE_ENC) {
+        topk->rngState = RedisModule_LoadUnsigned(io);
     }
+    TopK_BuildIndex(topk);
+    TopK_InitDecay(topk);
 
     return topk;
 }
@@ -284,7 +412,8 @@ static void TopKFree(void *value) { TopK_Destroy(value); }
 static size_t TopKMemUsage(const void *value) {
     TopK *topk = (TopK *)value;
     return sizeof(TopK) + ((size_t)topk->width) * topk->depth * sizeof(Bucket) +
-           topk->k * sizeof(HeapBucket);
+           topk->k * sizeof(HeapBucket) + (topk->heapIndexMask + 1) * sizeof(uint32_t) +
+           topk->arenaSize + (topk->stats ? sizeof(*topk->stats) : 0);
 }
 
 int TopKModule_onLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
@@ -306,6 +435,7 @@ int TopKModule_onLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RMUtil_RegisterReadCmd(ctx, "topk.query", TopK_Query_Cmd);
     RMUtil_RegisterWriteCmd(ctx, "topk.count", TopK_Count_Cmd);
     RMUtil_RegisterReadCmd(ctx, "topk.list", TopK_List_Cmd);
+    RMUtil_RegisterWriteDenyOOMCmd(ctx, "topk.merge", TopK_Merge_Cmd);
     RMUtil_RegisterReadCmd(ctx, "topk.info", TopK_Info_Cmd);
 
     return REDISMODULE_OK;
@@ -3,9 +3,17 @@
 
 #include "redismodule.h"
 
-#define TOPK_ENC_VER 0
+#define TOPK_ENC_VER 5
+#define TOPK_MIN_INDEX_MODE_ENC 1
+#define TOPK_MIN_HASH_MODE_ENC 2
+#define TOPK_MIN_RNG_STATE_ENC 3
+#define TOPK_MIN_ITEM_LEN_ENC 4
+#define TOPK_MIN_ZRLE_ENC 5
 #define REDIS_MODULE_TARGET
 
+/* Counts the adds, heap replacements and decrements of each Top-K when set */
+extern int TopKCollectStats;
+
 int TopKModule_onLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc);
 
 #endif
\ No newline at end of file
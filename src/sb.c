@@ -1,9 +1,14 @@
 #include "sb.h"
 #include "redismodule.h"
+#include "reserve.h"
 #define BLOOM_CALLOC RedisModule_Calloc
 #define BLOOM_FREE RedisModule_Free
 #include "contrib/bloom.c"
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
@@ -13,6 +18,12 @@
 #define ERROR_TIGHTENING_RATIO 0.5
 #define CUR_FILTER(sb) ((sb)->filters + ((sb)->nfilters - 1))
 
+SBChainStats sbTotalStats;
+
+static uint64_t sbStampClock;
+
+void SBChain_Touch(SBChain *sb) { sb->stamp = ++sbStampClock; }
+
 static int SBChain_AddLink(SBChain *chain, uint64_t size, double error_rate) {
     if (!chain->filters) {
         chain->filters = RedisModule_Calloc(1, sizeof(*chain->filters));
@@ -24,17 +35,230 @@ static int SBChain_AddLink(SBChain *chain, uint64_t size, double error_rate) {
     SBLink *newlink = chain->filters + chain->nfilters;
     newlink->size = 0;
     chain->nfilters++;
-    return bloom_init(&newlink->inner, size, error_rate, chain->options);
+    struct bloom *bm = &newlink->inner;
+    if (bloom_layout(bm, size, error_rate, chain->options) != 0) {
+        return -1;
+    }
+    bm->bf = chain->reserve ? Reserve_Take(chain->reserve, bm->bytes) : NULL;
+    chain->reserve = NULL;
+    if (!bm->bf && !(bm->bf = RedisModule_Calloc(bm->bytes, 1))) {
+        return -1; // LCOV_EXCL_LINE memory failure
+    }
+    SBChain_Touch(chain);
+    return SBChain_UpdateProbes(chain);
 }
 
-void SBChain_Free(SBChain *sb) {
+// Starts allocating the link that will follow the last one once it is filled
+// past reserveThreshold percent of its capacity
+static void SBChain_ReserveLink(SBChain *sb) {
+    const SBLink *cur = CUR_FILTER(sb);
+    if (sb->window || (sb->options & BLOOM_OPT_NO_SCALING) ||
+        cur->size * 100 < cur->inner.entries * (uint64_t)reserveThreshold) {
+        return;
+    }
+    struct bloom next;
+    if (bloom_layout(&next, cur->inner.entries * (size_t)sb->growth,
+                     cur->inner.error * ERROR_TIGHTENING_RATIO, sb->options) == 0) {
+        sb->reserve = Reserve_Start(next.bytes);
+    }
+}
+
+// Links loaded by SB_NewChainFromFile point into the mapping and are released
+// with it, links added later own their buffer.
+static void SBChain_FreeLinks(SBChain *sb) {
+    const unsigned char *mapped = sb->mapped;
     for (size_t ii = 0; ii < sb->nfilters; ++ii) {
-        bloom_free(&sb->filters[ii].inner);
+        const unsigned char *bf = sb->filters[ii].inner.bf;
+        if (!mapped || bf < mapped || bf >= mapped + sb->mappedLen) {
+            bloom_free(&sb->filters[ii].inner);
+        }
     }
+    if (mapped) {
+        munmap(sb->mapped, sb->mappedLen);
+        sb->mapped = NULL;
+        sb->mappedLen = 0;
+    }
+}
+
+void SBChain_Free(SBChain *sb) {
+    SBChain_StageAbort(sb);
+    Reserve_Cancel(sb->reserve);
+    SBChain_FreeLinks(sb);
+    RedisModule_Free(sb->stats);
+    RedisModule_Free(sb->window);
+    RedisModule_Free(sb->probes);
     RedisModule_Free(sb->filters);
     RedisModule_Free(sb);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+/// Probe plan                                                               ///
+////////////////////////////////////////////////////////////////////////////////
+
+// Power of two links: the 32 and 64 bit variants of bloom.c agree under a mask
+#define SB_PROBE_MASK 0
+// Links of arbitrary size, probed with a precomputed reciprocal
+#define SB_PROBE_MOD 1
+// Cache-line blocked links
+#define SB_PROBE_BLOCKED 2
+// Counting links, plain or blocked
+#define SB_PROBE_COUNTING 3
+#define SB_PROBE_COUNTING_BLOCKED 4
+
+static void SBProbe_SetFns(SBProbe *p);
+
+int SBChain_UpdateProbes(SBChain *sb) {
+    SBProbe *probes = RedisModule_Realloc(sb->probes, sizeof(*probes) * sb->nfilters);
+    if (!probes) {
+        return -1; // LCOV_EXCL_LINE memory failure
+    }
+    sb->probes = probes;
+
+    for (size_t ii = 0; ii < sb->nfilters; ++ii) {
+        const struct bloom *bm = &sb->filters[ii].inner;
+        SBProbe *p = probes + ii;
+        p->bf = bm->bf;
+        p->hashes = bm->hashes;
+        if (bm->counting) {
+            p->kind = bm->blocked ? SB_PROBE_COUNTING_BLOCKED : SB_PROBE_COUNTING;
+            p->mod = bm->blocked ? bm->bytes / BLOOM_BLOCK_BYTES : bm->bits;
+        } else if (bm->blocked) {
+            p->kind = SB_PROBE_BLOCKED;
+            p->mod = bm->bytes / BLOOM_BLOCK_BYTES;
+        } else if (bm->n2 > 0) {
+            p->kind = SB_PROBE_MASK;
+            p->mod = 1LLU << bm->n2;
+        } else {
+            p->kind = SB_PROBE_MOD;
+            p->mod = bm->bits;
+        }
+        p->recip = p->mod ? UINT64_MAX / p->mod : 0;
+        SBProbe_SetFns(p);
+    }
+    return 0;
+}
+
+// v % mod without a division. The quotient estimated from the reciprocal is
+// at most one less than the real one, so a single correction gives the exact
+// remainder.
+static inline uint64_t SBProbe_Mod(const SBProbe *p, uint64_t v) {
+#ifdef __SIZEOF_INT128__
+    uint64_t q = ((unsigned __int128)v * p->recip) >> 64;
+    uint64_t r = v - q * p->mod;
+    return r >= p->mod ? r - p->mod : r;
+#else
+    return v % p->mod;
+#endif
+}
+
+// The probes of each kind, in MODE_READ or MODE_WRITE like the bloom.c
+// functions they mirror. They are inlined with constant `hashes` and `mode`
+// below, which lets the compiler unroll them.
+static inline int SBProbe_Positions(const SBProbe *p, bloom_hashval hv, uint32_t hashes, int mode,
+                                    int masked) {
+    unsigned char *bf = (unsigned char *)p->bf;
+    int found_unset = 0;
+    for (uint32_t i = 0; i < hashes; i++) {
+        const uint64_t v = hv.a + i * hv.b;
+        if (!test_bit_set_bit(bf, masked ? v & (p->mod - 1) : SBProbe_Mod(p, v), mode)) {
+            if (mode == MODE_READ) {
+                return 0;
+            }
+            found_unset = 1;
+        }
+    }
+    return mode == MODE_READ ? 1 : found_unset;
+}
+
+static inline int SBProbe_Blocked(const SBProbe *p, bloom_hashval hv, uint32_t hashes, int mode) {
+    uint64_t maskbuf[BLOOM_BLOCK_BYTES / 8] = {0};
+    bloom_block_mask(hv, hashes, (unsigned char *)maskbuf);
+    unsigned char *block = (unsigned char *)p->bf + SBProbe_Mod(p, hv.a) * BLOOM_BLOCK_BYTES;
+    return mode == MODE_READ ? simdOps.blockTest(block, (unsigned char *)maskbuf)
+                             : simdOps.blockSet(block, (unsigned char *)maskbuf);
+}
+
+static inline int SBProbe_Op(const SBProbe *p, bloom_hashval hv, uint32_t hashes, int mode) {
+    switch (p->kind) {
+    case SB_PROBE_MASK:
+        return SBProbe_Positions(p, hv, hashes, mode, 1);
+    case SB_PROBE_MOD:
+        return SBProbe_Positions(p, hv, hashes, mode, 0);
+    case SB_PROBE_BLOCKED:
+        return SBProbe_Blocked(p, hv, hashes, mode);
+    default:
+        return bloom_counters_op((unsigned char *)p->bf, p->mod, hashes,
+                                 p->kind == SB_PROBE_COUNTING_BLOCKED, hv, mode);
+    }
+}
+
+static int SBProbe_CheckAny(const SBProbe *p, bloom_hashval hv) {
+    return SBProbe_Op(p, hv, p->hashes, MODE_READ);
+}
+
+static int SBProbe_AddAny(const SBProbe *p, bloom_hashval hv) {
+    return SBProbe_Op(p, hv, p->hashes, MODE_WRITE);
+}
+
+// Specialisations for the usual numbers of hashes, from error rates of 10%
+// down to 0.01%, for the kinds other than counting
+#define SB_PROBE_MIN_HASHES 4
+#define SB_PROBE_MAX_HASHES 14
+#define SB_PROBE_HASHES(X)                                                                         \
+    X(4) X(5) X(6) X(7) X(8) X(9) X(10) X(11) X(12) X(13) X(14)
+
+#define SB_PROBE_SPECIALISE(K)                                                                     \
+    static int SBProbe_CheckMask##K(const SBProbe *p, bloom_hashval hv) {                          \
+        return SBProbe_Positions(p, hv, K, MODE_READ, 1);                                          \
+    }                                                                                              \
+    static int SBProbe_AddMask##K(const SBProbe *p, bloom_hashval hv) {                            \
+        return SBProbe_Positions(p, hv, K, MODE_WRITE, 1);                                         \
+    }                                                                                              \
+    static int SBProbe_CheckMod##K(const SBProbe *p, bloom_hashval hv) {                           \
+        return SBProbe_Positions(p, hv, K, MODE_READ, 0);                                          \
+    }                                                                                              \
+    static int SBProbe_AddMod##K(const SBProbe *p, bloom_hashval hv) {                             \
+        return SBProbe_Positions(p, hv, K, MODE_WRITE, 0);                                         \
+    }                                                                                              \
+    static int SBProbe_CheckBlocked##K(const SBProbe *p, bloom_hashval hv) {                       \
+        return SBProbe_Blocked(p, hv, K, MODE_READ);                                               \
+    }                                                                                              \
+    static int SBProbe_AddBlocked##K(const SBProbe *p, bloom_hashval hv) {                         \
+        return SBProbe_Blocked(p, hv, K, MODE_WRITE);                                              \
+    }
+SB_PROBE_HASHES(SB_PROBE_SPECIALISE)
+
+typedef struct {
+    SBProbeFn check;
+    SBProbeFn add;
+} SBProbeFns;
+
+#define SB_PROBE_ENTRY(K, kind)                                                                    \
+    [K - SB_PROBE_MIN_HASHES] = {SBProbe_Check##kind##K, SBProbe_Add##kind##K},
+#define SB_PROBE_MASK_ENTRY(K) SB_PROBE_ENTRY(K, Mask)
+#define SB_PROBE_MOD_ENTRY(K) SB_PROBE_ENTRY(K, Mod)
+#define SB_PROBE_BLOCKED_ENTRY(K) SB_PROBE_ENTRY(K, Blocked)
+
+static const SBProbeFns sbProbeFns[][SB_PROBE_MAX_HASHES - SB_PROBE_MIN_HASHES + 1] = {
+    [SB_PROBE_MASK] = {SB_PROBE_HASHES(SB_PROBE_MASK_ENTRY)},
+    [SB_PROBE_MOD] = {SB_PROBE_HASHES(SB_PROBE_MOD_ENTRY)},
+    [SB_PROBE_BLOCKED] = {SB_PROBE_HASHES(SB_PROBE_BLOCKED_ENTRY)},
+};
+
+// Picks the functions of a probe once its kind and number of hashes are known
+static void SBProbe_SetFns(SBProbe *p) {
+    p->check = SBProbe_CheckAny;
+    p->add = SBProbe_AddAny;
+    if (p->kind <= SB_PROBE_BLOCKED && p->hashes >= SB_PROBE_MIN_HASHES &&
+        p->hashes <= SB_PROBE_MAX_HASHES) {
+        const SBProbeFns *fns = &sbProbeFns[p->kind][p->hashes - SB_PROBE_MIN_HASHES];
+        p->check = fns->check;
+        p->add = fns->add;
+    }
+}
+
+static inline int SBProbe_Check(const SBProbe *p, bloom_hashval hv) { return p->check(p, hv); }
+
 static int SBChain_AddToLink(SBLink *lb, bloom_hashval hash) {
     if (!bloom_add_h(&lb->inner, hash)) {
         // Element not previously present?
@@ -53,17 +277,67 @@ static bloom_hashval SBChain_GetHash(const SBChain *chain, const void *buf, size
     }
 }
 
-int SBChain_Add(SBChain *sb, const void *data, size_t len) {
-    // Does it already exist?
-    bloom_hashval h = SBChain_GetHash(sb, data, len);
+int SBChain_EnableStats(SBChain *sb) {
+    if (!sb->stats) {
+        sb->stats = RedisModule_Calloc(1, sizeof(*sb->stats));
+    }
+    return sb->stats ? 0 : -1;
+}
+
+static void SBChain_CountLookups(const SBChain *sb, uint64_t lookups, uint64_t visited) {
+    if (sb->stats) {
+        __atomic_fetch_add(&sb->stats->lookups, lookups, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&sb->stats->linksVisited, visited, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&sbTotalStats.lookups, lookups, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&sbTotalStats.linksVisited, visited, __ATOMIC_RELAXED);
+    }
+}
+
+// Newest generation first, skipping the cleared and expired ones
+static int SBChain_CheckWindowVisited(const SBChain *sb, bloom_hashval hv, uint64_t *visited) {
+    size_t ii = sb->window->current;
+    for (size_t gen = sb->window->expired; gen < sb->nfilters; ++gen) {
+        if (sb->filters[ii].size > 0) {
+            ++*visited;
+            if (SBProbe_Check(sb->probes + ii, hv)) {
+                return 1;
+            }
+        }
+        ii = ii == 0 ? sb->nfilters - 1 : ii - 1;
+    }
+    return 0;
+}
+
+// Also adds the number of links probed to `visited`
+static int SBChain_CheckHashVisited(const SBChain *sb, bloom_hashval hv, uint64_t *visited) {
+    if (sb->window) {
+        return SBChain_CheckWindowVisited(sb, hv, visited);
+    }
     for (int ii = sb->nfilters - 1; ii >= 0; --ii) {
-        if (bloom_check_h(&sb->filters[ii].inner, h)) {
-            return 0;
+        if (SBProbe_Check(sb->probes + ii, hv)) {
+            *visited += sb->nfilters - ii;
+            return 1;
         }
     }
+    *visited += sb->nfilters;
+    return 0;
+}
+
+static int SBChain_CheckHash(const SBChain *sb, bloom_hashval hv) {
+    uint64_t visited = 0;
+    return SBChain_CheckHashVisited(sb, hv, &visited);
+}
+
+static int SBChain_AddHashToChain(SBChain *sb, bloom_hashval h) {
+    // Does it already exist? Counting chains count it again, so that deleting
+    // a false positive does not take the item it collides with along.
+    const int found = SBChain_CheckHash(sb, h);
+    if (found && !(sb->options & BLOOM_OPT_COUNTING)) {
+        return 0;
+    }
 
     // Determine if we need to add more items?
-    SBLink *cur = CUR_FILTER(sb);
+    SBLink *cur = sb->window ? sb->filters + sb->window->current : CUR_FILTER(sb);
     if (cur->size >= cur->inner.entries) {
         if (sb->options & BLOOM_OPT_NO_SCALING) {
             return -2;
@@ -72,26 +346,334 @@ int SBChain_Add(SBChain *sb, const void *data, size_t len) {
         if (SBChain_AddLink(sb, cur->inner.entries * (size_t)sb->growth, error) != 0) {
             return -1;
         }
+        if (sb->stats) {
+            sb->stats->grows++;
+            __atomic_fetch_add(&sbTotalStats.grows, 1, __ATOMIC_RELAXED);
+        }
         cur = CUR_FILTER(sb);
     }
 
-    int rv = SBChain_AddToLink(cur, h);
-    if (rv) {
+    const SBProbe *p = sb->probes + (cur - sb->filters);
+    int rv = p->add(p, h);
+    SBChain_Touch(sb);
+    if (sb->options & BLOOM_OPT_COUNTING) {
+        cur->size++;
+        sb->size++;
+        rv = !found;
+    } else if (rv) {
+        cur->size++;
         sb->size++;
     }
+    if (reserveThreshold && !sb->reserve) {
+        SBChain_ReserveLink(sb);
+    }
     return rv;
 }
 
-int SBChain_Check(const SBChain *sb, const void *data, size_t len) {
-    bloom_hashval hv = SBChain_GetHash(sb, data, len);
-    for (int ii = sb->nfilters - 1; ii >= 0; --ii) {
-        if (bloom_check_h(&sb->filters[ii].inner, hv)) {
+static int SBChain_AddHash(SBChain *sb, bloom_hashval h) {
+    int rv = SBChain_AddHashToChain(sb, h);
+    if (sb->staging && rv >= 0) {
+        SBChain_AddToLink(sb->staging, h);
+    }
+    return rv;
+}
+
+int SBChain_Add(SBChain *sb, const void *data, size_t len) {
+    return SBChain_AddHash(sb, SBChain_GetHash(sb, data, len));
+}
+
+int SBChain_Delete(SBChain *sb, const void *data, size_t len) {
+    if (!(sb->options & BLOOM_OPT_COUNTING)) {
+        return -1;
+    }
+    bloom_hashval h = SBChain_GetHash(sb, data, len);
+    // Same order as lookups, so the link answering BF.EXISTS loses the item
+    size_t ii = sb->window ? sb->window->current : sb->nfilters - 1;
+    for (size_t nn = 0; nn < sb->nfilters; ++nn) {
+        SBLink *link = sb->filters + ii;
+        if (link->size > 0 && bloom_del_h(&link->inner, h) == 1) {
+            link->size--;
+            sb->size--;
+            SBChain_Touch(sb);
             return 1;
         }
+        ii = ii == 0 ? sb->nfilters - 1 : ii - 1;
+    }
+    return 0;
+}
+
+int SBChain_Check(const SBChain *sb, const void *data, size_t len) {
+    uint64_t visited = 0;
+    int rv = SBChain_CheckHashVisited(sb, SBChain_GetHash(sb, data, len), &visited);
+    SBChain_CountLookups(sb, 1, visited);
+    return rv;
+}
+
+// Number of items hashed and prefetched ahead of resolving them. Large enough
+// to keep the memory system busy, small enough for the prefetched lines to
+// still be in cache when they are used.
+#define SB_BATCH_SIZE 16
+
+static void SBChain_PrefetchHashes(const SBChain *sb, const bloom_hashval *hashes, size_t n,
+                                   int mode) {
+    for (size_t ii = 0; ii < n; ++ii) {
+        for (size_t jj = 0; jj < sb->nfilters; ++jj) {
+            bloom_prefetch_h(&sb->filters[jj].inner, hashes[ii], mode);
+        }
+    }
+}
+
+static void SBChain_PrefetchBatch(const SBChain *sb, const char *const *items, const size_t *lens,
+                                  size_t n, bloom_hashval *hashes, int mode) {
+    for (size_t ii = 0; ii < n; ++ii) {
+        hashes[ii] = SBChain_GetHash(sb, items[ii], lens[ii]);
+    }
+    SBChain_PrefetchHashes(sb, hashes, n, mode);
+}
+
+bloom_hashval SBChain_HashItem(const SBChain *sb, const void *data, size_t len) {
+    return SBChain_GetHash(sb, data, len);
+}
+
+size_t SBChain_AddHashes(SBChain *sb, const bloom_hashval *hashes, size_t n, int *results) {
+    for (size_t base = 0; base < n; base += SB_BATCH_SIZE) {
+        size_t batch = n - base < SB_BATCH_SIZE ? n - base : SB_BATCH_SIZE;
+        SBChain_PrefetchHashes(sb, hashes + base, batch, MODE_WRITE);
+        for (size_t ii = 0; ii < batch; ++ii) {
+            int rv = results[base + ii] = SBChain_AddHash(sb, hashes[base + ii]);
+            if (rv < 0) {
+                return base + ii + 1;
+            }
+        }
+    }
+    return n;
+}
+
+void SBChain_CheckMany(const SBChain *sb, const char *const *items, const size_t *lens, size_t n,
+                       int *results) {
+    bloom_hashval hashes[SB_BATCH_SIZE];
+    uint64_t visited = 0;
+    for (size_t base = 0; base < n; base += SB_BATCH_SIZE) {
+        size_t batch = n - base < SB_BATCH_SIZE ? n - base : SB_BATCH_SIZE;
+        SBChain_PrefetchBatch(sb, items + base, lens + base, batch, hashes, MODE_READ);
+        for (size_t ii = 0; ii < batch; ++ii) {
+            results[base + ii] = SBChain_CheckHashVisited(sb, hashes[ii], &visited);
+        }
+    }
+    SBChain_CountLookups(sb, n, visited);
+}
+
+size_t SBChain_AddMany(SBChain *sb, const char *const *items, const size_t *lens, size_t n,
+                       int *results) {
+    bloom_hashval hashes[SB_BATCH_SIZE];
+    for (size_t base = 0; base < n; base += SB_BATCH_SIZE) {
+        size_t batch = n - base < SB_BATCH_SIZE ? n - base : SB_BATCH_SIZE;
+        SBChain_PrefetchBatch(sb, items + base, lens + base, batch, hashes, MODE_WRITE);
+        for (size_t ii = 0; ii < batch; ++ii) {
+            int rv = results[base + ii] = SBChain_AddHash(sb, hashes[ii]);
+            if (rv < 0) {
+                return base + ii + 1;
+            }
+        }
+    }
+    return n;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Consolidation                                                            ///
+////////////////////////////////////////////////////////////////////////////////
+
+int SBChain_StageBegin(SBChain *sb, uint64_t capacity) {
+    if (sb->staging || sb->window || (sb->options & BLOOM_OPT_COUNTING) || capacity == 0) {
+        return -1;
     }
+    SBLink *link = RedisModule_Calloc(1, sizeof(*link));
+    // The first link carries the error budget the chain was created with
+    if (bloom_init(&link->inner, capacity, sb->filters[0].inner.error, sb->options) != 0) {
+        RedisModule_Free(link);
+        return -1;
+    }
+    sb->staging = link;
     return 0;
 }
 
+int SBChain_StageAdd(SBChain *sb, const void *data, size_t len) {
+    return SBChain_AddToLink(sb->staging, SBChain_GetHash(sb, data, len));
+}
+
+int SBChain_StageCommit(SBChain *sb) {
+    if (!sb->staging) {
+        return -1;
+    }
+    // The next link now follows the staged one
+    Reserve_Cancel(sb->reserve);
+    sb->reserve = NULL;
+    SBChain_FreeLinks(sb);
+    sb->filters = RedisModule_Realloc(sb->filters, sizeof(*sb->filters));
+    sb->filters[0] = *sb->staging;
+    sb->nfilters = 1;
+    sb->size = sb->staging->size;
+    RedisModule_Free(sb->staging);
+    sb->staging = NULL;
+    SBChain_Touch(sb);
+    return SBChain_UpdateProbes(sb);
+}
+
+void SBChain_StageAbort(SBChain *sb) {
+    if (sb->staging) {
+        bloom_free(&sb->staging->inner);
+        RedisModule_Free(sb->staging);
+        sb->staging = NULL;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Merging                                                                  ///
+////////////////////////////////////////////////////////////////////////////////
+
+int SBChain_MergeCompatible(const SBChain *a, const SBChain *b) {
+    if (a->window || b->window || a->options != b->options || a->nfilters != b->nfilters) {
+        return 0;
+    }
+    for (size_t ii = 0; ii < a->nfilters; ++ii) {
+        const struct bloom *x = &a->filters[ii].inner, *y = &b->filters[ii].inner;
+        if (x->bytes != y->bytes || x->bits != y->bits || x->hashes != y->hashes ||
+            x->n2 != y->n2) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+SBChainMerge *SBChain_MergeBegin(const SBChain *layout, int intersect) {
+    SBChain *chain = SB_NewChainFromTemplate(layout);
+    if (!chain) {
+        return NULL; // LCOV_EXCL_LINE memory failure
+    }
+    SBChainMerge *m = RedisModule_Calloc(1, sizeof(*m));
+    m->chain = chain;
+    m->set = RedisModule_Calloc(chain->nfilters, sizeof(*m->set));
+    m->intersect = intersect;
+    for (size_t ii = 0; ii < chain->nfilters; ++ii) {
+        m->total += chain->filters[ii].inner.bytes;
+    }
+    return m;
+}
+
+void SBChain_MergeRange(SBChainMerge *m, const SBChain *const *srcs, size_t n, size_t begin,
+                        size_t end) {
+    const int counting = m->chain->options & BLOOM_OPT_COUNTING;
+    size_t offset = 0;
+    for (size_t ii = 0; ii < m->chain->nfilters; ++ii) {
+        const size_t bytes = m->chain->filters[ii].inner.bytes;
+        const size_t lo = begin > offset ? begin : offset;
+        const size_t hi = end < offset + bytes ? end : offset + bytes;
+        if (lo < hi) {
+            unsigned char *dst = m->chain->filters[ii].inner.bf + (lo - offset);
+            uint64_t set = 0;
+            // The buffer starts zeroed, so merging the first source copies it
+            for (size_t jj = 0; jj < n; ++jj) {
+                const unsigned char *src = srcs[jj]->filters[ii].inner.bf + (lo - offset);
+                const int intersect = m->intersect && jj > 0;
+                set = counting ? bloom_counters_merge(dst, src, hi - lo, intersect)
+                               : simdOps.mergeBits(dst, src, hi - lo, intersect);
+            }
+            m->set[ii] += set;
+        }
+        offset += bytes;
+    }
+}
+
+// Estimates the number of items of a link from the number of its positions that
+// are set, as -(m / k) * ln(1 - set / m) for m positions and k hashes. Every item
+// adds k to the counters of counting links, short of saturated ones.
+static size_t SBLink_EstimateSize(const struct bloom *bm, uint64_t set) {
+    if (bm->counting) {
+        return set / bm->hashes;
+    }
+    const double m = bm->bits ? bm->bits : bm->bytes * 8;
+    if (set >= m) {
+        return bm->entries;
+    }
+    return -(m / bm->hashes) * log1p(-(double)set / m) + 0.5;
+}
+
+SBChain *SBChain_MergeEnd(SBChainMerge *m, SBChain *dest) {
+    SBChain *chain = m->chain;
+    chain->size = 0;
+    for (size_t ii = 0; ii < chain->nfilters; ++ii) {
+        chain->filters[ii].size = SBLink_EstimateSize(&chain->filters[ii].inner, m->set[ii]);
+        chain->size += chain->filters[ii].size;
+    }
+    RedisModule_Free(m->set);
+    RedisModule_Free(m);
+    if (!dest) {
+        return chain;
+    }
+
+    // Moves the buffers, the rest of `dest` is kept
+    SBChain_FreeLinks(dest);
+    for (size_t ii = 0; ii < dest->nfilters; ++ii) {
+        dest->filters[ii].inner.bf = chain->filters[ii].inner.bf;
+        dest->filters[ii].size = chain->filters[ii].size;
+    }
+    dest->size = chain->size;
+    chain->nfilters = 0;
+    SBChain_Free(chain);
+    SBChain_Touch(dest);
+    SBChain_UpdateProbes(dest);
+    return dest;
+}
+
+void SBChain_MergeReset(SBChainMerge *m) {
+    for (size_t ii = 0; ii < m->chain->nfilters; ++ii) {
+        memset(m->chain->filters[ii].inner.bf, 0, m->chain->filters[ii].inner.bytes);
+        m->set[ii] = 0;
+    }
+}
+
+void SBChain_MergeAbort(SBChainMerge *m) {
+    SBChain_Free(m->chain);
+    RedisModule_Free(m->set);
+    RedisModule_Free(m);
+}
+
+SBChain *SBChain_Merge(SBChain *dest, const SBChain *const *srcs, size_t n, int intersect) {
+    SBChainMerge *m = SBChain_MergeBegin(dest ? dest : srcs[0], intersect);
+    if (!m) {
+        return NULL; // LCOV_EXCL_LINE memory failure
+    }
+    SBChain_MergeRange(m, srcs, n, 0, m->total);
+    return SBChain_MergeEnd(m, dest);
+}
+
+SBChain *SB_NewChainFromTemplate(const SBChain *template) {
+    SBChain *sb = RedisModule_Calloc(1, sizeof(*sb));
+    sb->options = template->options;
+    sb->growth = template->growth;
+    sb->filters = RedisModule_Calloc(template->nfilters, sizeof(*sb->filters));
+    for (size_t ii = 0; ii < template->nfilters; ++ii) {
+        SBLink *link = sb->filters + ii;
+        link->inner = template->filters[ii].inner;
+        link->inner.bf = RedisModule_Calloc(link->inner.bytes, 1);
+        if (!link->inner.bf) {
+            SBChain_Free(sb); // LCOV_EXCL_LINE memory failure
+            return NULL;      // LCOV_EXCL_LINE
+        }
+        sb->nfilters++;
+    }
+    if (template->window) {
+        sb->window = RedisModule_Calloc(1, sizeof(*sb->window));
+        *sb->window = *template->window;
+    }
+    SBChain_Touch(sb);
+    if (SBChain_UpdateProbes(sb) != 0) {
+        SBChain_Free(sb); // LCOV_EXCL_LINE memory failure
+        return NULL;      // LCOV_EXCL_LINE
+    }
+    return sb;
+}
+
 SBChain *SB_NewChain(uint64_t initsize, double error_rate, unsigned options, unsigned growth) {
     if (initsize == 0 || error_rate == 0 || error_rate >= 1) {
         return NULL;
@@ -107,6 +689,58 @@ SBChain *SB_NewChain(uint64_t initsize, double error_rate, unsigned options, uns
     return sb;
 }
 
+SBChain *SB_NewWindowChain(uint64_t capacity, double error_rate, unsigned options,
+                           uint32_t generations, uint64_t period, uint64_t now) {
+    if (capacity == 0 || error_rate <= 0 || error_rate >= 1 || generations == 0 || period == 0) {
+        return NULL;
+    }
+    SBChain *sb = RedisModule_Calloc(1, sizeof(*sb));
+    sb->options = options | BLOOM_OPT_NO_SCALING | SB_OPT_WINDOW;
+    sb->window = RedisModule_Calloc(1, sizeof(*sb->window));
+    sb->window->period = period;
+    sb->window->start = now;
+    // A lookup may hit any of the generations
+    for (uint32_t ii = 0; ii < generations; ++ii) {
+        if (SBChain_AddLink(sb, capacity, error_rate / generations) != 0) {
+            SBChain_Free(sb);
+            return NULL;
+        }
+    }
+    return sb;
+}
+
+size_t SBChain_Advance(SBChain *sb, uint64_t now) {
+    SBWindow *w = sb->window;
+    if (!w) {
+        return 0;
+    }
+    w->expired = 0;
+    if (now < w->start || now - w->start < w->period) {
+        return 0;
+    }
+    uint64_t elapsed = (now - w->start) / w->period;
+    size_t cleared = elapsed < sb->nfilters ? elapsed : sb->nfilters;
+    for (size_t ii = 0; ii < cleared; ++ii) {
+        w->current = (w->current + 1) % sb->nfilters;
+        SBLink *link = sb->filters + w->current;
+        memset(link->inner.bf, 0, link->inner.bytes);
+        sb->size -= link->size;
+        link->size = 0;
+    }
+    w->start += elapsed * w->period;
+    SBChain_Touch(sb);
+    return cleared;
+}
+
+void SBChain_Expire(SBChain *sb, uint64_t now) {
+    SBWindow *w = sb->window;
+    if (!w) {
+        return;
+    }
+    uint64_t elapsed = now < w->start ? 0 : (now - w->start) / w->period;
+    w->expired = elapsed < sb->nfilters ? elapsed : sb->nfilters;
+}
+
 typedef struct __attribute__((packed)) {
     uint64_t bytes;
     uint64_t bits;
@@ -137,6 +771,17 @@ typedef struct __attribute__((packed)) {
     dumpedChainLink links[0];
 } dumpedChainHeader;
 
+// Follows the links of windowed chains
+typedef struct __attribute__((packed)) {
+    uint64_t period;
+    uint64_t start;
+    uint32_t current;
+} dumpedChainWindow;
+
+static dumpedChainWindow *encodedWindow(const dumpedChainHeader *header) {
+    return (dumpedChainWindow *)(header->links + header->nfilters);
+}
+
 static SBLink *getLinkPos(const SBChain *sb, long long curIter, size_t *offset) {
     // printf("Requested %lld\n", curIter);
 
@@ -187,6 +832,9 @@ const char *SBChain_GetEncodedChunk(const SBChain *sb, long long *curIter, size_
 
 char *SBChain_GetEncodedHeader(const SBChain *sb, size_t *hdrlen) {
     *hdrlen = sizeof(dumpedChainHeader) + (sizeof(dumpedChainLink) * sb->nfilters);
+    if (sb->window) {
+        *hdrlen += sizeof(dumpedChainWindow);
+    }
     dumpedChainHeader *hdr = RedisModule_Calloc(1, *hdrlen);
     hdr->size = sb->size;
     hdr->nfilters = sb->nfilters;
@@ -201,29 +849,81 @@ char *SBChain_GetEncodedHeader(const SBChain *sb, size_t *hdrlen) {
         X_ENCODED_LINK(X, dstlink, srclink)
 #undef X
     }
+    if (sb->window) {
+        dumpedChainWindow *window = encodedWindow(hdr);
+        window->period = sb->window->period;
+        window->start = sb->window->start;
+        window->current = sb->window->current;
+    }
     return (char *)hdr;
 }
 
 void SB_FreeEncodedHeader(char *s) { RedisModule_Free(s); }
 
-SBChain *SB_NewChainFromHeader(const char *buf, size_t bufLen, const char **errmsg) {
+// Length of the encoded header starting at buf, or 0 if buf is too short to tell
+static size_t encodedHeaderLen(const char *buf, size_t bufLen) {
     const dumpedChainHeader *header = (const void *)buf;
     if (bufLen < sizeof(dumpedChainHeader)) {
-        *errmsg = "ERR received bad data"; // LCOV_EXCL_LINE
-        return NULL;                       // LCOV_EXCL_LINE
+        return 0;
     }
+    return sizeof(*header) + (sizeof(header->links[0]) * header->nfilters) +
+           (header->options & SB_OPT_WINDOW ? sizeof(dumpedChainWindow) : 0);
+}
+
+static int encodedLinkValid(const dumpedChainLink *link, uint32_t options) {
+    // Probes index the buffer by `bits`, or by 2^n2 when it is set
+    if (link->bits == 0 || link->bytes > UINT64_MAX / 8 || link->bits > link->bytes * 8 ||
+        link->n2 > 63 || (link->n2 && (1LLU << link->n2) > link->bits)) {
+        return 0;
+    }
+    if ((options & BLOOM_OPT_BLOCKED) && (link->bytes == 0 || link->bytes % BLOOM_BLOCK_BYTES)) {
+        return 0; // LCOV_EXCL_LINE
+    }
+    // Lookups index the counters by `bits`, which must fit in the buffer
+    if ((options & BLOOM_OPT_COUNTING) && link->bits != link->bytes * 8 / BLOOM_COUNTER_BITS) {
+        return 0; // LCOV_EXCL_LINE
+    }
+    return 1;
+}
 
-    if (bufLen != sizeof(*header) + (sizeof(header->links[0]) * header->nfilters)) {
+// Builds a chain from a header of known length. With `bits`, the links point
+// into it at their offsets in iteration order, otherwise they get a buffer each.
+static SBChain *chainFromHeader(const char *buf, size_t bufLen, unsigned char *bits,
+                                const char **errmsg) {
+    const dumpedChainHeader *header = (const void *)buf;
+    if (bufLen == 0 || bufLen != encodedHeaderLen(buf, bufLen)) {
         *errmsg = "ERR received bad data"; // LCOV_EXCL_LINE
         return NULL;                       // LCOV_EXCL_LINE
     }
 
+    for (size_t ii = 0; ii < header->nfilters; ++ii) {
+        if (!encodedLinkValid(header->links + ii, header->options)) {
+            *errmsg = "ERR received bad data";
+            return NULL;
+        }
+    }
+
+    const dumpedChainWindow *window = NULL;
+    if (header->options & SB_OPT_WINDOW) {
+        window = encodedWindow(header);
+        if (window->period == 0 || window->current >= header->nfilters) {
+            *errmsg = "ERR received bad data"; // LCOV_EXCL_LINE
+            return NULL;                       // LCOV_EXCL_LINE
+        }
+    }
+
     SBChain *sb = RedisModule_Calloc(1, sizeof(*sb));
+    if (window) {
+        sb->window = RedisModule_Calloc(1, sizeof(*sb->window));
+        sb->window->period = window->period;
+        sb->window->start = window->start;
+        sb->window->current = window->current;
+    }
     sb->filters = RedisModule_Calloc(header->nfilters, sizeof(*sb->filters));
     sb->nfilters = header->nfilters;
     sb->options = header->options;
     sb->size = header->size;
-    sb->growth = sb->growth;
+    sb->growth = header->growth;
 
     for (size_t ii = 0; ii < header->nfilters; ++ii) {
         SBLink *dstlink = sb->filters + ii;
@@ -231,12 +931,86 @@ SBChain *SB_NewChainFromHeader(const char *buf, size_t bufLen, const char **errm
 #define X(encfld, dstfld) dstfld = encfld;
         X_ENCODED_LINK(X, srclink, dstlink)
 #undef X
-        dstlink->inner.bf = RedisModule_Alloc(dstlink->inner.bytes);
+        if (bits) {
+            dstlink->inner.bf = bits;
+            bits += dstlink->inner.bytes;
+        } else {
+            // Zeroed, chunks of zeros may be left out of the AOF
+            dstlink->inner.bf = RedisModule_Calloc(dstlink->inner.bytes, 1);
+        }
         if (sb->options & BLOOM_OPT_FORCE64) {
             dstlink->inner.force64 = 1;
         }
+        if (sb->options & BLOOM_OPT_BLOCKED) {
+            dstlink->inner.blocked = 1;
+        }
+        if (sb->options & BLOOM_OPT_COUNTING) {
+            dstlink->inner.counting = 1;
+        }
     }
 
+    SBChain_Touch(sb);
+    if (SBChain_UpdateProbes(sb) != 0) {
+        // LCOV_EXCL_START memory failure
+        if (bits) {
+            sb->nfilters = 0; // The links belong to the caller's mapping
+        }
+        SBChain_Free(sb);
+        return NULL;
+        // LCOV_EXCL_STOP
+    }
+    return sb;
+}
+
+SBChain *SB_NewChainFromHeader(const char *buf, size_t bufLen, const char **errmsg) {
+    return chainFromHeader(buf, bufLen, NULL, errmsg);
+}
+
+SBChain *SB_NewChainFromFile(const char *path, const char **errmsg) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        *errmsg = "ERR could not open file";
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        *errmsg = "ERR not a regular file";
+        return NULL;
+    }
+
+    // Private and writable: pages are shared with the page cache until a write
+    // copies them, and the file itself is never modified.
+    size_t len = st.st_size;
+    char *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        *errmsg = "ERR could not map file";
+        return NULL;
+    }
+
+    // The file holds the header followed by the bits of every link
+    size_t hdrlen = encodedHeaderLen(map, len);
+    const dumpedChainHeader *header = (const void *)map;
+    int valid = hdrlen && hdrlen <= len;
+    size_t total = hdrlen;
+    for (size_t ii = 0; valid && ii < header->nfilters; ++ii) {
+        // Checked against what is left of the file, so the sum cannot overflow
+        valid = header->links[ii].bytes <= len - total;
+        total += valid ? header->links[ii].bytes : 0;
+    }
+    SBChain *sb = NULL;
+    if (valid && total == len) {
+        sb = chainFromHeader(map, hdrlen, (unsigned char *)map + hdrlen, errmsg);
+    } else {
+        *errmsg = "ERR received bad data";
+    }
+    if (!sb) {
+        munmap(map, len);
+        return NULL;
+    }
+    sb->mapped = map;
+    sb->mappedLen = len;
     return sb;
 }
 
@@ -259,5 +1033,61 @@ int SBChain_LoadEncodedChunk(SBChain *sb, long long iter, const char *buf, size_
 
     // printf("Copying to %p. Offset=%lu, Len=%lu\n", link, offset, bufLen);
     memcpy(link->inner.bf + offset, buf, bufLen);
+    SBChain_Touch(sb);
+    return 0;
+}
+
+char *SBChain_GetEncodedStaging(const SBChain *sb, size_t *len) {
+    if (!sb->staging) {
+        return NULL;
+    }
+    *len = sizeof(dumpedChainLink);
+    dumpedChainLink *dstlink = RedisModule_Calloc(1, *len);
+    const SBLink *srclink = sb->staging;
+#define X(encfld, srcfld) encfld = srcfld;
+    X_ENCODED_LINK(X, dstlink, srclink)
+#undef X
+    return (char *)dstlink;
+}
+
+int SBChain_LoadEncodedStaging(SBChain *sb, const char *buf, size_t bufLen, const char **errmsg) {
+    const dumpedChainLink *srclink = (const void *)buf;
+    if (sb->staging) {
+        *errmsg = "ERR consolidation already in progress";
+        return -1;
+    }
+    // Consolidation is refused for these chains, see SBChain_StageBegin
+    if (sb->window || (sb->options & BLOOM_OPT_COUNTING) || bufLen != sizeof(*srclink) ||
+        !encodedLinkValid(srclink, sb->options)) {
+        *errmsg = "ERR received bad data";
+        return -1;
+    }
+
+    SBLink *dstlink = RedisModule_Calloc(1, sizeof(*dstlink));
+#define X(encfld, dstfld) dstfld = encfld;
+    X_ENCODED_LINK(X, srclink, dstlink)
+#undef X
+    dstlink->inner.bf = RedisModule_Calloc(dstlink->inner.bytes, 1);
+    if (sb->options & BLOOM_OPT_FORCE64) {
+        dstlink->inner.force64 = 1;
+    }
+    if (sb->options & BLOOM_OPT_BLOCKED) {
+        dstlink->inner.blocked = 1;
+    }
+    sb->staging = dstlink;
+    return 0;
+}
+
+int SBChain_LoadStagingChunk(SBChain *sb, size_t offset, const char *buf, size_t bufLen,
+                             const char **errmsg) {
+    if (!sb->staging) {
+        *errmsg = "ERR no consolidation in progress";
+        return -1;
+    }
+    if (offset > sb->staging->inner.bytes || bufLen > sb->staging->inner.bytes - offset) {
+        *errmsg = "ERR invalid chunk - Too big for current filter";
+        return -1;
+    }
+    memcpy(sb->staging->inner.bf + offset, buf, bufLen);
     return 0;
 }
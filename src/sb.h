@@ -14,6 +14,44 @@ typedef struct SBLink {
     size_t size;        // < Number of items in the link
 } SBLink;
 
+struct SBProbe;
+typedef int (*SBProbeFn)(const struct SBProbe *p, bloom_hashval hv);
+
+/**
+ * Precomputed lookup parameters of a single link, so that checking the whole
+ * chain is one loop without per-link dispatch. See SBChain_UpdateProbes.
+ */
+typedef struct SBProbe {
+    const unsigned char *bf; //< Bits of the link
+    uint64_t mod;            //< Number of bits or counters, or of blocks for blocked links
+    uint64_t recip;          //< floor((2^64 - 1) / mod), replaces the modulo division
+    uint32_t hashes;         //< Number of hash functions
+    uint8_t kind;            //< How bit positions are derived, SB_PROBE_*
+    SBProbeFn check;         //< Returns 1 if every position is set
+    SBProbeFn add;           //< Sets the positions, returns 1 if any was unset
+} SBProbe;
+
+/** Counters of a chain, see SBChain_EnableStats */
+typedef struct SBChainStats {
+    uint64_t lookups;      //< Items checked by SBChain_Check and SBChain_CheckMany
+    uint64_t linksVisited; //< Links probed by those lookups
+    uint64_t grows;        //< Links added because the last one was full
+} SBChainStats;
+
+/** Sum of the counters of all the chains with stats */
+extern SBChainStats sbTotalStats;
+
+/** Chain option of windowed chains, see SB_NewWindowChain */
+#define SB_OPT_WINDOW 0x100
+
+/** Ring of generations of a windowed chain, one link each */
+typedef struct SBWindow {
+    uint64_t period;  //< Length of a generation, in ms
+    uint64_t start;   //< When the current generation started, in ms
+    uint32_t current; //< Link of the current generation, receiving the adds
+    uint32_t expired; //< Generations past their time, skipped by lookups, see SBChain_Expire
+} SBWindow;
+
 /** A chain of one or more bloom filters */
 typedef struct SBChain {
     SBLink *filters;  //< Current filter
@@ -21,8 +59,24 @@ typedef struct SBChain {
     size_t nfilters;  //< Number of links in chain
     unsigned options; //< Options passed directly to bloom_init
     unsigned growth;
+    SBProbe *probes; //< One entry per link
+    SBLink *staging; //< Link being filled by BF.CONSOLIDATE, or NULL
+    void *mapped;    //< File mapping holding the bits of the links, or NULL
+    size_t mappedLen;
+    SBChainStats *stats; //< Counters, NULL unless enabled
+    SBWindow *window;    //< Generations of a windowed chain, or NULL
+    struct Reserve *reserve; //< Buffer of the next link, allocated ahead of time, or NULL
+    uint64_t stamp;          //< Changed by every write, see SBChain_Touch
 } SBChain;
 
+/**
+ * Marks a change to the chain, giving it a new stamp from a clock shared by all
+ * chains, so that a chain replacing another never has the same stamp. The
+ * functions below changing a chain call it; asynchronous merges compare the
+ * stamps of their sources to notice writes between slices.
+ */
+void SBChain_Touch(SBChain *sb);
+
 /**
  * Create a new chain
  * initsize: The initial desired capacity of the chain
@@ -33,6 +87,36 @@ typedef struct SBChain {
  */
 SBChain *SB_NewChain(uint64_t initsize, double error_rate, unsigned options, unsigned growth);
 
+/**
+ * Create a windowed chain: a ring of `generations` links of `capacity` items
+ * each, for dedup over the last `generations * period` ms. Items are added to
+ * the link of the current generation, which starts at `now`. The false
+ * positive rate of the whole chain is kept under `error_rate`.
+ *
+ * A windowed chain does not scale: adding to a full generation fails like on
+ * a BLOOM_OPT_NO_SCALING chain. It also cannot be consolidated.
+ */
+SBChain *SB_NewWindowChain(uint64_t capacity, double error_rate, unsigned options,
+                           uint32_t generations, uint64_t period, uint64_t now);
+
+/**
+ * Move a windowed chain to the generation holding `now`. The links of the
+ * generations that left the window are cleared in place, keeping their
+ * buffers, and are skipped by lookups until they receive items again.
+ * Must be called before using a windowed chain; times before the start of
+ * the current generation are ignored. Does nothing on other chains.
+ * Returns the number of links cleared.
+ */
+size_t SBChain_Advance(SBChain *sb, uint64_t now);
+
+/**
+ * Hide the generations that left the window at `now` from lookups, without
+ * clearing them, for readers that must not change the chain. They are shown
+ * again by the next SBChain_Advance, which clears them. Does nothing on other
+ * chains.
+ */
+void SBChain_Expire(SBChain *sb, uint64_t now);
+
 /**
  * Create a new chain from a 'template'. This template will copy an existing
  * chain, but not its internal data - which is reset from scratch. This is
@@ -43,18 +127,139 @@ SBChain *SB_NewChainFromTemplate(const SBChain *template);
 /** Free a created chain */
 void SBChain_Free(SBChain *sb);
 
+/**
+ * Rebuild the probe plan used by SBChain_Check. Must be called whenever links
+ * are added or their buffers replaced outside of this file, e.g. after loading
+ * a chain from RDB. Returns 0 on success.
+ */
+int SBChain_UpdateProbes(SBChain *sb);
+
+/**
+ * Starts counting lookups and growth of the chain, also summed in sbTotalStats.
+ * Lookups may run on several threads at once, so their counters are updated
+ * atomically. Returns 0 on success.
+ */
+int SBChain_EnableStats(SBChain *sb);
+
 /**
  * Add an item to the chain
  * Returns 0 if newly added, nonzero if new.
  */
 int SBChain_Add(SBChain *sb, const void *data, size_t len);
 
+/**
+ * Remove an item from a chain created with BLOOM_OPT_COUNTING. On these chains
+ * SBChain_Add counts every addition, so an item added twice must be removed
+ * twice. The item is removed from the newest link holding it.
+ * Returns 1 if removed, 0 if the item is unknown to the chain, -1 if the
+ * chain is not counting.
+ */
+int SBChain_Delete(SBChain *sb, const void *data, size_t len);
+
 /**
  * Check if an item was previously seen by the chain
  * Return 0 if the item is unknown to the chain, nonzero otherwise
  */
 int SBChain_Check(const SBChain *sb, const void *data, size_t len);
 
+/**
+ * Check several items at once. All the items of a batch are hashed and their
+ * probe locations prefetched before any of them is resolved, so the cache
+ * misses of different items overlap.
+ * results[i] receives the value SBChain_Check would return for items[i].
+ */
+void SBChain_CheckMany(const SBChain *sb, const char *const *items, const size_t *lens, size_t n,
+                       int *results);
+
+/**
+ * Add several items at once, prefetching like SBChain_CheckMany. Items are
+ * added in order, with the same semantics as calling SBChain_Add on each.
+ * results[i] receives the value SBChain_Add returns for items[i]. Processing
+ * stops at the first error, which is the last result written.
+ * Returns the number of results written.
+ */
+size_t SBChain_AddMany(SBChain *sb, const char *const *items, const size_t *lens, size_t n,
+                       int *results);
+
+/**
+ * Hashing and adding can also be done separately, e.g. to hash on several
+ * threads. SBChain_HashItem depends only on the options of the chain and is
+ * safe to call concurrently. SBChain_AddHashes behaves like SBChain_AddMany
+ * for the items the hashes were computed from.
+ */
+bloom_hashval SBChain_HashItem(const SBChain *sb, const void *data, size_t len);
+size_t SBChain_AddHashes(SBChain *sb, const bloom_hashval *hashes, size_t n, int *results);
+
+/**
+ * Consolidation folds all the links of a chain into a single one. Bloom bits
+ * cannot be rehashed, so the caller re-supplies every item of the chain.
+ *
+ * SBChain_StageBegin starts an empty staging link sized for `capacity` items.
+ * While it exists, SBChain_Add also writes every accepted item to it so that
+ * concurrent writers are not lost. SBChain_StageAdd adds the re-supplied
+ * items. SBChain_StageCommit replaces all the links with the staging link,
+ * and SBChain_StageAbort discards it.
+ *
+ * StageBegin returns 0 on success, -1 on failure (e.g. already staging).
+ * StageAdd returns 1 if the item was newly added to the staging link.
+ * StageCommit returns 0 on success, -1 if nothing is staged.
+ */
+int SBChain_StageBegin(SBChain *sb, uint64_t capacity);
+int SBChain_StageAdd(SBChain *sb, const void *data, size_t len);
+int SBChain_StageCommit(SBChain *sb);
+void SBChain_StageAbort(SBChain *sb);
+
+/**
+ * The staging link is serialized apart from the chain, after its chunks.
+ * SBChain_GetEncodedStaging encodes its parameters like a link of the header,
+ * or returns NULL if nothing is staged; free it with SB_FreeEncodedHeader.
+ * SBChain_LoadEncodedStaging starts a zeroed staging link from them, and
+ * SBChain_LoadStagingChunk copies `bufLen` bytes of its bits at `offset`.
+ * Both return 0 on success, nonzero on failure with errmsg populated.
+ */
+char *SBChain_GetEncodedStaging(const SBChain *sb, size_t *len);
+int SBChain_LoadEncodedStaging(SBChain *sb, const char *buf, size_t bufLen, const char **errmsg);
+int SBChain_LoadStagingChunk(SBChain *sb, size_t offset, const char *buf, size_t bufLen,
+                             const char **errmsg);
+
+/**
+ * Merging combines chains of the same layout, e.g. created from the same
+ * template, into one holding the union or the intersection of their items.
+ * The bits are ORed or ANDed, the counters of counting chains are summed or
+ * take their minimum. The number of items of every link is estimated from
+ * the positions set after merging, or from the sum of the counters.
+ *
+ * SBChain_MergeCompatible returns 1 if the two chains can be merged. Windowed
+ * chains never can.
+ *
+ * SBChain_MergeBegin prepares a merge into new buffers, laid out like `layout`.
+ * SBChain_MergeRange merges bytes [begin, end) of the `n` sources, counting
+ * bytes across the links in the order of GetEncodedChunk; every byte up to
+ * `total` must be merged once, in any order and in as many calls as needed. The
+ * sources must be compatible with the layout but may change between calls.
+ * SBChain_MergeEnd moves the result into `dest`, which must be compatible, or
+ * into a new chain if `dest` is NULL, and returns that chain.
+ * SBChain_MergeAbort discards the merge.
+ *
+ * SBChain_Merge does all of it at once.
+ */
+typedef struct SBChainMerge {
+    SBChain *chain;  //< Holds the merged links
+    uint64_t *set;   //< Positions set in each merged link, or sum of its counters
+    size_t total;    //< Number of bytes to merge
+    int intersect;
+} SBChainMerge;
+
+int SBChain_MergeCompatible(const SBChain *a, const SBChain *b);
+SBChainMerge *SBChain_MergeBegin(const SBChain *layout, int intersect);
+void SBChain_MergeRange(SBChainMerge *m, const SBChain *const *srcs, size_t n, size_t begin,
+                        size_t end);
+SBChain *SBChain_MergeEnd(SBChainMerge *m, SBChain *dest);
+// Clears what was merged so far, for the merge to start over
+void SBChain_MergeReset(SBChainMerge *m);
+void SBChain_MergeAbort(SBChainMerge *m);
+SBChain *SBChain_Merge(SBChain *dest, const SBChain *const *srcs, size_t n, int intersect);
+
 /**
  * Get an encoded header. This is the first step to serializing a bloom filter.
  * The length of the header will be written to in hdrlen.
@@ -89,6 +294,16 @@ const char *SBChain_GetEncodedChunk(const SBChain *sb, long long *curIter, size_
  */
 SBChain *SB_NewChainFromHeader(const char *buf, size_t bufLen, const char **errmsg);
 
+/**
+ * Creates a new chain from a file holding the encoded header followed by every
+ * chunk returned by GetEncodedChunk, in order. The file is mapped privately
+ * instead of being read: its pages are shared with the page cache and only
+ * copied when the chain writes to them. The file is never modified, but must
+ * not be truncated or rewritten in place while the chain exists.
+ * Returns NULL with errmsg populated if the file cannot be mapped or is corrupt.
+ */
+SBChain *SB_NewChainFromFile(const char *path, const char **errmsg);
+
 /**
  * Incrementally load the bloom filter with chunks returned from GetEncodedChunk.
  * This function returns 0 on success, and nonzero on failure - in which case errmsg
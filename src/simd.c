@@ -0,0 +1,385 @@
+#include "simd.h"
+
+#include <string.h>  // memcpy
+#include <strings.h> // strcasecmp
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SIMD_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+#define BLOCK_WORDS (SIMD_BLOCK_BYTES / 8)
+
+/////////////////////////////////////////////////////////////////////////////
+// Scalar                                                                  //
+/////////////////////////////////////////////////////////////////////////////
+
+static int scalarBlockTest(const unsigned char *block, const unsigned char *mask) {
+    for (size_t ii = 0; ii < BLOCK_WORDS; ++ii) {
+        uint64_t b, m;
+        memcpy(&b, block + ii * 8, 8);
+        memcpy(&m, mask + ii * 8, 8);
+        if ((b & m) != m) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int scalarBlockSet(unsigned char *block, const unsigned char *mask) {
+    uint64_t unset = 0;
+    for (size_t ii = 0; ii < BLOCK_WORDS; ++ii) {
+        uint64_t b, m;
+        memcpy(&b, block + ii * 8, 8);
+        memcpy(&m, mask + ii * 8, 8);
+        unset |= m & ~b;
+        b |= m;
+        memcpy(block + ii * 8, &b, 8);
+    }
+    return unset != 0;
+}
+
+static int scalarFindByte(const uint8_t *buf, size_t n, uint8_t v) {
+    for (size_t ii = 0; ii < n; ++ii) {
+        if (buf[ii] == v) {
+            return ii;
+        }
+    }
+    return -1;
+}
+
+static size_t scalarCountByte(const uint8_t *buf, size_t n, uint8_t v) {
+    size_t ret = 0;
+    for (size_t ii = 0; ii < n; ++ii) {
+        ret += buf[ii] == v;
+    }
+    return ret;
+}
+
+static uint64_t scalarMergeBits(uint8_t *dst, const uint8_t *src, size_t n, int intersect) {
+    uint64_t ret = 0;
+    size_t ii = 0;
+    for (; ii + 8 <= n; ii += 8) {
+        uint64_t d, s;
+        memcpy(&d, dst + ii, 8);
+        memcpy(&s, src + ii, 8);
+        d = intersect ? d & s : d | s;
+        memcpy(dst + ii, &d, 8);
+        ret += __builtin_popcountll(d);
+    }
+    for (; ii < n; ++ii) {
+        dst[ii] = intersect ? dst[ii] & src[ii] : dst[ii] | src[ii];
+        ret += __builtin_popcount(dst[ii]);
+    }
+    return ret;
+}
+
+static const SIMDOps scalarOps = {.name = "scalar",
+                                  .blockTest = scalarBlockTest,
+                                  .blockSet = scalarBlockSet,
+                                  .findByte = scalarFindByte,
+                                  .countByte = scalarCountByte,
+                                  .mergeBits = scalarMergeBits};
+
+#ifdef SIMD_X86
+/////////////////////////////////////////////////////////////////////////////
+// SSE4 (SSE2 byte compares, SSE4.1 ptest)                                 //
+/////////////////////////////////////////////////////////////////////////////
+
+#define SSE4_TARGET __attribute__((target("sse4.2,popcnt")))
+
+SSE4_TARGET static int sse4BlockTest(const unsigned char *block, const unsigned char *mask) {
+    int ret = 1;
+    for (size_t ii = 0; ii < SIMD_BLOCK_BYTES; ii += 16) {
+        __m128i b = _mm_loadu_si128((const __m128i *)(block + ii));
+        __m128i m = _mm_loadu_si128((const __m128i *)(mask + ii));
+        ret &= _mm_testc_si128(b, m);
+    }
+    return ret;
+}
+
+SSE4_TARGET static int sse4BlockSet(unsigned char *block, const unsigned char *mask) {
+    int allSet = 1;
+    for (size_t ii = 0; ii < SIMD_BLOCK_BYTES; ii += 16) {
+        __m128i b = _mm_loadu_si128((const __m128i *)(block + ii));
+        __m128i m = _mm_loadu_si128((const __m128i *)(mask + ii));
+        allSet &= _mm_testc_si128(b, m);
+        _mm_storeu_si128((__m128i *)(block + ii), _mm_or_si128(b, m));
+    }
+    return !allSet;
+}
+
+SSE4_TARGET static int sse4FindByte(const uint8_t *buf, size_t n, uint8_t v) {
+    const __m128i needle = _mm_set1_epi8((char)v);
+    size_t ii = 0;
+    for (; ii + 16 <= n; ii += 16) {
+        __m128i cmp = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + ii)), needle);
+        unsigned bits = _mm_movemask_epi8(cmp);
+        if (bits) {
+            return ii + __builtin_ctz(bits);
+        }
+    }
+    int pos = scalarFindByte(buf + ii, n - ii, v);
+    return pos < 0 ? -1 : (int)ii + pos;
+}
+
+SSE4_TARGET static size_t sse4CountByte(const uint8_t *buf, size_t n, uint8_t v) {
+    const __m128i needle = _mm_set1_epi8((char)v);
+    size_t ret = 0, ii = 0;
+    for (; ii + 16 <= n; ii += 16) {
+        __m128i cmp = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + ii)), needle);
+        ret += __builtin_popcount(_mm_movemask_epi8(cmp));
+    }
+    return ret + scalarCountByte(buf + ii, n - ii, v);
+}
+
+SSE4_TARGET static uint64_t sse4MergeBits(uint8_t *dst, const uint8_t *src, size_t n,
+                                          int intersect) {
+    uint64_t ret = 0;
+    size_t ii = 0;
+    for (; ii + 16 <= n; ii += 16) {
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + ii));
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + ii));
+        d = intersect ? _mm_and_si128(d, s) : _mm_or_si128(d, s);
+        _mm_storeu_si128((__m128i *)(dst + ii), d);
+        uint64_t w[2];
+        memcpy(w, &d, sizeof w);
+        ret += __builtin_popcountll(w[0]) + __builtin_popcountll(w[1]);
+    }
+    return ret + scalarMergeBits(dst + ii, src + ii, n - ii, intersect);
+}
+
+static const SIMDOps sse4Ops = {.name = "sse4",
+                                .blockTest = sse4BlockTest,
+                                .blockSet = sse4BlockSet,
+                                .findByte = sse4FindByte,
+                                .countByte = sse4CountByte,
+                                .mergeBits = sse4MergeBits};
+
+/////////////////////////////////////////////////////////////////////////////
+// AVX2                                                                    //
+/////////////////////////////////////////////////////////////////////////////
+
+// The tails are handled with 128 bit operations compiled for the same target:
+// calling into the SSE4 kernels would mix legacy and VEX encodings, which costs
+// more than the tail itself.
+#define AVX2_TARGET __attribute__((target("avx2,popcnt")))
+
+AVX2_TARGET static int avx2BlockTest(const unsigned char *block, const unsigned char *mask) {
+    __m256i b0 = _mm256_loadu_si256((const __m256i *)block);
+    __m256i b1 = _mm256_loadu_si256((const __m256i *)(block + 32));
+    __m256i m0 = _mm256_loadu_si256((const __m256i *)mask);
+    __m256i m1 = _mm256_loadu_si256((const __m256i *)(mask + 32));
+    return _mm256_testc_si256(b0, m0) & _mm256_testc_si256(b1, m1);
+}
+
+AVX2_TARGET static int avx2BlockSet(unsigned char *block, const unsigned char *mask) {
+    __m256i b0 = _mm256_loadu_si256((const __m256i *)block);
+    __m256i b1 = _mm256_loadu_si256((const __m256i *)(block + 32));
+    __m256i m0 = _mm256_loadu_si256((const __m256i *)mask);
+    __m256i m1 = _mm256_loadu_si256((const __m256i *)(mask + 32));
+    int allSet = _mm256_testc_si256(b0, m0) & _mm256_testc_si256(b1, m1);
+    _mm256_storeu_si256((__m256i *)block, _mm256_or_si256(b0, m0));
+    _mm256_storeu_si256((__m256i *)(block + 32), _mm256_or_si256(b1, m1));
+    return !allSet;
+}
+
+AVX2_TARGET static int avx2FindByte(const uint8_t *buf, size_t n, uint8_t v) {
+    const __m256i needle = _mm256_set1_epi8((char)v);
+    size_t ii = 0;
+    for (; ii + 32 <= n; ii += 32) {
+        __m256i cmp = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + ii)), needle);
+        unsigned bits = _mm256_movemask_epi8(cmp);
+        if (bits) {
+            return ii + __builtin_ctz(bits);
+        }
+    }
+    if (ii + 16 <= n) {
+        __m128i cmp = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + ii)),
+                                     _mm256_castsi256_si128(needle));
+        unsigned bits = _mm_movemask_epi8(cmp);
+        if (bits) {
+            return ii + __builtin_ctz(bits);
+        }
+        ii += 16;
+    }
+    int pos = scalarFindByte(buf + ii, n - ii, v);
+    return pos < 0 ? -1 : (int)ii + pos;
+}
+
+AVX2_TARGET static size_t avx2CountByte(const uint8_t *buf, size_t n, uint8_t v) {
+    const __m256i needle = _mm256_set1_epi8((char)v);
+    size_t ret = 0, ii = 0;
+    for (; ii + 32 <= n; ii += 32) {
+        __m256i cmp = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + ii)), needle);
+        ret += __builtin_popcount(_mm256_movemask_epi8(cmp));
+    }
+    if (ii + 16 <= n) {
+        __m128i cmp = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + ii)),
+                                     _mm256_castsi256_si128(needle));
+        ret += __builtin_popcount(_mm_movemask_epi8(cmp));
+        ii += 16;
+    }
+    return ret + scalarCountByte(buf + ii, n - ii, v);
+}
+
+AVX2_TARGET static uint64_t avx2MergeBits(uint8_t *dst, const uint8_t *src, size_t n,
+                                          int intersect) {
+    uint64_t ret = 0;
+    size_t ii = 0;
+    for (; ii + 32 <= n; ii += 32) {
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + ii));
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + ii));
+        d = intersect ? _mm256_and_si256(d, s) : _mm256_or_si256(d, s);
+        _mm256_storeu_si256((__m256i *)(dst + ii), d);
+        uint64_t w[4];
+        memcpy(w, &d, sizeof w);
+        ret += __builtin_popcountll(w[0]) + __builtin_popcountll(w[1]) +
+               __builtin_popcountll(w[2]) + __builtin_popcountll(w[3]);
+    }
+    return ret + scalarMergeBits(dst + ii, src + ii, n - ii, intersect);
+}
+
+static const SIMDOps avx2Ops = {.name = "avx2",
+                                .blockTest = avx2BlockTest,
+                                .blockSet = avx2BlockSet,
+                                .findByte = avx2FindByte,
+                                .countByte = avx2CountByte,
+                                .mergeBits = avx2MergeBits};
+#endif // SIMD_X86
+
+#ifdef SIMD_NEON
+/////////////////////////////////////////////////////////////////////////////
+// NEON                                                                    //
+/////////////////////////////////////////////////////////////////////////////
+
+static int neonBlockTest(const unsigned char *block, const unsigned char *mask) {
+    uint8x16_t unset = vdupq_n_u8(0);
+    for (size_t ii = 0; ii < SIMD_BLOCK_BYTES; ii += 16) {
+        unset = vorrq_u8(unset, vbicq_u8(vld1q_u8(mask + ii), vld1q_u8(block + ii)));
+    }
+    return vmaxvq_u8(unset) == 0;
+}
+
+static int neonBlockSet(unsigned char *block, const unsigned char *mask) {
+    uint8x16_t unset = vdupq_n_u8(0);
+    for (size_t ii = 0; ii < SIMD_BLOCK_BYTES; ii += 16) {
+        uint8x16_t b = vld1q_u8(block + ii);
+        uint8x16_t m = vld1q_u8(mask + ii);
+        unset = vorrq_u8(unset, vbicq_u8(m, b));
+        vst1q_u8(block + ii, vorrq_u8(b, m));
+    }
+    return vmaxvq_u8(unset) != 0;
+}
+
+static int neonFindByte(const uint8_t *buf, size_t n, uint8_t v) {
+    const uint8x16_t needle = vdupq_n_u8(v);
+    size_t ii = 0;
+    for (; ii + 16 <= n; ii += 16) {
+        uint8x16_t cmp = vceqq_u8(vld1q_u8(buf + ii), needle);
+        // Narrow each byte of the comparison to a nibble to get a 64 bit mask
+        uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(cmp), 4);
+        uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(nibbles), 0);
+        if (bits) {
+            return ii + (__builtin_ctzll(bits) >> 2);
+        }
+    }
+    int pos = scalarFindByte(buf + ii, n - ii, v);
+    return pos < 0 ? -1 : (int)ii + pos;
+}
+
+static size_t neonCountByte(const uint8_t *buf, size_t n, uint8_t v) {
+    const uint8x16_t needle = vdupq_n_u8(v);
+    const uint8x16_t one = vdupq_n_u8(1);
+    size_t ret = 0, ii = 0;
+    for (; ii + 16 <= n; ii += 16) {
+        uint8x16_t cmp = vceqq_u8(vld1q_u8(buf + ii), needle);
+        ret += vaddvq_u8(vandq_u8(cmp, one));
+    }
+    return ret + scalarCountByte(buf + ii, n - ii, v);
+}
+
+static uint64_t neonMergeBits(uint8_t *dst, const uint8_t *src, size_t n, int intersect) {
+    uint64_t ret = 0;
+    size_t ii = 0;
+    for (; ii + 16 <= n; ii += 16) {
+        uint8x16_t d = vld1q_u8(dst + ii);
+        uint8x16_t s = vld1q_u8(src + ii);
+        d = intersect ? vandq_u8(d, s) : vorrq_u8(d, s);
+        vst1q_u8(dst + ii, d);
+        // At most 8 bits per byte, the sum of 16 of them fits in a byte
+        ret += vaddvq_u8(vcntq_u8(d));
+    }
+    return ret + scalarMergeBits(dst + ii, src + ii, n - ii, intersect);
+}
+
+static const SIMDOps neonOps = {.name = "neon",
+                                .blockTest = neonBlockTest,
+                                .blockSet = neonBlockSet,
+                                .findByte = neonFindByte,
+                                .countByte = neonCountByte,
+                                .mergeBits = neonMergeBits};
+#endif // SIMD_NEON
+
+/////////////////////////////////////////////////////////////////////////////
+// Dispatch                                                                //
+/////////////////////////////////////////////////////////////////////////////
+
+SIMDOps simdOps = {.name = "scalar",
+                   .blockTest = scalarBlockTest,
+                   .blockSet = scalarBlockSet,
+                   .findByte = scalarFindByte,
+                   .countByte = scalarCountByte,
+                   .mergeBits = scalarMergeBits};
+
+static int isSupported(const SIMDOps *ops) {
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (ops == &avx2Ops) {
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+    }
+    if (ops == &sse4Ops) {
+        return __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt");
+    }
+#endif
+    return 1;
+}
+
+// Ordered from the most preferable
+static const SIMDOps *const allOps[] = {
+#ifdef SIMD_X86
+    &avx2Ops,
+    &sse4Ops,
+#endif
+#ifdef SIMD_NEON
+    &neonOps,
+#endif
+    &scalarOps,
+};
+
+void SIMD_Init(void) {
+    for (size_t ii = 0; ii < sizeof(allOps) / sizeof(allOps[0]); ++ii) {
+        if (isSupported(allOps[ii])) {
+            simdOps = *allOps[ii];
+            return;
+        }
+    }
+}
+
+int SIMD_Select(const char *name) {
+    for (size_t ii = 0; ii < sizeof(allOps) / sizeof(allOps[0]); ++ii) {
+        if (!strcasecmp(allOps[ii]->name, name)) {
+            if (!isSupported(allOps[ii])) {
+                return -1;
+            }
+            simdOps = *allOps[ii];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *SIMD_Name(void) { return simdOps.name; }
@@ -0,0 +1,62 @@
+#ifndef REDISBLOOM_SIMD_H
+#define REDISBLOOM_SIMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Probe kernels used by the hot lookup paths of the Bloom and Cuckoo filters.
+ * The scalar implementation is always available and selected by default;
+ * SIMD_Init() replaces it with the widest one the CPU supports.
+ */
+
+/** Size in bytes of the blocks handled by blockTest/blockSet */
+#define SIMD_BLOCK_BYTES 64
+
+typedef struct {
+    const char *name;
+
+    /** Returns 1 if every bit set in `mask` is also set in `block` */
+    int (*blockTest)(const unsigned char *block, const unsigned char *mask);
+
+    /** Sets the bits of `mask` in `block`. Returns 1 if any of them was unset */
+    int (*blockSet)(unsigned char *block, const unsigned char *mask);
+
+    /** Returns the index of the first byte equal to `v`, or -1 if there is none */
+    int (*findByte)(const uint8_t *buf, size_t n, uint8_t v);
+
+    /** Returns the number of bytes equal to `v` */
+    size_t (*countByte)(const uint8_t *buf, size_t n, uint8_t v);
+
+    /**
+     * ORs `src` into `dst`, or ANDs it with `intersect`. Returns the number of
+     * bits set in `dst` afterwards
+     */
+    uint64_t (*mergeBits)(uint8_t *dst, const uint8_t *src, size_t n, int intersect);
+} SIMDOps;
+
+extern SIMDOps simdOps;
+
+/**
+ * Select the best kernels supported by the running CPU.
+ * Safe to call more than once.
+ */
+void SIMD_Init(void);
+
+/**
+ * Select kernels by name ("scalar", "sse4", "avx2", "neon").
+ * Returns 0 on success, -1 if unknown or not supported by this CPU.
+ */
+int SIMD_Select(const char *name);
+
+/** Name of the currently selected kernels */
+const char *SIMD_Name(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
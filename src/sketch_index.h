@@ -0,0 +1,94 @@
+#ifndef SKETCH_INDEX_H
+#define SKETCH_INDEX_H
+
+#include <stddef.h>  // size_t
+#include <stdint.h>  // uint32_t
+#include <strings.h> // strcasecmp
+
+#include "contrib/murmurhash3.h"
+
+/**
+ * How Count-Min Sketch and Top-K rows map a 32 bit hash to one of their `width`
+ * counters. POW2 and FASTRANGE avoid the integer division of the default mode.
+ * The mode is part of the encoded sketch, as it changes where items land.
+ */
+typedef enum {
+    SKETCH_INDEX_MOD = 0,
+    // width is a power of two, hash & (width - 1)
+    SKETCH_INDEX_POW2 = 1,
+    // Lemire's multiply-shift range reduction, (hash * width) >> 32
+    SKETCH_INDEX_FASTRANGE = 2,
+} SketchIndexMode;
+
+/**
+ * How the row hashes are computed. Sketches created before SKETCH_HASH_DOUBLE
+ * hashed the item once per row with a different seed.
+ */
+typedef enum {
+    SKETCH_HASH_PER_ROW = 0,
+    // One 128 bit hash, rows derived by Kirsch-Mitzenmacher double hashing
+    SKETCH_HASH_DOUBLE = 1,
+} SketchHashMode;
+
+typedef struct {
+    uint64_t a;
+    uint64_t b;
+} SketchHash;
+
+static inline SketchHash Sketch_Hash(const char *item, size_t itemlen) {
+    uint64_t out[2];
+    MurmurHash3_x64_128(item, itemlen, 0x9747b28c, out);
+    return (SketchHash){.a = out[0], .b = out[1]};
+}
+
+/** Hash of row `i`, from the high bits of a + i * b */
+static inline uint32_t Sketch_RowHash(SketchHash h, uint32_t i) { return (h.a + i * h.b) >> 32; }
+
+/** Item fingerprint, independent from the row hashes */
+static inline uint32_t Sketch_Fingerprint(SketchHash h) { return (uint32_t)h.a; }
+
+#define SKETCH_INDEX_MAX_WIDTH ((size_t)1 << 31)
+
+static inline size_t Sketch_Index(uint32_t hash, size_t width, int mode) {
+    switch (mode) {
+    case SKETCH_INDEX_POW2:
+        return hash & (width - 1);
+    case SKETCH_INDEX_FASTRANGE:
+        return ((uint64_t)hash * width) >> 32;
+    default:
+        return hash % width;
+    }
+}
+
+/** Returns the mode named by `s`, or -1 if it isn't one */
+static inline int Sketch_ParseIndexMode(const char *s) {
+    if (!strcasecmp(s, "POW2")) {
+        return SKETCH_INDEX_POW2;
+    } else if (!strcasecmp(s, "FASTRANGE")) {
+        return SKETCH_INDEX_FASTRANGE;
+    }
+    return -1;
+}
+
+/**
+ * Adjusts `width` to what `mode` requires. Returns 0, or -1 if the width is
+ * too large for the mode.
+ */
+static inline int Sketch_IndexWidth(int mode, size_t *width) {
+    if (mode == SKETCH_INDEX_MOD) {
+        return 0;
+    }
+    if (*width > SKETCH_INDEX_MAX_WIDTH) {
+        return -1;
+    }
+    if (mode == SKETCH_INDEX_POW2) {
+        size_t w = 1;
+        while (w < *width) {
+            w <<= 1;
+        }
+        *width = w;
+    }
+    return 0;
+}
+
+#endif
@@ -16,6 +16,7 @@
 #include <stdbool.h> // bool
 
 #include "topk.h"
+#include "sketch_index.h"
 #include "../contrib/murmurhash2.h"
 
 #define TOPK_HASH(item, itemlen, i) MurmurHash2(item, itemlen, i)
@@ -23,14 +24,102 @@
 
 static inline uint32_t max(uint32_t a, uint32_t b) { return a > b ? a : b; }
 
-static inline char *topKStrndup(const char *s, size_t n) {
-    char *ret = TOPK_CALLOC(n + 1, sizeof(char));
-    if (ret)
-        memcpy(ret, s, n);
+#define TOPK_ARENA_MIN_SIZE 64
+
+/*  Heap items are appended to a per-sketch arena instead of being allocated
+    one by one. Expelled items are left in place until the arena is full, then
+    the live items are copied to a new arena sized to twice what they need,
+    so compaction is amortized over at least as many bytes as it copies. */
+static void arenaReserve(TopK *topk, size_t len) {
+    if (topk->arenaUsed + len <= topk->arenaSize) {
+        return;
+    }
+    size_t size = 2 * (topk->arenaLive + len);
+    if (size < TOPK_ARENA_MIN_SIZE) {
+        size = TOPK_ARENA_MIN_SIZE;
+    }
+    char *arena = TOPK_CALLOC(size, sizeof(char));
+    size_t used = 0;
+    for (uint32_t i = 0; i < topk->k; ++i) {
+        HeapBucket *bucket = &topk->heap[i];
+        if (bucket->item) {
+            memcpy(arena + used, bucket->item, bucket->itemlen + 1);
+            bucket->item = arena + used;
+            used += bucket->itemlen + 1;
+        }
+    }
+    TOPK_FREE(topk->arena);
+    topk->arena = arena;
+    topk->arenaSize = size;
+    topk->arenaUsed = used;
+}
+
+static char *arenaAppend(TopK *topk, const char *item, size_t itemlen) {
+    arenaReserve(topk, itemlen + 1);
+    char *ret = topk->arena + topk->arenaUsed;
+    memcpy(ret, item, itemlen);
+    ret[itemlen] = '\0';
+    topk->arenaUsed += itemlen + 1;
+    topk->arenaLive += itemlen + 1;
     return ret;
 }
 
-void heapifyDown(HeapBucket *array, size_t len, size_t start) {
+/*  Heap items are found through 'heapIndex', a linear probing table keyed by
+    fingerprint whose entries hold the heap slot of the item plus one. Entries
+    follow the items as heapifyDown moves them. */
+
+static inline uint32_t indexStart(const TopK *topk, uint32_t fp) {
+    return (fp ^ (fp >> 16)) & topk->heapIndexMask;
+}
+
+static void indexInsert(TopK *topk, uint32_t slot) {
+    uint32_t pos = indexStart(topk, topk->heap[slot].fp);
+    while (topk->heapIndex[pos] != 0) {
+        pos = (pos + 1) & topk->heapIndexMask;
+    }
+    topk->heapIndex[pos] = slot + 1;
+}
+
+// Returns the entry of the item in heap 'slot'
+static uint32_t indexFind(const TopK *topk, uint32_t slot) {
+    uint32_t pos = indexStart(topk, topk->heap[slot].fp);
+    while (topk->heapIndex[pos] != slot + 1) {
+        assert(topk->heapIndex[pos] != 0);
+        pos = (pos + 1) & topk->heapIndexMask;
+    }
+    return pos;
+}
+
+// Removes entry 'pos', shifting back the entries after it so no tombstone is needed
+static void indexRemove(TopK *topk, uint32_t pos) {
+    uint32_t *index = topk->heapIndex;
+    uint32_t mask = topk->heapIndexMask;
+    uint32_t next = pos;
+    for (;;) {
+        next = (next + 1) & mask;
+        if (index[next] == 0) {
+            break;
+        }
+        uint32_t home = indexStart(topk, topk->heap[index[next] - 1].fp);
+        // Move the entry back unless its home lies cyclically in (pos, next]
+        if (((next - home) & mask) >= ((next - pos) & mask)) {
+            index[pos] = index[next];
+            pos = next;
+        }
+    }
+    index[pos] = 0;
+}
+
+static inline void heapMove(TopK *topk, HeapBucket *array, size_t to, size_t from) {
+    if (topk && array[from].item) {
+        topk->heapIndex[indexFind(topk, from)] = to + 1;
+    }
+    memcpy(&array[to], &array[from], sizeof(HeapBucket));
+}
+
+/*  Sifts 'start' down the min heap. If 'topk' is not NULL, 'array' is its heap
+    and its index is kept up to date. */
+static void siftDown(TopK *topk, HeapBucket *array, size_t len, size_t start) {
     size_t child = start;
 
     // check whether larger than children
@@ -47,9 +136,13 @@ void heapifyDown(HeapBucket *array, size_t len, size_t start) {
 
     // swap while larger than child
     HeapBucket top = {0};
+    uint32_t topEntry = 0;
+    if (topk && array[start].item) {
+        topEntry = indexFind(topk, start) + 1;
+    }
     memcpy(&top, &array[start], sizeof(HeapBucket));
     do {
-        memcpy(&array[start], &array[child], sizeof(HeapBucket));
+        heapMove(topk, array, start, child);
         start = child;
 
         if ((len - 2) / 2 < child) {
@@ -62,6 +155,72 @@ void heapifyDown(HeapBucket *array, size_t len, size_t start) {
         }
     } while (array[child].count < top.count);
     memcpy(&array[start], &top, sizeof(HeapBucket));
+    if (topEntry) {
+        topk->heapIndex[topEntry - 1] = start + 1;
+    }
+}
+
+void heapifyDown(HeapBucket *array, size_t len, size_t start) {
+    siftDown(NULL, array, len, start);
+}
+
+static void indexFill(TopK *topk) {
+    memset(topk->heapIndex, 0, (topk->heapIndexMask + 1) * sizeof(uint32_t));
+    for (uint32_t i = 0; i < topk->k; ++i) {
+        if (topk->heap[i].item) {
+            indexInsert(topk, i);
+        }
+    }
+}
+
+void TopK_BuildIndex(TopK *topk) {
+    // Keep the load factor at or below 1/2
+    size_t size = 2;
+    while (size < 2 * (size_t)topk->k) {
+        size <<= 1;
+    }
+    TOPK_FREE(topk->heapIndex);
+    topk->heapIndex = TOPK_CALLOC(size, sizeof(uint32_t));
+    topk->heapIndexMask = size - 1;
+    indexFill(topk);
+}
+
+/*  Random generator for decay. The state lives in the sketch so that a
+    master and its replicas, which load the same RDB, take the same decisions. */
+static inline uint64_t nextRandom(TopK *topk) {
+    uint64_t x = topk->rngState;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    topk->rngState = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+// Uniform double in (0, 1]
+static inline double nextUniform(TopK *topk) {
+    return ((nextRandom(topk) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+static inline double decayChance(const TopK *topk, counter_t count) {
+    if (count < TOPK_DECAY_LOOKUP_TABLE) {
+        return topk->lookupTable[count];
+    }
+    return pow(topk->decay, count);
+}
+
+void TopK_InitDecay(TopK *topk) {
+    for (uint32_t i = 0; i < TOPK_DECAY_LOOKUP_TABLE; ++i) {
+        topk->lookupTable[i] = pow(topk->decay, i);
+    }
+    if (topk->rngState == 0) {
+        // splitmix64 of the dimensions, never 0 which xorshift can't leave
+        uint64_t z = 0x9E3779B97F4A7C15ULL * (((uint64_t)topk->k << 32) ^ topk->width) +
+                     topk->depth;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        z ^= z >> 31;
+        topk->rngState = z ? z : 1;
+    }
 }
 
 TopK *TopK_Create(uint32_t k, uint32_t width, uint32_t depth, double decay) {
@@ -75,12 +234,11 @@ TopK *TopK_Create(uint32_t k, uint32_t width, uint32_t depth, double decay) {
     topk->width = width;
     topk->depth = depth;
     topk->decay = decay;
+    topk->hashMode = SKETCH_HASH_DOUBLE;
     topk->data = TOPK_CALLOC(((size_t)width) * depth, sizeof(Bucket));
     topk->heap = TOPK_CALLOC(k, sizeof(HeapBucket));
-
-    for (uint32_t i = 0; i < TOPK_DECAY_LOOKUP_TABLE; ++i) {
-        topk->lookupTable[i] = pow(decay, i);
-    }
+    TopK_BuildIndex(topk);
+    TopK_InitDecay(topk);
 
     return topk;
 }
@@ -88,31 +246,146 @@ TopK *TopK_Create(uint32_t k, uint32_t width, uint32_t depth, double decay) {
 void TopK_Destroy(TopK *topk) {
     assert(topk);
 
-    for (uint32_t i = 0; i < topk->k; ++i) {
-        TOPK_FREE(topk->heap[i].item);
-    }
-
+    TOPK_FREE(topk->arena);
+    topk->arena = NULL;
     TOPK_FREE(topk->heap);
     topk->heap = NULL;
+    TOPK_FREE(topk->heapIndex);
+    topk->heapIndex = NULL;
     TOPK_FREE(topk->data);
     topk->data = NULL;
+    TOPK_FREE(topk->stats);
     TOPK_FREE(topk);
 }
 
-// Complexity O(k + strlen)
-static HeapBucket *checkExistInHeap(TopK *topk, const char *item, size_t itemlen) {
-    uint32_t fp = TOPK_HASH(item, itemlen, GA);
-    HeapBucket *runner = topk->heap;
+TopKStats topkTotalStats;
+
+int TopK_EnableStats(TopK *topk) {
+    if (!topk->stats) {
+        topk->stats = TOPK_CALLOC(1, sizeof(*topk->stats));
+    }
+    return topk->stats ? 0 : -1;
+}
+
+#define TOPK_COUNT(topk, field, n)                                                                 \
+    do {                                                                                           \
+        if ((topk)->stats) {                                                                       \
+            (topk)->stats->field += (n);                                                           \
+            topkTotalStats.field += (n);                                                           \
+        }                                                                                          \
+    } while (0)
+
+typedef struct {
+    SketchHash h;
+    uint32_t fp;
+} ItemHash;
+
+static inline ItemHash itemHash(const TopK *topk, const char *item, size_t itemlen) {
+    ItemHash ih = {0};
+    if (topk->hashMode == SKETCH_HASH_DOUBLE) {
+        ih.h = Sketch_Hash(item, itemlen);
+        ih.fp = Sketch_Fingerprint(ih.h);
+    } else {
+        ih.fp = TOPK_HASH(item, itemlen, GA);
+    }
+    return ih;
+}
+
+static inline uint32_t rowLoc(const TopK *topk, const char *item, size_t itemlen,
+                              const ItemHash *ih, uint32_t i) {
+    uint32_t hash = topk->hashMode == SKETCH_HASH_DOUBLE ? Sketch_RowHash(ih->h, i)
+                                                         : TOPK_HASH(item, itemlen, i);
+    return Sketch_Index(hash, topk->width, topk->indexMode);
+}
+
+/*  Applies 'increment' decay attempts to a bucket owned by another item.
+    Each attempt decrements the counter with probability decay^count, so the
+    number of attempts until the next decrement is geometric and can be drawn
+    directly instead of flipping a coin per attempt. Returns the count the
+    item takes over the bucket with, or 0 if the bucket survived.
+    Complexity - O(decrements), which is bounded by log(increment) / -log(decay) */
+static counter_t decayBucket(TopK *topk, Bucket *runner, uint32_t increment) {
+    uint64_t left = increment;
+    counter_t count = runner->count;
+
+    if (topk->decay == 1) {
+        // Every attempt succeeds
+        if (left < count) {
+            runner->count = count - left;
+            return 0;
+        }
+        return left - count + 1;
+    }
 
-    for (int32_t i = topk->k - 1; i >= 0; --i)
-        if (fp == (runner + i)->fp && itemlen == (runner + i)->itemlen &&
-            memcmp((runner + i)->item, item, itemlen) == 0) {
-            return runner + i;
+    while (left > 0) {
+        double chance = decayChance(topk, count);
+        if (chance <= 0) {
+            break;
+        }
+        // Attempts up to and including the next successful one
+        double attempts = floor(log(nextUniform(topk)) / log1p(-chance)) + 1;
+        if (attempts > left) {
+            break;
+        }
+        left -= (uint64_t)attempts;
+        if (--count == 0) {
+            // The attempt that emptied the bucket counts for the new item
+            return left + 1;
         }
+    }
+    runner->count = count;
+    return 0;
+}
+
+// Complexity O(strlen)
+static HeapBucket *checkExistInHeap(TopK *topk, const char *item, size_t itemlen, uint32_t fp) {
+    for (uint32_t pos = indexStart(topk, fp); topk->heapIndex[pos] != 0;
+         pos = (pos + 1) & topk->heapIndexMask) {
+        HeapBucket *runner = topk->heap + topk->heapIndex[pos] - 1;
+        if (fp == runner->fp && itemlen == runner->itemlen &&
+            memcmp(runner->item, item, itemlen) == 0) {
+            return runner;
+        }
+    }
     return NULL;
 }
 
-char *TopK_Add(TopK *topk, const char *item, size_t itemlen, uint32_t increment) {
+void TopK_SetHeapItem(TopK *topk, uint32_t slot, const char *item, size_t itemlen) {
+    assert(slot < topk->k);
+    HeapBucket *bucket = &topk->heap[slot];
+    if (bucket->item) {
+        topk->arenaLive -= bucket->itemlen + 1;
+        bucket->item = NULL;
+    }
+    bucket->item = arenaAppend(topk, item, itemlen);
+    bucket->itemlen = itemlen;
+}
+
+// Puts 'item' in place of the item with the smallest count and returns the expelled item
+static const char *replaceHeapMin(TopK *topk, const char *item, size_t itemlen, uint32_t fp,
+                                  counter_t count, size_t *expelledLen) {
+    // Compact before reading the expelled item so it stays in the arena
+    arenaReserve(topk, itemlen + 1);
+    char *expelled = topk->heap[0].item;
+    if (expelled) {
+        indexRemove(topk, indexFind(topk, 0));
+        topk->arenaLive -= topk->heap[0].itemlen + 1;
+        if (expelledLen) {
+            *expelledLen = topk->heap[0].itemlen;
+        }
+    }
+
+    topk->heap[0].count = count;
+    topk->heap[0].fp = fp;
+    topk->heap[0].item = arenaAppend(topk, item, itemlen);
+    topk->heap[0].itemlen = itemlen;
+    indexInsert(topk, 0);
+    siftDown(topk, topk->heap, topk->k, 0);
+    return expelled;
+}
+
+const char *TopK_Add(TopK *topk, const char *item, size_t itemlen, uint32_t increment,
+                     size_t *expelledLen) {
     assert(topk);
     assert(item);
     assert(itemlen);
@@ -120,15 +393,17 @@ char *TopK_Add(TopK *topk, const char *item, size_t itemlen, uint32_t increment)
     Bucket *runner;
     counter_t *countPtr;
     counter_t maxCount = 0;
-    uint32_t fp = TOPK_HASH(item, itemlen, GA);
+    ItemHash ih = itemHash(topk, item, itemlen);
+    uint32_t fp = ih.fp;
 
     bool heapSearched = false;
     HeapBucket *itemHeapPtr = NULL;
     counter_t heapMin = topk->heap->count;
+    TOPK_COUNT(topk, adds, 1);
 
     // get max item count
     for (uint32_t i = 0; i < topk->depth; ++i) {
-        uint32_t loc = TOPK_HASH(item, itemlen, i) % topk->width;
+        uint32_t loc = rowLoc(topk, item, itemlen, &ih, i);
         runner = topk->data + i * topk->width + loc;
         countPtr = &runner->count;
         if (*countPtr == 0) {
@@ -137,7 +412,7 @@ char *TopK_Add(TopK *topk, const char *item, size_t itemlen, uint32_t increment)
             maxCount = max(maxCount, *countPtr);
         } else if (runner->fp == fp) {
             if (*countPtr >= heapMin && heapSearched == false) {
-                itemHeapPtr = checkExistInHeap(topk, item, itemlen);
+                itemHeapPtr = checkExistInHeap(topk, item, itemlen, fp);
                 heapSearched = true;
             }
             if (itemHeapPtr || *countPtr <= heapMin) {
@@ -145,26 +420,13 @@ char *TopK_Add(TopK *topk, const char *item, size_t itemlen, uint32_t increment)
                 maxCount = max(maxCount, *countPtr);
             }
         } else {
-            uint32_t local_incr = increment;
-            for (; local_incr > 0; --local_incr) {
-                double decay;
-                if (*countPtr < TOPK_DECAY_LOOKUP_TABLE) {
-                    decay = topk->lookupTable[*countPtr];
-                } else {
-                    //  using precalculate lookup table to save cpu
-                    decay = pow(topk->lookupTable[TOPK_DECAY_LOOKUP_TABLE - 1],
-                                (*countPtr / TOPK_DECAY_LOOKUP_TABLE) *
-                                    topk->lookupTable[*countPtr % TOPK_DECAY_LOOKUP_TABLE]);
-                }
-                double chance = rand() / (double)RAND_MAX;
-                if (chance < decay) {
-                    --*countPtr;
-                    if (*countPtr == 0) {
-                        runner->fp = fp;
-                        *countPtr = local_incr;
-                        maxCount = max(maxCount, *countPtr);
-                    }
-                }
+            counter_t before = *countPtr;
+            counter_t taken = decayBucket(topk, runner, increment);
+            TOPK_COUNT(topk, decrements, taken > 0 ? before : before - *countPtr);
+            if (taken > 0) {
+                runner->fp = fp;
+                *countPtr = taken;
+                maxCount = max(maxCount, *countPtr);
             }
         }
     }
@@ -172,23 +434,16 @@ char *TopK_Add(TopK *topk, const char *item, size_t itemlen, uint32_t increment)
     // update heap
     if (itemHeapPtr != NULL) {
         itemHeapPtr->count = maxCount; // Not max of the two, as it might have been decayed
-        heapifyDown(topk->heap, topk->k, itemHeapPtr - topk->heap);
+        siftDown(topk, topk->heap, topk->k, itemHeapPtr - topk->heap);
     } else if (maxCount > heapMin) {
-        // TOPK_FREE(topk->heap[0].item);
-        char *expelled = topk->heap[0].item;
-
-        topk->heap[0].count = maxCount;
-        topk->heap[0].fp = fp;
-        topk->heap[0].item = topKStrndup(item, itemlen);
-        topk->heap[0].itemlen = itemlen;
-        heapifyDown(topk->heap, topk->k, 0);
-        return expelled;
+        TOPK_COUNT(topk, heapReplacements, 1);
+        return replaceHeapMin(topk, item, itemlen, fp, maxCount, expelledLen);
     }
     return NULL;
 }
 
 bool TopK_Query(TopK *topk, const char *item, size_t itemlen) {
-    return checkExistInHeap(topk, item, itemlen) != NULL;
+    return checkExistInHeap(topk, item, itemlen, itemHash(topk, item, itemlen).fp) != NULL;
 }
 
 size_t TopK_Count(TopK *topk, const char *item, size_t itemlen) {
@@ -197,14 +452,15 @@ size_t TopK_Count(TopK *topk, const char *item, size_t itemlen) {
     assert(itemlen);
 
     Bucket *runner = NULL;
-    uint32_t fp = TOPK_HASH(item, itemlen, GA);
+    ItemHash ih = itemHash(topk, item, itemlen);
+    uint32_t fp = ih.fp;
     // TODO: The optimization of >heapMin should be revisited for performance
     counter_t heapMin = topk->heap->count;
-    HeapBucket *heapPtr = checkExistInHeap(topk, item, itemlen);
+    HeapBucket *heapPtr = checkExistInHeap(topk, item, itemlen, fp);
     counter_t res = 0;
 
     for (uint32_t i = 0; i < topk->depth; ++i) {
-        uint32_t loc = TOPK_HASH(item, itemlen, i) % topk->width;
+        uint32_t loc = rowLoc(topk, item, itemlen, &ih, i);
         runner = topk->data + i * topk->width + loc;
         if (runner->fp == fp && (heapPtr == NULL || runner->count >= heapMin)) {
             res = max(res, runner->count);
@@ -213,8 +469,110 @@ size_t TopK_Count(TopK *topk, const char *item, size_t itemlen) {
     return res;
 }
 
-void TopK_List(TopK *topk, char **heapList) {
-    for (uint32_t i = 0; i < topk->k; ++i) {
-        heapList[i] = topk->heap[i].item;
+bool TopK_CanMerge(const TopK *a, const TopK *b) {
+    return a->width == b->width && a->depth == b->depth && a->indexMode == b->indexMode &&
+           a->hashMode == b->hashMode;
+}
+
+void TopK_Merge(TopK *dest, size_t quantity, const TopK **src, const uint32_t *weights) {
+    assert(dest);
+    assert(quantity > 0);
+
+    size_t cells = ((size_t)dest->width) * dest->depth;
+    TopK *merged = TopK_Create(dest->k, dest->width, dest->depth, dest->decay);
+    merged->indexMode = dest->indexMode;
+    merged->hashMode = dest->hashMode;
+    merged->rngState = dest->rngState;
+
+    // Per cell, sum the counts of each fingerprint and keep the largest sum
+    uint32_t *fps = TOPK_CALLOC(quantity, sizeof(uint32_t));
+    uint64_t *sums = TOPK_CALLOC(quantity, sizeof(uint64_t));
+    for (size_t c = 0; c < cells; ++c) {
+        size_t distinct = 0;
+        for (size_t j = 0; j < quantity; ++j) {
+            const Bucket *bucket = &src[j]->data[c];
+            uint64_t count = (uint64_t)bucket->count * (weights ? weights[j] : 1);
+            if (count == 0) {
+                continue;
+            }
+            size_t n = 0;
+            while (n < distinct && fps[n] != bucket->fp) {
+                ++n;
+            }
+            if (n == distinct) {
+                fps[distinct] = bucket->fp;
+                sums[distinct++] = 0;
+            }
+            sums[n] += count;
+        }
+        size_t best = 0;
+        for (size_t n = 1; n < distinct; ++n) {
+            if (sums[n] > sums[best]) {
+                best = n;
+            }
+        }
+        if (distinct > 0) {
+            merged->data[c].fp = fps[best];
+            merged->data[c].count = sums[best] < UINT32_MAX ? sums[best] : UINT32_MAX;
+        }
+    }
+    TOPK_FREE(fps);
+    TOPK_FREE(sums);
+
+    // Rebuild the heap from the items of the source heaps, counted in the merged buckets
+    for (size_t j = 0; j < quantity; ++j) {
+        for (uint32_t i = 0; i < src[j]->k; ++i) {
+            const HeapBucket *candidate = &src[j]->heap[i];
+            if (candidate->item == NULL) {
+                continue;
+            }
+            ItemHash ih = itemHash(merged, candidate->item, candidate->itemlen);
+            counter_t count = 0;
+            for (uint32_t d = 0; d < merged->depth; ++d) {
+                uint32_t loc = rowLoc(merged, candidate->item, candidate->itemlen, &ih, d);
+                const Bucket *bucket = merged->data + d * merged->width + loc;
+                if (bucket->fp == ih.fp) {
+                    count = max(count, bucket->count);
+                }
+            }
+            if (count > merged->heap[0].count &&
+                !checkExistInHeap(merged, candidate->item, candidate->itemlen, ih.fp)) {
+                replaceHeapMin(merged, candidate->item, candidate->itemlen, ih.fp, count, NULL);
+            }
+        }
     }
+
+    // 'dest' may be one of the sources, so it is only replaced once the merge is done
+    TopK tmp = *dest;
+    *dest = *merged;
+    *merged = tmp;
+    // The counters stay with 'dest'
+    dest->stats = merged->stats;
+    merged->stats = NULL;
+    TopK_Destroy(merged);
+}
+
+const HeapBucket *TopK_List(TopK *topk) { return topk->heap; }
+
+// Orders by count, then empty buckets first, then by item so ties are deterministic
+static int heapBucketCmp(const void *a, const void *b) {
+    const HeapBucket *x = a, *y = b;
+    if (x->count != y->count) {
+        return x->count < y->count ? -1 : 1;
+    }
+    if (!x->item || !y->item) {
+        return (x->item != NULL) - (y->item != NULL);
+    }
+    int cmp = memcmp(x->item, y->item, x->itemlen < y->itemlen ? x->itemlen : y->itemlen);
+    if (cmp == 0) {
+        cmp = (x->itemlen > y->itemlen) - (x->itemlen < y->itemlen);
+    }
+    return cmp;
+}
+
+HeapBucket *TopK_SortedList(const TopK *topk) {
+    HeapBucket *sorted = TOPK_CALLOC(topk->k, sizeof(HeapBucket));
+    memcpy(sorted, topk->heap, topk->k * sizeof(HeapBucket));
+    qsort(sorted, topk->k, sizeof(HeapBucket), heapBucketCmp);
+    return sorted;
 }
\ No newline at end of file
@@ -35,7 +35,7 @@ typedef uint32_t counter_t;
 typedef struct HeapBucket {
     uint32_t fp;
     uint32_t itemlen;
-    char *item;
+    char *item; // points into the arena of the Top-K, NULL for an empty bucket
     counter_t count;
 } HeapBucket;
 
@@ -44,15 +44,35 @@ typedef struct Bucket {
     counter_t count;
 } Bucket;
 
+/* Counters of a Top-K DS, see TopK_EnableStats */
+typedef struct TopKStats {
+    uint64_t adds;             // Calls to TopK_Add
+    uint64_t heapReplacements; // Items that entered the heap
+    uint64_t decrements;       // Decays of buckets owned by other items
+} TopKStats;
+
+/* Sum of the counters of all the Top-K DSs with stats */
+extern TopKStats topkTotalStats;
+
 typedef struct topk {
     uint32_t k;
     uint32_t width;
     uint32_t depth;
     double decay;
+    int indexMode; // SketchIndexMode
+    int hashMode;  // SketchHashMode
 
     Bucket *data;
     struct HeapBucket *heap;
+    uint32_t *heapIndex;    // open addressing table of heap slot + 1 by fingerprint, 0 is empty
+    uint32_t heapIndexMask; // number of heapIndex entries - 1
+    char *arena;            // heap items, each followed by a NUL
+    size_t arenaSize;
+    size_t arenaUsed;       // bytes appended since the last compaction
+    size_t arenaLive;       // bytes of the items currently in the heap
+    uint64_t rngState; // xorshift64* state used by decay, persisted with the sketch
     double lookupTable[TOPK_DECAY_LOOKUP_TABLE];
+    TopKStats *stats; // Counters, NULL unless enabled
     //  TODO: add function pointers for fast vs accurate
 } TopK;
 
@@ -61,16 +81,41 @@ typedef struct topk {
     Complexity - O(1) */
 TopK *TopK_Create(uint32_t k, uint32_t width, uint32_t depth, double decay);
 
+/*  Computes the decay lookup table of 'topk' from its 'decay' rate and seeds
+    its random generator if it has no state yet. Must be called on a Top-K DS
+    that was not created with TopK_Create, e.g. after loading it from RDB.
+    Complexity - O(1) */
+void TopK_InitDecay(TopK *topk);
+
+/*  Stores a copy of 'item' in heap bucket 'slot' of 'topk', the other fields
+    of the bucket are kept. Used to fill the heap of a Top-K DS that was not
+    created with TopK_Create, before calling TopK_BuildIndex.
+    Complexity - O(itemlen) amortized */
+void TopK_SetHeapItem(TopK *topk, uint32_t slot, const char *item, size_t itemlen);
+
+/*  Builds the index used to find items of the heap of 'topk'. Must be
+    called once the heap of a Top-K DS that was not created with TopK_Create
+    is filled, e.g. after loading it from RDB.
+    Complexity - O(k) */
+void TopK_BuildIndex(TopK *topk);
+
 /*  Releases resources of a Top-K DS.
     Complexity - O(k) */
 void TopK_Destroy(TopK *topk);
 
+/*  Starts counting the adds, heap replacements and decrements of 'topk',
+    also summed in topkTotalStats. Returns 0 on success.
+    Complexity - O(1) */
+int TopK_EnableStats(TopK *topk);
+
 /*  Inserts an 'item' with length 'itemlen' into 'topk' DS.
     Return value is NULL if no change to Top-K list occurred else,
-    it returns the item expelled from list. If returned pointer
-    is not NULL, it should be free()d.
-    Complexity - O(k) */
-char *TopK_Add(TopK *topk, const char *item, size_t itemlen, uint32_t increment);
+    it returns the item expelled from list and sets 'expelledLen' to its
+    length if not NULL. The returned item is owned by 'topk' and is valid
+    until the next change to it.
+    Complexity - O(depth + itemlen) amortized */
+const char *TopK_Add(TopK *topk, const char *item, size_t itemlen, uint32_t increment,
+                     size_t *expelledLen);
 
 /*  Checks whether an 'item' is in Top-K list of 'topk'.
     Complexity - O(k) */
@@ -81,7 +126,31 @@ bool TopK_Query(TopK *topk, const char *item, size_t itemlen);
     Complexity - O(k) */
 size_t TopK_Count(TopK *topk, const char *item, size_t itemlen);
 
-/*  Returns full 'heapList' of items in 'topk' DS. */
-void TopK_List(TopK *topk, char **heapList);
+/*  Returns true if the buckets of 'a' and 'b' can be merged: same width, depth,
+    index and hash mode.
+    Complexity - O(1) */
+bool TopK_CanMerge(const TopK *a, const TopK *b);
+
+/*  Replaces 'dest' DS with the merge of the 'quantity' DSs of 'src', which
+    must all be mergeable with it and may include it. Counts of 'src[i]' are
+    multiplied by 'weights[i]', or by 1 if 'weights' is NULL. In each bucket,
+    counts of the same fingerprint are summed and the largest sum is kept. The
+    heap is rebuilt from the items in the heaps of 'src', keeping the k of
+    'dest'.
+    Complexity - O(quantity * (width * depth + k * depth)) */
+void TopK_Merge(TopK *dest, size_t quantity, const TopK **src, const uint32_t *weights);
+
+/*  Returns the k buckets of the heap of 'topk' DS in heap order. They are
+    owned by 'topk' and are valid until the next change to it.
+    Complexity - O(1) */
+const HeapBucket *TopK_List(TopK *topk);
+
+/*  Returns a copy of the k buckets of the heap of 'topk' DS sorted by
+    increasing count, empty buckets first. The heap itself is left as is, so
+    that its order only depends on the writes to 'topk'. The items are owned by
+    'topk' and are valid until the next change to it; free the array with
+    TOPK_FREE.
+    Complexity - O(k log k) */
+HeapBucket *TopK_SortedList(const TopK *topk);
 
 #endif
@@ -0,0 +1,111 @@
+#include "workers.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+typedef struct {
+    WorkersFn fn;
+    void *arg;
+    size_t n;
+    size_t partSize;
+    size_t numParts;
+    size_t nextPart; // Taken with atomic increments
+    size_t doneParts;
+    int active; // Pool threads working on the job
+} WorkersJob;
+
+static pthread_mutex_t workersLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workersWake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t workersDone = PTHREAD_COND_INITIALIZER;
+static WorkersJob *currentJob;
+static uint64_t jobGeneration;
+static int numWorkers;
+
+static size_t runParts(WorkersJob *job) {
+    size_t ran = 0, part;
+    while ((part = __atomic_fetch_add(&job->nextPart, 1, __ATOMIC_RELAXED)) < job->numParts) {
+        size_t begin = part * job->partSize;
+        size_t end = begin + job->partSize < job->n ? begin + job->partSize : job->n;
+        job->fn(job->arg, begin, end);
+        ran++;
+    }
+    return ran;
+}
+
+static void *workerMain(void *unused) {
+    (void)unused;
+    uint64_t seen = 0;
+    pthread_mutex_lock(&workersLock);
+    for (;;) {
+        while (jobGeneration == seen) {
+            pthread_cond_wait(&workersWake, &workersLock);
+        }
+        seen = jobGeneration;
+        // The job belongs to the caller's stack: it is only touched while counted as active
+        WorkersJob *job = currentJob;
+        if (!job) {
+            continue;
+        }
+        job->active++;
+        pthread_mutex_unlock(&workersLock);
+        size_t ran = runParts(job);
+        pthread_mutex_lock(&workersLock);
+        job->doneParts += ran;
+        if (--job->active == 0 && job->doneParts == job->numParts) {
+            pthread_cond_signal(&workersDone);
+        }
+    }
+    return NULL;
+}
+
+int Workers_Init(int numThreads) {
+    if (numWorkers > 0 || numThreads <= 0) {
+        return -1;
+    }
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (int ii = 0; ii < numThreads; ++ii) {
+        pthread_t tid;
+        if (pthread_create(&tid, &attr, workerMain, NULL) != 0) {
+            break; // LCOV_EXCL_LINE
+        }
+        numWorkers++;
+    }
+    pthread_attr_destroy(&attr);
+    return numWorkers == numThreads ? 0 : -1;
+}
+
+int Workers_Count(void) { return numWorkers; }
+
+void Workers_ParallelFor(size_t n, size_t minPart, WorkersFn fn, void *arg) {
+    size_t numParts = minPart ? n / minPart : n;
+    if (numParts > (size_t)numWorkers + 1) {
+        numParts = numWorkers + 1;
+    }
+    if (numParts <= 1) {
+        fn(arg, 0, n);
+        return;
+    }
+
+    WorkersJob job = {.fn = fn,
+                      .arg = arg,
+                      .n = n,
+                      .partSize = (n + numParts - 1) / numParts,
+                      .numParts = numParts};
+    pthread_mutex_lock(&workersLock);
+    currentJob = &job;
+    jobGeneration++;
+    pthread_cond_broadcast(&workersWake);
+    pthread_mutex_unlock(&workersLock);
+
+    size_t ran = runParts(&job);
+
+    pthread_mutex_lock(&workersLock);
+    job.doneParts += ran;
+    while (job.active > 0 || job.doneParts < job.numParts) {
+        pthread_cond_wait(&workersDone, &workersLock);
+    }
+    currentJob = NULL;
+    pthread_mutex_unlock(&workersLock);
+}
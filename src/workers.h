@@ -0,0 +1,39 @@
+#ifndef REDISBLOOM_WORKERS_H
+#define REDISBLOOM_WORKERS_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A fixed pool of threads that read-only commands split large batches across.
+ * Work is fork-join: the calling thread takes part in it and only returns once
+ * every part is done, so whatever it holds, such as the Redis lock, covers the
+ * whole batch. There is no pool until Workers_Init is called.
+ */
+
+/** Handles the items [begin, end) of a batch */
+typedef void (*WorkersFn)(void *arg, size_t begin, size_t end);
+
+/**
+ * Start `numThreads` threads. Returns 0 on success, -1 if a thread could not be
+ * started or a pool already exists.
+ */
+int Workers_Init(int numThreads);
+
+/** Number of threads in the pool, not counting the callers of Workers_ParallelFor */
+int Workers_Count(void);
+
+/**
+ * Runs `fn` over [0, n) in parts of at least `minPart` items, on the pool and
+ * the calling thread. Runs inline if there is no pool or a single part.
+ * Must only be called from one thread at a time.
+ */
+void Workers_ParallelFor(size_t n, size_t minPart, WorkersFn fn, void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
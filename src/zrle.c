@@ -0,0 +1,178 @@
+#include "zrle.h"
+
+#include <string.h> // memcpy
+
+#define ZRLE_WORD 8
+
+// Chunk encodings in RDB
+#define ZRLE_RDB_RAW 0
+#define ZRLE_RDB_ENCODED 1
+
+static inline uint64_t loadWord(const uint8_t *p) {
+    uint64_t w;
+    memcpy(&w, p, sizeof(w));
+    return w;
+}
+
+static size_t putVarint(uint8_t *dst, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        dst[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    dst[n++] = v;
+    return n;
+}
+
+static int getVarint(const uint8_t *src, size_t len, size_t *pos, uint64_t *v) {
+    uint64_t ret = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        if (*pos >= len) {
+            return -1;
+        }
+        const uint8_t b = src[(*pos)++];
+        ret |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = ret;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+size_t ZRLE_Encode(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+    const size_t words = n / ZRLE_WORD;
+    size_t out = 0;
+    for (size_t ii = 0; ii < words;) {
+        size_t zeros = ii;
+        while (zeros < words && loadWord(src + zeros * ZRLE_WORD) == 0) {
+            ++zeros;
+        }
+        // A single zero word costs less inside the literals than as a new pair
+        size_t lit = zeros;
+        while (lit < words && (loadWord(src + lit * ZRLE_WORD) != 0 ||
+                               (lit + 1 < words && loadWord(src + (lit + 1) * ZRLE_WORD) != 0))) {
+            ++lit;
+        }
+        const size_t litBytes = (lit - zeros) * ZRLE_WORD;
+        // Two varints take at most 20 bytes
+        if (out + 20 + litBytes > cap) {
+            return 0;
+        }
+        out += putVarint(dst + out, zeros - ii);
+        out += putVarint(dst + out, lit - zeros);
+        memcpy(dst + out, src + zeros * ZRLE_WORD, litBytes);
+        out += litBytes;
+        ii = lit;
+    }
+
+    const size_t tail = n % ZRLE_WORD;
+    if (out + tail > cap) {
+        return 0;
+    }
+    memcpy(dst + out, src + words * ZRLE_WORD, tail);
+    return out + tail;
+}
+
+int ZRLE_Decode(const uint8_t *src, size_t len, uint8_t *dst, size_t n) {
+    const size_t words = n / ZRLE_WORD;
+    size_t pos = 0;
+    for (size_t ii = 0; ii < words;) {
+        uint64_t zeros, lit;
+        if (getVarint(src, len, &pos, &zeros) != 0 || zeros > words - ii) {
+            return -1;
+        }
+        ii += zeros;
+        if (getVarint(src, len, &pos, &lit) != 0 || lit > words - ii ||
+            lit * ZRLE_WORD > len - pos) {
+            return -1;
+        }
+        memcpy(dst + ii * ZRLE_WORD, src + pos, lit * ZRLE_WORD);
+        pos += lit * ZRLE_WORD;
+        ii += lit;
+    }
+
+    const size_t tail = n % ZRLE_WORD;
+    if (len - pos != tail) {
+        return -1;
+    }
+    memcpy(dst + words * ZRLE_WORD, src + pos, tail);
+    return 0;
+}
+
+int ZRLE_IsZero(const void *buf, size_t n) {
+    const uint8_t *p = buf;
+    size_t ii = 0;
+    for (; ii + ZRLE_WORD <= n; ii += ZRLE_WORD) {
+        if (loadWord(p + ii) != 0) {
+            return 0;
+        }
+    }
+    for (; ii < n; ++ii) {
+        if (p[ii] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void ZRLE_RdbSave(RedisModuleIO *io, const void *buf, size_t len) {
+    RedisModule_SaveUnsigned(io, len);
+    if (len == 0) {
+        return;
+    }
+
+    uint8_t *enc = RedisModule_Alloc(len < ZRLE_RDB_CHUNK_SIZE ? len : ZRLE_RDB_CHUNK_SIZE);
+    for (size_t off = 0; off < len; off += ZRLE_RDB_CHUNK_SIZE) {
+        const size_t n = len - off < ZRLE_RDB_CHUNK_SIZE ? len - off : ZRLE_RDB_CHUNK_SIZE;
+        const char *chunk = (const char *)buf + off;
+        // Only kept if smaller than the chunk itself
+        const size_t encLen = ZRLE_Encode((const uint8_t *)chunk, n, enc, n - 1);
+        if (encLen > 0) {
+            RedisModule_SaveUnsigned(io, ZRLE_RDB_ENCODED);
+            RedisModule_SaveUnsigned(io, n);
+            RedisModule_SaveStringBuffer(io, (const char *)enc, encLen);
+        } else {
+            RedisModule_SaveUnsigned(io, ZRLE_RDB_RAW);
+            RedisModule_SaveStringBuffer(io, chunk, n);
+        }
+    }
+    RedisModule_Free(enc);
+}
+
+void *ZRLE_RdbLoad(RedisModuleIO *io, size_t *lenp, int encoded) {
+    size_t len = *lenp = RedisModule_LoadUnsigned(io);
+    // Zeroed, so that decoding skips the zero words
+    uint8_t *buf = RedisModule_Calloc(len ? len : 1, 1);
+    for (size_t off = 0; off < len;) {
+        const uint64_t encoding = encoded ? RedisModule_LoadUnsigned(io) : ZRLE_RDB_RAW;
+        size_t n = 0;
+        if (encoding == ZRLE_RDB_ENCODED) {
+            n = RedisModule_LoadUnsigned(io);
+        } else if (encoding != ZRLE_RDB_RAW) {
+            RedisModule_Free(buf); // LCOV_EXCL_LINE corrupt data
+            return NULL;           // LCOV_EXCL_LINE
+        }
+
+        size_t chunkLen;
+        char *chunk = RedisModule_LoadStringBuffer(io, &chunkLen);
+        int ok;
+        if (encoding == ZRLE_RDB_ENCODED) {
+            ok = n > 0 && n <= len - off &&
+                 ZRLE_Decode((const uint8_t *)chunk, chunkLen, buf + off, n) == 0;
+        } else {
+            n = chunkLen;
+            ok = n > 0 && n <= len - off;
+            if (ok) {
+                memcpy(buf + off, chunk, n);
+            }
+        }
+        RedisModule_Free(chunk);
+        if (!ok) {
+            RedisModule_Free(buf); // LCOV_EXCL_LINE corrupt data
+            return NULL;           // LCOV_EXCL_LINE
+        }
+        off += n;
+    }
+    return buf;
+}
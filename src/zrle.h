@@ -0,0 +1,60 @@
+#ifndef REDISBLOOM_ZRLE_H
+#define REDISBLOOM_ZRLE_H
+
+#include "redismodule.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Run-length encoding of zero words, for the arrays of filters and sketches,
+ * which are mostly zeros until they fill up.
+ *
+ * The array is taken as 8 byte words, encoded as pairs of varints: a number of
+ * zero words, then a number of literal words followed by their bytes. The
+ * bytes after the last whole word are appended as they are.
+ */
+
+/**
+ * Encode `n` bytes of `src` into `dst`. Returns the encoded length, or 0 if it
+ * would exceed `cap` bytes.
+ */
+size_t ZRLE_Encode(const uint8_t *src, size_t n, uint8_t *dst, size_t cap);
+
+/**
+ * Decode `len` bytes of `src` into the `n` bytes of `dst`, which must be zeroed
+ * beforehand: zero words are skipped, not written. Returns 0 on success, -1 if
+ * the data is malformed or does not decode to exactly `n` bytes.
+ */
+int ZRLE_Decode(const uint8_t *src, size_t len, uint8_t *dst, size_t n);
+
+/** Returns 1 if the `n` bytes of `buf` are all zero */
+int ZRLE_IsZero(const void *buf, size_t n);
+
+/** Arrays are saved in chunks of at most this size, see ZRLE_RdbSave */
+#define ZRLE_RDB_CHUNK_SIZE (16 * 1024 * 1024)
+
+/**
+ * Save an array to RDB as its length followed by chunks of at most
+ * ZRLE_RDB_CHUNK_SIZE bytes, so that loading fills a single buffer instead of
+ * holding a full temporary copy. Each chunk is preceded by its encoding: raw,
+ * or zero-word RLE when that is smaller.
+ */
+void ZRLE_RdbSave(RedisModuleIO *io, const void *buf, size_t len);
+
+/**
+ * Load an array saved by ZRLE_RdbSave, or by the chunked format preceding it,
+ * without encodings, when `encoded` is 0. Writes its length to `lenp`. Returns
+ * NULL if the data is malformed, the buffer otherwise, freed with
+ * RedisModule_Free.
+ */
+void *ZRLE_RdbLoad(RedisModuleIO *io, size_t *lenp, int encoded);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
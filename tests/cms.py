@@ -21,7 +21,7 @@ class CMSTest(ModuleTestCase('../redisbloom.so')):
         self.assertEqual([5L], self.cmd('cms.query', 'cms2', 'a'))
         self.assertEqual(['width', 2000, 'depth', 7, 'count', 5], 
                          self.cmd('cms.info', 'cms2'))
-        self.assertEqual(840, self.cmd('MEMORY USAGE', 'cms1'))
+        self.assertEqual(496, self.cmd('MEMORY USAGE', 'cms1'))
 
     def test_validation(self):
         for args in (
@@ -166,6 +166,86 @@ class CMSTest(ModuleTestCase('../redisbloom.so')):
 #        print(self.cmd('cms.info', 'B'))
 #        print(self.cmd('cms.info', 'C'))
 
+    def test_merge_into_source(self):
+        self.cmd('cms.initbydim', 'A', '1000', '5')
+        self.cmd('cms.initbydim', 'B', '1000', '5')
+        self.cmd('cms.incrby', 'A', 'foo', '5', 'bar', '1')
+        self.cmd('cms.incrby', 'B', 'foo', '10')
+        self.assertOk(self.cmd('cms.merge', 'A', 2, 'A', 'B', 'weights', 2, 3))
+        self.assertEqual([40, 2], self.cmd('cms.query', 'A', 'foo', 'bar'))
+        self.assertEqual(['width', 1000, 'depth', 5, 'count', 42], self.cmd('cms.info', 'A'))
+
+        self.assertRaises(ResponseError, self.cmd, 'cms.merge', 'A', 0, 'weights')
+        self.assertRaises(ResponseError, self.cmd, 'cms.merge', 'A', -1, 'B')
+        self.assertRaises(ResponseError, self.cmd, 'cms.merge', 'A', 2, 'A', 'B', 'weights', 1)
+
+    def test_index_modes(self):
+        self.assertOk(self.cmd('cms.initbydim', 'mod', '1000', '5'))
+        self.assertOk(self.cmd('cms.initbydim', 'pow2', '1000', '5', 'pow2'))
+        self.assertOk(self.cmd('cms.initbydim', 'fast', '1000', '5', 'FASTRANGE'))
+        self.assertOk(self.cmd('cms.initbyprob', 'prob', '0.001', '0.01', 'pow2'))
+        self.assertEqual(['width', 1024, 'depth', 5, 'count', 0], self.cmd('cms.info', 'pow2'))
+        self.assertEqual(['width', 1000, 'depth', 5, 'count', 0], self.cmd('cms.info', 'fast'))
+        self.assertEqual(['width', 2048, 'depth', 7, 'count', 0], self.cmd('cms.info', 'prob'))
+        self.assertRaises(ResponseError, self.cmd, 'cms.initbydim', 'bad', '1000', '5', 'foo')
+        self.assertRaises(ResponseError, self.cmd, 'cms.initbydim', 'bad', '1000', '5', 'pow2', 'x')
+
+        for key in ('mod', 'pow2', 'fast'):
+            for i in xrange(100):
+                self.cmd('cms.incrby', key, str(i), i)
+        for _ in self.client.retry_with_rdb_reload():
+            for key in ('mod', 'pow2', 'fast'):
+                for i in xrange(100):
+                    self.assertLessEqual(i, self.cmd('cms.query', key, str(i))[0])
+                self.assertEqual(4950, self.cmd('cms.info', key)[5])
+
+        # Only sketches indexed the same way can be merged
+        self.assertOk(self.cmd('cms.initbydim', 'fast2', '1000', '5', 'fastrange'))
+        self.assertOk(self.cmd('cms.merge', 'fast2', 1, 'fast'))
+        self.assertEqual(self.cmd('cms.query', 'fast', '42'), self.cmd('cms.query', 'fast2', '42'))
+        self.assertRaises(ResponseError, self.cmd, 'cms.merge', 'fast2', 2, 'fast', 'mod')
+
+    def test_counter_width(self):
+        self.assertOk(self.cmd('cms.initbydim', 'c16', '20', '5', 'counter', '16'))
+        self.assertOk(self.cmd('cms.initbydim', 'c64', '20', '5', 'COUNTER', '64', 'pow2'))
+        self.assertOk(self.cmd('cms.initbyprob', 'p16', '0.01', '0.01', 'counter', '16'))
+        self.assertRaises(ResponseError, self.cmd, 'cms.initbydim', 'bad', '20', '5', 'counter', '8')
+        self.assertRaises(ResponseError, self.cmd, 'cms.initbydim', 'bad', '20', '5', 'counter')
+        self.assertEqual(296, self.cmd('MEMORY USAGE', 'c16'))
+
+        # Counters saturate instead of wrapping around
+        self.assertEqual([60000], self.cmd('cms.incrby', 'c16', 'a', 60000))
+        self.assertEqual([65535], self.cmd('cms.incrby', 'c16', 'a', 60000))
+        self.assertEqual([2 ** 33], self.cmd('cms.incrby', 'c64', 'a', 2 ** 33))
+        for _ in self.client.retry_with_rdb_reload():
+            self.assertEqual([65535], self.cmd('cms.query', 'c16', 'a'))
+            self.assertEqual([2 ** 33], self.cmd('cms.query', 'c64', 'a'))
+
+        self.assertOk(self.cmd('cms.initbydim', 'm16', '20', '5', 'counter', '16'))
+        self.assertOk(self.cmd('cms.merge', 'm16', 2, 'c16', 'c16'))
+        self.assertEqual([65535], self.cmd('cms.query', 'm16', 'a'))
+        self.assertRaises(ResponseError, self.cmd, 'cms.merge', 'm16', 2, 'c16', 'cms1')
+
+    def test_conservative(self):
+        self.assertOk(self.cmd('cms.initbydim', 'plain', '500', '4'))
+        self.assertOk(self.cmd('cms.initbydim', 'cons', '500', '4', 'conservative'))
+        for key in ('plain', 'cons'):
+            for i in xrange(4000):
+                self.cmd('cms.incrby', key, str(i % 2000), 1)
+        plain = sum(self.cmd('cms.query', 'plain', *[str(i) for i in xrange(2000)]))
+        for _ in self.client.retry_with_rdb_reload():
+            cons = self.cmd('cms.query', 'cons', *[str(i) for i in xrange(2000)])
+            self.assertTrue(all(c >= 2 for c in cons))
+            self.assertLess(sum(cons), plain)
+        self.assertEqual(['width', 500, 'depth', 4, 'count', 4000], self.cmd('cms.info', 'cons'))
+
+    def test_rdb_sparse(self):
+        self.assertOk(self.cmd('cms.initbydim', 'sparse', '100000', '5'))
+        self.assertEqual([10, 42], self.cmd('cms.incrby', 'sparse', 'foo', '10', 'bar', '42'))
+        self.assertLess(len(self.cmd('dump', 'sparse')), 1024)
+        for _ in self.client.retry_with_rdb_reload():
+            self.assertEqual([10, 42, 0], self.cmd('cms.query', 'sparse', 'foo', 'bar', 'baz'))
+
     def test_smallset(self):
         self.assertOk(self.cmd('cms.initbydim', 'cms1', '2', '2'))
         self.assertEqual([10, 42], self.cmd('cms.incrby', 'cms1', 'foo', '10', 'bar', '42'))
@@ -174,6 +254,40 @@ class CMSTest(ModuleTestCase('../redisbloom.so')):
                          self.cmd('cms.info', 'cms1'))
         self.assertEqual([10, 42], self.cmd('cms.incrby', 'cms1', 'foo', '0', 'bar', '0'))
 
+class CMSAsyncMergeTest(ModuleTestCase('../redisbloom.so', module_args=['CMS_ASYNC_MERGE', '1'])):
+    def test_merge(self):
+        for name in ('A', 'B', 'C'):
+            self.assertOk(self.cmd('cms.initbydim', name, '100000', '5'))
+        for i in xrange(1000):
+            self.cmd('cms.incrby', 'A', str(i), 1)
+            self.cmd('cms.incrby', 'B', str(i), 2)
+        self.assertOk(self.cmd('cms.merge', 'C', 2, 'A', 'B', 'weights', 1, 10))
+        for i in xrange(1000):
+            self.assertLessEqual(21, self.cmd('cms.query', 'C', str(i))[0])
+        self.assertEqual(['width', 100000, 'depth', 5, 'count', 21000], self.cmd('cms.info', 'C'))
+
+        # Aliasing the destination
+        self.assertOk(self.cmd('cms.merge', 'A', 2, 'A', 'A'))
+        self.assertEqual(['width', 100000, 'depth', 5, 'count', 2000], self.cmd('cms.info', 'A'))
+        self.assertEqual([2], self.cmd('cms.query', 'A', '1'))
+
+        self.assertRaises(ResponseError, self.cmd, 'cms.merge', 'C', 1, 'noexist')
+
+    def test_merge_concurrent_writes(self):
+        # Sources written to during the merge are merged in a single state, the
+        # counters agreeing with the count
+        for name in ('A', 'B', 'C'):
+            self.assertOk(self.cmd('cms.initbydim', name, '2000000', '5'))
+        self.cmd('cms.incrby', 'A', 'x', 1)
+        conn = self.client.connection_pool.get_connection('cms.merge')
+        conn.send_command('cms.merge', 'C', 2, 'A', 'B')
+        for i in xrange(100):
+            self.cmd('cms.incrby', 'B', 'y', 1)
+        self.assertEqual('OK', conn.read_response())
+        self.client.connection_pool.release(conn)
+        count = self.cmd('cms.info', 'C')[5]
+        self.assertEqual([1, count - 1], self.cmd('cms.query', 'C', 'x', 'y'))
+
 if __name__ == "__main__":
     import unittest
     unittest.main()
@@ -67,8 +67,8 @@ class CuckooTestCase(ModuleTestCase('../redisbloom.so')):
         self.restart_and_reload()
         for x in xrange(100):
             self.assertEqual(1, self.cmd('cf.exists', 'smallCF2', str(x)))
-        self.assertEqual(580, self.cmd('MEMORY USAGE', 'smallCF'))
-        self.assertEqual(284, self.cmd('MEMORY USAGE', 'smallCF2'))
+        self.assertEqual(612, self.cmd('MEMORY USAGE', 'smallCF'))
+        self.assertEqual(316, self.cmd('MEMORY USAGE', 'smallCF2'))
 
     def test_setnx(self):
         self.assertEqual(1, self.cmd('cf.addnx', 'cf', 'k1'))
@@ -109,6 +109,52 @@ class CuckooTestCase(ModuleTestCase('../redisbloom.so')):
         for x in xrange(maxrange):
             self.assertEqual(1, self.cmd('cf.exists', 'cf', str(x)))
 
+    def test_scandump_options(self):
+        # Several sub-filters, dumped in small checksummed chunks
+        self.cmd('cf.reserve', 'cf', 64, 'bucketsize', 2, 'expansion', 2)
+        for x in xrange(1000):
+            self.cmd('cf.add', 'cf', str(x))
+        nfilters = int(self.cmd('cf.debug', 'cf').split('filters:')[1].split()[0])
+        self.assertGreater(nfilters, 1)
+
+        self.assertRaises(ResponseError, self.cmd, 'cf.scandump', 'cf', 0, 'chunksize', 0)
+        self.assertRaises(ResponseError, self.cmd, 'cf.scandump', 'cf', 0, 'chunksize')
+        self.assertRaises(ResponseError, self.cmd, 'cf.scandump', 'cf', 0, 'foo')
+
+        chunks = []
+        while True:
+            last_pos = chunks[-1][0] if chunks else 0
+            chunk = self.cmd('cf.scandump', 'cf', last_pos, 'chunksize', 100, 'checksum')
+            self.assertEqual(3, len(chunk))
+            if not chunk[0]:
+                break
+            if chunks:
+                self.assertLessEqual(len(chunk[1]), 100)
+            chunks.append(chunk)
+        self.assertGreater(len(chunks), 3)
+
+        self.cmd('del', 'cf')
+        bad = [chunks[0][0], chunks[0][1], chunks[0][2] ^ 1]
+        self.assertRaises(ResponseError, self.cmd, 'cf.loadchunk', 'cf', *bad)
+        for chunk in chunks:
+            self.assertOk(self.cmd('cf.loadchunk', 'cf', *chunk))
+        for x in xrange(1000):
+            self.assertEqual(1, self.cmd('cf.exists', 'cf', str(x)))
+
+        # ALL returns one sub-filter per call
+        nchunks = 0
+        pos = self.cmd('cf.scandump', 'cf', 0, 'chunksize', 'all')[0]
+        while True:
+            pos = self.cmd('cf.scandump', 'cf', pos, 'chunksize', 'all')[0]
+            if not pos:
+                break
+            nchunks += 1
+        self.assertEqual(nfilters, nchunks)
+
+    def test_scandump_bad_header(self):
+        self.assertRaises(ResponseError, self.cmd, 'cf.loadchunk', 'cf', 1, 'garbage')
+        self.assertEqual(0, self.cmd('exists', 'cf'))
+
     def test_insert(self):
         # Ensure insert with default capacity works
         self.assertEqual(1, self.cmd('cf.add', 'f1', 'foo'))
@@ -161,9 +207,9 @@ class CuckooTestCase(ModuleTestCase('../redisbloom.so')):
 
     def test_mem_usage(self):
         self.cmd('CF.RESERVE', 'cf', '1000')
-        self.assertEqual(1112, self.cmd('MEMORY USAGE', 'cf'))
+        self.assertEqual(1144, self.cmd('MEMORY USAGE', 'cf'))
         self.cmd('cf.insert', 'cf', 'nocreate', 'items', 'foo')
-        self.assertEqual(1112, self.cmd('MEMORY USAGE', 'cf'))
+        self.assertEqual(1144, self.cmd('MEMORY USAGE', 'cf'))
 
     def test_max_iterations(self):
         self.cmd('CF.RESERVE a 10 MAXITERATIONS 10')
@@ -176,6 +222,27 @@ class CuckooTestCase(ModuleTestCase('../redisbloom.so')):
 
         self.assertRaises(ResponseError, self.cmd, 'CF.RESERVE a 10 MAXITERATIONS string')
 
+    def test_rdb_chunked(self):
+        # Larger than a single RDB chunk, with several sub-filters
+        self.assertOk(self.cmd('cf.reserve', 'big', 20 * 1024 * 1024, 'bucketsize', 1))
+        for x in xrange(1000):
+            self.cmd('cf.add', 'big', x)
+        d1 = self.cmd('cf.debug', 'big')
+        for _ in self.client.retry_with_rdb_reload():
+            self.assertEqual(d1, self.cmd('cf.debug', 'big'))
+            for x in xrange(1000):
+                self.assertEqual(1, self.cmd('cf.exists', 'big', x))
+
+    def test_rdb_sparse(self):
+        self.assertOk(self.cmd('cf.reserve', 'sparse', 1000000))
+        for x in xrange(10):
+            self.cmd('cf.add', 'sparse', x)
+        self.assertLess(len(self.cmd('dump', 'sparse')), 1024)
+        for _ in self.client.retry_with_rdb_reload():
+            for x in xrange(10):
+                self.assertEqual(1, self.cmd('cf.exists', 'sparse', x))
+            self.assertEqual(0, self.cmd('cf.exists', 'sparse', 'nonexist'))
+
     def test_num_deletes(self):
         self.cmd('cf.add', 'nums', 'RedisLabs')
         self.cmd('cf.del', 'nums', 'RedisLabs')
@@ -203,6 +270,54 @@ class CuckooTestCase(ModuleTestCase('../redisbloom.so')):
 
         self.assertRaises(ResponseError, self.cmd, 'CF.COMPACT a')
         self.assertRaises(ResponseError, self.cmd, 'CF.COMPACT a b')
+        self.assertRaises(ResponseError, self.cmd, 'CF.COMPACT cf BUDGET')
+        self.assertRaises(ResponseError, self.cmd, 'CF.COMPACT cf BUDGET -1')
+        self.assertRaises(ResponseError, self.cmd, 'CF.COMPACT cf TIME 1')
+
+    def test_compact_budget(self):
+        self.cmd('CF.RESERVE cf 1024 BUCKETSIZE 4 EXPANSION 2')
+        for x in xrange(10000):
+            self.cmd('cf.add cf', str(x))
+        filters = self.cmd('CF.INFO cf')[5]
+        self.assertGreater(filters, 2)
+        for x in xrange(10000):
+            if x % 4:
+                self.cmd('cf.del cf', str(x))
+
+        # The deletes started a compaction, which runs from a timer and from
+        # CF.COMPACT, with items added in between
+        self.cmd('cf.add cf', 'extra')
+        while self.cmd('CF.COMPACT cf BUDGET 0') == 0:
+            self.cmd('cf.add cf', 'extra')
+        self.assertLess(self.cmd('CF.INFO cf')[5], filters)
+        self.assertEqual(1, self.cmd('CF.COMPACT cf BUDGET 10'))
+        for x in xrange(0, 10000, 4):
+            self.assertEqual(1, self.cmd('cf.exists cf', str(x)))
+        self.assertEqual(1, self.cmd('cf.exists cf', 'extra'))
+
+    def test_compact_buckets(self):
+        self.cmd('CF.RESERVE cf 1024 BUCKETSIZE 4 EXPANSION 2')
+        for x in xrange(5000):
+            self.cmd('cf.add cf', str(x))
+        self.assertGreater(self.cmd('CF.INFO cf')[5], 2)
+        # Nothing to resume until a compaction is started
+        self.assertEqual(1, self.cmd('CF.COMPACT cf BUCKETS 0'))
+        self.assertEqual('OK', self.cmd('CF.COMPACT cf START'))
+        self.assertEqual(0, self.cmd('CF.COMPACT cf BUCKETS 1'))
+        # The cursor is saved with the filter, and in its SCANDUMP header
+        for _ in self.client.retry_with_rdb_reload():
+            self.assertEqual(0, self.cmd('CF.COMPACT cf BUCKETS 0'))
+        header = self.cmd('cf.scandump', 'cf', 0)
+        self.assertOk(self.cmd('cf.loadchunk', 'copy', *header))
+        self.assertEqual(0, self.cmd('CF.COMPACT copy BUCKETS 0'))
+        self.assertEqual(1, self.cmd('CF.COMPACT cf BUCKETS 100000'))
+        self.assertEqual(1, self.cmd('CF.COMPACT cf BUDGET 10'))
+        for x in xrange(5000):
+            self.assertEqual(1, self.cmd('cf.exists cf', str(x)))
+        self.assertRaises(ResponseError, self.cmd, 'CF.COMPACT cf BUCKETS -1')
+        self.assertRaises(ResponseError, self.cmd, 'CF.COMPACT cf BUCKETS x')
+        self.assertRaises(ResponseError, self.cmd, 'CF.COMPACT cf STEPS 1')
+        self.assertRaises(ResponseError, self.cmd, 'CF.COMPACT cf STOP')
 
     def test_max_expansions(self):
         self.cmd('CF.RESERVE', 'cf', '4')
@@ -251,16 +366,90 @@ class CuckooTestCase(ModuleTestCase('../redisbloom.so')):
         self.assertRaises(ResponseError, self.cmd, 'CF.RESERVE err 10 EXPANSION')
         self.assertRaises(ResponseError, self.cmd, 'CF.RESERVE err 10 EXPANSION string')
     
+    def test_fp_size(self):
+        self.assertRaises(ResponseError, self.cmd, 'CF.RESERVE err 1000 FPSIZE 12')
+        self.assertRaises(ResponseError, self.cmd, 'CF.RESERVE err 1000 FPSIZE')
+        self.assertRaises(ResponseError, self.cmd, 'CF.RESERVE err 1000 FPSIZE string')
+        for bits in (8, 16, 32):
+            key = 'cf%d' % bits
+            self.assertOk(self.cmd('CF.RESERVE', key, 64, 'FPSIZE', bits, 'EXPANSION', 2))
+            info = self.cmd('CF.INFO', key)
+            self.assertEqual(bits, info[info.index('Fingerprint size') + 1])
+            self.assertEqual(80 + 64 * bits / 8, info[1])
+            for x in xrange(1000):
+                self.cmd('CF.ADD', key, str(x))
+            self.cmd('CF.DEL', key, '0')
+
+            chunks = []
+            while True:
+                last_pos = chunks[-1][0] if chunks else 0
+                chunk = self.cmd('CF.SCANDUMP', key, last_pos)
+                if not chunk[0]:
+                    break
+                chunks.append(chunk)
+            self.cmd('DEL', key)
+            for chunk in chunks:
+                self.assertOk(self.cmd('CF.LOADCHUNK', key, *chunk))
+
+            for _ in self.client.retry_with_rdb_reload():
+                self.assertEqual(bits, self.cmd('CF.INFO', key)[-1])
+                self.assertEqual(0, self.cmd('CF.EXISTS', key, '0'))
+                for x in xrange(1, 1000):
+                    self.assertEqual(1, self.cmd('CF.EXISTS', key, str(x)))
+            self.assertOk(self.cmd('CF.COMPACT', key))
+            for x in xrange(1, 1000):
+                self.assertEqual(1, self.cmd('CF.EXISTS', key, str(x)))
+
+        # Wider fingerprints give far fewer false positives
+        fp = dict((bits, sum(self.cmd('CF.MEXISTS', 'cf%d' % bits, *[str(x) for x in xrange(1000, 5000)])))
+                  for bits in (8, 16))
+        self.assertLess(fp[16] * 20, fp[8])
+
+    def test_semisort(self):
+        self.assertRaises(ResponseError, self.cmd, 'CF.RESERVE err 1000 SEMISORT BUCKETSIZE 2')
+        self.assertRaises(ResponseError, self.cmd, 'CF.RESERVE err 1000 SEMISORT FPSIZE 32')
+        self.assertRaises(ResponseError, self.cmd, 'CF.RESERVE err 1000 SEMISORT SEMISORT EXPANSION')
+        # Buckets of 4 fingerprints take 4 * (bits - 1) bits, plus 7 bytes of padding
+        for bits in (8, 16):
+            key = 'ss%d' % bits
+            self.assertOk(self.cmd('CF.RESERVE', key, 64, 'SEMISORT', 'FPSIZE', bits, 'EXPANSION', 2))
+            info = self.cmd('CF.INFO', key)
+            self.assertEqual(4, info[info.index('Bucket size') + 1])
+            self.assertEqual(80 + 16 * 4 * (bits - 1) / 8 + 7, info[1])
+            for x in xrange(1000):
+                self.cmd('CF.ADD', key, str(x))
+            self.cmd('CF.DEL', key, '0')
+
+            chunks = []
+            while True:
+                last_pos = chunks[-1][0] if chunks else 0
+                chunk = self.cmd('CF.SCANDUMP', key, last_pos)
+                if not chunk[0]:
+                    break
+                chunks.append(chunk)
+            self.cmd('DEL', key)
+            for chunk in chunks:
+                self.assertOk(self.cmd('CF.LOADCHUNK', key, *chunk))
+
+            for _ in self.client.retry_with_rdb_reload():
+                self.assertEqual(0, self.cmd('CF.EXISTS', key, '0'))
+                for x in xrange(1, 1000):
+                    self.assertEqual(1, self.cmd('CF.EXISTS', key, str(x)))
+            self.assertOk(self.cmd('CF.COMPACT', key))
+            for x in xrange(1, 1000):
+                self.assertEqual(1, self.cmd('CF.EXISTS', key, str(x)))
+
     def test_info(self):
         self.cmd('CF.RESERVE a 1000')
-        self.assertEqual(self.cmd('CF.INFO a'), ['Size', 1080L, 
+        self.assertEqual(self.cmd('CF.INFO a'), ['Size', 1112L, 
                                                  'Number of buckets', 512L, 
                                                  'Number of filters', 1L, 
                                                  'Number of items inserted', 0L, 
                                                  'Number of items deleted', 0L, 
                                                  'Bucket size', 2L, 
                                                  'Expansion rate', 1L, 
-                                                 'Max iterations', 20L])
+                                                 'Max iterations', 20L,
+                                                 'Fingerprint size', 8L])
 
         with self.assertResponseError():
             self.cmd('cf.info', 'bf')   
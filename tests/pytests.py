@@ -2,6 +2,10 @@
 from rmtest import ModuleTestCase
 from redis import ResponseError
 import sys
+import os
+import tempfile
+import time
+import subprocess
 
 if sys.version >= '3':
     xrange = range
@@ -93,6 +97,35 @@ class RebloomTestCase(ModuleTestCase('../redisbloom.so')):
         self.assertEqual(1, self.cmd('bf.exists', 'test', 'foo'))
         self.assertEqual(0, self.cmd('bf.exists', 'test', 'bar'))
     
+    def test_rdb_chunked(self):
+        # Larger than a single RDB chunk
+        c = self.client
+        self.assertOk(self.cmd('bf.reserve big 0.001 15000000'))
+        self.assertOk(self.cmd('bf.reserve small 0.01 10 blocked'))
+        for x in xrange(1000):
+            self.cmd('bf.madd', 'big', x, 'x{}'.format(x))
+            self.cmd('bf.add', 'small', x)
+        size = self.cmd('bf.info big')[3]
+        self.assertGreater(size, 16 * 1024 * 1024)
+        for _ in c.retry_with_rdb_reload():
+            self.assertEqual(size, self.cmd('bf.info big')[3])
+            for x in xrange(1000):
+                self.assertEqual([1, 1], self.cmd('bf.mexists', 'big', x, 'x{}'.format(x)))
+                self.assertEqual(1, self.cmd('bf.exists', 'small', x))
+
+    def test_rdb_sparse(self):
+        # Zero words of the bit array take next to no space
+        c = self.client
+        self.assertOk(self.cmd('bf.reserve sparse 0.001 1000000'))
+        for x in xrange(20):
+            self.cmd('bf.add', 'sparse', x)
+        self.assertGreater(self.cmd('bf.info sparse')[3], 1024 * 1024)
+        self.assertLess(len(self.cmd('dump', 'sparse')), 4096)
+        for _ in c.retry_with_rdb_reload():
+            for x in xrange(20):
+                self.assertEqual(1, self.cmd('bf.exists', 'sparse', x))
+            self.assertEqual(0, self.cmd('bf.exists', 'sparse', 'nonexist'))
+
     def test_dump_and_load(self):
         # Store a filter
         quantity = 1000
@@ -155,6 +188,49 @@ class RebloomTestCase(ModuleTestCase('../redisbloom.so')):
         self.cmd('del', 'myBloom')
         self.cmd('bf.reserve', 'myBloom', '0.0001', '10000000')
 
+    def test_scandump_options(self):
+        self.cmd('bf.reserve', 'myBloom', '0.01', '100')
+        for x in xrange(1000):
+            self.cmd('bf.add', 'myBloom', x)
+
+        with self.assertResponseError():
+            self.cmd('bf.scandump', 'myBloom', 0, 'chunksize', 0)
+        with self.assertResponseError():
+            self.cmd('bf.scandump', 'myBloom', 0, 'chunksize', 'str')
+        with self.assertResponseError():
+            self.cmd('bf.scandump', 'myBloom', 0, 'foo')
+
+        cmds = []
+        cur = self.cmd('bf.scandump', 'myBloom', 0, 'chunksize', 64, 'checksum')
+        while cur[0]:
+            self.assertEqual(3, len(cur))
+            cmds.append(cur)
+            cur = self.cmd('bf.scandump', 'myBloom', cur[0], 'chunksize', 64, 'checksum')
+        for cmd in cmds[1:]:
+            self.assertLessEqual(len(cmd[1]), 64)
+
+        prev_info = self.cmd('bf.debug', 'myBloom')
+        self.cmd('del', 'myBloom')
+        with self.assertResponseError():
+            self.cmd('bf.loadchunk', 'myBloom', cmds[0][0], cmds[0][1], cmds[0][2] ^ 1)
+        self.assertEqual(0, self.cmd('exists', 'myBloom'))
+        for cmd in cmds:
+            self.assertOk(self.cmd('bf.loadchunk', 'myBloom', *cmd))
+        self.assertEqual(prev_info, self.cmd('bf.debug', 'myBloom'))
+        for x in xrange(1000):
+            self.assertEqual(1, self.cmd('bf.exists', 'myBloom', x))
+
+        # ALL returns each sub-filter in a single chunk
+        nlinks = len(prev_info) - 1
+        nchunks = 0
+        cur = self.cmd('bf.scandump', 'myBloom', 0, 'chunksize', 'all')
+        while True:
+            cur = self.cmd('bf.scandump', 'myBloom', cur[0], 'chunksize', 'all')
+            if not cur[0]:
+                break
+            nchunks += 1
+        self.assertEqual(nlinks, nchunks)
+
     def test_missing(self):
         res = self.cmd('bf.exists', 'myBloom', 'foo')
         self.assertEqual(0, res)
@@ -196,10 +272,10 @@ class RebloomTestCase(ModuleTestCase('../redisbloom.so')):
 
     def test_mem_usage(self):
         self.assertOk(self.cmd('bf.reserve', 'bf', '0.05', '1000'))
-        self.assertEqual(1088, self.cmd('MEMORY USAGE', 'bf'))
+        self.assertEqual(1152, self.cmd('MEMORY USAGE', 'bf'))
         self.assertEqual([1, 1, 1], self.cmd(
             'bf.madd', 'bf', 'foo', 'bar', 'baz'))
-        self.assertEqual(1088, self.cmd('MEMORY USAGE', 'bf'))
+        self.assertEqual(1152, self.cmd('MEMORY USAGE', 'bf'))
         with self.assertResponseError():
             self.cmd('bf.debug', 'bf', 'noexist')
         with self.assertResponseError():
@@ -255,7 +331,7 @@ class RebloomTestCase(ModuleTestCase('../redisbloom.so')):
     def test_info(self):
         self.assertOk(self.cmd('bf.reserve', 'bf', '0.001', '100'))
         self.assertEqual(self.cmd('bf.info bf'), ['Capacity', 100,
-                                                  'Size', 352, 
+                                                  'Size', 416, 
                                                   'Number of filters', 1L, 
                                                   'Number of items inserted', 0L,
                                                   'Expansion rate', 2L])
@@ -304,7 +380,7 @@ class RebloomTestCase(ModuleTestCase('../redisbloom.so')):
         self.assertEqual([0L, 0L, 0L,],resp[:3])
         self.assertEqual('non scaling filter is full',str(resp[3]))
         info_actual = self.cmd('BF.INFO nonscaling_err')
-        info_expected = ['Capacity', 3L, 'Size', 160L, 'Number of filters', 1L,
+        info_expected = ['Capacity', 3L, 'Size', 224L, 'Number of filters', 1L,
          'Number of items inserted', 3L, 'Expansion rate', None]
         self.assertEqual(info_actual, info_expected)
 
@@ -314,7 +390,358 @@ class RebloomTestCase(ModuleTestCase('../redisbloom.so')):
         self.assertOk(self.cmd('bf.reserve bf', error_rate, capacity))
         info = ConvertInfo(self.cmd('bf.info bf'))
         self.assertEqual(info["Capacity"], 300000000)
-        self.assertEqual(info["Size"],    1132420288)
+        self.assertEqual(info["Size"],    1132420352)
+
+    def test_consolidate(self):
+        self.assertOk(self.cmd('bf.reserve bf 0.01 10'))
+        for x in xrange(1000):
+            self.cmd('bf.add bf', x)
+        self.assertGreater(ConvertInfo(self.cmd('bf.info bf'))['Number of filters'], 5)
+
+        with self.assertResponseError():
+            self.cmd('bf.consolidate bf commit')
+        with self.assertResponseError():
+            self.cmd('bf.consolidate bf items')
+        with self.assertResponseError():
+            self.cmd('bf.consolidate bf capacity 0 items a')
+        with self.assertResponseError():
+            self.cmd('bf.consolidate nonexist items a')
+
+        self.assertEqual(2, self.cmd('bf.consolidate bf items a b'))
+        self.assertOk(self.cmd('bf.consolidate bf abort'))
+        self.assertEqual(1, self.cmd('bf.exists bf 999'))
+
+        with self.assertResponseError():
+            self.cmd('bf.consolidate bf restore garbage')
+        with self.assertResponseError():
+            self.cmd('bf.consolidate bf restore 0 garbage')
+
+        # The staging sub-filter is saved with the filter
+        for x in xrange(0, 500, 100):
+            self.cmd('bf.consolidate bf capacity 2000 items', *range(x, x + 100))
+        for _ in self.client.retry_with_rdb_reload():
+            self.assertEqual(500, self.cmd('bf.consolidate bf items 0'))
+        for x in xrange(500, 1000, 100):
+            self.cmd('bf.consolidate bf capacity 2000 items', *range(x, x + 100))
+        self.cmd('bf.add bf new')
+        self.assertOk(self.cmd('bf.consolidate bf commit'))
+        info = ConvertInfo(self.cmd('bf.info bf'))
+        self.assertEqual(1, info['Number of filters'])
+        self.assertEqual(2000, info['Capacity'])
+        for x in xrange(1000):
+            self.assertEqual(1, self.cmd('bf.exists bf', x))
+        self.assertEqual(1, self.cmd('bf.exists bf new'))
+
+    def test_blocked(self):
+        c = self.client
+        self.assertOk(self.cmd('bf.reserve blk 0.01 1000 blocked'))
+        self.assertOk(self.cmd('bf.reserve blk_mix 0.01 1000 nonscaling blocked'))
+        self.assertEqual([1L, 1L, 1L], self.cmd('bf.insert blk_ins blocked items foo bar baz'))
+        for x in xrange(2000):
+            self.cmd('bf.add blk', x)
+
+        for _ in c.retry_with_rdb_reload():
+            for x in xrange(2000):
+                self.assertEqual(1, self.cmd('bf.exists blk', x))
+            self.assertEqual([1, 1, 1, 0], self.cmd('bf.mexists blk_ins foo bar baz nonexist'))
+            info = ConvertInfo(self.cmd('bf.info blk'))
+            self.assertGreater(info['Number of filters'], 1)
+
+    def test_window(self):
+        c = self.client
+        for args in (['window'], ['window', 0, 2], ['window', 100, 0], ['window', 100, 1000],
+                     ['window', 100, 2, 'nonscaling'], ['expansion', 4, 'window', 100, 2],
+                     ['start', 0], ['window', 100, 2, 'start'], ['window', 100, 2, 'start', -1]):
+            with self.assertResponseError():
+                self.cmd('bf.reserve', 'win', 0.01, 100, *args)
+        self.assertOk(self.cmd('bf.reserve', 'win', 0.01, 100, 'window', 1000, 2))
+        for x in xrange(100):
+            self.assertEqual(1, self.cmd('bf.add', 'win', x))
+        # The current generation is full, new items are rejected
+        with self.assertResponseError():
+            for x in xrange(100, 110):
+                self.cmd('bf.add', 'win', x)
+        with self.assertResponseError():
+            self.cmd('bf.consolidate', 'win', 'items', 'foo')
+        info = ConvertInfo(self.cmd('bf.info win'))
+        self.assertEqual(2, info['Number of filters'])
+        self.assertEqual(1000, info['Generation period'])
+        self.assertEqual(None, info['Expansion rate'])
+        for _ in c.retry_with_rdb_reload():
+            self.assertEqual([1] * 100, self.cmd('bf.mexists', 'win', *range(100)))
+
+        # Items expire one to two periods after they were added. Lookups skip them,
+        # the next write clears them
+        time.sleep(2.1)
+        self.assertLess(sum(self.cmd('bf.mexists', 'win', *range(100))), 5)
+        self.assertEqual(100, ConvertInfo(self.cmd('bf.info win'))['Number of items inserted'])
+        self.assertEqual(1, self.cmd('bf.add', 'win', 'full'))
+        self.assertEqual(1, ConvertInfo(self.cmd('bf.info win'))['Number of items inserted'])
+
+    def test_window_advance(self):
+        # Starting in the future, the window only moves as told by BF.ADVANCE
+        start = 4000000000000
+        self.assertOk(self.cmd('bf.reserve', 'win', 0.01, 100, 'window', 1000, 2,
+                               'start', start))
+        self.assertOk(self.cmd('bf.reserve', 'plain', 0.01, 100))
+        for args in (['win'], ['win', 'x'], ['win', -1], ['plain', start], ['missing', start]):
+            with self.assertResponseError():
+                self.cmd('bf.advance', *args)
+        for x in xrange(50):
+            self.assertEqual(1, self.cmd('bf.add', 'win', x))
+        self.assertEqual(0, self.cmd('bf.advance', 'win', start - 1))
+        self.assertEqual(1, self.cmd('bf.advance', 'win', start + 1000))
+        self.assertEqual([1] * 50, self.cmd('bf.mexists', 'win', *range(50)))
+        self.assertEqual(1, self.cmd('bf.advance', 'win', start + 2500))
+        self.assertLess(sum(self.cmd('bf.mexists', 'win', *range(50))), 3)
+        self.assertEqual(0, ConvertInfo(self.cmd('bf.info win'))['Number of items inserted'])
+
+    def test_counting(self):
+        c = self.client
+        self.assertOk(self.cmd('bf.reserve cnt 0.01 1000 counting'))
+        self.assertOk(self.cmd('bf.reserve cnt_blk 0.01 1000 counting blocked'))
+        self.assertEqual([1L, 1L], self.cmd('bf.insert cnt_ins counting items foo bar'))
+        self.assertOk(self.cmd('bf.reserve plain 0.01 1000'))
+        self.cmd('bf.add plain foo')
+        with self.assertResponseError():
+            self.cmd('bf.del plain foo')
+        with self.assertResponseError():
+            self.cmd('bf.del missing foo')
+        with self.assertResponseError():
+            self.cmd('bf.del cnt')
+        for x in xrange(3000):
+            self.cmd('bf.add cnt', x)
+            self.cmd('bf.add cnt_blk', x)
+        self.assertGreater(ConvertInfo(self.cmd('bf.info cnt'))['Number of filters'], 1)
+        with self.assertResponseError():
+            self.cmd('bf.consolidate', 'cnt', 'items', 'foo')
+
+        removed = sum(self.cmd('bf.del cnt', x) for x in xrange(0, 3000, 2))
+        self.assertGreater(removed, 1470)
+        self.assertEqual(3000 - removed,
+                         ConvertInfo(self.cmd('bf.info cnt'))['Number of items inserted'])
+        self.assertEqual(1, self.cmd('bf.del cnt_ins foo'))
+        self.assertEqual(0, self.cmd('bf.del cnt_ins foo'))
+        self.assertEqual([0, 1], self.cmd('bf.mexists cnt_ins foo bar'))
+
+        for _ in c.retry_with_rdb_reload():
+            self.assertGreater(sum(self.cmd('bf.mexists', 'cnt', *range(1, 3000, 2))), 1470)
+            self.assertEqual([1] * 3000, self.cmd('bf.mexists', 'cnt_blk', *range(3000)))
+            self.assertLess(sum(self.cmd('bf.mexists', 'cnt', *range(0, 3000, 2))), 60)
+
+        # SCANDUMP keeps the counters
+        cmds = []
+        cur = self.cmd('bf.scandump', 'cnt', 0)
+        while cur[0]:
+            cmds.append(cur)
+            cur = self.cmd('bf.scandump', 'cnt', cur[0])
+        prev_info = self.cmd('bf.debug', 'cnt')
+        self.cmd('del', 'cnt')
+        for cmd in cmds:
+            self.assertOk(self.cmd('bf.loadchunk', 'cnt', *cmd))
+        self.assertEqual(prev_info, self.cmd('bf.debug', 'cnt'))
+        self.assertEqual(1, self.cmd('bf.del cnt 1'))
+
+    def test_merge(self):
+        c = self.client
+        for name in ('a', 'b', 'dest'):
+            self.assertOk(self.cmd('bf.reserve', name, 0.01, 1000))
+        for x in xrange(1500):
+            self.cmd('bf.add', 'a', x)
+            self.cmd('bf.add', 'b', x + 1500)
+            self.cmd('bf.add', 'dest', x + 3000)
+        self.assertOk(self.cmd('bf.reserve', 'small', 0.01, 100))
+        self.assertOk(self.cmd('bf.reserve', 'win', 0.01, 1000, 'window', 1000, 2))
+        for args in (['dest', 0, 'a'], ['dest', 'x', 'a'], ['dest', 2, 'a'],
+                     ['dest', 1, 'a', 'b'], ['dest', 1, 'missing'], ['dest', 2, 'a', 'small'],
+                     ['dest', 1, 'win'], ['win', 1, 'a'], ['small', 1, 'a']):
+            with self.assertResponseError():
+                self.cmd('bf.merge', *args)
+
+        self.assertOk(self.cmd('bf.merge', 'union', 2, 'a', 'b'))
+        self.assertOk(self.cmd('bf.merge', 'dest', 2, 'a', 'b'))
+        self.assertOk(self.cmd('bf.merge', 'inter', 2, 'union', 'a', 'intersect'))
+        for _ in c.retry_with_rdb_reload():
+            self.assertEqual([1] * 3000, self.cmd('bf.mexists', 'union', *range(3000)))
+            self.assertEqual([1] * 4500, self.cmd('bf.mexists', 'dest', *range(4500)))
+            self.assertEqual([1] * 1500, self.cmd('bf.mexists', 'inter', *range(1500)))
+            self.assertLess(sum(self.cmd('bf.mexists', 'inter', *range(1500, 3000))), 50)
+            size = ConvertInfo(self.cmd('bf.info', 'union'))['Number of items inserted']
+            self.assertGreater(size, 2850)
+            self.assertLess(size, 3150)
+
+        # Aliasing the destination
+        self.assertOk(self.cmd('bf.merge', 'a', 2, 'a', 'b', 'intersect'))
+        self.assertLess(sum(self.cmd('bf.mexists', 'a', *range(3000))), 100)
+
+        # Counting filters sum their counters
+        self.assertOk(self.cmd('bf.reserve', 'c1', 0.01, 1000, 'counting'))
+        self.assertOk(self.cmd('bf.reserve', 'c2', 0.01, 1000, 'counting'))
+        self.cmd('bf.add', 'c1', 'foo')
+        self.cmd('bf.add', 'c2', 'foo')
+        self.assertOk(self.cmd('bf.merge', 'c3', 2, 'c1', 'c2'))
+        self.assertEqual(1, self.cmd('bf.del', 'c3', 'foo'))
+        self.assertEqual(1, self.cmd('bf.exists', 'c3', 'foo'))
+
+    def test_mmap_disabled(self):
+        with self.assertResponseError():
+            self.cmd('bf.mmap', 'mapped', 'filter.bf')
+
+MMAP_DIR = tempfile.mkdtemp()
+
+class MmapTestCase(ModuleTestCase('../redisbloom.so', module_args=['BF_MMAP_DIR', MMAP_DIR])):
+    def dump_to_file(self, key, name):
+        with open(os.path.join(MMAP_DIR, name), 'wb') as fp:
+            it = 0
+            while True:
+                it, data = self.cmd('bf.scandump', key, it)
+                if it == 0:
+                    break
+                fp.write(data)
+
+    def test_mmap(self):
+        self.assertOk(self.cmd('bf.reserve', 'src', 0.001, 1000))
+        for x in xrange(3000):
+            self.cmd('bf.add', 'src', x)
+        self.dump_to_file('src', 'filter.bf')
+
+        self.assertOk(self.cmd('bf.mmap', 'mapped', 'filter.bf'))
+        self.assertEqual(self.cmd('bf.debug', 'src'), self.cmd('bf.debug', 'mapped'))
+        for x in xrange(3000):
+            self.assertEqual(1, self.cmd('bf.exists', 'mapped', x))
+
+        # Writes only affect the key
+        for x in xrange(3000, 6000):
+            self.cmd('bf.add', 'mapped', x)
+        self.assertOk(self.cmd('bf.mmap', 'mapped2', 'filter.bf'))
+        self.assertEqual(self.cmd('bf.debug', 'src'), self.cmd('bf.debug', 'mapped2'))
+        for _ in self.retry_with_rdb_reload():
+            for x in xrange(6000):
+                self.assertEqual(1, self.cmd('bf.exists', 'mapped', x))
+
+        with self.assertResponseError():
+            self.cmd('bf.mmap', 'mapped', 'filter.bf')
+        with self.assertResponseError():
+            self.cmd('bf.mmap', 'other', 'missing.bf')
+        with self.assertResponseError():
+            self.cmd('bf.mmap', 'other', '../' + os.path.basename(MMAP_DIR))
+        with self.assertResponseError():
+            self.cmd('bf.mmap', 'other', '/etc/passwd')
+
+    def test_builder(self):
+        with open(os.path.join(MMAP_DIR, 'items.txt'), 'w') as fp:
+            for x in xrange(3000):
+                fp.write('%d\n' % x)
+        subprocess.check_call(['../redisbloom-builder', '-c', '1000', '-e', '0.001',
+                               '-o', os.path.join(MMAP_DIR, 'built.bf'),
+                               os.path.join(MMAP_DIR, 'items.txt')])
+        self.assertOk(self.cmd('bf.reserve', 'added', 0.001, 1000))
+        for x in xrange(3000):
+            self.cmd('bf.add', 'added', x)
+        self.assertOk(self.cmd('bf.mmap', 'built', 'built.bf'))
+        self.assertEqual(self.cmd('bf.debug', 'added'), self.cmd('bf.debug', 'built'))
+        # Fingerprint sizes are not rounded down to a supported one
+        with open(os.devnull, 'w') as devnull:
+            for bits in ('9', '12', '24', '31'):
+                self.assertNotEqual(0, subprocess.call(
+                    ['../redisbloom-builder', '-t', 'cf', '-c', '1000', '-f', bits, '-o',
+                     os.path.join(MMAP_DIR, 'built.cf'), os.path.join(MMAP_DIR, 'items.txt')],
+                    stderr=devnull))
+
+    def test_mmap_bad_file(self):
+        with open(os.path.join(MMAP_DIR, 'bad.bf'), 'wb') as fp:
+            fp.write(b'not a filter')
+        with self.assertResponseError():
+            self.cmd('bf.mmap', 'other', 'bad.bf')
+
+class GrowReserveTestCase(ModuleTestCase('../redisbloom.so', module_args=['GROW_RESERVE', '50'])):
+    def test_grow(self):
+        c = self.client
+        self.assertOk(self.cmd('bf.reserve', 'bf', 0.01, 100000))
+        self.assertOk(self.cmd('cf.reserve', 'cf', 100000))
+        empty = [self.cmd('memory', 'usage', key) for key in ('bf', 'cf')]
+        for x in xrange(0, 300000, 1000):
+            self.cmd('bf.madd', 'bf', *range(x, x + 1000))
+            self.cmd('cf.insert', 'cf', 'items', *range(x, x + 1000))
+            if x == 70000:
+                # The next sub-filters are held by the keys ahead of time
+                self.assertGreater(self.cmd('memory', 'usage', 'bf'), empty[0] * 1.5)
+                self.assertGreater(self.cmd('memory', 'usage', 'cf'), empty[1] * 1.5)
+        for _ in c.retry_with_rdb_reload():
+            self.assertEqual([1] * 1000, self.cmd('bf.mexists', 'bf', *range(299000, 300000)))
+            self.assertEqual(1, self.cmd('cf.exists', 'cf', 299999))
+            self.assertGreater(ConvertInfo(self.cmd('bf.info', 'bf'))['Number of filters'], 1)
+            self.assertGreater(ConvertInfo(self.cmd('cf.info', 'cf'))['Number of filters'], 1)
+
+class AsyncMergeTestCase(ModuleTestCase('../redisbloom.so', module_args=['BF_ASYNC_MERGE', '1'])):
+    def test_merge(self):
+        for name in ('a', 'b'):
+            self.assertOk(self.cmd('bf.reserve', name, 0.001, 1000000))
+        for x in xrange(1000):
+            self.cmd('bf.add', 'a', x)
+            self.cmd('bf.add', 'b', x + 1000)
+        self.assertOk(self.cmd('bf.merge', 'c', 2, 'a', 'b'))
+        self.assertEqual([1] * 2000, self.cmd('bf.mexists', 'c', *range(2000)))
+        self.assertOk(self.cmd('bf.merge', 'a', 2, 'a', 'c', 'intersect'))
+        self.assertEqual([1] * 1000, self.cmd('bf.mexists', 'a', *range(1000)))
+        with self.assertResponseError():
+            self.cmd('bf.merge', 'c', 1, 'missing')
+
+    def test_merge_concurrent_writes(self):
+        # Sources written to during the merge are merged in a single state, holding
+        # the items added up to some point
+        for name in ('a', 'b'):
+            self.assertOk(self.cmd('bf.reserve', name, 0.0001, 4000000))
+        conn = self.client.connection_pool.get_connection('bf.merge')
+        conn.send_command('bf.merge', 'c', 2, 'a', 'b')
+        for x in xrange(100):
+            self.cmd('bf.add', 'b', x)
+        self.assertEqual('OK', conn.read_response())
+        self.client.connection_pool.release(conn)
+        found = self.cmd('bf.mexists', 'c', *range(100))
+        self.assertEqual(sorted(found, reverse=True), found)
+
+class StatsTestCase(ModuleTestCase('../redisbloom.so', module_args=['STATS', 'yes'])):
+    def test_stats(self):
+        self.cmd('bf.reserve', 'bf', '0.01', '100')
+        for x in xrange(1000):
+            self.cmd('bf.add', 'bf', str(x))
+        self.cmd('bf.mexists', 'bf', 'a', 'b', 'c')
+        info = self.cmd('bf.info', 'bf')
+        info = dict(zip(info[::2], info[1::2]))
+        self.assertEqual(3, info['Lookups'])
+        self.assertEqual(info['Number of filters'] - 1, info['Filters added'])
+        self.assertGreaterEqual(info['Filters visited'], 3)
+
+        self.cmd('cf.reserve', 'cf', '100')
+        for x in xrange(1000):
+            self.cmd('cf.add', 'cf', str(x))
+        self.cmd('cf.exists', 'cf', '1')
+        info = self.cmd('cf.info', 'cf')
+        info = dict(zip(info[::2], info[1::2]))
+        self.assertEqual(1, info['Lookups'])
+        self.assertEqual(info['Number of filters'] - 1, info['Filters added'])
+        self.assertGreater(info['Evictions'], 0)
+        self.assertEqual(0, info['Relocations'])
+
+        self.cmd('cms.initbydim', 'cms', '100', '5')
+        self.cmd('cms.incrby', 'cms', 'a', '1', 'b', '2')
+        self.cmd('cms.query', 'cms', 'a')
+        self.assertEqual(['width', 100, 'depth', 5, 'count', 3, 'increments', 2, 'queries', 1],
+                         self.cmd('cms.info', 'cms'))
+
+        self.cmd('topk.reserve', 'topk', '2', '50', '3', '0.9')
+        self.cmd('topk.add', 'topk', 'a', 'b', 'c', 'a')
+        info = self.cmd('topk.info', 'topk')
+        self.assertEqual(['adds', 4, 'heap replacements', 2], info[8:12])
+        self.assertEqual('decrements', info[12])
+
+        # Totals of all the keys, from Redis 6
+        info = self.cmd('info', 'bf_stats')
+        if info:
+            # Fields are prefixed with the module name
+            self.assertEqual([3], [v for k, v in info.items() if k.endswith('bf_lookups')])
+            self.assertEqual([2], [v for k, v in info.items() if k.endswith('cms_increments')])
 
 if __name__ == "__main__":
     import unittest
@@ -1,10 +1,17 @@
 #include "redismodule.h"
 #include "sb.h"
+#include "simd.h"
+#include "crc64.h"
+#include "workers.h"
+#include "reserve.h"
+#include "zrle.h"
 #include "test.h"
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 #define BF_DEFAULT_GROWTH 2
 
@@ -167,12 +174,706 @@ TEST_F(basic, test64BitHash) {
     SBChain_Free(chain);
 }
 
+TEST_F(basic, testBlocked) {
+    SBChain *chain = SB_NewChain(10000, 0.01, BLOOM_OPT_FORCE64 | BLOOM_OPT_NOROUND | BLOOM_OPT_BLOCKED,
+                                 BF_DEFAULT_GROWTH);
+    ASSERT_NE(NULL, chain);
+    ASSERT_EQ(1, chain->filters[0].inner.blocked);
+    ASSERT_EQ(0, chain->filters[0].inner.bytes % BLOOM_BLOCK_BYTES);
+
+    for (size_t ii = 0; ii < 10000; ++ii) {
+        SBChain_Add(chain, &ii, sizeof ii);
+        ASSERT_NE(0, SBChain_Check(chain, &ii, sizeof ii));
+    }
+    ASSERT_EQ(1, chain->nfilters);
+
+    // Blocked filters trade a little accuracy for locality; stay well below 2%
+    size_t nColls = 0;
+    for (size_t ii = 10000; ii < 110000; ++ii) {
+        nColls += SBChain_Check(chain, &ii, sizeof ii);
+    }
+    ASSERT_LT(nColls, 2000);
+
+    // Scaling keeps the layout
+    for (size_t ii = 10000; ii < 30000; ++ii) {
+        SBChain_Add(chain, &ii, sizeof ii);
+    }
+    ASSERT_GT(chain->nfilters, 1);
+    ASSERT_EQ(1, chain->filters[chain->nfilters - 1].inner.blocked);
+    for (size_t ii = 0; ii < 30000; ++ii) {
+        ASSERT_NE(0, SBChain_Check(chain, &ii, sizeof ii));
+    }
+    SBChain_Free(chain);
+}
+
 typedef struct {
     const char *buf;
     size_t nbuf;
     long long iter;
 } encodedInfo;
 
+TEST_F(basic, testBlockedKernels) {
+    static const char *kernels[] = {"scalar", "sse4", "avx2", "neon"};
+    unsigned char block[BLOOM_BLOCK_BYTES], mask[BLOOM_BLOCK_BYTES];
+
+    for (size_t kk = 0; kk < sizeof(kernels) / sizeof(kernels[0]); ++kk) {
+        if (SIMD_Select(kernels[kk]) != 0) {
+            continue;
+        }
+        for (size_t ii = 0; ii < 1000; ++ii) {
+            memset(block, 0, sizeof block);
+            memset(mask, 0, sizeof mask);
+            for (size_t jj = 0; jj < BLOOM_BLOCK_BYTES; ++jj) {
+                block[jj] = (jj * 31 + ii) % 251 > 120 ? 0xff : jj ^ ii;
+            }
+            size_t bit = (ii * 37) % BLOOM_BLOCK_BITS;
+            mask[bit >> 3] |= 1 << (bit % 8);
+            int isSet = (block[bit >> 3] >> (bit % 8)) & 1;
+            ASSERT_EQ(isSet, simdOps.blockTest(block, mask));
+            ASSERT_EQ(!isSet, simdOps.blockSet(block, mask));
+            ASSERT_EQ(1, simdOps.blockTest(block, mask));
+            ASSERT_EQ(0, simdOps.blockSet(block, mask));
+        }
+
+        SBChain *chain = SB_NewChain(10000, 0.001, BLOOM_OPT_FORCE64 | BLOOM_OPT_BLOCKED,
+                                     BF_DEFAULT_GROWTH);
+        for (size_t ii = 0; ii < 10000; ++ii) {
+            SBChain_Add(chain, &ii, sizeof ii);
+        }
+        for (size_t ii = 0; ii < 10000; ++ii) {
+            ASSERT_NE(0, SBChain_Check(chain, &ii, sizeof ii));
+        }
+        SBChain_Free(chain);
+    }
+    SIMD_Select("scalar");
+}
+
+TEST_F(basic, testBatch) {
+    static const unsigned opts[] = {BLOOM_OPT_FORCE64 | BLOOM_OPT_NOROUND,
+                                    BLOOM_OPT_FORCE64 | BLOOM_OPT_NOROUND | BLOOM_OPT_BLOCKED, 0};
+    enum { NITEMS = 5000 };
+    static char bufs[NITEMS][16];
+    const char *items[NITEMS];
+    size_t lens[NITEMS];
+    int results[NITEMS];
+    for (size_t ii = 0; ii < NITEMS; ++ii) {
+        // Every fifth item repeats an earlier one inside the same batch
+        lens[ii] = sprintf(bufs[ii], "item%zu", ii % 5 == 4 ? ii - 2 : ii);
+        items[ii] = bufs[ii];
+    }
+
+    for (size_t oo = 0; oo < sizeof(opts) / sizeof(opts[0]); ++oo) {
+        SBChain *batched = SB_NewChain(1000, 0.01, opts[oo], BF_DEFAULT_GROWTH);
+        SBChain *single = SB_NewChain(1000, 0.01, opts[oo], BF_DEFAULT_GROWTH);
+        ASSERT_EQ(NITEMS, SBChain_AddMany(batched, items, lens, NITEMS, results));
+        for (size_t ii = 0; ii < NITEMS; ++ii) {
+            ASSERT_EQ(SBChain_Add(single, items[ii], lens[ii]), results[ii]);
+        }
+        ASSERT_EQ(single->size, batched->size);
+        ASSERT_EQ(single->nfilters, batched->nfilters);
+        ASSERT_GT(batched->nfilters, 1);
+
+        SBChain_CheckMany(batched, items, lens, NITEMS, results);
+        for (size_t ii = 0; ii < NITEMS; ++ii) {
+            ASSERT_EQ(1, results[ii]);
+        }
+        // A mix of known and unknown items
+        for (size_t ii = 0; ii < NITEMS; ++ii) {
+            lens[ii] = sprintf(bufs[ii], "%s%zu", ii % 2 ? "item" : "other", ii);
+        }
+        SBChain_CheckMany(batched, items, lens, NITEMS, results);
+        for (size_t ii = 0; ii < NITEMS; ++ii) {
+            ASSERT_EQ(SBChain_Check(single, items[ii], lens[ii]), results[ii]);
+        }
+        SBChain_Free(batched);
+        SBChain_Free(single);
+    }
+
+    // Stops at the first error
+    SBChain *chain = SB_NewChain(100, 0.01, BLOOM_OPT_NO_SCALING, BF_DEFAULT_GROWTH);
+    size_t n = SBChain_AddMany(chain, items, lens, NITEMS, results);
+    ASSERT_GT(n, chain->filters[0].inner.entries);
+    ASSERT_LT(n, NITEMS);
+    ASSERT_EQ(-2, results[n - 1]);
+    ASSERT_EQ(chain->filters[0].inner.entries, chain->size);
+    SBChain_Free(chain);
+}
+
+typedef struct {
+    const SBChain *sb;
+    const char **items;
+    size_t *lens;
+    int *results;
+    size_t calls;
+} WorkersCheck;
+
+static void workersCheckPart(void *arg, size_t begin, size_t end) {
+    WorkersCheck *check = arg;
+    SBChain_CheckMany(check->sb, check->items + begin, check->lens + begin, end - begin,
+                      check->results + begin);
+    __atomic_fetch_add(&check->calls, 1, __ATOMIC_RELAXED);
+}
+
+TEST_F(basic, testWorkers) {
+    enum { NITEMS = 20000 };
+    static char bufs[NITEMS][16];
+    static const char *items[NITEMS];
+    static size_t lens[NITEMS];
+    static int results[NITEMS];
+    SBChain *chain = SB_NewChain(NITEMS / 2, 0.01, BLOOM_OPT_FORCE64, BF_DEFAULT_GROWTH);
+    for (size_t ii = 0; ii < NITEMS; ++ii) {
+        lens[ii] = sprintf(bufs[ii], "item%zu", ii);
+        items[ii] = bufs[ii];
+        if (ii % 2) {
+            SBChain_Add(chain, items[ii], lens[ii]);
+        }
+    }
+
+    WorkersCheck check = {.sb = chain, .items = items, .lens = lens, .results = results};
+    // Inline without a pool
+    ASSERT_EQ(0, Workers_Count());
+    Workers_ParallelFor(NITEMS, 100, workersCheckPart, &check);
+    ASSERT_EQ(1, check.calls);
+
+    ASSERT_EQ(0, Workers_Init(3));
+    ASSERT_EQ(-1, Workers_Init(3));
+    ASSERT_EQ(3, Workers_Count());
+    for (size_t round = 0; round < 100; ++round) {
+        memset(results, 0xff, sizeof(results));
+        check.calls = 0;
+        Workers_ParallelFor(NITEMS, 100, workersCheckPart, &check);
+        ASSERT_EQ(4, check.calls);
+        for (size_t ii = 0; ii < NITEMS; ++ii) {
+            ASSERT_EQ(SBChain_Check(chain, items[ii], lens[ii]), results[ii]);
+        }
+    }
+
+    // Small batches stay on the calling thread
+    check.calls = 0;
+    Workers_ParallelFor(150, 100, workersCheckPart, &check);
+    ASSERT_EQ(1, check.calls);
+    SBChain_Free(chain);
+}
+
+TEST_F(basic, testProbePlan) {
+    // Probe plans must select exactly the bits bloom_check_h selects, with
+    // both the specialised and the generic number of hashes
+    static const unsigned opts[] = {BLOOM_OPT_FORCE64 | BLOOM_OPT_NOROUND,
+                                    BLOOM_OPT_FORCE64 | BLOOM_OPT_NOROUND | BLOOM_OPT_BLOCKED,
+                                    BLOOM_OPT_FORCE64, BLOOM_OPT_NOROUND, 0};
+    static const double errors[] = {0.05, 0.3, 0.001, 1e-7};
+    for (size_t nn = 0; nn < sizeof(opts) / sizeof(opts[0]) * 4; ++nn) {
+        const size_t oo = nn / 4;
+        SBChain *chain = SB_NewChain(777, errors[nn % 4], opts[oo], BF_DEFAULT_GROWTH);
+        for (size_t ii = 0; ii < 20000; ++ii) {
+            SBChain_Add(chain, &ii, sizeof ii);
+        }
+        ASSERT_GT(chain->nfilters, 2);
+
+        size_t npos = 0;
+        for (size_t ii = 0; ii < 220000; ++ii) {
+            bloom_hashval hv = (opts[oo] & BLOOM_OPT_FORCE64) ? bloom_calc_hash64(&ii, sizeof ii)
+                                                               : bloom_calc_hash(&ii, sizeof ii);
+            int expected = 0;
+            for (size_t jj = 0; jj < chain->nfilters; ++jj) {
+                expected |= bloom_check_h(&chain->filters[jj].inner, hv);
+            }
+            ASSERT_EQ(expected, SBChain_Check(chain, &ii, sizeof ii));
+            if (ii < 20000) {
+                ASSERT_EQ(1, expected);
+            } else {
+                npos += expected;
+            }
+        }
+        if (errors[nn % 4] > 0.01) {
+            ASSERT_GT(npos, 0);
+        }
+        SBChain_Free(chain);
+    }
+}
+
+TEST_F(basic, testConsolidate) {
+    SBChain *chain = SB_NewChain(100, 0.01, BLOOM_OPT_FORCE64 | BLOOM_OPT_NOROUND, BF_DEFAULT_GROWTH);
+    for (size_t ii = 0; ii < 20000; ++ii) {
+        SBChain_Add(chain, &ii, sizeof ii);
+    }
+    ASSERT_GT(chain->nfilters, 5);
+    ASSERT_EQ(-1, SBChain_StageCommit(chain));
+
+    // Aborting leaves the chain untouched
+    ASSERT_EQ(0, SBChain_StageBegin(chain, chain->size));
+    ASSERT_EQ(-1, SBChain_StageBegin(chain, chain->size));
+    SBChain_StageAbort(chain);
+    ASSERT_EQ(NULL, chain->staging);
+
+    ASSERT_EQ(0, SBChain_StageBegin(chain, 25000));
+    for (size_t ii = 0; ii < 20000; ++ii) {
+        SBChain_StageAdd(chain, &ii, sizeof ii);
+        // Writers keep adding while the items are re-supplied
+        if (ii % 4 == 0) {
+            size_t extra = ii + 1000000;
+            SBChain_Add(chain, &extra, sizeof extra);
+        }
+    }
+    ASSERT_EQ(0, SBChain_StageCommit(chain));
+    ASSERT_EQ(1, chain->nfilters);
+    ASSERT_EQ(NULL, chain->staging);
+    ASSERT_EQ(chain->filters[0].size, chain->size);
+
+    for (size_t ii = 0; ii < 20000; ++ii) {
+        size_t extra = ii + 1000000;
+        ASSERT_EQ(1, SBChain_Check(chain, &ii, sizeof ii));
+        if (ii % 4 == 0) {
+            ASSERT_EQ(1, SBChain_Check(chain, &extra, sizeof extra));
+        }
+    }
+    size_t nColls = 0;
+    for (size_t ii = 2000000; ii < 2100000; ++ii) {
+        nColls += SBChain_Check(chain, &ii, sizeof ii);
+    }
+    ASSERT_LT(nColls, 1000);
+
+    // The consolidated chain still scales
+    for (size_t ii = 3000000; ii < 3050000; ++ii) {
+        SBChain_Add(chain, &ii, sizeof ii);
+    }
+    ASSERT_GT(chain->nfilters, 1);
+    SBChain_Free(chain);
+}
+
+TEST_F(basic, testConsolidateSerialize) {
+    SBChain *chain = SB_NewChain(100, 0.01, BLOOM_OPT_NOROUND, BF_DEFAULT_GROWTH);
+    for (size_t ii = 0; ii < 2000; ++ii) {
+        SBChain_Add(chain, &ii, sizeof ii);
+    }
+    size_t len;
+    const char *errmsg;
+    ASSERT_EQ(NULL, SBChain_GetEncodedStaging(chain, &len));
+    ASSERT_EQ(0, SBChain_StageBegin(chain, 4000));
+    for (size_t ii = 0; ii < 1000; ++ii) {
+        SBChain_StageAdd(chain, &ii, sizeof ii);
+    }
+
+    char *hdr = SBChain_GetEncodedHeader(chain, &len);
+    SBChain *copy = SB_NewChainFromHeader(hdr, len, &errmsg);
+    SB_FreeEncodedHeader(hdr);
+    ASSERT_NE(NULL, copy);
+    long long iter = SB_CHUNKITER_INIT;
+    const char *chunk;
+    while ((chunk = SBChain_GetEncodedChunk(chain, &iter, &len, 100)) != NULL) {
+        ASSERT_EQ(0, SBChain_LoadEncodedChunk(copy, iter, chunk, len, &errmsg));
+    }
+    ASSERT_EQ(-1, SBChain_LoadStagingChunk(copy, 0, "", 0, &errmsg));
+    ASSERT_EQ(-1, SBChain_LoadEncodedStaging(copy, "bad", 3, &errmsg));
+
+    char *staging = SBChain_GetEncodedStaging(chain, &len);
+    ASSERT_EQ(0, SBChain_LoadEncodedStaging(copy, staging, len, &errmsg));
+    ASSERT_EQ(-1, SBChain_LoadEncodedStaging(copy, staging, len, &errmsg));
+    SB_FreeEncodedHeader(staging);
+    const struct bloom *bm = &chain->staging->inner;
+    ASSERT_EQ(bm->bytes, copy->staging->inner.bytes);
+    ASSERT_EQ(-1, SBChain_LoadStagingChunk(copy, bm->bytes, "x", 1, &errmsg));
+    for (size_t offset = 0; offset < bm->bytes; offset += 100) {
+        len = bm->bytes - offset < 100 ? bm->bytes - offset : 100;
+        ASSERT_EQ(0, SBChain_LoadStagingChunk(copy, offset, (const char *)bm->bf + offset, len,
+                                              &errmsg));
+    }
+    ASSERT_EQ(chain->staging->size, copy->staging->size);
+
+    // The copy carries on with the consolidation
+    for (size_t ii = 1000; ii < 2000; ++ii) {
+        SBChain_StageAdd(copy, &ii, sizeof ii);
+    }
+    ASSERT_EQ(0, SBChain_StageCommit(copy));
+    ASSERT_EQ(1, copy->nfilters);
+    for (size_t ii = 0; ii < 2000; ++ii) {
+        ASSERT_EQ(1, SBChain_Check(copy, &ii, sizeof ii));
+    }
+    SBChain_Free(copy);
+    SBChain_Free(chain);
+}
+
+TEST_F(basic, testStats) {
+    SBChainStats before = sbTotalStats;
+    SBChain *chain = SB_NewChain(100, 0.01, BLOOM_OPT_FORCE64 | BLOOM_OPT_NOROUND, BF_DEFAULT_GROWTH);
+    ASSERT_EQ(NULL, chain->stats);
+    ASSERT_EQ(0, SBChain_EnableStats(chain));
+    for (size_t ii = 0; ii < 5000; ++ii) {
+        SBChain_Add(chain, &ii, sizeof ii);
+    }
+    ASSERT_GT(chain->nfilters, 3);
+    ASSERT_EQ(chain->nfilters - 1, chain->stats->grows);
+    ASSERT_EQ(chain->stats->grows, sbTotalStats.grows - before.grows);
+
+    // Lookups of items that are not there visit every link
+    uint64_t lookups = chain->stats->lookups, visited = chain->stats->linksVisited;
+    size_t missing = 0;
+    for (size_t ii = 1000000; ii < 1000100; ++ii) {
+        missing += !SBChain_Check(chain, &ii, sizeof ii);
+    }
+    ASSERT_EQ(lookups + 100, chain->stats->lookups);
+    ASSERT_LE(visited + missing * chain->nfilters, chain->stats->linksVisited);
+
+    const char *items[] = {"foo", "bar", "baz"};
+    const size_t lens[] = {3, 3, 3};
+    int results[3];
+    SBChain_CheckMany(chain, items, lens, 3, results);
+    ASSERT_EQ(lookups + 103, chain->stats->lookups);
+    ASSERT_EQ(chain->stats->lookups, sbTotalStats.lookups - before.lookups);
+    SBChain_Free(chain);
+}
+
+TEST_F(basic, testWindow) {
+    const uint64_t period = 1000, t0 = 5000000;
+    ASSERT_EQ(NULL, SB_NewWindowChain(100, 0.01, 0, 0, period, t0));
+    ASSERT_EQ(NULL, SB_NewWindowChain(100, 0.01, 0, 4, 0, t0));
+    SBChain *chain = SB_NewWindowChain(1000, 0.01, BLOOM_OPT_FORCE64, 4, period, t0);
+    ASSERT_EQ(4, chain->nfilters);
+    ASSERT_EQ(0, chain->window->current);
+    unsigned char *bits = chain->filters[0].inner.bf;
+
+    // One batch of items per generation
+    for (uint64_t gen = 0; gen < 4; ++gen) {
+        ASSERT_EQ(gen ? 1 : 0, SBChain_Advance(chain, t0 + gen * period + 10));
+        ASSERT_EQ(gen, chain->window->current);
+        for (size_t ii = gen * 100; ii < (gen + 1) * 100; ++ii) {
+            ASSERT_EQ(1, SBChain_Add(chain, &ii, sizeof ii));
+        }
+    }
+    ASSERT_EQ(400, chain->size);
+    for (size_t ii = 0; ii < 400; ++ii) {
+        ASSERT_EQ(1, SBChain_Check(chain, &ii, sizeof ii));
+        ASSERT_EQ(0, SBChain_Add(chain, &ii, sizeof ii));
+    }
+
+    // Expired generations are only hidden from lookups
+    SBChain_Expire(chain, t0 + 5 * period);
+    ASSERT_EQ(3, chain->window->current);
+    ASSERT_EQ(400, chain->size);
+    size_t hidden = 0;
+    for (size_t ii = 0; ii < 200; ++ii) {
+        hidden += SBChain_Check(chain, &ii, sizeof ii);
+    }
+    ASSERT_LT(hidden, 10);
+    for (size_t ii = 200; ii < 400; ++ii) {
+        ASSERT_EQ(1, SBChain_Check(chain, &ii, sizeof ii));
+    }
+    SBChain_Expire(chain, t0 + 3 * period + 10);
+    for (size_t ii = 0; ii < 400; ++ii) {
+        ASSERT_EQ(1, SBChain_Check(chain, &ii, sizeof ii));
+    }
+
+    // Earlier times do not move the window back
+    ASSERT_EQ(0, SBChain_Advance(chain, t0));
+    ASSERT_EQ(3, chain->window->current);
+
+    // The oldest generation expires and its link is reused
+    ASSERT_EQ(1, SBChain_Advance(chain, t0 + 4 * period));
+    ASSERT_EQ(0, chain->window->current);
+    ASSERT_EQ(bits, chain->filters[0].inner.bf);
+    ASSERT_EQ(300, chain->size);
+    size_t found = 0;
+    for (size_t ii = 0; ii < 100; ++ii) {
+        found += SBChain_Check(chain, &ii, sizeof ii);
+    }
+    ASSERT_LT(found, 5);
+    for (size_t ii = 100; ii < 400; ++ii) {
+        ASSERT_EQ(1, SBChain_Check(chain, &ii, sizeof ii));
+    }
+
+    // A generation holds a fixed number of items
+    size_t extra = 1000;
+    while (SBChain_Add(chain, &extra, sizeof extra) >= 0) {
+        extra++;
+    }
+    ASSERT_EQ(chain->filters[0].inner.entries, chain->filters[0].size);
+    ASSERT_EQ(-2, SBChain_Add(chain, &extra, sizeof extra));
+    ASSERT_EQ(-1, SBChain_StageBegin(chain, 100));
+
+    // Survives encoding
+    size_t hdrlen;
+    char *hdr = SBChain_GetEncodedHeader(chain, &hdrlen);
+    const char *errmsg;
+    SBChain *loaded = SB_NewChainFromHeader(hdr, hdrlen, &errmsg);
+    SB_FreeEncodedHeader(hdr);
+    ASSERT_NE(NULL, loaded);
+    ASSERT_EQ(chain->window->period, loaded->window->period);
+    ASSERT_EQ(chain->window->start, loaded->window->start);
+    ASSERT_EQ(chain->window->current, loaded->window->current);
+    long long iter = SB_CHUNKITER_INIT;
+    size_t len;
+    const char *chunk;
+    while ((chunk = SBChain_GetEncodedChunk(chain, &iter, &len, 4096)) != NULL) {
+        ASSERT_EQ(0, SBChain_LoadEncodedChunk(loaded, iter, chunk, len, &errmsg));
+    }
+    for (size_t ii = 100; ii < 400; ++ii) {
+        ASSERT_EQ(1, SBChain_Check(loaded, &ii, sizeof ii));
+    }
+
+    // Idle for longer than the window clears everything
+    ASSERT_EQ(4, SBChain_Advance(loaded, t0 + 100 * period));
+    ASSERT_EQ(0, loaded->size);
+    ASSERT_EQ(0, SBChain_Check(loaded, "foo", 3));
+    ASSERT_EQ(1, SBChain_Add(loaded, "foo", 3));
+    ASSERT_EQ(1, SBChain_Check(loaded, "foo", 3));
+    SBChain_Free(loaded);
+    SBChain_Free(chain);
+}
+
+TEST_F(basic, testCounting) {
+    SBChain *plain = SB_NewChain(1000, 0.01, BLOOM_OPT_FORCE64, BF_DEFAULT_GROWTH);
+    ASSERT_EQ(-1, SBChain_Delete(plain, "foo", 3));
+    SBChain_Free(plain);
+
+    const unsigned layouts[] = {0, BLOOM_OPT_BLOCKED};
+    for (size_t ll = 0; ll < 2; ++ll) {
+        unsigned options = BLOOM_OPT_FORCE64 | BLOOM_OPT_NOROUND | BLOOM_OPT_COUNTING | layouts[ll];
+        SBChain *chain = SB_NewChain(1000, 0.01, options, BF_DEFAULT_GROWTH);
+        ASSERT_EQ(1, chain->filters[0].inner.counting);
+        ASSERT_EQ(chain->filters[0].inner.bytes * 2, chain->filters[0].inner.bits);
+
+        for (size_t ii = 0; ii < 4000; ++ii) {
+            SBChain_Add(chain, &ii, sizeof ii);
+        }
+        ASSERT_EQ(4000, chain->size);
+        ASSERT_GT(chain->nfilters, 1);
+        ASSERT_EQ(1, chain->filters[chain->nfilters - 1].inner.counting);
+        for (size_t ii = 0; ii < 4000; ++ii) {
+            ASSERT_EQ(1, SBChain_Check(chain, &ii, sizeof ii));
+        }
+
+        // Removing half of the items keeps the other half. A false positive in
+        // a newer link than the one holding an item removes it from the wrong
+        // link, which is rare but may lose another item.
+        size_t removed = 0;
+        for (size_t ii = 0; ii < 4000; ii += 2) {
+            removed += SBChain_Delete(chain, &ii, sizeof ii);
+        }
+        ASSERT_GT(removed, 1960);
+        ASSERT_EQ(4000 - removed, chain->size);
+        size_t found = 0;
+        for (size_t ii = 0; ii < 4000; ii += 2) {
+            found += SBChain_Check(chain, &ii, sizeof ii);
+        }
+        ASSERT_LT(found, 80);
+        size_t kept = 0;
+        for (size_t ii = 1; ii < 4000; ii += 2) {
+            kept += SBChain_Check(chain, &ii, sizeof ii);
+        }
+        ASSERT_GT(kept, 1960);
+
+        // Every addition counts
+        ASSERT_EQ(1, SBChain_Add(chain, "foo", 3));
+        ASSERT_EQ(0, SBChain_Add(chain, "foo", 3));
+        ASSERT_EQ(1, SBChain_Delete(chain, "foo", 3));
+        ASSERT_EQ(1, SBChain_Check(chain, "foo", 3));
+        ASSERT_EQ(1, SBChain_Delete(chain, "foo", 3));
+        ASSERT_EQ(0, SBChain_Check(chain, "foo", 3));
+        ASSERT_EQ(0, SBChain_Delete(chain, "foo", 3));
+        ASSERT_EQ(-1, SBChain_StageBegin(chain, 100));
+
+        // Survives encoding
+        size_t hdrlen;
+        char *hdr = SBChain_GetEncodedHeader(chain, &hdrlen);
+        const char *errmsg;
+        SBChain *loaded = SB_NewChainFromHeader(hdr, hdrlen, &errmsg);
+        SB_FreeEncodedHeader(hdr);
+        ASSERT_NE(NULL, loaded);
+        long long iter = SB_CHUNKITER_INIT;
+        size_t len;
+        const char *chunk;
+        while ((chunk = SBChain_GetEncodedChunk(chain, &iter, &len, 4096)) != NULL) {
+            ASSERT_EQ(0, SBChain_LoadEncodedChunk(loaded, iter, chunk, len, &errmsg));
+        }
+        for (size_t ii = 0; ii < loaded->nfilters; ++ii) {
+            ASSERT_EQ(1, loaded->filters[ii].inner.counting);
+        }
+        for (size_t ii = 1; ii < 4000; ii += 2) {
+            ASSERT_EQ(SBChain_Check(chain, &ii, sizeof ii), SBChain_Check(loaded, &ii, sizeof ii));
+        }
+        ASSERT_EQ(chain->size, loaded->size);
+        SBChain_Free(loaded);
+        SBChain_Free(chain);
+    }
+
+    // Saturated counters are never decremented
+    SBChain *chain = SB_NewChain(1000, 0.01, BLOOM_OPT_COUNTING, BF_DEFAULT_GROWTH);
+    for (int ii = 0; ii < BLOOM_COUNTER_MAX + 5; ++ii) {
+        SBChain_Add(chain, "bar", 3);
+    }
+    for (int ii = 0; ii < BLOOM_COUNTER_MAX + 5; ++ii) {
+        ASSERT_EQ(1, SBChain_Delete(chain, "bar", 3));
+    }
+    ASSERT_EQ(1, SBChain_Check(chain, "bar", 3));
+    SBChain_Free(chain);
+}
+
+TEST_F(basic, testMergeKernels) {
+    static const char *kernels[] = {"scalar", "sse4", "avx2", "neon"};
+    unsigned char src[100], dst[100], expected[100];
+
+    for (size_t kk = 0; kk < sizeof(kernels) / sizeof(kernels[0]); ++kk) {
+        if (SIMD_Select(kernels[kk]) != 0) {
+            continue;
+        }
+        for (size_t len = 0; len <= sizeof src; ++len) {
+            for (int intersect = 0; intersect < 2; ++intersect) {
+                uint64_t bits = 0;
+                for (size_t ii = 0; ii < len; ++ii) {
+                    src[ii] = ii * 37 + len;
+                    dst[ii] = ii * 11 ^ len;
+                    expected[ii] = intersect ? src[ii] & dst[ii] : src[ii] | dst[ii];
+                    bits += __builtin_popcount(expected[ii]);
+                }
+                ASSERT_EQ(bits, simdOps.mergeBits(dst, src, len, intersect));
+                ASSERT_EQ(0, memcmp(expected, dst, len));
+            }
+        }
+    }
+    SIMD_Select("scalar");
+}
+
+TEST_F(basic, testMerge) {
+    const unsigned options = BLOOM_OPT_FORCE64 | BLOOM_OPT_NOROUND;
+    SBChain *a = SB_NewChain(1000, 0.01, options, BF_DEFAULT_GROWTH);
+    SBChain *b = SB_NewChain(1000, 0.01, options, BF_DEFAULT_GROWTH);
+    for (size_t ii = 0; ii < 3000; ++ii) {
+        size_t other = ii + 3000;
+        SBChain_Add(a, &ii, sizeof ii);
+        SBChain_Add(b, &other, sizeof other);
+    }
+    ASSERT_EQ(2, a->nfilters);
+    ASSERT_EQ(1, SBChain_MergeCompatible(a, b));
+
+    // Templates have the layout, without the items
+    SBChain *empty = SB_NewChainFromTemplate(a);
+    ASSERT_EQ(1, SBChain_MergeCompatible(a, empty));
+    ASSERT_EQ(0, empty->size);
+    for (size_t ii = 0; ii < 3000; ++ii) {
+        ASSERT_EQ(0, SBChain_Check(empty, &ii, sizeof ii));
+    }
+
+    const SBChain *srcs[] = {a, b};
+    SBChain *both = SBChain_Merge(NULL, srcs, 2, 0);
+    for (size_t ii = 0; ii < 6000; ++ii) {
+        ASSERT_EQ(1, SBChain_Check(both, &ii, sizeof ii));
+    }
+    // The number of items is estimated from the bits
+    ASSERT_GT(both->size, 5700);
+    ASSERT_LT(both->size, 6300);
+
+    // Into an existing chain, one slice at a time and out of order
+    const SBChain *pair[] = {both, a};
+    SBChainMerge *m = SBChain_MergeBegin(empty, 1);
+    for (size_t end = m->total; end > 0; end = end > 100 ? end - 100 : 0) {
+        SBChain_MergeRange(m, pair, 2, end > 100 ? end - 100 : 0, end);
+    }
+    ASSERT_EQ(empty, SBChain_MergeEnd(m, empty));
+    for (size_t ii = 0; ii < 3000; ++ii) {
+        ASSERT_EQ(1, SBChain_Check(empty, &ii, sizeof ii));
+    }
+    for (size_t ii = 0; ii < a->nfilters; ++ii) {
+        ASSERT_EQ(0, memcmp(a->filters[ii].inner.bf, empty->filters[ii].inner.bf,
+                            a->filters[ii].inner.bytes));
+    }
+    ASSERT_LT(abs((int)empty->size - (int)a->size), 150);
+
+    SBChain *none = SBChain_Merge(NULL, srcs, 2, 1);
+    size_t found = 0;
+    for (size_t ii = 0; ii < 6000; ++ii) {
+        found += SBChain_Check(none, &ii, sizeof ii);
+    }
+    ASSERT_LT(found, 60);
+
+    // Layouts must match
+    SBChain *small = SB_NewChain(500, 0.01, options, BF_DEFAULT_GROWTH);
+    SBChain *blocked = SB_NewChain(1000, 0.01, options | BLOOM_OPT_BLOCKED, BF_DEFAULT_GROWTH);
+    SBChain *window = SB_NewWindowChain(1000, 0.01, options, 1, 1000, 0);
+    ASSERT_EQ(0, SBChain_MergeCompatible(a, small));
+    ASSERT_EQ(0, SBChain_MergeCompatible(small, blocked));
+    ASSERT_EQ(0, SBChain_MergeCompatible(window, window));
+    SBChain_Free(small);
+    SBChain_Free(blocked);
+    SBChain_Free(window);
+
+    // Counting chains sum their counters
+    SBChain *c1 = SB_NewChain(1000, 0.01, options | BLOOM_OPT_COUNTING, BF_DEFAULT_GROWTH);
+    SBChain *c2 = SB_NewChainFromTemplate(c1);
+    SBChain_Add(c1, "foo", 3);
+    SBChain_Add(c2, "foo", 3);
+    SBChain_Add(c2, "bar", 3);
+    const SBChain *counting[] = {c1, c2};
+    SBChain *sum = SBChain_Merge(NULL, counting, 2, 0);
+    SBChain *min = SBChain_Merge(NULL, counting, 2, 1);
+    ASSERT_EQ(3, sum->size);
+    ASSERT_EQ(1, min->size);
+    ASSERT_EQ(1, SBChain_Delete(sum, "foo", 3));
+    ASSERT_EQ(1, SBChain_Delete(sum, "foo", 3));
+    ASSERT_EQ(0, SBChain_Check(sum, "foo", 3));
+    ASSERT_EQ(1, SBChain_Check(sum, "bar", 3));
+    ASSERT_EQ(1, SBChain_Check(min, "foo", 3));
+    ASSERT_EQ(0, SBChain_Check(min, "bar", 3));
+
+    SBChain_Free(sum);
+    SBChain_Free(min);
+    SBChain_Free(c1);
+    SBChain_Free(c2);
+    SBChain_Free(none);
+    SBChain_Free(both);
+    SBChain_Free(empty);
+    SBChain_Free(a);
+    SBChain_Free(b);
+}
+
+TEST_F(basic, testGrowReserve) {
+    // Buffers are zeroed, and only handed over at the requested size
+    for (size_t ii = 0; ii < 8; ++ii) {
+        size_t bytes = (size_t)1 << (12 + ii);
+        unsigned char *buf = Reserve_Take(Reserve_Start(bytes), bytes);
+        for (size_t jj = 0; buf && jj < bytes; ++jj) {
+            ASSERT_EQ(0, buf[jj]);
+        }
+        RedisModule_Free(buf);
+        ASSERT_EQ(NULL, Reserve_Take(Reserve_Start(bytes), bytes + 1));
+        Reserve_Cancel(Reserve_Start(bytes));
+    }
+    Reserve_Cancel(NULL);
+
+    reserveThreshold = 50;
+    SBChain *sb = SB_NewChain(1000, 0.01, 0, BF_DEFAULT_GROWTH);
+    const size_t entries = sb->filters[0].inner.entries;
+    size_t ii = 0;
+    for (; sb->filters[0].size * 2 < entries; ++ii) {
+        ASSERT_EQ(NULL, sb->reserve);
+        SBChain_Add(sb, &ii, sizeof ii);
+    }
+    ASSERT_NE(NULL, sb->reserve);
+    for (; sb->nfilters == 1; ++ii) {
+        SBChain_Add(sb, &ii, sizeof ii);
+    }
+    ASSERT_EQ(NULL, sb->reserve);
+    ASSERT_EQ(1, sb->filters[1].size);
+    for (size_t jj = 0; jj < ii; ++jj) {
+        ASSERT_NE(0, SBChain_Check(sb, &jj, sizeof jj));
+    }
+    SBChain_Free(sb);
+
+    // Chains that never grow reserve nothing, released chains drop their reservation
+    sb = SB_NewChain(1000, 0.01, BLOOM_OPT_NO_SCALING, BF_DEFAULT_GROWTH);
+    for (ii = 0; ii < 1000; ++ii) {
+        SBChain_Add(sb, &ii, sizeof ii);
+    }
+    ASSERT_EQ(NULL, sb->reserve);
+    SBChain_Free(sb);
+    sb = SB_NewChain(100, 0.01, 0, BF_DEFAULT_GROWTH);
+    for (ii = 0; sb->filters[0].size * 2 < sb->filters[0].inner.entries; ++ii) {
+        SBChain_Add(sb, &ii, sizeof ii);
+    }
+    ASSERT_NE(NULL, sb->reserve);
+    SBChain_Free(sb);
+    reserveThreshold = 0;
+}
+
 TEST_CLASS(encoding)
 
 TEST_F(encoding, testEncodingSimple) {
@@ -249,6 +950,228 @@ TEST_F(encoding, testEncodingSimple) {
     free(encs);
 }
 
+TEST_F(encoding, testEncodingBlocked) {
+    SBChain *chain = SB_NewChain(1000, 0.001, BLOOM_OPT_BLOCKED, BF_DEFAULT_GROWTH);
+    ASSERT_NE(NULL, chain);
+    for (size_t ii = 1; ii < 10000; ++ii) {
+        SBChain_Add(chain, &ii, sizeof ii);
+    }
+
+    size_t len = 0;
+    char *hdr = SBChain_GetEncodedHeader(chain, &len);
+    const char *errmsg;
+    SBChain *chain2 = SB_NewChainFromHeader(hdr, len, &errmsg);
+    ASSERT_NE(NULL, chain2);
+    SB_FreeEncodedHeader(hdr);
+
+    long long iter = SB_CHUNKITER_INIT;
+    const char *buf;
+    size_t nbuf;
+    while ((buf = SBChain_GetEncodedChunk(chain, &iter, &nbuf, 256)) != NULL) {
+        ASSERT_EQ(0, SBChain_LoadEncodedChunk(chain2, iter, buf, nbuf, &errmsg));
+    }
+
+    ASSERT_EQ(chain->nfilters, chain2->nfilters);
+    for (size_t ii = 0; ii < chain2->nfilters; ++ii) {
+        ASSERT_EQ(1, chain2->filters[ii].inner.blocked);
+    }
+    for (size_t ii = 1; ii < 10000; ++ii) {
+        ASSERT_EQ(1, SBChain_Check(chain2, &ii, sizeof ii));
+    }
+    SBChain_Free(chain);
+    SBChain_Free(chain2);
+}
+
+static void writeEncodedFile(const SBChain *chain, const char *path, size_t truncate) {
+    FILE *fp = fopen(path, "wb");
+    size_t len;
+    char *hdr = SBChain_GetEncodedHeader(chain, &len);
+    fwrite(hdr, 1, len, fp);
+    SB_FreeEncodedHeader(hdr);
+
+    long long iter = SB_CHUNKITER_INIT;
+    const char *buf;
+    while ((buf = SBChain_GetEncodedChunk(chain, &iter, &len, 4096)) != NULL) {
+        fwrite(buf, 1, len, fp);
+    }
+    if (truncate) {
+        fflush(fp);
+        ftruncate(fileno(fp), ftell(fp) - truncate);
+    }
+    fclose(fp);
+}
+
+TEST_F(encoding, testEncodingMmap) {
+    SBChain *chain = SB_NewChain(1000, 0.001, BLOOM_OPT_BLOCKED, BF_DEFAULT_GROWTH);
+    for (size_t ii = 1; ii < 5000; ++ii) {
+        SBChain_Add(chain, &ii, sizeof ii);
+    }
+    char path[] = "/tmp/test-basic-mmap-XXXXXX";
+    close(mkstemp(path));
+    writeEncodedFile(chain, path, 0);
+
+    const char *errmsg;
+    SBChain *chain2 = SB_NewChainFromFile(path, &errmsg);
+    ASSERT_NE(NULL, chain2);
+    ASSERT_NE(NULL, chain2->mapped);
+    ASSERT_EQ(chain->nfilters, chain2->nfilters);
+    ASSERT_EQ(chain->size, chain2->size);
+    for (size_t ii = 1; ii < 5000; ++ii) {
+        ASSERT_EQ(1, SBChain_Check(chain2, &ii, sizeof ii));
+    }
+
+    // Writes go to private copies of the pages and new links to the heap
+    size_t nfilters = chain2->nfilters;
+    for (size_t ii = 5000; ii < 20000; ++ii) {
+        SBChain_Add(chain2, &ii, sizeof ii);
+    }
+    ASSERT_LT(nfilters, chain2->nfilters);
+    SBChain *chain3 = SB_NewChainFromFile(path, &errmsg);
+    ASSERT_NE(NULL, chain3);
+    for (size_t ii = 0; ii < chain->nfilters; ++ii) {
+        ASSERT_EQ(0, memcmp(chain->filters[ii].inner.bf, chain3->filters[ii].inner.bf,
+                            chain->filters[ii].inner.bytes));
+    }
+
+    // Consolidation releases the mapping
+    ASSERT_EQ(0, SBChain_StageBegin(chain3, 10000));
+    for (size_t ii = 1; ii < 5000; ++ii) {
+        SBChain_StageAdd(chain3, &ii, sizeof ii);
+    }
+    ASSERT_EQ(0, SBChain_StageCommit(chain3));
+    ASSERT_EQ(NULL, chain3->mapped);
+    for (size_t ii = 1; ii < 5000; ++ii) {
+        ASSERT_EQ(1, SBChain_Check(chain3, &ii, sizeof ii));
+    }
+    SBChain_Free(chain2);
+    SBChain_Free(chain3);
+
+    writeEncodedFile(chain, path, 1);
+    ASSERT_EQ(NULL, SB_NewChainFromFile(path, &errmsg));
+    ASSERT_EQ(NULL, SB_NewChainFromFile("/nonexistent/filter", &errmsg));
+    unlink(path);
+    SBChain_Free(chain);
+}
+
+// Offsets in the encoded header of the `bytes` and `bits` of a link
+#define ENC_LINK_BYTES(ii) (20 + (ii)*53)
+#define ENC_LINK_BITS(ii) (ENC_LINK_BYTES(ii) + 8)
+
+static uint64_t patchFile(const char *path, off_t off, uint64_t value) {
+    int fd = open(path, O_RDWR);
+    uint64_t old;
+    ASSERT_EQ((ssize_t)sizeof old, pread(fd, &old, sizeof old, off));
+    ASSERT_EQ((ssize_t)sizeof value, pwrite(fd, &value, sizeof value, off));
+    close(fd);
+    return old;
+}
+
+TEST_F(encoding, testEncodingMmapBadHeader) {
+    SBChain *chain = SB_NewChain(100, 0.01, 0, BF_DEFAULT_GROWTH);
+    for (size_t ii = 1; ii < 500; ++ii) {
+        SBChain_Add(chain, &ii, sizeof ii);
+    }
+    ASSERT_LT(1, chain->nfilters);
+    char path[] = "/tmp/test-basic-mmap-XXXXXX";
+    close(mkstemp(path));
+    const char *errmsg;
+
+    // Links probing past their bytes
+    writeEncodedFile(chain, path, 0);
+    uint64_t bytes = patchFile(path, ENC_LINK_BYTES(0), chain->filters[0].inner.bytes);
+    ASSERT_EQ(chain->filters[0].inner.bytes, bytes);
+    patchFile(path, ENC_LINK_BITS(0), bytes * 8 + 64);
+    ASSERT_EQ(NULL, SB_NewChainFromFile(path, &errmsg));
+    patchFile(path, ENC_LINK_BITS(0), 0);
+    ASSERT_EQ(NULL, SB_NewChainFromFile(path, &errmsg));
+
+    // Sizes whose sum wraps around to the length of the file
+    writeEncodedFile(chain, path, 0);
+    patchFile(path, ENC_LINK_BYTES(0), bytes + (1LLU << 63));
+    patchFile(path, ENC_LINK_BYTES(1), chain->filters[1].inner.bytes + (1LLU << 63));
+    ASSERT_EQ(NULL, SB_NewChainFromFile(path, &errmsg));
+
+    writeEncodedFile(chain, path, 0);
+    SBChain *chain2 = SB_NewChainFromFile(path, &errmsg);
+    ASSERT_NE(NULL, chain2);
+    SBChain_Free(chain2);
+    unlink(path);
+    SBChain_Free(chain);
+}
+
+TEST_F(encoding, testCrc64) {
+    const char *check = "123456789";
+    ASSERT_EQ(0xe9c6d914c4b8d9caULL, crc64(0, check, strlen(check)));
+    ASSERT_EQ(0, crc64(0, NULL, 0));
+
+    // Checksums of consecutive chunks chain into the checksum of the whole buffer
+    char buf[1000];
+    for (size_t ii = 0; ii < sizeof buf; ++ii) {
+        buf[ii] = ii * 31;
+    }
+    uint64_t crc = 0;
+    for (size_t ii = 0; ii < sizeof buf; ii += 77) {
+        size_t n = sizeof buf - ii < 77 ? sizeof buf - ii : 77;
+        crc = crc64(crc, buf + ii, n);
+    }
+    ASSERT_EQ(crc64(0, buf, sizeof buf), crc);
+}
+
+static void zrleRoundTrip(const uint8_t *src, size_t n, size_t maxLen) {
+    uint8_t *enc = malloc(n + 32);
+    size_t len = ZRLE_Encode(src, n, enc, n + 32);
+    ASSERT_NE(0, len);
+    ASSERT_LE(len, maxLen);
+    uint8_t *dec = calloc(n + 1, 1);
+    ASSERT_EQ(0, ZRLE_Decode(enc, len, dec, n));
+    ASSERT_EQ(0, memcmp(src, dec, n));
+
+    // Truncated or extended data does not decode
+    ASSERT_EQ(-1, ZRLE_Decode(enc, len - 1, dec, n));
+    enc[len] = 1;
+    ASSERT_EQ(-1, ZRLE_Decode(enc, len + 1, dec, n));
+    free(enc);
+    free(dec);
+}
+
+TEST_F(encoding, testZrle) {
+    const size_t n = 64 * 1024 + 5;
+    uint8_t *buf = calloc(n, 1);
+
+    // Zero runs take a few bytes whatever their length
+    ASSERT_EQ(1, ZRLE_IsZero(buf, n));
+    zrleRoundTrip(buf, n, 16);
+
+    // Sparse words, single zero words between them and the tail bytes
+    size_t set = 0;
+    for (size_t ii = 0; ii < n; ii += 997) {
+        buf[ii] = ii | 1;
+        ++set;
+    }
+    buf[8 * 100] = buf[8 * 102] = 1;
+    buf[n - 1] = 7;
+    ASSERT_EQ(0, ZRLE_IsZero(buf, n));
+    ASSERT_EQ(0, ZRLE_IsZero(buf + n - 1, 1));
+    zrleRoundTrip(buf, n, (set + 3) * 16 + 5);
+
+    // Dense data does not fit in less than its own size
+    for (size_t ii = 0; ii < n; ++ii) {
+        buf[ii] = ii * 31 + 1;
+    }
+    zrleRoundTrip(buf, n, n + 3);
+    uint8_t *enc = malloc(n);
+    ASSERT_EQ(0, ZRLE_Encode(buf, n, enc, n - 1));
+
+    // Lengths below a word, and runs decoding past the end, are handled
+    zrleRoundTrip(buf, 3, 3);
+    memset(buf, 0, 16);
+    ASSERT_EQ(2, ZRLE_Encode(buf, 16, enc, n));
+    ASSERT_EQ(-1, ZRLE_Decode(enc, 2, buf, 8));
+    ASSERT_EQ(-1, ZRLE_Decode((const uint8_t *)"\x80\x80", 2, buf, 16));
+    free(enc);
+    free(buf);
+}
+
 int main(int argc, char **argv) {
     test__abort_on_fail = 1;
     RedisModule_Calloc = calloc_wrap;
@@ -1,4 +1,6 @@
 #include "cuckoo.h"
+#include "reserve.h"
+#include "simd.h"
 #include "test.h"
 #include "murmurhash2.h"
 #include "redismodule.h"
@@ -188,6 +190,41 @@ TEST_F(cuckoo, testBulkDelwithExpansion) {
     CuckooFilter_Free(&ck);
 }
 
+TEST_F(cuckoo, testGrowReserve) {
+    reserveThreshold = 50;
+    CuckooFilter ck;
+    CuckooFilter_Init(&ck, 1024, DEFAULT_BUCKETSIZE, 500, 2);
+    size_t ii = 0;
+    for (; ck.numItems < 512; ++ii) {
+        ASSERT_EQ(NULL, ck.reserve);
+        ASSERT_EQ(CuckooInsert_Inserted, CuckooFilter_Insert(&ck, CUCKOO_GEN_HASH(&ii, sizeof ii)));
+    }
+    for (; ck.numFilters == 1; ++ii) {
+        ASSERT_EQ(CuckooInsert_Inserted, CuckooFilter_Insert(&ck, CUCKOO_GEN_HASH(&ii, sizeof ii)));
+        if (ck.numFilters == 1) {
+            ASSERT_NE(NULL, ck.reserve);
+        }
+    }
+    ASSERT_EQ(NULL, ck.reserve);
+    for (size_t jj = 0; jj < ii; ++jj) {
+        ASSERT_EQ(1, CuckooFilter_Check(&ck, CUCKOO_GEN_HASH(&jj, sizeof jj)));
+    }
+
+    // Dropping the last sub-filter also drops the reservation following it
+    for (; ck.reserve == NULL; ++ii) {
+        ASSERT_EQ(CuckooInsert_Inserted, CuckooFilter_Insert(&ck, CUCKOO_GEN_HASH(&ii, sizeof ii)));
+    }
+    ASSERT_EQ(2, ck.numFilters);
+    for (size_t jj = 0; jj < ii; ++jj) {
+        ASSERT_EQ(1, CuckooFilter_Delete(&ck, CUCKOO_GEN_HASH(&jj, sizeof jj)));
+    }
+    CuckooFilter_Compact(&ck);
+    ASSERT_EQ(1, ck.numFilters);
+    ASSERT_EQ(NULL, ck.reserve);
+    CuckooFilter_Free(&ck);
+    reserveThreshold = 0;
+}
+
 TEST_F(cuckoo, testBucketSize) {
     CuckooFilter ck;
     CuckooFilter_Init(&ck, NUM_BULK / 10, 1, 50, 1);
@@ -207,6 +244,371 @@ TEST_F(cuckoo, testBucketSize) {
     CuckooFilter_Free(&ck);
 }
 
+TEST_F(cuckoo, testBucketScans) {
+    // The usual bucket sizes are scanned by unrolled loops, the others by the generic one
+    static const uint16_t fpSizes[] = {1, 2, 4};
+    for (uint16_t bucketSize = 1; bucketSize <= 9; ++bucketSize) {
+        for (size_t ff = 0; ff < sizeof(fpSizes) / sizeof(fpSizes[0]); ++ff) {
+            CuckooFilter ck;
+            CuckooFilter_InitWithFpSize(&ck, 4096, bucketSize, 500, 1, fpSizes[ff]);
+            for (size_t ii = 0; ii < 400; ++ii) {
+                CuckooHash h = CUCKOO_GEN_HASH(&ii, sizeof ii);
+                ASSERT_EQ(CuckooInsert_Inserted, CuckooFilter_Insert(&ck, h));
+                ASSERT_EQ(CuckooInsert_Inserted, CuckooFilter_Insert(&ck, h));
+            }
+            for (size_t ii = 0; ii < 400; ++ii) {
+                CuckooHash h = CUCKOO_GEN_HASH(&ii, sizeof ii);
+                ASSERT_EQ(1, CuckooFilter_Check(&ck, h));
+                ASSERT_LE(2, CuckooFilter_Count(&ck, h));
+                ASSERT_EQ(1, CuckooFilter_Delete(&ck, h));
+                ASSERT_LE(1, CuckooFilter_Count(&ck, h));
+            }
+            ASSERT_EQ(400, ck.numItems);
+            CuckooFilter_Free(&ck);
+        }
+    }
+}
+
+static size_t countFalsePositives(CuckooFilter *ck, size_t probes) {
+    size_t ret = 0;
+    for (size_t ii = NUM_BULK; ii < NUM_BULK + probes; ++ii) {
+        ret += CuckooFilter_Check(ck, CUCKOO_GEN_HASH(&ii, sizeof ii));
+    }
+    return ret;
+}
+
+TEST_F(cuckoo, testFpSize) {
+    static const uint16_t fpSizes[] = {1, 2, 4};
+    size_t falsePositives[3];
+    for (size_t kk = 0; kk < 3; ++kk) {
+        CuckooFilter ck;
+        CuckooFilter_InitWithFpSize(&ck, NUM_BULK / 8, DEFAULT_BUCKETSIZE, 500, 2, fpSizes[kk]);
+        ASSERT_EQ(fpSizes[kk], ck.fpSize);
+        ASSERT_EQ(ck.numBuckets * DEFAULT_BUCKETSIZE * fpSizes[kk], SubCF_DataSize(ck.filters));
+        doFill(&ck);
+        ASSERT_EQ(NUM_BULK, ck.numItems);
+        ASSERT_LT(1, ck.numFilters);
+        countColls(&ck);
+        falsePositives[kk] = countFalsePositives(&ck, NUM_BULK * 10);
+
+        // Fingerprints survive relocation between sub-filters
+        for (size_t ii = 0; ii < NUM_BULK; ii += 2) {
+            ASSERT_EQ(1, CuckooFilter_Delete(&ck, CUCKOO_GEN_HASH(&ii, sizeof ii)));
+        }
+        CuckooFilter_Compact(&ck);
+        for (size_t ii = 1; ii < NUM_BULK; ii += 2) {
+            ASSERT_EQ(1, CuckooFilter_Check(&ck, CUCKOO_GEN_HASH(&ii, sizeof ii)));
+        }
+        for (size_t ii = 1; ii < NUM_BULK; ii += 2) {
+            ASSERT_EQ(1, CuckooFilter_Delete(&ck, CUCKOO_GEN_HASH(&ii, sizeof ii)));
+        }
+        ASSERT_EQ(0, ck.numItems);
+        CuckooFilter_Free(&ck);
+    }
+    ASSERT_LT(falsePositives[1] * 64, falsePositives[0]);
+    ASSERT_LE(falsePositives[2], falsePositives[1]);
+}
+
+TEST_F(cuckoo, testSemiSort) {
+    static const uint16_t fpSizes[] = {1, 2};
+    for (size_t kk = 0; kk < 2; ++kk) {
+        CuckooFilter raw, ck;
+        CuckooFilter_InitWithFpSize(&raw, NUM_BULK / 8, 4, 500, 2, fpSizes[kk]);
+        CuckooFilter_InitSemiSorted(&ck, NUM_BULK / 8, 500, 2, fpSizes[kk]);
+        ASSERT_EQ(4, ck.bucketSize);
+        ASSERT_EQ(raw.numBuckets, ck.numBuckets);
+        // One bit less per fingerprint, plus the padding
+        size_t fpBits = fpSizes[kk] * 8;
+        ASSERT_EQ(ck.numBuckets * 4 * (fpBits - 1) / 8 + 7, SubCF_DataSize(ck.filters));
+
+        doFill(&raw);
+        doFill(&ck);
+        ASSERT_EQ(NUM_BULK, ck.numItems);
+        ASSERT_EQ(raw.numFilters, ck.numFilters);
+        countColls(&ck);
+        // Same fingerprints, so the same false positive rate, give or take the placement
+        size_t rawFalsePositives = countFalsePositives(&raw, NUM_BULK * 10);
+        size_t falsePositives = countFalsePositives(&ck, NUM_BULK * 10);
+        ASSERT_LE(falsePositives, rawFalsePositives * 2 + 2);
+        ASSERT_LE(rawFalsePositives, falsePositives * 2 + 2);
+
+        // Repeated fingerprints sort next to each other and are all counted
+        CuckooHash kfoo = CUCKOO_GEN_HASH("foo", 3);
+        for (size_t ii = 0; ii < 3; ++ii) {
+            ASSERT_EQ(CuckooInsert_Inserted, CuckooFilter_Insert(&ck, kfoo));
+        }
+        ASSERT_LE(3, CuckooFilter_Count(&ck, kfoo));
+        for (size_t ii = 0; ii < 3; ++ii) {
+            ASSERT_EQ(1, CuckooFilter_Delete(&ck, kfoo));
+        }
+
+        for (size_t ii = 0; ii < NUM_BULK; ii += 2) {
+            ASSERT_EQ(1, CuckooFilter_Delete(&ck, CUCKOO_GEN_HASH(&ii, sizeof ii)));
+        }
+        CuckooFilter_Compact(&ck);
+        for (size_t ii = 1; ii < NUM_BULK; ii += 2) {
+            ASSERT_EQ(1, CuckooFilter_Check(&ck, CUCKOO_GEN_HASH(&ii, sizeof ii)));
+        }
+        for (size_t ii = 1; ii < NUM_BULK; ii += 2) {
+            ASSERT_EQ(1, CuckooFilter_Delete(&ck, CUCKOO_GEN_HASH(&ii, sizeof ii)));
+        }
+        ASSERT_EQ(0, ck.numItems);
+        CuckooFilter_Free(&raw);
+        CuckooFilter_Free(&ck);
+    }
+}
+
+TEST_F(cuckoo, testIncrementalCompact) {
+    CuckooFilter ck;
+    CuckooFilter_Init(&ck, NUM_BULK / 8, 4, 500, 2);
+    doFill(&ck);
+    uint16_t numFilters = ck.numFilters;
+    ASSERT_LT(2, numFilters);
+
+    // Deletes only start the compaction
+    for (size_t ii = 0; ii < NUM_BULK; ++ii) {
+        if (ii % 4 != 0) {
+            ASSERT_EQ(1, CuckooFilter_Delete(&ck, CUCKOO_GEN_HASH(&ii, sizeof ii)));
+        }
+    }
+    ASSERT_EQ(1, CuckooFilter_Compacting(&ck));
+    ASSERT_EQ(numFilters, ck.numFilters);
+
+    // Items come and go between the steps
+    size_t steps = 0, extra = NUM_BULK;
+    uint64_t numRelocs = 0;
+    while (!CuckooFilter_CompactStep(&ck, 16, &numRelocs)) {
+        steps++;
+        CuckooHash hash = CUCKOO_GEN_HASH(&extra, sizeof extra);
+        ASSERT_EQ(CuckooInsert_Inserted, CuckooFilter_Insert(&ck, hash));
+        ASSERT_EQ(CuckooInsert_Inserted, CuckooFilter_Insert(&ck, hash));
+        ASSERT_EQ(1, CuckooFilter_Delete(&ck, hash));
+        extra++;
+    }
+    ASSERT_LT(100, steps);
+    ASSERT_LT(0, numRelocs);
+    ASSERT_EQ(0, CuckooFilter_Compacting(&ck));
+    ASSERT_EQ(0, ck.numDeletes);
+    ASSERT_GT(numFilters, ck.numFilters);
+    ASSERT_EQ(NUM_BULK / 4 + extra - NUM_BULK, ck.numItems);
+
+    for (size_t ii = 0; ii < extra; ii += ii < NUM_BULK ? 4 : 1) {
+        ASSERT_EQ(1, CuckooFilter_Check(&ck, CUCKOO_GEN_HASH(&ii, sizeof ii)));
+    }
+    // Idle filters have nothing to do
+    ASSERT_EQ(1, CuckooFilter_CompactStep(&ck, 16, NULL));
+    CuckooFilter_Free(&ck);
+}
+
+TEST_F(cuckoo, testCompactKeepsStaying) {
+    CuckooFilter ck;
+    CuckooFilter_Init(&ck, NUM_BULK / 8, 4, 500, 2);
+    doFill(&ck);
+    uint16_t numFilters = ck.numFilters;
+    ASSERT_LT(2, numFilters);
+    for (size_t ii = 0; ii < NUM_BULK; ii += 2) {
+        ASSERT_EQ(1, CuckooFilter_Delete(&ck, CUCKOO_GEN_HASH(&ii, sizeof ii)));
+    }
+
+    // A sub-filter that has to stay doesn't stop the fingerprints from moving
+    CuckooFilter_CompactStart(&ck);
+    ck.compactDirty = 1;
+    uint64_t numRelocs = 0;
+    ASSERT_EQ(1, CuckooFilter_CompactStep(&ck, UINT64_MAX, &numRelocs));
+    ASSERT_LT(0, numRelocs);
+    ASSERT_EQ(numFilters, ck.numFilters);
+    for (size_t ii = 1; ii < NUM_BULK; ii += 2) {
+        ASSERT_EQ(1, CuckooFilter_Check(&ck, CUCKOO_GEN_HASH(&ii, sizeof ii)));
+    }
+    CuckooFilter_Free(&ck);
+}
+
+// Number of items added to a single sub-filter before it grows
+static size_t fillUntilGrowth(CuckooFilter *ck) {
+    size_t ii = 0;
+    while (ck->numFilters == 1) {
+        ASSERT_EQ(CuckooInsert_Inserted, CuckooFilter_Insert(ck, CUCKOO_GEN_HASH(&ii, sizeof ii)));
+        ii++;
+    }
+    return ii - 1;
+}
+
+TEST_F(cuckoo, testBFSEviction) {
+    size_t numItems[2];
+    for (int bfs = 0; bfs < 2; ++bfs) {
+        cuckooEviction = bfs ? CuckooEviction_BFS : CuckooEviction_Walk;
+        CuckooFilter ck;
+        CuckooFilter_Init(&ck, NUM_BULK, 2, 20, 1);
+        numItems[bfs] = fillUntilGrowth(&ck);
+        for (size_t ii = 0; ii <= numItems[bfs]; ++ii) {
+            ASSERT_EQ(1, CuckooFilter_Check(&ck, CUCKOO_GEN_HASH(&ii, sizeof ii)));
+        }
+        CuckooFilter_Free(&ck);
+    }
+    // About 67% and 78% full
+    ASSERT_LT(numItems[0] * 11 / 10, numItems[1]);
+
+    // Older sub-filters and semi-sorted buckets make room too
+    CuckooFilter ck;
+    CuckooFilter_InitSemiSorted(&ck, NUM_BULK / 8, 50, 2, 1);
+    doFill(&ck);
+    countColls(&ck);
+    for (size_t ii = 0; ii < NUM_BULK; ++ii) {
+        ASSERT_EQ(1, CuckooFilter_Delete(&ck, CUCKOO_GEN_HASH(&ii, sizeof ii)));
+    }
+    ASSERT_EQ(0, ck.numItems);
+    CuckooFilter_Free(&ck);
+    cuckooEviction = CuckooEviction_Walk;
+}
+
+TEST_F(cuckoo, testStats) {
+    CuckooStats before = cuckooTotalStats;
+    CuckooFilter ck;
+    CuckooFilter_Init(&ck, NUM_BULK, 2, 20, 1);
+    ASSERT_EQ(NULL, ck.stats);
+    ASSERT_EQ(0, CuckooFilter_EnableStats(&ck));
+    size_t numItems = fillUntilGrowth(&ck);
+    ASSERT_EQ(1, ck.stats->grows);
+    ASSERT_GT(ck.stats->evictions, 0);
+
+    for (size_t ii = 0; ii <= numItems; ++ii) {
+        ASSERT_EQ(1, CuckooFilter_Check(&ck, CUCKOO_GEN_HASH(&ii, sizeof ii)));
+    }
+    ASSERT_EQ(numItems + 1, ck.stats->lookups);
+    ASSERT_LE(ck.stats->lookups, ck.stats->filtersVisited);
+
+    // Items of the newest sub-filter move to the older one once it has room
+    for (size_t ii = numItems + 1; ii < numItems + numItems / 4; ++ii) {
+        ASSERT_EQ(CuckooInsert_Inserted, CuckooFilter_Insert(&ck, CUCKOO_GEN_HASH(&ii, sizeof ii)));
+    }
+    for (size_t ii = 0; ii < numItems / 2; ++ii) {
+        ASSERT_EQ(1, CuckooFilter_Delete(&ck, CUCKOO_GEN_HASH(&ii, sizeof ii)));
+    }
+    uint64_t relocs = CuckooFilter_Compact(&ck);
+    ASSERT_GT(relocs, 0);
+    ASSERT_EQ(relocs, ck.stats->relocations);
+
+    ASSERT_EQ(ck.stats->lookups, cuckooTotalStats.lookups - before.lookups);
+    ASSERT_EQ(ck.stats->evictions, cuckooTotalStats.evictions - before.evictions);
+    ASSERT_EQ(ck.stats->relocations, cuckooTotalStats.relocations - before.relocations);
+    CuckooFilter_Free(&ck);
+}
+
+TEST_F(cuckoo, testBatch) {
+    static char bufs[NUM_BULK * 2][16];
+    static const char *items[NUM_BULK * 2];
+    static size_t lens[NUM_BULK * 2];
+    static int results[NUM_BULK * 2];
+    static CuckooInsertStatus statuses[NUM_BULK * 2];
+    for (size_t ii = 0; ii < NUM_BULK * 2; ++ii) {
+        // Every item twice
+        lens[ii] = sprintf(bufs[ii], "item%zu", ii % NUM_BULK);
+        items[ii] = bufs[ii];
+    }
+
+    for (int semiSort = 0; semiSort < 2; ++semiSort) {
+        CuckooFilter one, many;
+        if (semiSort) {
+            CuckooFilter_InitSemiSorted(&one, NUM_BULK / 4, 20, 2, 1);
+            CuckooFilter_InitSemiSorted(&many, NUM_BULK / 4, 20, 2, 1);
+        } else {
+            CuckooFilter_Init(&one, NUM_BULK / 4, 2, 20, 2);
+            CuckooFilter_Init(&many, NUM_BULK / 4, 2, 20, 2);
+        }
+
+        // Same filter as one at a time, over several sub-filters and batches
+        for (size_t ii = 0; ii < NUM_BULK * 2; ++ii) {
+            CuckooHash hash = CUCKOO_GEN_HASH(items[ii], lens[ii]);
+            statuses[ii] = (ii / 999) % 2 ? CuckooFilter_InsertUnique(&one, hash)
+                                          : CuckooFilter_Insert(&one, hash);
+        }
+        for (size_t base = 0; base < NUM_BULK * 2; base += 999) {
+            size_t n = NUM_BULK * 2 - base < 999 ? NUM_BULK * 2 - base : 999;
+            CuckooInsertStatus batch[999];
+            CuckooFilter_InsertMany(&many, items + base, lens + base, n, (base / 999) % 2, batch);
+            for (size_t ii = 0; ii < n; ++ii) {
+                ASSERT_EQ(statuses[base + ii], batch[ii]);
+            }
+        }
+        ASSERT_LT(1, many.numFilters);
+        ASSERT_EQ(one.numFilters, many.numFilters);
+        ASSERT_EQ(one.numItems, many.numItems);
+        for (uint16_t ii = 0; ii < one.numFilters; ++ii) {
+            ASSERT_EQ(0, memcmp(one.filters[ii].data, many.filters[ii].data,
+                                SubCF_DataSize(&one.filters[ii])));
+        }
+
+        // Unique inserts in one batch see the earlier items of the batch
+        CuckooFilter_InsertMany(&many, items, lens, NUM_BULK * 2, 1, statuses);
+        for (size_t ii = 0; ii < NUM_BULK * 2; ++ii) {
+            ASSERT_EQ(CuckooInsert_Exists, statuses[ii]);
+        }
+
+        for (size_t ii = 0; ii < NUM_BULK * 2; ++ii) {
+            lens[ii] = sprintf(bufs[ii], "item%zu", ii);
+        }
+        CuckooFilter_CheckMany(&many, items, lens, NUM_BULK * 2, results);
+        for (size_t ii = 0; ii < NUM_BULK * 2; ++ii) {
+            ASSERT_EQ(CuckooFilter_Check(&many, CUCKOO_GEN_HASH(items[ii], lens[ii])), results[ii]);
+            if (ii < NUM_BULK) {
+                ASSERT_EQ(1, results[ii]);
+            }
+        }
+        for (size_t ii = 0; ii < NUM_BULK * 2; ++ii) {
+            lens[ii] = sprintf(bufs[ii], "item%zu", ii % NUM_BULK);
+        }
+        CuckooFilter_Free(&one);
+        CuckooFilter_Free(&many);
+    }
+}
+
+static const char *simdKernels[] = {"scalar", "sse4", "avx2", "neon"};
+
+TEST_F(cuckoo, testSimdKernels) {
+    uint8_t buf[300];
+    for (size_t ii = 0; ii < sizeof buf; ++ii) {
+        buf[ii] = (ii * 7 + 3) % 64;
+    }
+
+    for (size_t kk = 0; kk < sizeof(simdKernels) / sizeof(simdKernels[0]); ++kk) {
+        if (SIMD_Select(simdKernels[kk]) != 0) {
+            continue;
+        }
+        for (size_t len = 0; len < 256; ++len) {
+            for (int v = 0; v < 70; ++v) {
+                int expPos = -1;
+                size_t expCount = 0;
+                for (size_t ii = 0; ii < len; ++ii) {
+                    if (buf[ii] == v) {
+                        expPos = expPos < 0 ? (int)ii : expPos;
+                        expCount++;
+                    }
+                }
+                ASSERT_EQ(expPos, simdOps.findByte(buf, len, v));
+                ASSERT_EQ(expCount, simdOps.countByte(buf, len, v));
+            }
+        }
+
+        // Wide buckets go through the kernels
+        CuckooFilter ck;
+        CuckooFilter_Init(&ck, NUM_BULK, 64, 50, 1);
+        for (size_t ii = 0; ii < NUM_BULK; ++ii) {
+            CuckooFilter_Insert(&ck, CUCKOO_GEN_HASH(&ii, sizeof ii));
+        }
+        for (size_t ii = 0; ii < NUM_BULK; ++ii) {
+            CuckooHash hash = CUCKOO_GEN_HASH(&ii, sizeof ii);
+            ASSERT_EQ(1, CuckooFilter_Check(&ck, hash));
+            ASSERT_LE(1, CuckooFilter_Count(&ck, hash));
+        }
+        for (size_t ii = 0; ii < NUM_BULK; ++ii) {
+            ASSERT_EQ(1, CuckooFilter_Delete(&ck, CUCKOO_GEN_HASH(&ii, sizeof ii)));
+        }
+        ASSERT_EQ(0, ck.numItems);
+        CuckooFilter_Free(&ck);
+    }
+    SIMD_Select("scalar");
+}
+
 int main(int argc, char **argv) {
     test__abort_on_fail = 1;
     RedisModule_Calloc = calloc_wrap;
@@ -1,25 +1,373 @@
+/*
+ * In-process micro-benchmarks of the filter and sketch cores.
+ *
+ * Every case builds a structure with fixed parameters and times each of its
+ * operations over the same number of items. Results are written to stdout as
+ * a single JSON document:
+ *
+ *   {"version": "...", "simd": "...", "ops": N, "results": [
+ *     {"name": "bf.add", "params": {...}, "ns_per_op": 21.4, "cache_misses_per_op": 0.91},
+ *     ...]}
+ *
+ * cache_misses_per_op is null when hardware counters are not available, e.g.
+ * in most containers or with a restrictive kernel.perf_event_paranoid.
+ *
+ * Usage: test-perf [-n OPS] [-m TYPE]
+ *   -n OPS   items per operation (1048576)
+ *   -m TYPE  only run the cases of bf, cf, cms or topk
+ */
+
 #include "redismodule.h"
 #include "sb.h"
+#include "cuckoo.h"
+#include "cms.h"
+#include "topk.h"
+#include "simd.h"
+#include "version.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
 
-#define NUM_ITERATIONS 50000000
-#define NUM_ITEMS 100000
-#define ERROR_RATE 0.0001
+#define BENCH_DEFAULT_OPS (1 << 20)
+#define BENCH_BATCH 64
+// Distinct string items of the CMS and Top-K cases
+#define BENCH_NUM_STRINGS (1 << 16)
 
 static void *calloc_wrap(size_t a, size_t b) { return calloc(a, b); }
 static void free_wrap(void *p) { free(p); }
 
+static size_t numOps = BENCH_DEFAULT_OPS;
+static const char *only = NULL;
+static int missesFd = -1;
+static int numResults = 0;
+// Results of the lookups, so that they are not optimized away
+static volatile size_t sink;
+
+// Parameters of the running case, as JSON members
+static char caseParams[256];
+
+typedef struct {
+    struct timespec start;
+    long long misses;
+} Sample;
+
+static void openMissesCounter(void) {
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof attr);
+    attr.size = sizeof attr;
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    missesFd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+}
+
+static long long readMisses(void) {
+    long long v = 0;
+    if (missesFd < 0 || read(missesFd, &v, sizeof v) != sizeof v) {
+        return -1;
+    }
+    return v;
+}
+
+static int selected(const char *type) { return !only || strcmp(type, only) == 0; }
+
+static void sampleBegin(Sample *s) {
+    s->misses = readMisses();
+    clock_gettime(CLOCK_MONOTONIC, &s->start);
+}
+
+static void sampleEnd(const Sample *s, const char *name, size_t ops) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long long misses = readMisses();
+    double ns = (end.tv_sec - s->start.tv_sec) * 1e9 + (end.tv_nsec - s->start.tv_nsec);
+
+    printf("%s\n    {\"name\": \"%s\", \"params\": {%s}, \"ns_per_op\": %.2f, ",
+           numResults++ ? "," : "", name, caseParams, ns / ops);
+    if (s->misses >= 0 && misses >= 0) {
+        printf("\"cache_misses_per_op\": %.3f}", (double)(misses - s->misses) / ops);
+    } else {
+        printf("\"cache_misses_per_op\": null}");
+    }
+    fflush(stdout);
+}
+
+/* Bloom filters */
+
+static void benchBloom(double error, unsigned filters, int force64, int blocked, int counting) {
+    snprintf(caseParams, sizeof caseParams,
+             "\"error\": %g, \"filters\": %u, \"hash\": %d, \"blocked\": %s, \"counting\": %s",
+             error, filters, force64 ? 64 : 32, blocked ? "true" : "false",
+             counting ? "true" : "false");
+    // With a growth of 2, 'filters' links hold (2^filters - 1) times the first one
+    size_t capacity = numOps / ((1 << filters) - 1) + 1;
+    unsigned options = BLOOM_OPT_NOROUND | (force64 ? BLOOM_OPT_FORCE64 : 0) |
+                       (blocked ? BLOOM_OPT_BLOCKED : 0) | (counting ? BLOOM_OPT_COUNTING : 0);
+    SBChain *sb = SB_NewChain(capacity, error, options, 2);
+    Sample s;
+    size_t found = 0;
+
+    sampleBegin(&s);
+    for (size_t ii = 0; ii < numOps; ++ii) {
+        SBChain_Add(sb, &ii, sizeof ii);
+    }
+    sampleEnd(&s, "bf.add", numOps);
+
+    sampleBegin(&s);
+    for (size_t ii = 0; ii < numOps; ++ii) {
+        found += SBChain_Check(sb, &ii, sizeof ii);
+    }
+    sampleEnd(&s, "bf.check", numOps);
+
+    sampleBegin(&s);
+    for (size_t ii = numOps; ii < 2 * numOps; ++ii) {
+        found += SBChain_Check(sb, &ii, sizeof ii);
+    }
+    sampleEnd(&s, "bf.check_missing", numOps);
+
+    size_t keys[BENCH_BATCH];
+    const char *items[BENCH_BATCH];
+    size_t lens[BENCH_BATCH];
+    int results[BENCH_BATCH];
+    for (size_t ii = 0; ii < BENCH_BATCH; ++ii) {
+        items[ii] = (const char *)&keys[ii];
+        lens[ii] = sizeof keys[ii];
+    }
+    sampleBegin(&s);
+    for (size_t ii = 0; ii + BENCH_BATCH <= numOps; ii += BENCH_BATCH) {
+        for (size_t jj = 0; jj < BENCH_BATCH; ++jj) {
+            keys[jj] = ii + jj;
+        }
+        SBChain_CheckMany(sb, items, lens, BENCH_BATCH, results);
+        found += results[0];
+    }
+    sampleEnd(&s, "bf.check_many", numOps / BENCH_BATCH * BENCH_BATCH);
+
+    if (counting) {
+        sampleBegin(&s);
+        for (size_t ii = 0; ii < numOps; ++ii) {
+            found += SBChain_Delete(sb, &ii, sizeof ii);
+        }
+        sampleEnd(&s, "bf.del", numOps);
+    }
+
+    sink += found;
+    SBChain_Free(sb);
+}
+
+/* Cuckoo filters */
+
+static void benchCuckoo(uint16_t bucketSize, double load, unsigned filters) {
+    snprintf(caseParams, sizeof caseParams, "\"bucket_size\": %u, \"load\": %g, \"filters\": %u",
+             bucketSize, load, filters);
+    // Sized so that the items fill 'load' of 'filters' sub-filters of the same size
+    size_t items = numOps;
+    size_t capacity = items / load / filters;
+    CuckooFilter cf;
+    CuckooFilter_Init(&cf, capacity, bucketSize, 500, 1);
+    Sample s;
+    size_t found = 0;
+
+    sampleBegin(&s);
+    for (size_t ii = 0; ii < items; ++ii) {
+        CuckooFilter_Insert(&cf, CUCKOO_GEN_HASH(&ii, sizeof ii));
+    }
+    sampleEnd(&s, "cf.add", items);
+
+    sampleBegin(&s);
+    for (size_t ii = 0; ii < items; ++ii) {
+        found += CuckooFilter_Check(&cf, CUCKOO_GEN_HASH(&ii, sizeof ii));
+    }
+    sampleEnd(&s, "cf.check", items);
+
+    sampleBegin(&s);
+    for (size_t ii = items; ii < 2 * items; ++ii) {
+        found += CuckooFilter_Check(&cf, CUCKOO_GEN_HASH(&ii, sizeof ii));
+    }
+    sampleEnd(&s, "cf.check_missing", items);
+
+    sampleBegin(&s);
+    for (size_t ii = 0; ii < items; ++ii) {
+        found += CuckooFilter_Count(&cf, CUCKOO_GEN_HASH(&ii, sizeof ii));
+    }
+    sampleEnd(&s, "cf.count", items);
+
+    sampleBegin(&s);
+    for (size_t ii = 0; ii < items; ++ii) {
+        found += CuckooFilter_Delete(&cf, CUCKOO_GEN_HASH(&ii, sizeof ii));
+    }
+    sampleEnd(&s, "cf.delete", items);
+
+    sink += found;
+    CuckooFilter_Free(&cf);
+}
+
+/* Sketches */
+
+static char *strings[BENCH_NUM_STRINGS];
+static size_t stringLens[BENCH_NUM_STRINGS];
+// Indexes into 'strings', skewed towards the first ones so that the sketches see heavy hitters
+static uint32_t *sequence;
+
+static void initStrings(void) {
+    char buf[32];
+    for (size_t ii = 0; ii < BENCH_NUM_STRINGS; ++ii) {
+        stringLens[ii] = snprintf(buf, sizeof buf, "item:%zu", ii);
+        strings[ii] = strdup(buf);
+    }
+    sequence = malloc(numOps * sizeof(*sequence));
+    srand(42);
+    for (size_t ii = 0; ii < numOps; ++ii) {
+        double u = (double)rand() / RAND_MAX;
+        sequence[ii] = (uint32_t)(u * u * u * (BENCH_NUM_STRINGS - 1));
+    }
+}
+
+static void freeStrings(void) {
+    for (size_t ii = 0; ii < BENCH_NUM_STRINGS; ++ii) {
+        free(strings[ii]);
+    }
+    free(sequence);
+}
+
+static void benchCMS(size_t width, size_t depth) {
+    snprintf(caseParams, sizeof caseParams, "\"width\": %zu, \"depth\": %zu", width, depth);
+    CMSketch *cms = NewCMSketch(width, depth);
+    Sample s;
+    size_t total = 0;
+
+    sampleBegin(&s);
+    for (size_t ii = 0; ii < numOps; ++ii) {
+        uint32_t ix = sequence[ii];
+        total += CMS_IncrBy(cms, strings[ix], stringLens[ix], 1);
+    }
+    sampleEnd(&s, "cms.incrby", numOps);
+
+    sampleBegin(&s);
+    for (size_t ii = 0; ii < numOps; ++ii) {
+        uint32_t ix = sequence[ii];
+        total += CMS_Query(cms, strings[ix], stringLens[ix]);
+    }
+    sampleEnd(&s, "cms.query", numOps);
+
+    sink += total;
+    CMS_Destroy(cms);
+}
+
+static void benchTopK(uint32_t k, double decay) {
+    snprintf(caseParams, sizeof caseParams, "\"k\": %u, \"decay\": %g", k, decay);
+    TopK *topk = TopK_Create(k, 8 * k, 7, decay);
+    Sample s;
+    size_t total = 0;
+
+    sampleBegin(&s);
+    for (size_t ii = 0; ii < numOps; ++ii) {
+        uint32_t ix = sequence[ii];
+        total += TopK_Add(topk, strings[ix], stringLens[ix], 1, NULL) != NULL;
+    }
+    sampleEnd(&s, "topk.add", numOps);
+
+    sampleBegin(&s);
+    for (size_t ii = 0; ii < numOps; ++ii) {
+        uint32_t ix = sequence[ii];
+        total += TopK_Query(topk, strings[ix], stringLens[ix]);
+    }
+    sampleEnd(&s, "topk.query", numOps);
+
+    sampleBegin(&s);
+    for (size_t ii = 0; ii < numOps; ++ii) {
+        uint32_t ix = sequence[ii];
+        total += TopK_Count(topk, strings[ix], stringLens[ix]);
+    }
+    sampleEnd(&s, "topk.count", numOps);
+
+    sink += total;
+    TopK_Destroy(topk);
+}
+
 int main(int argc, char **argv) {
     RedisModule_Calloc = calloc_wrap;
     RedisModule_Free = free_wrap;
     RedisModule_Realloc = realloc;
+    RedisModule_Alloc = malloc;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:m:")) != -1) {
+        switch (opt) {
+        case 'n':
+            numOps = strtoull(optarg, NULL, 10);
+            break;
+        case 'm':
+            only = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n OPS] [-m TYPE]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (numOps < BENCH_BATCH) {
+        fprintf(stderr, "OPS must be at least %d\n", BENCH_BATCH);
+        return 1;
+    }
+
+    SIMD_Init();
+    openMissesCounter();
+    printf("{\"version\": \"%d.%d.%d\", \"simd\": \"%s\", \"ops\": %zu, \"results\": [",
+           REBLOOM_VERSION_MAJOR, REBLOOM_VERSION_MINOR, REBLOOM_VERSION_PATCH, SIMD_Name(),
+           numOps);
 
-    SBChain *chain = SB_NewChain(NUM_ITEMS, ERROR_RATE, 0, 2);
-    for (size_t ii = 0; ii < NUM_ITERATIONS; ++ii) {
-        size_t elem = ii % NUM_ITEMS;
-        SBChain_Add(chain, &elem, sizeof elem);
-        SBChain_Check(chain, &elem, sizeof elem);
+    if (selected("bf")) {
+        const double errors[] = {0.01, 0.0001};
+        const unsigned filters[] = {1, 6};
+        for (size_t ee = 0; ee < 2; ++ee) {
+            for (size_t ff = 0; ff < 2; ++ff) {
+                benchBloom(errors[ee], filters[ff], 0, 0, 0);
+                benchBloom(errors[ee], filters[ff], 1, 0, 0);
+            }
+            benchBloom(errors[ee], 1, 1, 1, 0);
+            benchBloom(errors[ee], 1, 1, 0, 1);
+            benchBloom(errors[ee], 1, 1, 1, 1);
+        }
     }
-    SBChain_Free(chain);
+
+    if (selected("cf")) {
+        const uint16_t bucketSizes[] = {2, 4};
+        const double loads[] = {0.5, 0.9};
+        const unsigned filters[] = {1, 4};
+        for (size_t bb = 0; bb < 2; ++bb) {
+            for (size_t ll = 0; ll < 2; ++ll) {
+                for (size_t ff = 0; ff < 2; ++ff) {
+                    benchCuckoo(bucketSizes[bb], loads[ll], filters[ff]);
+                }
+            }
+        }
+    }
+
+    if (selected("cms") || selected("topk")) {
+        initStrings();
+        if (selected("cms")) {
+            benchCMS(2000, 5);
+            benchCMS(20000, 10);
+            benchCMS(1 << 20, 7);
+        }
+        if (selected("topk")) {
+            benchTopK(10, 0.9);
+            benchTopK(10, 0.99);
+            benchTopK(1000, 0.9);
+        }
+        freeStrings();
+    }
+
+    printf("\n]}\n");
     return 0;
 }
@@ -91,6 +91,106 @@ class TopKTest(ModuleTestCase('../redisbloom.so')):
         self.cmd('topk.incrby', 'topk', '42', 80, 'xyzzy', 400)
         self.assertEqual(['baz'], self.cmd('topk.list', 'topk'))
 
+    def test_large_incrby(self):
+        self.assertOk(self.cmd('topk.reserve', 'topk', '1', '1', '1', '0.9'))
+        self.assertEqual([None], self.cmd('topk.incrby', 'topk', 'foo', 10))
+        # The counter of 'foo' is decayed away and 'bar' takes over the bucket
+        self.assertEqual(['foo'], self.cmd('topk.incrby', 'topk', 'bar', 1000000000))
+        count = self.cmd('topk.count', 'topk', 'bar')[0]
+        self.assertGreater(count, 1000000000 - 1000)
+        self.assertEqual([0], self.cmd('topk.count', 'topk', 'foo'))
+
+        # Decay keeps working after a reload and 'bar' is too heavy to lose the bucket
+        for _ in self.client.retry_with_rdb_reload():
+            self.assertEqual([None], self.cmd('topk.incrby', 'topk', 'baz', 1000000000))
+            self.assertEqual(['bar'], self.cmd('topk.list', 'topk'))
+            self.assertEqual([count], self.cmd('topk.count', 'topk', 'bar'))
+
+        self.assertOk(self.cmd('topk.reserve', 'small', '1', '1', '1', '0.9'))
+        self.cmd('topk.incrby', 'small', 'foo', 3)
+        self.client.dr.dump_and_reload()
+        self.cmd('topk.incrby', 'small', 'bar', 100)
+        self.assertEqual(['bar'], self.cmd('topk.list', 'small'))
+
+    def test_list_withcount(self):
+        self.assertOk(self.cmd('topk.reserve', 'topk', '4', '50', '5', '0.9'))
+        self.assertEqual([], self.cmd('topk.list', 'topk', 'withcount'))
+        self.cmd('topk.incrby', 'topk', 'foo', 3, 'bar', 10, 'baz', 7)
+        expected = ['bar', 10, 'baz', 7, 'foo', 3]
+        heap = self.cmd('topk.list', 'topk')
+        self.assertEqual(expected, self.cmd('topk.list', 'topk', 'WITHCOUNT'))
+        # The heap is left in its order, which replicas share
+        self.assertEqual(heap, self.cmd('topk.list', 'topk'))
+        self.assertEqual(sorted(['foo', 'bar', 'baz', None]), sorted(heap))
+        self.assertEqual([1, 1, 1, 0], self.cmd('topk.query', 'topk', 'foo', 'bar', 'baz', 'qux'))
+        self.cmd('topk.incrby', 'topk', 'foo', 20, 'qux', 1)
+        for _ in self.client.retry_with_rdb_reload():
+            self.assertEqual(['foo', 23, 'bar', 10, 'baz', 7, 'qux', 1],
+                             self.cmd('topk.list', 'topk', 'withcount'))
+        self.assertRaises(ResponseError, self.cmd, 'topk.list', 'topk', 'withcounts')
+        self.assertRaises(ResponseError, self.cmd, 'topk.list', 'topk', 'withcount', 'foo')
+
+    def test_merge(self):
+        for key in ('shard1', 'shard2', 'dest'):
+            self.assertOk(self.cmd('topk.reserve', key, '3', '50', '5', '0.9'))
+        self.cmd('topk.incrby', 'shard1', 'foo', 10, 'bar', 5, 'local1', 8)
+        self.cmd('topk.incrby', 'shard2', 'foo', 10, 'bar', 5, 'local2', 7)
+        self.assertOk(self.cmd('topk.merge', 'dest', 2, 'shard1', 'shard2'))
+        self.assertEqual(['foo', 20, 'bar', 10, 'local1', 8],
+                         self.cmd('topk.list', 'dest', 'withcount'))
+        self.assertEqual([20, 10, 8, 7], self.cmd('topk.count', 'dest', 'foo', 'bar', 'local1', 'local2'))
+
+        # Weights and a destination that is also a source
+        self.assertOk(self.cmd('topk.merge', 'dest', 2, 'dest', 'shard2', 'WEIGHTS', 1, 3))
+        self.assertEqual(['foo', 50, 'local2', 28, 'bar', 25],
+                         self.cmd('topk.list', 'dest', 'withcount'))
+        for _ in self.client.retry_with_rdb_reload():
+            self.assertEqual([1, 1, 0, 1], self.cmd('topk.query', 'dest', 'foo', 'bar', 'local1', 'local2'))
+
+        self.assertOk(self.cmd('topk.reserve', 'other', '3', '40', '5', '0.9'))
+        self.assertOk(self.cmd('topk.reserve', 'pow2', '3', '64', '5', '0.9', 'pow2'))
+        self.assertOk(self.cmd('topk.reserve', 'dest64', '3', '64', '5', '0.9'))
+        self.assertRaises(ResponseError, self.cmd, 'topk.merge', 'dest', 1, 'other')
+        self.assertRaises(ResponseError, self.cmd, 'topk.merge', 'dest64', 1, 'pow2')
+        self.assertRaises(ResponseError, self.cmd, 'topk.merge', 'nonexist', 1, 'shard1')
+        self.assertRaises(ResponseError, self.cmd, 'topk.merge', 'dest', 1, 'nonexist')
+        self.assertRaises(ResponseError, self.cmd, 'topk.merge', 'dest', 0, 'shard1')
+        self.assertRaises(ResponseError, self.cmd, 'topk.merge', 'dest', 2, 'shard1')
+        self.assertRaises(ResponseError, self.cmd, 'topk.merge', 'dest', 1, 'shard1', 'WEIGHTS')
+        self.assertRaises(ResponseError, self.cmd, 'topk.merge', 'dest', 1, 'shard1', 'WEIGHTS', -1)
+        self.assertRaises(ResponseError, self.cmd, 'topk.merge', 'dest', 1)
+
+    def test_binary_items(self):
+        self.assertOk(self.cmd('topk.reserve', 'topk', '2', '50', '5', '0.9'))
+        items = ['a\x00b', 'a\x00c', 'line\r\nbreak']
+        self.cmd('topk.incrby', 'topk', items[0], 10, items[1], 5)
+        for _ in self.client.retry_with_rdb_reload():
+            self.assertEqual([1, 1, 0], self.cmd('topk.query', 'topk', *items))
+            self.assertEqual(sorted(items[:2]), sorted(self.cmd('topk.list', 'topk')))
+        self.assertEqual([items[1]], self.cmd('topk.incrby', 'topk', items[2], 20))
+        self.assertEqual(sorted([items[0], items[2]]), sorted(self.cmd('topk.list', 'topk')))
+        self.client.dr.dump_and_reload()
+        self.assertEqual([10, 5, 20], self.cmd('topk.count', 'topk', *items))
+
+    def test_large_k(self):
+        self.assertOk(self.cmd('topk.reserve', 'topk', '1000', '2000', '5', '0.9'))
+        for i in xrange(50):
+            self.cmd('topk.add', 'topk', *[str(j) for j in xrange(i * 100, i * 100 + 2000)])
+        for _ in self.client.retry_with_rdb_reload():
+            heapList = [item for item in self.cmd('topk.list', 'topk') if item is not None]
+            self.assertEqual(1000, len(heapList))
+            self.assertEqual([1] * len(heapList), self.cmd('topk.query', 'topk', *heapList))
+            self.assertEqual([0], self.cmd('topk.query', 'topk', 'nonexist'))
+            self.cmd('topk.add', 'topk', *heapList)
+            self.assertEqual([1] * len(heapList), self.cmd('topk.query', 'topk', *heapList))
+
+    def test_rdb_sparse(self):
+        self.assertOk(self.cmd('topk.reserve', 'sparse', '5', '100000', '5', '0.9'))
+        self.cmd('topk.add', 'sparse', 'a', 'b', 'c')
+        self.assertLess(len(self.cmd('dump', 'sparse')), 2048)
+        for _ in self.client.retry_with_rdb_reload():
+            self.assertEqual([1, 1, 1, 0], self.cmd('topk.query', 'sparse', 'a', 'b', 'c', 'd'))
+
     def test_list_info(self):
         self.cmd('topk.reserve', 'topk', '2', '50', '5', '0.9')
         self.assertRaises(ResponseError, self.cmd, 'topk.reserve', 'topk', '2', '50', '5', '0.9')
@@ -119,7 +219,7 @@ class TopKTest(ModuleTestCase('../redisbloom.so')):
         self.cmd('topk.reserve', 'test', '3', '50', '5', '0.9')
         self.cmd('topk.add', 'test', 'foo')
         self.assertEqual([None, 'foo', None], self.cmd('topk.list', 'test'))
-        self.assertEqual(4192, self.cmd('MEMORY USAGE', 'test'))
+        self.assertEqual(4328, self.cmd('MEMORY USAGE', 'test'))
 
     def test_time(self):
         self.cmd('topk.reserve', 'topk', '100', '1000', '5', '0.9')
@@ -153,6 +253,24 @@ class TopKTest(ModuleTestCase('../redisbloom.so')):
         expected_info = ['k', 3L, 'width', 8L, 'depth', 7L, 'decay', '0.90000000000000002']
         self.assertEqual(expected_info, info)
 
+    def test_index_modes(self):
+        self.assertOk(self.cmd('topk.reserve', 'pow2', '5', '100', '5', '0.9', 'POW2'))
+        self.assertOk(self.cmd('topk.reserve', 'fast', '5', '100', '5', '0.9', 'fastrange'))
+        self.assertOk(self.cmd('topk.reserve', 'default', '5', 'pow2'))
+        self.assertEqual(128L, self.cmd('topk.info', 'pow2')[3])
+        self.assertEqual(100L, self.cmd('topk.info', 'fast')[3])
+        self.assertEqual(8L, self.cmd('topk.info', 'default')[3])
+        self.assertRaises(ResponseError, self.cmd, 'topk.reserve', 'bad', '5', 'foo')
+
+        for key in ('pow2', 'fast', 'default'):
+            for i in xrange(5):
+                self.cmd('topk.incrby', key, 'item' + str(i), 100 * (i + 1))
+        for _ in self.client.retry_with_rdb_reload():
+            for key in ('pow2', 'fast', 'default'):
+                self.assertEqual(['item' + str(i) for i in xrange(5)],
+                                 sorted(self.cmd('topk.list', key)))
+                self.assertEqual(500, self.cmd('topk.count', key, 'item4')[0])
+
 if __name__ == "__main__":
     import unittest
     unittest.main()